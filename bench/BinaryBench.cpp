@@ -0,0 +1,106 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Compares the size and encode/decode speed of BinaryFormat with
+ * cereal's binary, portable binary, JSON and XML archives on the same
+ * Metadata.
+ *
+ * Usage: BinaryBench [ids] [keys per id]
+ */
+
+#include <cereal/archives/binary.hpp>
+#include <cereal/archives/json.hpp>
+#include <cereal/archives/portable_binary.hpp>
+#include <cereal/archives/xml.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/binary.h>
+#include <fr/metadata/metadata.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace fr::metadata;
+
+namespace {
+
+  template <typename Fn>
+  double seconds(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  void report(const std::string& name, size_t bytes, size_t ids, double encode, double decode) {
+    std::cout << std::format("{:<16} {:>12} {:>10.1f} {:>12.1f} {:>12.1f}\n", name, bytes,
+			     static_cast<double>(bytes) / ids,
+			     bytes / encode / (1024 * 1024), bytes / decode / (1024 * 1024));
+  }
+
+  // Round trip m through a cereal archive
+  template <typename Out, typename In>
+  void cerealRound(const std::string& name, Metadata& m, size_t ids) {
+    std::string encoded;
+    double encode = seconds([&]() {
+      std::ostringstream stream;
+      {
+	Out archive(stream);
+	archive(m);
+      }
+      encoded = stream.str();
+    });
+    Metadata loaded;
+    double decode = seconds([&]() {
+      std::istringstream stream(encoded);
+      In archive(stream);
+      archive(loaded);
+    });
+    report(name, encoded.size(), ids, encode, decode);
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 200000;
+  int keysPerId = argc > 2 ? std::atoi(argv[2]) : 10;
+
+  Metadata m;
+  for (int i = 0; i < nids; ++i) {
+    std::string id = std::format("{:08x}-0000-4000-8000-{:012x}", i, i * 7919);
+    for (int k = 0; k < keysPerId; ++k) {
+      m.update(id, std::format("key{}", k), std::format("some value {}", k * i));
+    }
+  }
+  std::cout << std::format("{} ids, {} keys each\n", nids, keysPerId);
+  std::cout << std::format("{:<16} {:>12} {:>10} {:>12} {:>12}\n", "format", "bytes", "bytes/id", "encode MB/s", "decode MB/s");
+
+  std::string binary;
+  double encode = seconds([&]() { binary = BinaryFormat::toBinary(m); });
+  Metadata loaded;
+  double decode = seconds([&]() { BinaryFormat::fromBinary(loaded, binary); });
+  report("BinaryFormat", binary.size(), nids, encode, decode);
+  if (loaded.ids().size() != m.ids().size()) {
+    std::cout << "BinaryFormat lost something!\n";
+    return 1;
+  }
+
+  cerealRound<cereal::BinaryOutputArchive, cereal::BinaryInputArchive>("cereal binary", m, nids);
+  cerealRound<cereal::PortableBinaryOutputArchive, cereal::PortableBinaryInputArchive>("portable binary", m, nids);
+  cerealRound<cereal::JSONOutputArchive, cereal::JSONInputArchive>("JSON", m, nids);
+  cerealRound<cereal::XMLOutputArchive, cereal::XMLInputArchive>("XML", m, nids);
+  return 0;
+}
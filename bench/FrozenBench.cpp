@@ -0,0 +1,119 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Compares lookup latency in FrozenMetadata against the regular mutable
+ * Metadata, from one thread and from several at once.
+ *
+ * Usage: FrozenBench [ids] [keys per id] [threads]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/frozen.h>
+#include <fr/metadata/metadata.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  struct Probe {
+    std::string id;
+    std::string key;
+  };
+
+  // Run lookup over every probe on each of threads threads and return
+  // nanoseconds per lookup
+  template <typename Fn>
+  double timeLookups(const std::vector<Probe>& probes, int threads, Fn&& lookup) {
+    std::atomic<size_t> found{0};
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+      workers.emplace_back([&, t]() {
+	size_t mine = 0;
+	// Everybody starts somewhere different so they aren't all
+	// missing cache on the same things
+	size_t offset = t * probes.size() / threads;
+	for (size_t i = 0; i < probes.size(); ++i) {
+	  const Probe& probe = probes[(i + offset) % probes.size()];
+	  mine += lookup(probe.id, probe.key);
+	}
+	found += mine;
+      });
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    if (found != probes.size() * threads) {
+      std::cout << "Lookups went missing!\n";
+      std::exit(1);
+    }
+    return elapsed.count() / probes.size();
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 200000;
+  int keysPerId = argc > 2 ? std::atoi(argv[2]) : 10;
+  int threads = argc > 3 ? std::atoi(argv[3]) : 4;
+
+  Metadata m;
+  for (int i = 0; i < nids; ++i) {
+    std::string id = std::format("{:08x}-0000-4000-8000-{:012x}", i, i * 7919);
+    for (int k = 0; k < keysPerId; ++k) {
+      m.update(id, std::format("key{}", k), std::format("some value {}", k * i));
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto frozen = FrozenMetadata::build(m);
+  std::chrono::duration<double> build = std::chrono::steady_clock::now() - start;
+  std::cout << std::format("{} ids, {} keys each. Frozen image is {} bytes, built in {:.3f}s\n",
+			   nids, keysPerId, frozen->bytes(), build.count());
+
+  std::vector<Probe> probes;
+  std::mt19937_64 rng(42);
+  for (int i = 0; i < 1000000; ++i) {
+    int id = rng() % nids;
+    probes.push_back({std::format("{:08x}-0000-4000-8000-{:012x}", id, id * 7919),
+		      std::format("key{}", rng() % keysPerId)});
+  }
+
+  std::cout << std::format("{:<24} {:>14} {:>14}\n", "store", "1 thread ns", std::format("{} threads ns", threads));
+  auto row = [&](const std::string& name, auto lookup) {
+    double one = timeLookups(probes, 1, lookup);
+    double many = timeLookups(probes, threads, lookup);
+    std::cout << std::format("{:<24} {:>14.1f} {:>14.1f}\n", name, one, many);
+  };
+  row("Metadata::value", [&m](const std::string& id, const std::string& key) {
+    return m.value(id, key).size() > 0;
+  });
+  row("FrozenMetadata::value", [&frozen](const std::string& id, const std::string& key) {
+    return frozen->value(id, key).size() > 0;
+  });
+  row("FrozenMetadata::find", [&frozen](const std::string& id, const std::string& key) {
+    return frozen->find(id, key).has_value();
+  });
+  return 0;
+}
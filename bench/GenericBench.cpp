@@ -0,0 +1,108 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Compares the memory used by Metadata and UuidMetadata for the same
+ * UUID keyed data, and how long a lookup takes in each.
+ *
+ * Usage: GenericBench [ids] [keys per id]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/generic.h>
+#include <fr/metadata/metadata.h>
+#include <iostream>
+#include <malloc.h>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  size_t heapInUse() {
+    return mallinfo2().uordblks;
+  }
+
+  std::string uuid(int i) {
+    return std::format("{:08x}-0000-4000-8000-{:012x}", i, i * 7919);
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 200000;
+  int keysPerId = argc > 2 ? std::atoi(argv[2]) : 6;
+
+  std::vector<std::string> keyNames;
+  for (int k = 0; k < keysPerId; ++k) {
+    keyNames.push_back(std::format("key{}", k));
+  }
+  std::vector<std::string> ids;
+  for (int i = 0; i < nids; ++i) {
+    ids.push_back(uuid(i));
+  }
+
+  size_t start = heapInUse();
+  Metadata plain;
+  for (const auto& id : ids) {
+    for (int k = 0; k < keysPerId; ++k) {
+      plain.setInt(id, keyNames[k], k);
+    }
+  }
+  size_t plainBytes = heapInUse() - start;
+
+  start = heapInUse();
+  UuidMetadata generic;
+  for (const auto& id : ids) {
+    Uuid128 uuid = Uuid128::parse(id);
+    for (int k = 0; k < keysPerId; ++k) {
+      generic.set(uuid, keyNames[k], Value::ofInt(k));
+    }
+  }
+  size_t genericBytes = heapInUse() - start;
+
+  std::cout << std::format("{} ids, {} keys each\n", nids, keysPerId);
+  std::cout << std::format("Metadata      {} bytes ({} per id)\n", plainBytes, plainBytes / nids);
+  std::cout << std::format("UuidMetadata  {} bytes ({} per id)\n", genericBytes, genericBytes / nids);
+
+  std::mt19937_64 rng(42);
+  std::vector<std::pair<int, int>> probes;
+  for (int i = 0; i < 1000000; ++i) {
+    probes.emplace_back(rng() % nids, rng() % keysPerId);
+  }
+  int64_t total = 0;
+  auto time = [&](auto lookup) {
+    auto begin = std::chrono::steady_clock::now();
+    for (const auto& [id, key] : probes) {
+      total += lookup(id, key);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - begin;
+    return elapsed.count() / probes.size();
+  };
+  double plainNs = time([&](int id, int key) { return plain.getInt(ids[id], keyNames[key]); });
+  // Parsing the ID and interning the key each time would be cheating
+  // the other way, so do them up front like a real caller would
+  std::vector<Uuid128> uuids;
+  for (const auto& id : ids) {
+    uuids.push_back(Uuid128::parse(id));
+  }
+  std::vector<Symbol> symbols(keyNames.begin(), keyNames.end());
+  double genericNs = time([&](int id, int key) { return generic.get(uuids[id], symbols[key]).asInt(); });
+  std::cout << std::format("Lookup ns: Metadata {:.1f}, UuidMetadata {:.1f} ({})\n", plainNs, genericNs, total);
+  return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * What hot key tracking adds to a read. Times getInt over a spread of
+ * IDs with tracking off and on at a few sample rates, and the tracker
+ * on its own.
+ *
+ * Usage: HotKeyBench [reads]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/hotkeys.h>
+#include <fr/metadata/metadata.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  template <typename Fn>
+  double nsPer(int reads, Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / reads;
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int reads = argc > 1 ? std::atoi(argv[1]) : 2000000;
+  const int nids = 10000;
+
+  Metadata m;
+  std::vector<std::string> ids;
+  for (int i = 0; i < nids; ++i) {
+    ids.push_back(std::format("file{}", i));
+    m.setInt(ids.back(), "size", i);
+  }
+  // Mostly one ID, like the hot spots this is for
+  std::vector<const std::string *> order;
+  for (int i = 0; i < reads; ++i) {
+    order.push_back(&ids[i % 4 ? 7 : (i * 7919) % nids]);
+  }
+
+  auto readAll = [&]() {
+    int64_t total = 0;
+    for (const std::string *id : order) {
+      total += m.getInt(*id, "size");
+    }
+    if (total == 42) {
+      std::cout << "";
+    }
+  };
+
+  double off = nsPer(reads, readAll);
+  std::cout << std::format("{:<32} {:>10}\n", "getInt", "ns/read");
+  std::cout << std::format("{:<32} {:>10.1f}\n", "tracking off", off);
+  for (uint32_t every : {1u, 16u, 64u}) {
+    HotTracker::Options options;
+    options.sampleEvery = every;
+    m.setHotKeyTracking(true, options);
+    double on = nsPer(reads, readAll);
+    std::cout << std::format("{:<32} {:>10.1f}  (+{:.1f})\n", std::format("tracking, 1 in {}", every), on, on - off);
+  }
+  std::cout << "Hottest: " << m.hotKeyStatistics(1).ids.at(0).name << "\n";
+
+  for (uint32_t every : {1u, 16u}) {
+    HotTracker::Options options;
+    options.sampleEvery = every;
+    HotKeys hot(options);
+    double ns = nsPer(reads, [&]() {
+      for (const std::string *id : order) {
+	hot.record(*id, "size");
+      }
+    });
+    std::cout << std::format("{:<32} {:>10.1f}\n", std::format("record() alone, 1 in {}", every), ns);
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Compares Metadata::fromJson (cereal and RapidJSON) with JsonImporter
+ * on the same document, and reports how fast stage one of the importer
+ * gets through it on its own and how the parallel importer scales.
+ *
+ * Usage: JsonImportBench [ids] [keys per id] [max threads]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/json_import.h>
+#include <fr/metadata/json_stream.h>
+#include <fr/metadata/metadata.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace fr::metadata;
+
+namespace {
+
+  template <typename Fn>
+  double seconds(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+
+  void report(const std::string& name, size_t bytes, double elapsed) {
+    std::cout << std::format("{:<16} {:>8.3f}s {:>10.1f} MB/s\n", name, elapsed, bytes / elapsed / (1024 * 1024));
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 200000;
+  int keysPerId = argc > 2 ? std::atoi(argv[2]) : 10;
+  size_t maxThreads = argc > 3 ? std::atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+
+  Metadata source;
+  for (int i = 0; i < nids; ++i) {
+    std::string id = std::format("{:08x}-0000-4000-8000-{:012x}", i, i * 7919);
+    for (int k = 0; k < keysPerId; ++k) {
+      source.update(id, std::format("key{}", k), std::format("some value {} for \"{}\"", k * i, id));
+    }
+  }
+  std::ostringstream out;
+  JsonStreamer::write(source, out);
+  std::string json = out.str();
+  std::cout << std::format("{} ids, {} keys each, {:.1f} MB of JSON\n", nids, keysPerId,
+			   json.size() / (1024.0 * 1024.0));
+
+  report("stage one", json.size(), seconds([&]() {
+    JsonImporter::StructuralScanner scanner(json);
+    size_t pos;
+    size_t count = 0;
+    while (scanner.next(pos)) {
+      count++;
+    }
+    if (count == 0) {
+      std::cout << "nothing found?\n";
+    }
+  }));
+
+  Metadata fast;
+  report("JsonImporter", json.size(), seconds([&]() { JsonImporter::load(fast, json); }));
+
+  for (size_t threads = 2; threads <= maxThreads; threads *= 2) {
+    Metadata parallel;
+    report(std::format("parallel x{}", threads), json.size(),
+	   seconds([&]() { JsonImporter::loadParallel(parallel, json, threads); }));
+    if (parallel.ids().size() != fast.ids().size()) {
+      std::cout << "Parallel importer disagrees!\n";
+      return 1;
+    }
+  }
+
+  Metadata slow;
+  report("fromJson", json.size(), seconds([&]() { Metadata::fromJson(slow, json); }));
+
+  if (fast.ids().size() != slow.ids().size()) {
+    std::cout << "Importers disagree!\n";
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Loads an LsmStore, then reports write amplification, compaction
+ * throughput and point read latency percentiles (for keys that exist
+ * and keys that don't, which is where the bloom filters earn their
+ * keep.)
+ *
+ * Usage: LsmBench [ids] [keys per id] [reads]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/lsm.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  void percentiles(const std::string& name, std::vector<double>& micros) {
+    std::sort(micros.begin(), micros.end());
+    auto at = [&micros](double p) { return micros[static_cast<size_t>(p * (micros.size() - 1))]; };
+    std::cout << std::format("{:<10} p50 {:>8.2f}us p90 {:>8.2f}us p99 {:>8.2f}us max {:>8.2f}us\n",
+			     name, at(0.5), at(0.9), at(0.99), micros.back());
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 100000;
+  int keysPerId = argc > 2 ? std::atoi(argv[2]) : 10;
+  int reads = argc > 3 ? std::atoi(argv[3]) : 100000;
+  std::string dir = "lsm_bench";
+  std::filesystem::remove_all(dir);
+
+  LsmStore::Options options;
+  options.durability = WriteAheadLog::Durability::Interval;
+  LsmStore store(dir, options);
+
+  auto start = std::chrono::steady_clock::now();
+  // Write everything twice so compaction has something to throw away
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < nids; ++i) {
+      std::string id = std::format("id{}", i);
+      for (int k = 0; k < keysPerId; ++k) {
+	store.update(id, std::format("key{}", k), std::format("value{}-{}", pass, i));
+      }
+    }
+  }
+  store.flush();
+  std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - start;
+  store.compactNow();
+
+  auto stats = store.stats();
+  std::cout << std::format("{} writes in {:.2f}s ({:.0f} writes/s)\n", 2ull * nids * keysPerId,
+			   loadTime.count(), 2.0 * nids * keysPerId / loadTime.count());
+  std::cout << std::format("write amplification {:.2f} ({} flushes, {} compactions, {} segments)\n",
+			   stats.writeAmplification(), stats.flushes, stats.compactions, stats.segments);
+  std::cout << std::format("compaction {:.1f} MB/s over {:.2f}s\n",
+			   stats.compactionThroughput() / (1024 * 1024), stats.compactionSeconds);
+
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> pick(0, nids - 1);
+  std::vector<double> hits;
+  std::vector<double> misses;
+  for (int i = 0; i < reads; ++i) {
+    std::string id = std::format("id{}", pick(rng));
+    auto before = std::chrono::steady_clock::now();
+    store.value(id, "key0");
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - before;
+    hits.push_back(elapsed.count());
+
+    std::string missing = std::format("missing{}", pick(rng));
+    before = std::chrono::steady_clock::now();
+    store.contains(missing);
+    elapsed = std::chrono::steady_clock::now() - before;
+    misses.push_back(elapsed.count());
+  }
+  percentiles("hit", hits);
+  percentiles("miss", misses);
+  stats = store.stats();
+  std::cout << std::format("bloom filters turned away {} of {} segment probes\n",
+			   stats.bloomNegatives, stats.bloomChecks);
+  std::filesystem::remove_all(dir);
+  return 0;
+}
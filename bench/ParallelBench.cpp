@@ -0,0 +1,87 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Adds up a size key over every ID the way a Python script would have
+ * to (ids() and then a lookup per ID), and with parallelReduce on
+ * various numbers of threads.
+ *
+ * Usage: ParallelBench [ids]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/predicate.h>
+#include <iostream>
+#include <string>
+#include <thread>
+
+using namespace fr::metadata;
+
+namespace {
+
+  template <typename Fn>
+  double timeMs(Fn&& fn, int64_t expected) {
+    auto start = std::chrono::steady_clock::now();
+    int64_t total = fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (total != expected) {
+      std::cout << "Got the wrong total!\n";
+      std::exit(1);
+    }
+    return elapsed.count();
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+  Metadata m;
+  int64_t expected = 0;
+  for (int i = 0; i < nids; ++i) {
+    std::string id = std::format("file{}", i);
+    m.update(id, "mime", i % 3 ? "image/png" : "text/plain");
+    m.setInt(id, "size", i % 10000);
+    expected += i % 10000;
+  }
+
+  std::cout << std::format("{:<28} {:>10}\n", "sum of size", "ms");
+  auto row = [](const std::string& name, double ms) {
+    std::cout << std::format("{:<28} {:>10.2f}\n", name, ms);
+  };
+  row("ids() + getInt()", timeMs([&m]() {
+    int64_t total = 0;
+    for (const auto& id : m.ids()) {
+      total += m.getInt(id, "size");
+    }
+    return total;
+  }, expected));
+  unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t threads : {size_t(1), size_t(2), size_t(4), size_t(cores)}) {
+    row(std::format("parallelReduce, {} threads", threads), timeMs([&m, threads]() {
+      return m.parallelReduce(int64_t(0),
+			      [](int64_t& total, const std::string&, const Metadata::DataType& store) {
+				total += store.at("size").asInt();
+			      },
+			      [](int64_t& into, int64_t&& from) { into += from; }, threads);
+    }, expected));
+  }
+  row("parallelFilter, prefix", timeMs([&m]() {
+    return static_cast<int64_t>(m.parallelFilter(KeyPredicate::prefix("mime", "text/")).size());
+  }, (nids + 2) / 3));
+  return 0;
+}
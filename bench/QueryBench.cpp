@@ -0,0 +1,88 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Runs a few queries against the same data with no indexes (so they
+ * scan) and again with indexes on mime and size, and prints how long
+ * each took and how the planner ran it.
+ *
+ * Usage: QueryBench [ids]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/query.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  // Best of a few runs, in ms
+  double timeMs(QueryEngine& engine, const Query& q, size_t& rows) {
+    double best = 0.0;
+    for (int run = 0; run < 3; ++run) {
+      auto start = std::chrono::steady_clock::now();
+      rows = engine.run(q).size();
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      if (run == 0 || elapsed.count() < best) {
+	best = elapsed.count();
+      }
+    }
+    return best;
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nids = argc > 1 ? std::atoi(argv[1]) : 1000000;
+
+  auto m = std::make_shared<Metadata>();
+  for (int i = 0; i < nids; ++i) {
+    std::string id = std::format("file{}", i);
+    m->update(id, "mime", i % 100 ? "image/png" : "text/plain");
+    m->setInt(id, "size", (i * 7919) % 1000003);
+    m->setInt(id, "mtime", i);
+  }
+
+  std::vector<std::string> queries = {
+    "where id = 'file12345'",
+    "where id ^= 'file1234'",
+    "where mime = 'text/plain'",
+    "where size between 1000 and 2000",
+    "select size where mime ^= 'image/' limit 100",
+    "select size order by size desc limit 100",
+  };
+
+  QueryEngine engine(m);
+  auto pass = [&](const std::string& heading) {
+    std::cout << heading << "\n";
+    for (const auto& text : queries) {
+      Query q = Query::parse(text);
+      size_t rows = 0;
+      double ms = timeMs(engine, q, rows);
+      std::cout << std::format("  {}\n    {} rows, {:.3f} ms, {}\n", text, rows, ms, engine.explain(q));
+    }
+  };
+  pass("No indexes");
+  engine.addIndex("mime");
+  engine.addIndex("size");
+  pass("Indexes on mime and size");
+  return 0;
+}
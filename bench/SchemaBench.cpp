@@ -0,0 +1,94 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Compares reading a known key out of a schema Record, by field and by
+ * name, with looking it up in a regular store.
+ *
+ * Usage: SchemaBench [records] [passes]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/schema.h>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  struct FileMeta {
+    FR_SCHEMA;
+    FR_FIELD(mime);
+    FR_FIELD(size);
+    FR_FIELD(mtime);
+    FR_FIELD(path);
+  };
+
+  // Run read over every record passes times and return nanoseconds per
+  // read
+  template <typename Records, typename Fn>
+  double timeReads(const Records& records, int passes, Fn&& read) {
+    int64_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; ++pass) {
+      for (const auto& record : records) {
+	total += read(record);
+      }
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    if (total != static_cast<int64_t>(records.size()) * passes * 4096) {
+      std::cout << "Reads went missing!\n";
+      std::exit(1);
+    }
+    return elapsed.count() / (records.size() * passes);
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nrecords = argc > 1 ? std::atoi(argv[1]) : 100000;
+  int passes = argc > 2 ? std::atoi(argv[2]) : 20;
+
+  std::vector<Record<FileMeta>> records(nrecords);
+  std::vector<Metadata::DataType> stores(nrecords);
+  for (int i = 0; i < nrecords; ++i) {
+    records[i].set(FileMeta::mime, "image/png");
+    records[i].set(FileMeta::size, Value::ofInt(4096));
+    records[i].set(FileMeta::mtime, Value::ofInt(1700000000 + i));
+    records[i].set(FileMeta::path, std::format("/data/{}.png", i));
+    records[i].set("owner", "bruce");
+    stores[i] = records[i].toData();
+  }
+
+  std::cout << std::format("{:<28} {:>10}\n", "read", "ns");
+  auto row = [](const std::string& name, double ns) {
+    std::cout << std::format("{:<28} {:>10.2f}\n", name, ns);
+  };
+  row("Record::get(field)", timeReads(records, passes, [](const Record<FileMeta>& r) {
+    return r.get(FileMeta::size).asInt();
+  }));
+  const std::string size = "size";
+  row("Record::find(\"size\")", timeReads(records, passes, [&size](const Record<FileMeta>& r) {
+    return r.find(size)->asInt();
+  }));
+  row("DataType::find(\"size\")", timeReads(stores, passes, [&size](const Metadata::DataType& s) {
+    return s.find(size)->second.asInt();
+  }));
+  return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Measures writes/sec and fsyncs/sec through a Metadata with a
+ * write-ahead log attached, at each durability level.
+ *
+ * Usage: WalBench [threads] [writes per thread]
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/wal.h>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  void run(const std::string& name, WriteAheadLog::Durability durability,
+	   int nthreads, int writesPerThread) {
+    std::string path = std::format("wal_bench_{}.log", name);
+    std::filesystem::remove(path);
+    Metadata m;
+    auto wal = std::make_shared<WriteAheadLog>(path, durability);
+    m.addListener(wal);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; ++t) {
+      threads.emplace_back([&m, t, writesPerThread]() {
+	std::string id = std::format("id{}", t);
+	for (int i = 0; i < writesPerThread; ++i) {
+	  m.update(id, std::format("key{}", i % 100), std::format("value{}", i));
+	}
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    wal->sync();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto stats = wal->stats();
+    double seconds = elapsed.count();
+    std::cout << std::format("{:<14} {:>12.0f} writes/s {:>10.0f} fsyncs/s {:>8.1f} records/fsync\n",
+			     name, stats.records / seconds, stats.syncs / seconds,
+			     stats.syncs ? static_cast<double>(stats.records) / stats.syncs : 0.0);
+    m.removeListener(wal);
+    wal.reset();
+    std::filesystem::remove(path);
+  }
+
+}
+
+int main(int argc, char *argv[]) {
+  int nthreads = argc > 1 ? std::atoi(argv[1]) : 8;
+  int writesPerThread = argc > 2 ? std::atoi(argv[2]) : 2000;
+  std::cout << std::format("{} threads, {} writes each\n", nthreads, writesPerThread);
+  run("per-operation", WriteAheadLog::Durability::PerOperation, nthreads, writesPerThread);
+  run("per-batch", WriteAheadLog::Durability::PerBatch, nthreads, writesPerThread);
+  run("interval", WriteAheadLog::Durability::Interval, nthreads, writesPerThread);
+  return 0;
+}
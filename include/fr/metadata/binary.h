@@ -0,0 +1,349 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A compact binary format for shipping a whole Metadata around.
+ *
+ * cereal's binary archives work, but they spend 8 bytes on every
+ * string length and write the same key names over and over, once per
+ * ID. Metadata tends to have a few dozen distinct key names shared by
+ * millions of IDs, and IDs that share long prefixes (they're often
+ * paths or UUIDs handed out in order), so there's a lot of fat to trim.
+ *
+ * Layout (varints are LEB128, see codec.h):
+ *
+ *   "FRBIN002"
+ *   varint key count, then that many strings: the key table
+ *   varint ID count, then for each ID, in sorted order:
+ *     varint bytes shared with the previous ID | string rest of the ID
+ *     varint pair count, then for each pair:
+ *       varint key table index << 3 | value type (see Value::Type)
+ *       the value: a string for strings and bytes, a zigzag varint
+ *       for ints, 8 bytes for doubles, one byte for bools
+ *   u32 crc32 of everything before it
+ *
+ * Strings are a varint length followed by the bytes. Nothing is
+ * aligned and nothing is padded. Version 001 files (from before there
+ * were typed values, with a plain key index and a string value for
+ * every pair) still read.
+ *
+ * Deltas from Metadata::exportSince go in nearly the same thing:
+ *
+ *   "FRDLT002"
+ *   varint since | varint through | u8 full
+ *   varint erased count, then that many ID strings
+ *   the key table and IDs, as above
+ *   u32 crc32 of everything before it
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/metadata.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fr::metadata {
+
+  class BinaryFormat {
+    static constexpr std::string_view magic = "FRBIN002";
+    static constexpr std::string_view deltaMagic = "FRDLT002";
+    // Before typed values
+    static constexpr std::string_view magic1 = "FRBIN001";
+    static constexpr std::string_view deltaMagic1 = "FRDLT001";
+
+    [[noreturn]] static void fail(const std::string& what) {
+      throw std::runtime_error(std::format("Unable to read binary metadata: {}", what));
+    }
+
+    // The key table and IDs
+    static void putStores(std::string& out, const Metadata::MetadataMap& stores) {
+      // Number the keys in the order they're first seen. The number for
+      // every pair gets remembered on the way past, so each key is only
+      // hashed once.
+      std::unordered_map<std::string_view, uint32_t> keyIndex;
+      std::vector<std::string_view> keyTable;
+      std::vector<uint32_t> keyNumbers;
+      size_t valueBytes = 0;
+      for (const auto& [id, store] : stores) {
+	if (!store) {
+	  continue;
+	}
+	for (const auto& [key, value] : *store) {
+	  auto [itr, added] = keyIndex.try_emplace(key, keyTable.size());
+	  if (added) {
+	    keyTable.push_back(key);
+	  }
+	  keyNumbers.push_back(itr->second);
+	  valueBytes += (value.type() == Value::Type::String || value.type() == Value::Type::Bytes ? value.bytes().size() : 8) + 2;
+	}
+      }
+
+      out.reserve(out.size() + valueBytes + stores.size() * 16 + 64);
+      codec::putVarint(out, keyTable.size());
+      for (auto key : keyTable) {
+	codec::putString(out, key);
+      }
+      codec::putVarint(out, stores.size());
+      std::string_view previous;
+      auto keyNumber = keyNumbers.begin();
+      for (const auto& [id, store] : stores) {
+	size_t shared = 0;
+	size_t most = std::min(previous.size(), id.size());
+	while (shared < most && previous[shared] == id[shared]) {
+	  shared++;
+	}
+	codec::putVarint(out, shared);
+	codec::putString(out, std::string_view(id).substr(shared));
+	previous = id;
+	if (!store) {
+	  codec::putVarint(out, 0);
+	  continue;
+	}
+	codec::putVarint(out, store->size());
+	for (const auto& [key, value] : *store) {
+	  codec::putVarint(out, static_cast<uint64_t>(*keyNumber++) << 3 | static_cast<uint8_t>(value.type()));
+	  putValue(out, value);
+	}
+      }
+    }
+
+    static void putValue(std::string& out, const Value& value) {
+      switch(value.type()) {
+      case Value::Type::Int: {
+	int64_t v = value.asInt();
+	codec::putVarint(out, (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63));
+	break;
+      }
+      case Value::Type::Double: {
+	double d = value.asDouble();
+	uint64_t bits;
+	std::memcpy(&bits, &d, sizeof(bits));
+	codec::putU64(out, bits);
+	break;
+      }
+      case Value::Type::Bool:
+	codec::putU8(out, value.asBool() ? 1 : 0);
+	break;
+      default:
+	codec::putString(out, value.bytes());
+	break;
+      }
+    }
+
+    static bool getValue(codec::Reader& reader, Value::Type type, Value& value) {
+      switch(type) {
+      case Value::Type::String:
+      case Value::Type::Bytes: {
+	std::string_view bytes;
+	if (!reader.getString(bytes)) {
+	  return false;
+	}
+	value = type == Value::Type::Bytes ? Value::ofBytes(std::string(bytes)) : Value(bytes);
+	return true;
+      }
+      case Value::Type::Int: {
+	uint64_t zigzag;
+	if (!reader.getVarint(zigzag)) {
+	  return false;
+	}
+	value = Value::ofInt(static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1));
+	return true;
+      }
+      case Value::Type::Double: {
+	uint64_t bits;
+	if (!reader.getU64(bits)) {
+	  return false;
+	}
+	double d;
+	std::memcpy(&d, &bits, sizeof(d));
+	value = Value::ofDouble(d);
+	return true;
+      }
+      case Value::Type::Bool: {
+	uint8_t b;
+	if (!reader.getU8(b)) {
+	  return false;
+	}
+	value = Value::ofBool(b != 0);
+	return true;
+      }
+      }
+      return false;
+    }
+
+    // Check the magic and checksum and return what's between them.
+    // version is set to 1 if it's the older of the two formats.
+    static std::string_view body(std::string_view data, std::string_view expectedMagic,
+				 std::string_view olderMagic, int& version) {
+      version = 2;
+      if (data.size() >= olderMagic.size() && data.starts_with(olderMagic)) {
+	version = 1;
+	expectedMagic = olderMagic;
+      }
+      if (data.size() < expectedMagic.size() + 4 || !data.starts_with(expectedMagic)) {
+	fail(std::format("not in the {} format", expectedMagic));
+      }
+      uint32_t expected = codec::getU32(data.data() + data.size() - 4);
+      data.remove_suffix(4);
+      if (codec::crc32(data) != expected) {
+	fail("checksum mismatch");
+      }
+      return data.substr(expectedMagic.size());
+    }
+
+    static Metadata::MetadataMap getStores(codec::Reader& reader, int version) {
+      uint64_t keyCount;
+      if (!reader.getVarint(keyCount) || keyCount > reader.remaining()) {
+	fail("truncated key table");
+      }
+      std::vector<std::string> keyTable(keyCount);
+      for (auto& key : keyTable) {
+	if (!reader.getString(key)) {
+	  fail("truncated key table");
+	}
+      }
+
+      Metadata::MetadataMap stores;
+      uint64_t idCount;
+      if (!reader.getVarint(idCount)) {
+	fail("truncated ID count");
+      }
+      std::string id;
+      for (uint64_t i = 0; i < idCount; ++i) {
+	uint64_t shared, pairs;
+	std::string_view rest;
+	if (!reader.getVarint(shared) || shared > id.size() || !reader.getString(rest) || !reader.getVarint(pairs)) {
+	  fail(std::format("truncated ID {}", i));
+	}
+	id.resize(shared);
+	id.append(rest);
+	auto store = std::make_shared<Metadata::DataType>();
+	for (uint64_t p = 0; p < pairs; ++p) {
+	  uint64_t key;
+	  Value value;
+	  if (!reader.getVarint(key)) {
+	    fail(std::format("truncated store for '{}'", id));
+	  }
+	  auto type = Value::Type::String;
+	  if (version > 1) {
+	    type = static_cast<Value::Type>(key & 7);
+	    key >>= 3;
+	  }
+	  if (type > Value::Type::Bytes) {
+	    fail(std::format("unknown value type {} in '{}'", static_cast<int>(type), id));
+	  }
+	  if (!getValue(reader, type, value)) {
+	    fail(std::format("truncated store for '{}'", id));
+	  }
+	  if (key >= keyTable.size()) {
+	    fail(std::format("key index {} out of range in '{}'", key, id));
+	  }
+	  // Keys come out sorted, so they go in at the end without a search
+	  store->emplace_hint(store->end(), keyTable[key], std::move(value));
+	}
+	stores.emplace_hint(stores.end(), id, std::move(store));
+      }
+      if (reader.remaining() != 0) {
+	fail("trailing bytes after the last ID");
+      }
+      return stores;
+    }
+
+  public:
+
+    static std::string encode(const Metadata::MetadataMap& stores) {
+      std::string out(magic);
+      putStores(out, stores);
+      codec::putU32(out, codec::crc32(out));
+      return out;
+    }
+
+    static Metadata::MetadataMap decode(std::string_view data) {
+      int version;
+      codec::Reader reader(body(data, magic, magic1, version));
+      return getStores(reader, version);
+    }
+
+    static std::string encodeDelta(const Metadata::Delta& delta) {
+      std::string out(deltaMagic);
+      codec::putVarint(out, delta.since);
+      codec::putVarint(out, delta.through);
+      codec::putU8(out, delta.full ? 1 : 0);
+      codec::putVarint(out, delta.erased.size());
+      for (const auto& id : delta.erased) {
+	codec::putString(out, id);
+      }
+      putStores(out, delta.stores);
+      codec::putU32(out, codec::crc32(out));
+      return out;
+    }
+
+    static Metadata::Delta decodeDelta(std::string_view data) {
+      int version;
+      codec::Reader reader(body(data, deltaMagic, deltaMagic1, version));
+      Metadata::Delta delta;
+      uint8_t full;
+      uint64_t erased;
+      if (!reader.getVarint(delta.since) || !reader.getVarint(delta.through) || !reader.getU8(full) ||
+	  !reader.getVarint(erased) || erased > reader.remaining()) {
+	fail("truncated delta header");
+      }
+      delta.full = full != 0;
+      delta.erased.resize(erased);
+      for (auto& id : delta.erased) {
+	if (!reader.getString(id)) {
+	  fail("truncated erased IDs");
+	}
+      }
+      delta.stores = getStores(reader, version);
+      return delta;
+    }
+
+    // What changed in m since sequence number since, ready to send (see
+    // Metadata::exportSince)
+    static std::string exportSince(Metadata& m, uint64_t since) {
+      return encodeDelta(m.exportSince(since));
+    }
+
+    // Apply what exportSince wrote to m. Returns the sequence number to
+    // ask for next time.
+    static uint64_t applyDelta(Metadata& m, std::string_view data) {
+      Metadata::Delta delta = decodeDelta(data);
+      m.applyDelta(delta);
+      return delta.through;
+    }
+
+    // The whole of m. Stores that haven't been loaded yet are read from
+    // its source; the lock is only held while the IDs are copied (see
+    // Metadata::snapshot.)
+    static std::string toBinary(Metadata& m) {
+      return encode(m.snapshot());
+    }
+
+    // Replace the contents of m with what's in data. Like fromJson,
+    // listeners aren't told.
+    static void fromBinary(Metadata& m, std::string_view data) {
+      m.restore(decode(data));
+    }
+  };
+
+}
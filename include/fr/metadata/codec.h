@@ -0,0 +1,288 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Little helpers for the hand-rolled binary formats (the write-ahead
+ * log and friends). Cereal is great for whole objects, but when you
+ * need to append a single record to a file and find out later whether
+ * it was torn in half by a power failure, you want to control every
+ * byte yourself.
+ *
+ * Everything is written little-endian regardless of host, so files
+ * can move between machines.
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+namespace fr::metadata::codec {
+
+  inline void putU8(std::string& out, uint8_t v) {
+    out.push_back(static_cast<char>(v));
+  }
+
+  inline void putU32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+  }
+
+  inline void putU64(std::string& out, uint64_t v) {
+    for (int i = 0; i < 8; ++i) {
+      out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+  }
+
+  // LEB128 style varint. Small numbers (which most string lengths are)
+  // only take one byte.
+  inline void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+      out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+      v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+  }
+
+  // Varint length followed by the bytes
+  inline void putString(std::string& out, std::string_view s) {
+    putVarint(out, s.size());
+    out.append(s.data(), s.size());
+  }
+
+  // Overwrite a previously reserved 4 byte slot (used to back-patch
+  // lengths and checksums once you know what they are)
+  inline void patchU32(std::string& out, size_t offset, uint32_t v) {
+    for (int i = 0; i < 4; ++i) {
+      out[offset + i] = static_cast<char>((v >> (8 * i)) & 0xff);
+    }
+  }
+
+  inline uint32_t getU32(const char *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+      v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return v;
+  }
+
+  inline uint64_t getU64(const char *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+      v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    }
+    return v;
+  }
+
+  /**
+   * Reader walks a buffer and pulls the things above back out of it.
+   * Every get returns false rather than throwing if the buffer runs
+   * out, since running out of buffer is the normal way to discover a
+   * torn record at the end of a log.
+   */
+
+  class Reader {
+    const char *cur;
+    const char *end;
+  public:
+    Reader(const char *data, size_t size) : cur(data), end(data + size) {}
+    Reader(std::string_view data) : Reader(data.data(), data.size()) {}
+
+    size_t remaining() const {
+      return static_cast<size_t>(end - cur);
+    }
+
+    bool getU8(uint8_t& v) {
+      if (remaining() < 1) {
+	return false;
+      }
+      v = static_cast<uint8_t>(*cur++);
+      return true;
+    }
+
+    bool getU32(uint32_t& v) {
+      if (remaining() < 4) {
+	return false;
+      }
+      v = codec::getU32(cur);
+      cur += 4;
+      return true;
+    }
+
+    bool getU64(uint64_t& v) {
+      if (remaining() < 8) {
+	return false;
+      }
+      v = codec::getU64(cur);
+      cur += 8;
+      return true;
+    }
+
+    bool getVarint(uint64_t& v) {
+      v = 0;
+      for (int shift = 0; shift < 64; shift += 7) {
+	if (cur == end) {
+	  return false;
+	}
+	uint8_t byte = static_cast<uint8_t>(*cur++);
+	v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+	if (!(byte & 0x80)) {
+	  return true;
+	}
+      }
+      // More than 10 bytes of continuation is garbage
+      return false;
+    }
+
+    // The view points into the buffer the reader was built with
+    bool getString(std::string_view& s) {
+      uint64_t len;
+      if (!getVarint(len) || len > remaining()) {
+	return false;
+      }
+      s = std::string_view(cur, len);
+      cur += len;
+      return true;
+    }
+
+    bool getString(std::string& s) {
+      std::string_view view;
+      if (!getString(view)) {
+	return false;
+      }
+      s.assign(view);
+      return true;
+    }
+  };
+
+  // Plain old CRC-32 (the zlib/ethernet polynomial.) The table is
+  // built at compile time.
+
+  namespace detail {
+    constexpr std::array<uint32_t, 256> crcTable() {
+      std::array<uint32_t, 256> table{};
+      for (uint32_t i = 0; i < 256; ++i) {
+	uint32_t c = i;
+	for (int k = 0; k < 8; ++k) {
+	  c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+	}
+	table[i] = c;
+      }
+      return table;
+    }
+    inline constexpr std::array<uint32_t, 256> crc32Table = crcTable();
+  }
+
+  inline uint32_t crc32(const char *data, size_t size, uint32_t crc = 0) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+      crc = detail::crc32Table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+  inline uint32_t crc32(std::string_view data, uint32_t crc = 0) {
+    return crc32(data.data(), data.size(), crc);
+  }
+
+  // Standard base64 with padding, for getting raw bytes through places
+  // that only take text (JSON, mostly)
+  inline std::string base64Encode(std::string_view data) {
+    static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    out.reserve((data.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 2 < data.size(); i += 3) {
+      uint32_t n = (static_cast<uint8_t>(data[i]) << 16) | (static_cast<uint8_t>(data[i + 1]) << 8) | static_cast<uint8_t>(data[i + 2]);
+      out.push_back(alphabet[n >> 18]);
+      out.push_back(alphabet[(n >> 12) & 0x3f]);
+      out.push_back(alphabet[(n >> 6) & 0x3f]);
+      out.push_back(alphabet[n & 0x3f]);
+    }
+    if (i < data.size()) {
+      uint32_t n = static_cast<uint8_t>(data[i]) << 16;
+      if (i + 1 < data.size()) {
+	n |= static_cast<uint8_t>(data[i + 1]) << 8;
+      }
+      out.push_back(alphabet[n >> 18]);
+      out.push_back(alphabet[(n >> 12) & 0x3f]);
+      out.push_back(i + 1 < data.size() ? alphabet[(n >> 6) & 0x3f] : '=');
+      out.push_back('=');
+    }
+    return out;
+  }
+
+  // Returns false if text isn't valid base64
+  inline bool base64Decode(std::string_view text, std::string& out) {
+    if (text.size() % 4 != 0) {
+      return false;
+    }
+    out.clear();
+    out.reserve(text.size() / 4 * 3);
+    auto sextet = [](char c) -> int {
+      if (c >= 'A' && c <= 'Z') return c - 'A';
+      if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+      if (c >= '0' && c <= '9') return c - '0' + 52;
+      if (c == '+') return 62;
+      if (c == '/') return 63;
+      return -1;
+    };
+    for (size_t i = 0; i < text.size(); i += 4) {
+      bool last = i + 4 == text.size();
+      int padding = last ? (text[i + 3] == '=') + (text[i + 2] == '=') : 0;
+      if (padding == 1 && text[i + 2] == '=') {
+	return false;
+      }
+      uint32_t n = 0;
+      for (int j = 0; j < 4 - padding; ++j) {
+	int v = sextet(text[i + j]);
+	if (v < 0) {
+	  return false;
+	}
+	n |= v << (18 - 6 * j);
+      }
+      out.push_back(static_cast<char>(n >> 16));
+      if (padding < 2) {
+	out.push_back(static_cast<char>((n >> 8) & 0xff));
+      }
+      if (padding < 1) {
+	out.push_back(static_cast<char>(n & 0xff));
+      }
+    }
+    return true;
+  }
+
+  // 64 bit FNV-1a with a murmur-style finalizer to spread the bits
+  // out. Not cryptographic, but stable across platforms and compilers,
+  // which std::hash isn't, so it's safe to use for anything that ends
+  // up in a file.
+  inline uint64_t hash64(std::string_view data, uint64_t seed = 0) {
+    uint64_t h = 0xcbf29ce484222325ull ^ seed;
+    for (char c : data) {
+      h ^= static_cast<uint8_t>(c);
+      h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+
+}
@@ -0,0 +1,189 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Live counters for Metadata::increment and fetchAdd.
+ *
+ * Bumping a count with get and set takes the Metadata lock twice and
+ * can lose updates when two threads do it at once. A counter here is
+ * a single atomic, so adding to it is one fetch_add and never loses
+ * anything. Each one has a cache line to itself so two busy counters
+ * don't slow each other down.
+ *
+ * Finding a counter by ID and key takes a lock, but not the Metadata
+ * one: the table is split into shards by ID, each with its own mutex,
+ * held just long enough to look the counter up. Anyone who wants
+ * to skip even that can hang on to the shared pointer
+ * Metadata::counter hands back and add to it directly.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <fr/metadata/codec.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace fr::metadata {
+
+  struct alignas(64) Counter {
+    std::atomic<int64_t> count;
+
+    explicit Counter(int64_t start = 0) : count(start) {}
+
+    // Returns what it was before delta was added
+    int64_t fetchAdd(int64_t delta) {
+      return count.fetch_add(delta, std::memory_order_relaxed);
+    }
+
+    int64_t load() const {
+      return count.load(std::memory_order_relaxed);
+    }
+
+    void store(int64_t value) {
+      count.store(value, std::memory_order_relaxed);
+    }
+  };
+
+  class CounterTable {
+    static constexpr size_t shardCount = 64;
+
+    struct alignas(64) Shard {
+      std::mutex mtx;
+      std::unordered_map<std::string, std::map<std::string, std::shared_ptr<Counter>>> ids;
+    };
+
+    std::array<Shard, shardCount> shards;
+    std::atomic<size_t> live{0};
+
+    Shard& shardFor(const std::string& id) {
+      return shards[codec::hash64(id) % shardCount];
+    }
+
+  public:
+
+    // The counter at id,key, or nullptr if there isn't one
+    std::shared_ptr<Counter> find(const std::string& id, const std::string& key) {
+      if (live.load(std::memory_order_relaxed) == 0) {
+	return nullptr;
+      }
+      Shard& shard = shardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto itr = shard.ids.find(id);
+      if (itr == shard.ids.end()) {
+	return nullptr;
+      }
+      auto counter = itr->second.find(key);
+      return counter == itr->second.end() ? nullptr : counter->second;
+    }
+
+    // The counter at id,key, made starting at start if it isn't there
+    // yet. If someone else beat you to it you get theirs.
+    std::shared_ptr<Counter> insert(const std::string& id, const std::string& key, int64_t start) {
+      Shard& shard = shardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto& counter = shard.ids[id][key];
+      if (!counter) {
+	counter = std::make_shared<Counter>(start);
+	live++;
+      }
+      return counter;
+    }
+
+    // The current counts of the counters in id
+    std::map<std::string, int64_t> counts(const std::string& id) {
+      std::map<std::string, int64_t> found;
+      if (live.load(std::memory_order_relaxed) == 0) {
+	return found;
+      }
+      Shard& shard = shardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto itr = shard.ids.find(id);
+      if (itr != shard.ids.end()) {
+	for (const auto& [key, counter] : itr->second) {
+	  found[key] = counter->load();
+	}
+      }
+      return found;
+    }
+
+    // Every counter's ID, key and current count. Each one is read
+    // separately, so this isn't a point-in-time picture of them all.
+    std::vector<std::tuple<std::string, std::string, int64_t>> all() {
+      std::vector<std::tuple<std::string, std::string, int64_t>> found;
+      if (live.load(std::memory_order_relaxed) == 0) {
+	return found;
+      }
+      for (auto& shard : shards) {
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	for (const auto& [id, counters] : shard.ids) {
+	  for (const auto& [key, counter] : counters) {
+	    found.emplace_back(id, key, counter->load());
+	  }
+	}
+      }
+      return found;
+    }
+
+    // Anyone still holding an erased counter can keep adding to it, but
+    // it's not attached to anything any more
+    void erase(const std::string& id) {
+      if (live.load(std::memory_order_relaxed) == 0) {
+	return;
+      }
+      Shard& shard = shardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto itr = shard.ids.find(id);
+      if (itr != shard.ids.end()) {
+	live -= itr->second.size();
+	shard.ids.erase(itr);
+      }
+    }
+
+    void erase(const std::string& id, const std::string& key) {
+      if (live.load(std::memory_order_relaxed) == 0) {
+	return;
+      }
+      Shard& shard = shardFor(id);
+      std::lock_guard<std::mutex> lock(shard.mtx);
+      auto itr = shard.ids.find(id);
+      if (itr != shard.ids.end() && itr->second.erase(key)) {
+	live--;
+	if (itr->second.empty()) {
+	  shard.ids.erase(itr);
+	}
+      }
+    }
+
+    void clear() {
+      for (auto& shard : shards) {
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	shard.ids.clear();
+      }
+      live = 0;
+    }
+
+    size_t size() const {
+      return live.load(std::memory_order_relaxed);
+    }
+  };
+
+}
@@ -0,0 +1,369 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Structural diff and three-way merge for Metadata.
+ *
+ * Both sides are sorted maps, so a diff is just a walk down the two of
+ * them side by side, like the merge step of a merge sort. Stores are
+ * copy-on-write, so two snapshots of the same Metadata (or a Metadata
+ * and a fork of it) share every store that hasn't changed in between.
+ * Those are skipped with a pointer compare, without looking at a single
+ * key.
+ *
+ * Big diffs get cut into ranges of IDs and each range is walked on its
+ * own thread. The ranges are put back together in order, so the result
+ * comes out sorted by ID and key either way.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/thread_pool.h>
+#include <future>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fr::metadata {
+
+  class MetadataDiff {
+  public:
+    using MetadataMap = Metadata::MetadataMap;
+    using Data = Metadata::Data;
+
+    struct Change {
+      enum class Kind : uint8_t {
+	IdAdded,     // Followed by a KeyAdded for each of its keys
+	IdRemoved,   // Followed by a KeyRemoved for each of its keys
+	KeyAdded,
+	KeyRemoved,
+	KeyChanged
+      };
+      Kind kind;
+      std::string id;
+      std::string key;     // Empty for IdAdded and IdRemoved
+      Value before;        // Set for KeyRemoved and KeyChanged
+      Value after;         // Set for KeyAdded and KeyChanged
+
+      bool operator==(const Change&) const = default;
+    };
+
+    // What to do when both sides changed the same thing differently
+    enum class Policy {
+      Ours,    // Keep ours
+      Theirs,  // Take theirs
+      Fail     // Throw std::runtime_error
+    };
+
+    struct Conflict {
+      std::string id;
+      std::string key;  // Empty if the conflict is over the whole ID
+      std::optional<Value> base;
+      std::optional<Value> ours;
+      std::optional<Value> theirs;
+    };
+
+    struct MergeResult {
+      MetadataMap merged;
+      // Everything the policy had to decide
+      std::vector<Conflict> conflicts;
+    };
+
+  private:
+
+    // Below this many IDs, threads cost more than they save
+    static constexpr size_t parallelThreshold = 64 * 1024;
+
+    static const Metadata::DataType& storeOf(const Data& store) {
+      static const Metadata::DataType empty;
+      return store ? *store : empty;
+    }
+
+    static bool same(const Data& a, const Data& b) {
+      return a == b || storeOf(a) == storeOf(b);
+    }
+
+    static void wholeId(Change::Kind idKind, Change::Kind keyKind, const std::string& id, const Data& store,
+			std::vector<Change>& out) {
+      out.push_back({idKind, id, "", "", ""});
+      for (const auto& [key, value] : storeOf(store)) {
+	if (keyKind == Change::Kind::KeyAdded) {
+	  out.push_back({keyKind, id, key, "", value});
+	} else {
+	  out.push_back({keyKind, id, key, value, ""});
+	}
+      }
+    }
+
+    static void diffStores(const std::string& id, const Data& before, const Data& after, std::vector<Change>& out) {
+      const auto& a = storeOf(before);
+      const auto& b = storeOf(after);
+      auto ai = a.begin();
+      auto bi = b.begin();
+      while (ai != a.end() || bi != b.end()) {
+	if (bi == b.end() || (ai != a.end() && ai->first < bi->first)) {
+	  out.push_back({Change::Kind::KeyRemoved, id, ai->first, ai->second, ""});
+	  ++ai;
+	} else if (ai == a.end() || bi->first < ai->first) {
+	  out.push_back({Change::Kind::KeyAdded, id, bi->first, "", bi->second});
+	  ++bi;
+	} else {
+	  if (ai->second != bi->second) {
+	    out.push_back({Change::Kind::KeyChanged, id, ai->first, ai->second, bi->second});
+	  }
+	  ++ai;
+	  ++bi;
+	}
+      }
+    }
+
+    // Walk the IDs from lo up to (but not including) hi. nullptr means
+    // the start or the end.
+    static std::vector<Change> walk(const MetadataMap& a, const MetadataMap& b,
+				    const std::string *lo, const std::string *hi) {
+      std::vector<Change> out;
+      auto ai = lo ? a.lower_bound(*lo) : a.begin();
+      auto ae = hi ? a.lower_bound(*hi) : a.end();
+      auto bi = lo ? b.lower_bound(*lo) : b.begin();
+      auto be = hi ? b.lower_bound(*hi) : b.end();
+      while (ai != ae || bi != be) {
+	if (bi == be || (ai != ae && ai->first < bi->first)) {
+	  wholeId(Change::Kind::IdRemoved, Change::Kind::KeyRemoved, ai->first, ai->second, out);
+	  ++ai;
+	} else if (ai == ae || bi->first < ai->first) {
+	  wholeId(Change::Kind::IdAdded, Change::Kind::KeyAdded, bi->first, bi->second, out);
+	  ++bi;
+	} else {
+	  // Shared stores can't differ
+	  if (ai->second != bi->second) {
+	    diffStores(ai->first, ai->second, bi->second, out);
+	  }
+	  ++ai;
+	  ++bi;
+	}
+      }
+      return out;
+    }
+
+    // Merge one key. Returns the value to keep, if any.
+    static std::optional<Value> mergeValue(const std::string& id, const std::string& key,
+					   const std::optional<Value>& base,
+					   const std::optional<Value>& ours,
+					   const std::optional<Value>& theirs,
+					   Policy policy, std::vector<Conflict>& conflicts) {
+      if (ours == theirs || theirs == base) {
+	return ours;
+      }
+      if (ours == base) {
+	return theirs;
+      }
+      if (policy == Policy::Fail) {
+	throw std::runtime_error(std::format("Merge conflict at '{}' key '{}'", id, key));
+      }
+      conflicts.push_back({id, key, base, ours, theirs});
+      return policy == Policy::Ours ? ours : theirs;
+    }
+
+    static std::optional<Value> lookup(const Data& store, const std::string& key) {
+      if (!store) {
+	return std::nullopt;
+      }
+      auto itr = store->find(key);
+      if (itr == store->end()) {
+	return std::nullopt;
+      }
+      return itr->second;
+    }
+
+    // Merge one ID key by key. Missing IDs are passed as nullptr.
+    static void mergeStores(const std::string& id, const Data& base, const Data& ours, const Data& theirs,
+			    Policy policy, MergeResult& result) {
+      auto merged = std::make_shared<Metadata::DataType>();
+      std::vector<std::string> keys;
+      for (const Data& store : {base, ours, theirs}) {
+	for (const auto& [key, value] : storeOf(store)) {
+	  keys.push_back(key);
+	}
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      for (const auto& key : keys) {
+	auto value = mergeValue(id, key, lookup(base, key), lookup(ours, key), lookup(theirs, key),
+				policy, result.conflicts);
+	if (value) {
+	  merged->emplace_hint(merged->end(), key, std::move(*value));
+	}
+      }
+      result.merged.emplace_hint(result.merged.end(), id, std::move(merged));
+    }
+
+  public:
+
+    // Everything it would take to turn a into b, sorted by ID and key.
+    // threads is how many threads a big diff gets (0 for one per core.)
+    static std::vector<Change> diff(const MetadataMap& a, const MetadataMap& b, size_t threads = 1) {
+      if (threads == 0) {
+	threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      const MetadataMap& bigger = a.size() >= b.size() ? a : b;
+      if (threads == 1 || bigger.size() < parallelThreshold) {
+	return walk(a, b, nullptr, nullptr);
+      }
+      // Cut the ID space into ranges with about the same number of IDs
+      // from the bigger side in each. A few per thread evens out ranges
+      // that have more changes than others.
+      size_t ranges = threads * 4;
+      size_t step = bigger.size() / ranges + 1;
+      std::vector<const std::string *> bounds{nullptr};
+      size_t n = 0;
+      for (const auto& [id, store] : bigger) {
+	if (n++ % step == 0 && n > 1) {
+	  bounds.push_back(&id);
+	}
+      }
+      bounds.push_back(nullptr);
+
+      ThreadPool pool(threads);
+      std::vector<std::future<std::vector<Change>>> parts;
+      for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+	parts.push_back(pool.submit([&a, &b, lo = bounds[i], hi = bounds[i + 1]]() {
+	  return walk(a, b, lo, hi);
+	}));
+      }
+      std::vector<std::vector<Change>> results;
+      size_t total = 0;
+      for (auto& part : parts) {
+	results.push_back(part.get());
+	total += results.back().size();
+      }
+      std::vector<Change> out;
+      out.reserve(total);
+      for (auto& result : results) {
+	std::move(result.begin(), result.end(), std::back_inserter(out));
+      }
+      return out;
+    }
+
+    // Diff two Metadata objects (or the same one at two points in time,
+    // via snapshots.) Neither lock is held while the diff runs.
+    static std::vector<Change> diff(Metadata& a, Metadata& b, size_t threads = 1) {
+      return diff(a.snapshot(), b.snapshot(), threads);
+    }
+
+    // Make b out of a using what diff returned
+    static void apply(Metadata& m, const std::vector<Change>& changes) {
+      for (const auto& change : changes) {
+	switch (change.kind) {
+	case Change::Kind::IdAdded:
+	  if (!m.contains(change.id)) {
+	    m.add(change.id);
+	  }
+	  break;
+	case Change::Kind::IdRemoved:
+	  m.erase(change.id);
+	  break;
+	case Change::Kind::KeyAdded:
+	case Change::Kind::KeyChanged:
+	  m.set(change.id, change.key, change.after);
+	  break;
+	case Change::Kind::KeyRemoved:
+	  m.erase(change.id, change.key);
+	  break;
+	}
+      }
+    }
+
+    // Three-way merge: everything ours and theirs each changed since
+    // base. Where they both changed the same key (or one erased an ID
+    // the other changed) to different things, policy decides. IDs all
+    // three share, or that only one side touched, are carried over
+    // without being copied.
+    static MergeResult merge(const MetadataMap& base, const MetadataMap& ours, const MetadataMap& theirs,
+			     Policy policy) {
+      MergeResult result;
+      auto bi = base.begin();
+      auto oi = ours.begin();
+      auto ti = theirs.begin();
+      while (bi != base.end() || oi != ours.end() || ti != theirs.end()) {
+	// The smallest ID any of them is on
+	const std::string *id = nullptr;
+	for (auto [itr, end] : {std::pair{bi, base.end()}, std::pair{oi, ours.end()}, std::pair{ti, theirs.end()}}) {
+	  if (itr != end && (!id || itr->first < *id)) {
+	    id = &itr->first;
+	  }
+	}
+	const Data none;
+	bool inBase = bi != base.end() && bi->first == *id;
+	bool inOurs = oi != ours.end() && oi->first == *id;
+	bool inTheirs = ti != theirs.end() && ti->first == *id;
+	const Data& b = inBase ? bi->second : none;
+	const Data& o = inOurs ? oi->second : none;
+	const Data& t = inTheirs ? ti->second : none;
+	std::string current = *id;
+
+	if (inOurs && inTheirs && o == t) {
+	  result.merged.emplace_hint(result.merged.end(), current, o);
+	} else if (inBase && !inOurs && !inTheirs) {
+	  // Both erased it
+	} else if (!inOurs || !inTheirs) {
+	  // One side erased it (or only one side added it)
+	  const Data& kept = inOurs ? o : t;
+	  bool keptChanged = !inBase || !same(b, kept);
+	  if (!inBase) {
+	    result.merged.emplace_hint(result.merged.end(), current, kept);
+	  } else if (keptChanged) {
+	    // Erased on one side and changed on the other
+	    if (policy == Policy::Fail) {
+	      throw std::runtime_error(std::format("Merge conflict: '{}' was erased on one side and changed on the other",
+						   current));
+	    }
+	    result.conflicts.push_back({current, "", std::nullopt, std::nullopt, std::nullopt});
+	    if ((policy == Policy::Ours) == inOurs) {
+	      result.merged.emplace_hint(result.merged.end(), current, kept);
+	    }
+	  }
+	} else if (inBase && same(b, o)) {
+	  result.merged.emplace_hint(result.merged.end(), current, t);
+	} else if (inBase && same(b, t)) {
+	  result.merged.emplace_hint(result.merged.end(), current, o);
+	} else {
+	  mergeStores(current, b, o, t, policy, result);
+	}
+
+	if (inBase) {
+	  ++bi;
+	}
+	if (inOurs) {
+	  ++oi;
+	}
+	if (inTheirs) {
+	  ++ti;
+	}
+      }
+      return result;
+    }
+
+    static MergeResult merge(Metadata& base, Metadata& ours, Metadata& theirs, Policy policy) {
+      return merge(base.snapshot(), ours.snapshot(), theirs.snapshot(), policy);
+    }
+  };
+
+}
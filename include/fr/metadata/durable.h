@@ -0,0 +1,74 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Helpers for getting files onto the disk and keeping them there.
+ *
+ * Everything that writes a file next to the real one and renames it
+ * into place (snapshots, mapped and frozen images, LSM segments and
+ * manifests, the trimmed write-ahead log) has to sync the new file
+ * before the rename and the directory after it, or a crash can leave
+ * a file with the right name and nothing in it, or bring the old one
+ * back. These all throw if the sync doesn't happen, since the caller
+ * is usually about to throw away something else on the assumption
+ * that it did.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+
+namespace fr::metadata::durable {
+
+  // fsync whatever's at name, opened with flags
+  inline void syncPath(const std::string& name, int flags) {
+    int fd = ::open(name.c_str(), flags | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error(std::format("Unable to open '{}' to sync it (errno {})", name, errno));
+    }
+    int result = ::fsync(fd);
+    int error = errno;
+    ::close(fd);
+    if (result != 0) {
+      throw std::runtime_error(std::format("Unable to sync '{}' (errno {})", name, error));
+    }
+  }
+
+  inline void syncFile(const std::string& path) {
+    syncPath(path, O_RDONLY);
+  }
+
+  // fsync the directory holding path, so a file created or renamed
+  // into it is still there after a crash
+  inline void syncParent(const std::string& path) {
+    syncPath(std::filesystem::absolute(path).parent_path().string(), O_RDONLY | O_DIRECTORY);
+  }
+
+  // Sync tmpPath, rename it over path and sync the directory. When this
+  // returns, path holds everything that was written to tmpPath.
+  inline void replace(const std::string& tmpPath, const std::string& path) {
+    syncFile(tmpPath);
+    if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+      throw std::runtime_error(std::format("Unable to rename '{}' to '{}' (errno {})", tmpPath, path, errno));
+    }
+    syncParent(path);
+  }
+
+}
@@ -0,0 +1,172 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A counting, blocked bloom filter that can be read while it's being
+ * written.
+ *
+ * Metadata puts one of these in front of contains() so that probes for
+ * IDs that don't exist can be turned away without taking the lock or
+ * walking the tree.
+ *
+ * Blocked: every key hashes to a single 64 byte block (one cache line)
+ * and all of its counters are in that block, so a lookup touches one
+ * cache line instead of k of them. It costs a little in false
+ * positives compared to a plain bloom filter, and buys a lot of speed.
+ *
+ * Counting: each slot is a 4 bit counter rather than a bit, so keys
+ * can be taken back out when IDs are erased. A counter that hits 15
+ * sticks there, since we no longer know how many keys share it; that's
+ * vanishingly rare at sensible sizes, and only costs false positives.
+ *
+ * Counters are packed 16 to an atomic 64 bit word. Updates are
+ * compare-and-swap loops, and lookups are plain atomic loads, so
+ * readers never wait on anything.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fr/metadata/codec.h>
+#include <memory>
+#include <string_view>
+
+namespace fr::metadata {
+
+  class CountingBloomFilter {
+    static constexpr size_t wordsPerBlock = 8;
+    static constexpr size_t countersPerBlock = wordsPerBlock * 16;
+    static constexpr int hashes = 6;
+
+    struct alignas(64) Block {
+      std::atomic<uint64_t> words[wordsPerBlock];
+    };
+
+    size_t nblocks;
+    std::unique_ptr<Block[]> blocks;
+    size_t expected;
+    std::atomic<uint64_t> count{0};
+
+    struct Slots {
+      Block *block;
+      uint8_t counter[hashes];
+    };
+
+    Slots slots(std::string_view key) const {
+      uint64_t h = codec::hash64(key);
+      Slots s;
+      // The top half picks the block (multiply and shift rather than
+      // modulo), and 7 bit slices of a remix of it pick the counters
+      s.block = &blocks[((h >> 32) * nblocks) >> 32];
+      uint64_t bits = h * 0x9e3779b97f4a7c15ull;
+      bits ^= bits >> 29;
+      for (int i = 0; i < hashes; ++i) {
+	s.counter[i] = static_cast<uint8_t>((bits >> (7 * i)) & (countersPerBlock - 1));
+      }
+      return s;
+    }
+
+    // Add delta (1 or -1) to one counter, leaving it alone if it's
+    // stuck at 15 (or, for a decrement, already 0)
+    static void bump(Block *block, uint8_t counter, int delta) {
+      auto& word = block->words[counter / 16];
+      int shift = 4 * (counter % 16);
+      uint64_t old = word.load(std::memory_order_relaxed);
+      while (true) {
+	uint64_t nibble = (old >> shift) & 0xf;
+	if (nibble == 0xf || (delta < 0 && nibble == 0)) {
+	  return;
+	}
+	uint64_t updated = delta > 0 ? old + (1ull << shift) : old - (1ull << shift);
+	if (word.compare_exchange_weak(old, updated, std::memory_order_release, std::memory_order_relaxed)) {
+	  return;
+	}
+      }
+    }
+
+  public:
+
+    // Sized for expected keys at countersPerKey 4 bit counters each. 16
+    // counters (8 bytes) a key gives roughly a 0.1% false positive rate.
+    CountingBloomFilter(size_t expected, size_t countersPerKey = 16) : expected(std::max<size_t>(expected, 1)) {
+      nblocks = std::max<size_t>(1, (this->expected * countersPerKey + countersPerBlock - 1) / countersPerBlock);
+      blocks = std::make_unique<Block[]>(nblocks);
+      for (size_t i = 0; i < nblocks; ++i) {
+	for (auto& word : blocks[i].words) {
+	  word.store(0, std::memory_order_relaxed);
+	}
+      }
+    }
+
+    CountingBloomFilter(const CountingBloomFilter&) = delete;
+    CountingBloomFilter& operator=(const CountingBloomFilter&) = delete;
+
+    void insert(std::string_view key) {
+      Slots s = slots(key);
+      for (int i = 0; i < hashes; ++i) {
+	bump(s.block, s.counter[i], 1);
+      }
+      count.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Only erase keys that were inserted, or other keys will start
+    // coming back as definite misses
+    void erase(std::string_view key) {
+      Slots s = slots(key);
+      for (int i = 0; i < hashes; ++i) {
+	bump(s.block, s.counter[i], -1);
+      }
+      count.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    // False means key is definitely not in the filter. True means it
+    // probably is.
+    bool maybeContains(std::string_view key) const {
+      Slots s = slots(key);
+      for (int i = 0; i < hashes; ++i) {
+	uint64_t word = s.block->words[s.counter[i] / 16].load(std::memory_order_acquire);
+	if (((word >> (4 * (s.counter[i] % 16))) & 0xf) == 0) {
+	  return false;
+	}
+      }
+      return true;
+    }
+
+    // Keys currently in the filter
+    uint64_t size() const {
+      return count.load(std::memory_order_relaxed);
+    }
+
+    // How many keys it was sized for
+    size_t capacity() const {
+      return expected;
+    }
+
+    size_t bytes() const {
+      return nblocks * sizeof(Block);
+    }
+
+    // The textbook estimate for the number of keys in it now. Blocking
+    // makes the real thing a bit worse than this.
+    double estimatedFalsePositiveRate() const {
+      double counters = static_cast<double>(nblocks * countersPerBlock);
+      double fill = 1.0 - std::exp(-hashes * static_cast<double>(size()) / counters);
+      return std::pow(fill, hashes);
+    }
+  };
+
+}
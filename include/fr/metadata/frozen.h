@@ -0,0 +1,697 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Frozen, read-only metadata for data that's built once and read a
+ * whole lot.
+ *
+ * Metadata takes a mutex and walks a tree (two of them, really) for
+ * every value you ask for. That's fine for data that changes, but for
+ * config-like data that's loaded at startup and then read billions of
+ * times, it's all overhead. FrozenMetadata throws the mutability away
+ * in exchange for lookups that are a couple of hashes and a couple of
+ * cache misses, with no locks at all.
+ *
+ * IDs and key names each get a minimal perfect hash (PerfectHash,
+ * below), so finding one is a hash, a pilot lookup and a single string
+ * compare to make sure it's really the one you asked for. Key names are
+ * shared by every ID, so there's one hash over all of them rather than
+ * one per ID; each ID's pairs are sorted by key number and found with a
+ * binary search over a few 16 byte records.
+ *
+ * The in-memory image is the file format, so write() is a single write
+ * and opening a file is an mmap. Nothing gets parsed, but every slot
+ * and pair record is checked once on opening so that lookups can trust
+ * the offsets in them.
+ *
+ * Layout (all integers little-endian, sections 8 byte aligned):
+ *
+ *   header   "FRFRZ001" | u64 seed | u64 id count | u64 id buckets
+ *            | u64 key count | u64 key buckets | u64 pair count
+ *            | u64 offsets of: id pilots, key pilots, id slots,
+ *              key slots, pairs, strings | u64 file size
+ *   id pilots   u32 per bucket
+ *   key pilots  u32 per bucket
+ *   id slots    u64 ID offset | u32 ID length | u32 hash check
+ *               | u64 first pair | u32 pair count | u32 reserved
+ *   key slots   u64 key offset | u32 key length | u32 hash check
+ *   pairs       u64 value offset | u32 value length | u32 key slot
+ *   strings     IDs, key names and values (in their Value::toText
+ *               form) back to back. Identical values are only stored
+ *               once.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <fcntl.h>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/durable.h>
+#include <fr/metadata/metadata.h>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fr::metadata {
+
+  /**
+   * A minimal perfect hash in the PTHash style. Keys are split into
+   * buckets of about four, and each bucket gets a "pilot" number,
+   * picked by trial and error, that sends all of its keys to slots
+   * nobody else has taken yet. Biggest buckets go first while the table
+   * is still empty. A lookup is one hash of the key, then one remix with
+   * its bucket's pilot, and always lands in [0, n).
+   *
+   * This only works on the 64 bit hashes of the keys, which have to be
+   * distinct. build returns nothing if two of them aren't, and the
+   * caller tries again with another seed.
+   */
+
+  class PerfectHash {
+  public:
+    static constexpr size_t keysPerBucket = 4;
+
+    static uint64_t mix(uint64_t x) {
+      x ^= x >> 33;
+      x *= 0xff51afd7ed558ccdull;
+      x ^= x >> 33;
+      x *= 0xc4ceb9fe1a85ec53ull;
+      x ^= x >> 33;
+      return x;
+    }
+
+    // x scaled into [0, n) with a multiply rather than a divide
+    static size_t range(uint64_t x, size_t n) {
+      return static_cast<size_t>((static_cast<unsigned __int128>(x) * n) >> 64);
+    }
+
+    static size_t bucketCount(size_t n) {
+      return n / keysPerBucket + 1;
+    }
+
+    static size_t bucket(uint64_t hash, size_t buckets) {
+      return range(hash, buckets);
+    }
+
+    static size_t slot(uint64_t hash, uint32_t pilot, size_t n) {
+      return range(mix(hash ^ (pilot * 0x9e3779b97f4a7c15ull)), n);
+    }
+
+    // One pilot per bucket (bucketCount(hashes.size()) of them)
+    static std::optional<std::vector<uint32_t>> build(const std::vector<uint64_t>& hashes) {
+      size_t n = hashes.size();
+      size_t buckets = bucketCount(n);
+      // Sorting by bucket groups each bucket's hashes together, and puts
+      // any duplicates next to each other where they're easy to spot
+      std::vector<std::pair<size_t, uint64_t>> sorted;
+      sorted.reserve(n);
+      for (uint64_t hash : hashes) {
+	sorted.emplace_back(bucket(hash, buckets), hash);
+      }
+      std::sort(sorted.begin(), sorted.end());
+      for (size_t i = 1; i < n; ++i) {
+	if (sorted[i].second == sorted[i - 1].second) {
+	  return std::nullopt;
+	}
+      }
+
+      // Where each bucket starts in sorted, then the buckets ordered
+      // biggest first
+      std::vector<size_t> starts(buckets + 1, 0);
+      for (const auto& [b, hash] : sorted) {
+	starts[b + 1]++;
+      }
+      for (size_t b = 0; b < buckets; ++b) {
+	starts[b + 1] += starts[b];
+      }
+      std::vector<uint32_t> order(buckets);
+      for (size_t b = 0; b < buckets; ++b) {
+	order[b] = b;
+      }
+      std::stable_sort(order.begin(), order.end(), [&starts](uint32_t a, uint32_t b) {
+	return starts[a + 1] - starts[a] > starts[b + 1] - starts[b];
+      });
+
+      std::vector<uint32_t> pilots(buckets, 0);
+      std::vector<bool> taken(n, false);
+      std::vector<size_t> slots;
+      for (uint32_t b : order) {
+	size_t size = starts[b + 1] - starts[b];
+	if (size == 0) {
+	  break;
+	}
+	uint32_t pilot = 0;
+	while (true) {
+	  slots.clear();
+	  bool fits = true;
+	  for (size_t i = starts[b]; i < starts[b + 1] && fits; ++i) {
+	    size_t s = slot(sorted[i].second, pilot, n);
+	    fits = !taken[s] && std::find(slots.begin(), slots.end(), s) == slots.end();
+	    slots.push_back(s);
+	  }
+	  if (fits) {
+	    break;
+	  }
+	  if (++pilot == 0) {
+	    // Ran through every pilot without finding a fit. Not going
+	    // to happen with a decent hash, but a new seed would fix it.
+	    return std::nullopt;
+	  }
+	}
+	pilots[b] = pilot;
+	for (size_t s : slots) {
+	  taken[s] = true;
+	}
+      }
+      return pilots;
+    }
+  };
+
+  /**
+   * FrozenMetadata is an immutable image of a Metadata, built with
+   * build() or mmapped from a file written by write(). Every read is
+   * const and lock-free, so share one between as many threads as you
+   * like. The string_views it hands back point into the image and are
+   * good for as long as the FrozenMetadata is.
+   */
+
+  class FrozenMetadata {
+  public:
+    static constexpr std::string_view fileMagic = "FRFRZ001";
+    static constexpr size_t headerSize = 112;
+    static constexpr size_t idSlotSize = 32;
+    static constexpr size_t keySlotSize = 16;
+    static constexpr size_t pairSize = 16;
+    static constexpr size_t npos = static_cast<size_t>(-1);
+
+  private:
+    std::string path;
+    // The image, when it was built in memory rather than mapped
+    std::string owned;
+    const char *data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+
+    uint64_t seed = 0;
+    size_t nids = 0;
+    size_t idBuckets = 0;
+    size_t keyCount = 0;
+    size_t keyBuckets = 0;
+    size_t pairCount = 0;
+    const char *idPilots = nullptr;
+    const char *keyPilots = nullptr;
+    const char *idSlots = nullptr;
+    const char *keySlots = nullptr;
+    const char *pairs = nullptr;
+
+    void fail(const std::string& why) {
+      if (mapped) {
+	::munmap(const_cast<char *>(data), size);
+	mapped = false;
+      }
+      data = nullptr;
+      throw std::runtime_error(std::format("'{}' is not a usable frozen metadata image: {}", path, why));
+    }
+
+    // Find the sections and check they're all inside the image
+    void parseHeader() {
+      if (size < headerSize || std::string_view(data, fileMagic.size()) != fileMagic) {
+	fail("bad magic");
+      }
+      seed = codec::getU64(data + 8);
+      nids = codec::getU64(data + 16);
+      idBuckets = codec::getU64(data + 24);
+      keyCount = codec::getU64(data + 32);
+      keyBuckets = codec::getU64(data + 40);
+      pairCount = codec::getU64(data + 48);
+      if (codec::getU64(data + 104) != size) {
+	fail("size doesn't match header (truncated?)");
+      }
+      // Every record is at least 4 bytes, so anything bigger than this
+      // can't be right (and would overflow the lengths below)
+      if (nids > size / 4 || keyCount > size / 4 || pairCount > size / 4) {
+	fail("counts too big for the file");
+      }
+      if (idBuckets != PerfectHash::bucketCount(nids) || keyBuckets != PerfectHash::bucketCount(keyCount)) {
+	fail("bucket counts don't match");
+      }
+      const char *sections[6];
+      const uint64_t lengths[6] = {4 * idBuckets, 4 * keyBuckets, idSlotSize * nids,
+				   keySlotSize * keyCount, pairSize * pairCount, 0};
+      for (int i = 0; i < 6; ++i) {
+	uint64_t offset = codec::getU64(data + 56 + 8 * i);
+	if (offset > size || lengths[i] > size - offset) {
+	  fail("section out of range");
+	}
+	sections[i] = data + offset;
+      }
+      idPilots = sections[0];
+      keyPilots = sections[1];
+      idSlots = sections[2];
+      keySlots = sections[3];
+      pairs = sections[4];
+      checkRecords();
+    }
+
+    bool inside(const char *record) const {
+      uint64_t offset = codec::getU64(record);
+      return offset <= size && codec::getU32(record + 8) <= size - offset;
+    }
+
+    // Reads trust the string offsets, pair ranges and key slot numbers
+    // in the records, so make sure they're all in range up front. This
+    // touches the records but not the strings.
+    void checkRecords() {
+      for (size_t s = 0; s < nids; ++s) {
+	const char *record = idSlots + s * idSlotSize;
+	uint64_t first = codec::getU64(record + 16);
+	if (!inside(record) || first > pairCount || codec::getU32(record + 24) > pairCount - first) {
+	  fail(std::format("ID slot {} is out of range", s));
+	}
+      }
+      for (size_t k = 0; k < keyCount; ++k) {
+	if (!inside(keySlots + k * keySlotSize)) {
+	  fail(std::format("key slot {} is out of range", k));
+	}
+      }
+      for (size_t p = 0; p < pairCount; ++p) {
+	const char *pair = pairs + p * pairSize;
+	if (!inside(pair) || codec::getU32(pair + 12) >= keyCount) {
+	  fail(std::format("pair {} is out of range", p));
+	}
+      }
+    }
+
+    std::string_view string(const char *record) const {
+      return std::string_view(data + codec::getU64(record), codec::getU32(record + 8));
+    }
+
+    size_t findKey(std::string_view key) const {
+      if (keyCount == 0) {
+	return npos;
+      }
+      uint64_t hash = codec::hash64(key, seed);
+      size_t s = PerfectHash::slot(hash, codec::getU32(keyPilots + 4 * PerfectHash::bucket(hash, keyBuckets)), keyCount);
+      const char *record = keySlots + s * keySlotSize;
+      // Any string at all hashes to some slot, so check it's really key.
+      // Comparing the hash first saves a trip to the strings for most
+      // misses.
+      if (codec::getU32(record + 12) != static_cast<uint32_t>(hash) || string(record) != key) {
+	return npos;
+      }
+      return s;
+    }
+
+    // Tells this constructor apart from the one that takes a path
+    struct InMemory {};
+
+    FrozenMetadata(InMemory, std::string image) : path("<memory>"), owned(std::move(image)) {
+      data = owned.data();
+      size = owned.size();
+      parseHeader();
+    }
+
+    static void pad(std::string& out) {
+      out.append((8 - out.size() % 8) % 8, '\0');
+    }
+
+  public:
+
+    // Map a file written by write()
+    FrozenMetadata(const std::string& path) : path(path) {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+	throw std::runtime_error(std::format("Unable to open '{}' (errno {})", path, errno));
+      }
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+	::close(fd);
+	throw std::runtime_error(std::format("Unable to stat '{}' (errno {})", path, errno));
+      }
+      size = st.st_size;
+      if (size < headerSize) {
+	::close(fd);
+	fail("too short");
+      }
+      void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED) {
+	throw std::runtime_error(std::format("Unable to mmap '{}' (errno {})", path, errno));
+      }
+      data = static_cast<const char *>(mapping);
+      mapped = true;
+      ::madvise(mapping, size, MADV_RANDOM);
+      parseHeader();
+    }
+
+    FrozenMetadata(const FrozenMetadata&) = delete;
+    FrozenMetadata& operator=(const FrozenMetadata&) = delete;
+
+    ~FrozenMetadata() {
+      if (mapped) {
+	::munmap(const_cast<char *>(data), size);
+      }
+    }
+
+    /**
+     * Lay stores out in the frozen format. Building the perfect hashes
+     * is the slow part; figure on a second or so per few million IDs.
+     */
+    static std::string image(const Metadata::MetadataMap& stores) {
+      static const Metadata::DataType empty;
+      std::vector<std::string_view> keys;
+      {
+	std::unordered_map<std::string_view, bool> seen;
+	for (const auto& [id, store] : stores) {
+	  for (const auto& [key, value] : store ? *store : empty) {
+	    if (seen.try_emplace(key, true).second) {
+	      keys.push_back(key);
+	    }
+	  }
+	}
+      }
+
+      // A seed that gives every ID and key a distinct hash. The first
+      // one almost always does.
+      uint64_t seed = 0;
+      std::vector<uint64_t> idHashes;
+      std::vector<uint64_t> keyHashes;
+      std::optional<std::vector<uint32_t>> idPilots;
+      std::optional<std::vector<uint32_t>> keyPilots;
+      for (;; ++seed) {
+	if (seed == 16) {
+	  throw std::runtime_error("Unable to build a perfect hash for this metadata");
+	}
+	idHashes.clear();
+	for (const auto& [id, store] : stores) {
+	  idHashes.push_back(codec::hash64(id, seed));
+	}
+	keyHashes.clear();
+	for (auto key : keys) {
+	  keyHashes.push_back(codec::hash64(key, seed));
+	}
+	idPilots = PerfectHash::build(idHashes);
+	keyPilots = idPilots ? PerfectHash::build(keyHashes) : std::nullopt;
+	if (idPilots && keyPilots) {
+	  break;
+	}
+      }
+
+      size_t idBuckets = PerfectHash::bucketCount(stores.size());
+      size_t keyBuckets = PerfectHash::bucketCount(keys.size());
+      std::string strings;
+      std::unordered_map<std::string_view, uint64_t> valueOffsets;
+      // Text forms of typed values, kept here so valueOffsets can point
+      // at them
+      std::deque<std::string> texts;
+
+      std::string keySlots(keySlotSize * keys.size(), '\0');
+      std::unordered_map<std::string_view, uint32_t> keySlot;
+      for (size_t i = 0; i < keys.size(); ++i) {
+	uint64_t hash = keyHashes[i];
+	size_t s = PerfectHash::slot(hash, (*keyPilots)[PerfectHash::bucket(hash, keyBuckets)], keys.size());
+	keySlot[keys[i]] = s;
+	std::string record;
+	codec::putU64(record, strings.size());
+	codec::putU32(record, keys[i].size());
+	codec::putU32(record, static_cast<uint32_t>(hash));
+	keySlots.replace(s * keySlotSize, keySlotSize, record);
+	strings.append(keys[i]);
+      }
+
+      // IDs in slot order, so each one's pairs end up next to its
+      // neighbours' rather than scattered about
+      std::vector<std::pair<const std::string *, const Metadata::DataType *>> bySlot(stores.size());
+      std::vector<uint64_t> hashBySlot(stores.size());
+      size_t i = 0;
+      for (const auto& [id, store] : stores) {
+	uint64_t hash = idHashes[i++];
+	size_t s = PerfectHash::slot(hash, (*idPilots)[PerfectHash::bucket(hash, idBuckets)], stores.size());
+	bySlot[s] = {&id, store ? store.get() : &empty};
+	hashBySlot[s] = hash;
+      }
+
+      std::string idSlots;
+      std::string pairs;
+      idSlots.reserve(idSlotSize * stores.size());
+      std::vector<std::pair<uint32_t, const Value *>> sortedPairs;
+      for (size_t s = 0; s < bySlot.size(); ++s) {
+	const auto& [id, store] = bySlot[s];
+	codec::putU64(idSlots, strings.size());
+	codec::putU32(idSlots, id->size());
+	codec::putU32(idSlots, static_cast<uint32_t>(hashBySlot[s]));
+	codec::putU64(idSlots, pairs.size() / pairSize);
+	codec::putU32(idSlots, store->size());
+	codec::putU32(idSlots, 0);
+	strings.append(*id);
+
+	sortedPairs.clear();
+	for (const auto& [key, value] : *store) {
+	  sortedPairs.emplace_back(keySlot[key], &value);
+	}
+	std::sort(sortedPairs.begin(), sortedPairs.end());
+	for (const auto& [k, value] : sortedPairs) {
+	  std::string_view text;
+	  if (value->type() == Value::Type::String && !value->bytes().starts_with(Value::marker)) {
+	    text = value->bytes();
+	  } else {
+	    text = texts.emplace_back(value->toText());
+	  }
+	  auto [itr, added] = valueOffsets.try_emplace(text, strings.size());
+	  if (added) {
+	    strings.append(text);
+	  }
+	  codec::putU64(pairs, itr->second);
+	  codec::putU32(pairs, text.size());
+	  codec::putU32(pairs, k);
+	}
+      }
+
+      std::string out(headerSize, '\0');
+      uint64_t offsets[6];
+      auto section = [&out](uint64_t& offset, const std::string& bytes) {
+	pad(out);
+	offset = out.size();
+	out.append(bytes);
+      };
+      std::string pilots;
+      for (uint32_t pilot : *idPilots) {
+	codec::putU32(pilots, pilot);
+      }
+      section(offsets[0], pilots);
+      pilots.clear();
+      for (uint32_t pilot : *keyPilots) {
+	codec::putU32(pilots, pilot);
+      }
+      section(offsets[1], pilots);
+      section(offsets[2], idSlots);
+      section(offsets[3], keySlots);
+      section(offsets[4], pairs);
+      // Offsets in the records are from the start of the strings, so
+      // they get rebased once we know where that is
+      pad(out);
+      offsets[5] = out.size();
+      out.append(strings);
+
+      auto rebase = [&out, base = offsets[5]](uint64_t start, size_t count, size_t recordSize) {
+	for (size_t r = 0; r < count; ++r) {
+	  char *p = out.data() + start + r * recordSize;
+	  uint64_t offset = codec::getU64(p) + base;
+	  for (int b = 0; b < 8; ++b) {
+	    p[b] = static_cast<char>((offset >> (8 * b)) & 0xff);
+	  }
+	}
+      };
+      rebase(offsets[2], stores.size(), idSlotSize);
+      rebase(offsets[3], keys.size(), keySlotSize);
+      rebase(offsets[4], pairs.size() / pairSize, pairSize);
+
+      std::string header(fileMagic);
+      codec::putU64(header, seed);
+      codec::putU64(header, stores.size());
+      codec::putU64(header, idBuckets);
+      codec::putU64(header, keys.size());
+      codec::putU64(header, keyBuckets);
+      codec::putU64(header, pairs.size() / pairSize);
+      for (uint64_t offset : offsets) {
+	codec::putU64(header, offset);
+      }
+      codec::putU64(header, out.size());
+      out.replace(0, headerSize, header);
+      return out;
+    }
+
+    static std::shared_ptr<FrozenMetadata> build(const Metadata::MetadataMap& stores) {
+      return std::shared_ptr<FrozenMetadata>(new FrozenMetadata(InMemory{}, image(stores)));
+    }
+
+    // Only holds m's lock long enough to take a snapshot
+    static std::shared_ptr<FrozenMetadata> build(Metadata& m) {
+      return build(m.snapshot());
+    }
+
+    // Write the image out to path. Open it again with the constructor.
+    void write(const std::string& path) const {
+      std::string tmpPath = path + ".tmp";
+      std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+      if (!out) {
+	throw std::runtime_error(std::format("Unable to create '{}'", tmpPath));
+      }
+      out.write(data, size);
+      out.close();
+      if (!out) {
+	throw std::runtime_error(std::format("Unable to write '{}'", tmpPath));
+      }
+      // Synced before and after the rename, so a crash can't leave a
+      // torn image under the real name
+      durable::replace(tmpPath, path);
+    }
+
+    static void write(const std::string& path, Metadata& m) {
+      build(m)->write(path);
+    }
+
+    size_t idCount() const {
+      return nids;
+    }
+
+    size_t bytes() const {
+      return size;
+    }
+
+    // The slot holding id, or npos
+    size_t find(std::string_view id) const {
+      if (nids == 0) {
+	return npos;
+      }
+      uint64_t hash = codec::hash64(id, seed);
+      size_t s = PerfectHash::slot(hash, codec::getU32(idPilots + 4 * PerfectHash::bucket(hash, idBuckets)), nids);
+      const char *record = idSlots + s * idSlotSize;
+      if (codec::getU32(record + 12) != static_cast<uint32_t>(hash) || string(record) != id) {
+	return npos;
+      }
+      return s;
+    }
+
+    // The value in its Value::toText form, which for plain strings is
+    // just the string
+    std::optional<std::string_view> find(std::string_view id, std::string_view key) const {
+      size_t s = find(id);
+      if (s == npos) {
+	return std::nullopt;
+      }
+      size_t k = findKey(key);
+      if (k == npos) {
+	return std::nullopt;
+      }
+      const char *record = idSlots + s * idSlotSize;
+      size_t lo = codec::getU64(record + 16);
+      size_t hi = lo + codec::getU32(record + 24);
+      while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	const char *pair = pairs + mid * pairSize;
+	uint32_t candidate = codec::getU32(pair + 12);
+	if (candidate < k) {
+	  lo = mid + 1;
+	} else if (k < candidate) {
+	  hi = mid;
+	} else {
+	  return string(pair);
+	}
+      }
+      return std::nullopt;
+    }
+
+    // The rest of these follow Metadata's API
+
+    bool contains(std::string_view id) const {
+      return find(id) != npos;
+    }
+
+    bool idContains(std::string_view id, std::string_view key) const {
+      return find(id, key).has_value();
+    }
+
+    Value get(const std::string& id, const std::string& key) const {
+      auto v = find(id, key);
+      if (!v) {
+	std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
+	throw std::runtime_error(errstr);
+      }
+      return Value::fromText(*v);
+    }
+
+    std::string value(const std::string& id, const std::string& key) const {
+      return get(id, key).str();
+    }
+
+    // These come out of the hash table in no particular order, so they
+    // get sorted to match Metadata
+    std::vector<std::string> ids() const {
+      std::vector<std::string> allIds;
+      allIds.reserve(nids);
+      for (size_t s = 0; s < nids; ++s) {
+	allIds.emplace_back(string(idSlots + s * idSlotSize));
+      }
+      std::sort(allIds.begin(), allIds.end());
+      return allIds;
+    }
+
+    std::vector<std::string> keys(const std::string& id) const {
+      size_t s = find(id);
+      if (s == npos) {
+	std::string errstr = std::format("Unique ID '{}' does not exist", id);
+	throw std::runtime_error(errstr);
+      }
+      const char *record = idSlots + s * idSlotSize;
+      const char *first = pairs + codec::getU64(record + 16) * pairSize;
+      std::vector<std::string> allKeys;
+      for (uint32_t p = 0; p < codec::getU32(record + 24); ++p) {
+	allKeys.emplace_back(string(keySlots + codec::getU32(first + p * pairSize + 12) * keySlotSize));
+      }
+      std::sort(allKeys.begin(), allKeys.end());
+      return allKeys;
+    }
+
+    // Copy everything back into a regular Metadata (replacing what's
+    // in it) so it can be changed
+    void materialize(Metadata& m) const {
+      Metadata::MetadataMap stores;
+      for (size_t s = 0; s < nids; ++s) {
+	const char *record = idSlots + s * idSlotSize;
+	const char *first = pairs + codec::getU64(record + 16) * pairSize;
+	auto store = std::make_shared<Metadata::DataType>();
+	for (uint32_t p = 0; p < codec::getU32(record + 24); ++p) {
+	  const char *pair = first + p * pairSize;
+	  store->emplace(string(keySlots + codec::getU32(pair + 12) * keySlotSize), Value::fromText(string(pair)));
+	}
+	stores.emplace(string(record), std::move(store));
+      }
+      m.restore(std::move(stores));
+    }
+  };
+
+}
@@ -0,0 +1,482 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Metadata with IDs, keys and values that aren't strings.
+ *
+ * Metadata uses std::string for everything, and the header comment
+ * there suggests UUIDs or hashes for IDs. A UUID written out is 36
+ * characters, which is too long for the short string optimization, so
+ * each one is a 32 byte std::string plus a 37 byte heap allocation, for
+ * 16 bytes of actual information. Keys are worse, since the same dozen
+ * key names get stored over again in every ID.
+ *
+ * BasicMetadata<Id, Key, Val> is the core of Metadata (IDs, keys,
+ * copy-on-write stores, snapshots, cereal) for any types with a
+ * KeyTraits specialization, which says how to hash, order and print
+ * them. Two ID and key types come with it:
+ *
+ *   Uuid128  a UUID (or any 128 bit hash) in 16 bytes
+ *   Symbol   an interned string in 4 bytes. The text is kept once, in
+ *            a table shared by the whole process.
+ *
+ * Stores are vectors of key/value pairs sorted by key, rather than
+ * maps, which for the handful of keys a store usually has is both
+ * smaller and quicker to search.
+ *
+ * UuidMetadata (BasicMetadata<Uuid128, Symbol, Value>) is the one you
+ * probably want, and SymbolMetadata keeps string IDs but interns the
+ * keys. cereal archives of a BasicMetadata look the same as
+ * Metadata's, so the two can read each other's files.
+ *
+ * The extras Metadata has grown (lazy loading, tiering, listeners, the
+ * bloom filter, counters) are still only on Metadata.
+ */
+
+#pragma once
+
+#include <cereal/types/map.hpp>
+#include <cereal/types/memory.hpp>
+#include <cereal/types/string.hpp>
+#include <algorithm>
+#include <charconv>
+#include <compare>
+#include <concepts>
+#include <cstdint>
+#include <deque>
+#include <format>
+#include <fr/metadata/value.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fr::metadata {
+
+  // 128 bits of ID, kept as two 64 bit halves so comparing and hashing
+  // them is a couple of instructions
+  struct Uuid128 {
+    uint64_t hi = 0;
+    uint64_t lo = 0;
+
+    auto operator<=>(const Uuid128&) const = default;
+
+    // Takes 32 hex digits, with or without the dashes (and either case.)
+    // Throws std::runtime_error if that's not what it gets.
+    static Uuid128 parse(std::string_view text) {
+      Uuid128 uuid;
+      int digits = 0;
+      for (char c : text) {
+	if (c == '-') {
+	  continue;
+	}
+	uint64_t nibble;
+	if (c >= '0' && c <= '9') {
+	  nibble = c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+	  nibble = c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+	  nibble = c - 'A' + 10;
+	} else {
+	  digits = -1;
+	  break;
+	}
+	if (digits < 16) {
+	  uuid.hi = uuid.hi << 4 | nibble;
+	} else if (digits < 32) {
+	  uuid.lo = uuid.lo << 4 | nibble;
+	}
+	digits++;
+      }
+      if (digits != 32) {
+	throw std::runtime_error(std::format("'{}' is not a UUID", text));
+      }
+      return uuid;
+    }
+
+    // The usual 8-4-4-4-12 lower case form
+    std::string str() const {
+      static constexpr char hex[] = "0123456789abcdef";
+      std::string text;
+      text.reserve(36);
+      for (int i = 0; i < 32; ++i) {
+	if (i == 8 || i == 12 || i == 16 || i == 20) {
+	  text.push_back('-');
+	}
+	uint64_t half = i < 16 ? hi : lo;
+	text.push_back(hex[(half >> (60 - 4 * (i % 16))) & 0xf]);
+      }
+      return text;
+    }
+  };
+
+  template <class Archive>
+  std::string save_minimal(const Archive&, const Uuid128& uuid) {
+    return uuid.str();
+  }
+
+  template <class Archive>
+  void load_minimal(const Archive&, Uuid128& uuid, const std::string& text) {
+    uuid = Uuid128::parse(text);
+  }
+
+  /**
+   * Where Symbols keep their text. Strings go in and never come out, so
+   * a reference to one is good forever. Looking up a string someone
+   * already interned only takes a shared lock.
+   */
+  class SymbolTable {
+    std::shared_mutex mtx;
+    // A deque, so the strings never move and the views in index stay
+    // good as it grows
+    std::deque<std::string> texts;
+    std::unordered_map<std::string_view, uint32_t> index;
+
+  public:
+    SymbolTable() {
+      texts.emplace_back();
+      index.emplace(texts.back(), 0);
+    }
+
+    static SymbolTable& global() {
+      static SymbolTable table;
+      return table;
+    }
+
+    uint32_t intern(std::string_view text) {
+      {
+	std::shared_lock<std::shared_mutex> lock(mtx);
+	auto itr = index.find(text);
+	if (itr != index.end()) {
+	  return itr->second;
+	}
+      }
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      auto itr = index.find(text);
+      if (itr != index.end()) {
+	return itr->second;
+      }
+      uint32_t id = static_cast<uint32_t>(texts.size());
+      texts.emplace_back(text);
+      index.emplace(texts.back(), id);
+      return id;
+    }
+
+    const std::string& text(uint32_t id) {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      return texts.at(id);
+    }
+
+    size_t size() {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      return texts.size();
+    }
+  };
+
+  // An interned string. Comparing two is comparing two integers. They
+  // order by when they were interned, not alphabetically.
+  class Symbol {
+    uint32_t index = 0;
+
+  public:
+    Symbol() = default;
+    Symbol(std::string_view text) : index(SymbolTable::global().intern(text)) {}
+    Symbol(const std::string& text) : Symbol(std::string_view(text)) {}
+    Symbol(const char *text) : Symbol(std::string_view(text)) {}
+
+    const std::string& str() const {
+      return SymbolTable::global().text(index);
+    }
+
+    uint32_t id() const {
+      return index;
+    }
+
+    auto operator<=>(const Symbol&) const = default;
+  };
+
+  template <class Archive>
+  std::string save_minimal(const Archive&, const Symbol& symbol) {
+    return symbol.str();
+  }
+
+  template <class Archive>
+  void load_minimal(const Archive&, Symbol& symbol, const std::string& text) {
+    symbol = Symbol(text);
+  }
+
+  /**
+   * How BasicMetadata hashes, orders and prints an ID or key type.
+   * Specialize it for your own: Hash and Less are function objects,
+   * and toString/fromString convert to and from the text that goes in
+   * error messages and archives.
+   */
+  template <typename T>
+  struct KeyTraits;
+
+  template <>
+  struct KeyTraits<std::string> {
+    using Hash = std::hash<std::string>;
+    using Less = std::less<std::string>;
+    static const std::string& toString(const std::string& s) { return s; }
+    static std::string fromString(const std::string& s) { return s; }
+  };
+
+  template <>
+  struct KeyTraits<Uuid128> {
+    struct Hash {
+      size_t operator()(const Uuid128& uuid) const {
+	// Random UUIDs would hash fine as they are, but sequential ones
+	// wouldn't, so give them a stir
+	uint64_t h = (uuid.hi ^ (uuid.lo * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+	return static_cast<size_t>(h ^ (h >> 32));
+      }
+    };
+    using Less = std::less<Uuid128>;
+    static std::string toString(const Uuid128& uuid) { return uuid.str(); }
+    static Uuid128 fromString(const std::string& s) { return Uuid128::parse(s); }
+  };
+
+  template <>
+  struct KeyTraits<Symbol> {
+    struct Hash {
+      size_t operator()(const Symbol& symbol) const {
+	return std::hash<uint32_t>()(symbol.id());
+      }
+    };
+    using Less = std::less<Symbol>;
+    static const std::string& toString(const Symbol& symbol) { return symbol.str(); }
+    static Symbol fromString(const std::string& s) { return Symbol(s); }
+  };
+
+  template <std::integral T>
+  struct KeyTraits<T> {
+    using Hash = std::hash<T>;
+    using Less = std::less<T>;
+    static std::string toString(T value) { return std::to_string(value); }
+    static T fromString(const std::string& s) {
+      T value{};
+      auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+      if (ec != std::errc() || ptr != s.data() + s.size()) {
+	throw std::runtime_error(std::format("'{}' is not an integer", s));
+      }
+      return value;
+    }
+  };
+
+  template <typename Id, typename Key, typename Val = Value,
+	    typename IdTraits = KeyTraits<Id>, typename KeyTraitsType = KeyTraits<Key>>
+  class BasicMetadata {
+  public:
+    using IdType = Id;
+    using KeyType = Key;
+    using ValueType = Val;
+    // A store is its key/value pairs sorted by key
+    using DataType = std::vector<std::pair<Key, Val>>;
+    using Data = std::shared_ptr<DataType>;
+    using MetadataMap = std::unordered_map<Id, Data, typename IdTraits::Hash>;
+
+  private:
+    std::mutex mtx;
+    MetadataMap metadata;
+
+    static auto lowerBound(DataType& store, const Key& key) {
+      return std::lower_bound(store.begin(), store.end(), key, [](const auto& pair, const Key& k) {
+	return typename KeyTraitsType::Less()(pair.first, k);
+      });
+    }
+
+    static const Val *find(const Data& store, const Key& key) {
+      if (!store) {
+	return nullptr;
+      }
+      auto itr = lowerBound(*store, key);
+      return itr != store->end() && itr->first == key ? &itr->second : nullptr;
+    }
+
+    // Same deal as Metadata::mutableStore: copy the store first if a
+    // snapshot still holds it. Call with mtx held.
+    DataType& mutableStore(Data& store) {
+      if (store.use_count() > 1) {
+	store = std::make_shared<DataType>(*store);
+      }
+      return *store;
+    }
+
+    [[noreturn]] static void missing(const Id& id, const Key& key) {
+      throw std::runtime_error(std::format("Key '{}' or unique ID '{}' do not exist",
+					   KeyTraitsType::toString(key), IdTraits::toString(id)));
+    }
+
+    // Everything as a map of strings, which is what Metadata archives
+    using ArchiveMap = std::map<std::string, std::shared_ptr<std::map<std::string, Val>>>;
+
+  public:
+
+    bool contains(const Id& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      return metadata.contains(id);
+    }
+
+    bool idContains(const Id& id, const Key& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = metadata.find(id);
+      return itr != metadata.end() && find(itr->second, key);
+    }
+
+    void add(const Id& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!metadata.try_emplace(id, std::make_shared<DataType>()).second) {
+	throw std::runtime_error(std::format("'{}' already exists in metadata", IdTraits::toString(id)));
+      }
+    }
+
+    // In IdTraits::Less order
+    std::vector<Id> ids() {
+      std::vector<Id> allIds;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	allIds.reserve(metadata.size());
+	for (const auto& [id, store] : metadata) {
+	  allIds.push_back(id);
+	}
+      }
+      std::sort(allIds.begin(), allIds.end(), typename IdTraits::Less());
+      return allIds;
+    }
+
+    std::vector<Key> keys(const Id& id) {
+      std::vector<Key> allKeys;
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = metadata.find(id);
+      if (itr == metadata.end()) {
+	throw std::runtime_error(std::format("Unique ID '{}' does not exist", IdTraits::toString(id)));
+      }
+      if (itr->second) {
+	allKeys.reserve(itr->second->size());
+	for (const auto& [key, value] : *itr->second) {
+	  allKeys.push_back(key);
+	}
+      }
+      return allKeys;
+    }
+
+    Val get(const Id& id, const Key& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = metadata.find(id);
+      const Val *found = itr == metadata.end() ? nullptr : find(itr->second, key);
+      if (!found) {
+	missing(id, key);
+      }
+      return *found;
+    }
+
+    // Creates the ID and the key if they aren't there
+    void set(const Id& id, const Key& key, Val value) {
+      std::lock_guard<std::mutex> lock(mtx);
+      Data& store = metadata[id];
+      if (!store) {
+	store = std::make_shared<DataType>();
+      }
+      DataType& data = mutableStore(store);
+      auto itr = lowerBound(data, key);
+      if (itr != data.end() && itr->first == key) {
+	itr->second = std::move(value);
+      } else {
+	data.emplace(itr, key, std::move(value));
+      }
+    }
+
+    void erase(const Id& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      metadata.erase(id);
+    }
+
+    void erase(const Id& id, const Key& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = metadata.find(id);
+      if (itr == metadata.end() || !find(itr->second, key)) {
+	return;
+      }
+      DataType& data = mutableStore(itr->second);
+      data.erase(lowerBound(data, key));
+    }
+
+    size_t size() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return metadata.size();
+    }
+
+    // Point-in-time copy of the ID map, with the stores shared. They're
+    // copy-on-write, as in Metadata.
+    MetadataMap snapshot() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return metadata;
+    }
+
+    void restore(MetadataMap stores) {
+      std::lock_guard<std::mutex> lock(mtx);
+      metadata = std::move(stores);
+    }
+
+    template <class Archive>
+    void serialize(Archive& archive) {
+      if constexpr (Archive::is_saving::value) {
+	ArchiveMap stores;
+	for (const auto& [id, store] : snapshot()) {
+	  auto strings = std::make_shared<std::map<std::string, Val>>();
+	  if (store) {
+	    for (const auto& [key, value] : *store) {
+	      strings->emplace(KeyTraitsType::toString(key), value);
+	    }
+	  }
+	  stores.emplace(IdTraits::toString(id), std::move(strings));
+	}
+	archive(stores);
+      } else {
+	ArchiveMap stores;
+	archive(stores);
+	MetadataMap loaded;
+	loaded.reserve(stores.size());
+	for (const auto& [id, strings] : stores) {
+	  auto store = std::make_shared<DataType>();
+	  if (strings) {
+	    store->reserve(strings->size());
+	    for (const auto& [key, value] : *strings) {
+	      store->emplace_back(KeyTraitsType::fromString(key), value);
+	    }
+	    // String order isn't necessarily Key order
+	    std::sort(store->begin(), store->end(), [](const auto& a, const auto& b) {
+	      return typename KeyTraitsType::Less()(a.first, b.first);
+	    });
+	  }
+	  loaded.emplace(IdTraits::fromString(id), std::move(store));
+	}
+	restore(std::move(loaded));
+      }
+    }
+  };
+
+  using UuidMetadata = BasicMetadata<Uuid128, Symbol, Value>;
+  // For IDs that really are strings, but keys that repeat
+  using SymbolMetadata = BasicMetadata<std::string, Symbol, Value>;
+
+}
@@ -0,0 +1,487 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Finding out which IDs (and keys) are getting hammered.
+ *
+ * Two pieces do the counting. A count-min sketch is a few rows of
+ * counters; a name bumps one counter in each row, picked by hashing,
+ * and how often it's been seen is the smallest of its counters. It
+ * never comes out low, only high when other names share all of its
+ * counters, and it's the same size however many names go through it.
+ * That can tell you how busy a name is, but not which names are the
+ * busy ones, so there's also a Space-Saving summary: a fixed number of
+ * slots, each holding a name and its count. A name that isn't in there
+ * takes over the slot with the smallest count and starts from that
+ * count (which is also how far off it might be.) The names that are
+ * seen most end up being the ones in the slots. Names only get into
+ * the summary once the sketch says they've been seen at least as often
+ * as its least busy name, so the long tail of IDs that are only read
+ * once doesn't keep churning it.
+ *
+ * Both get halved every half life, so what they show is what's busy
+ * lately rather than what's been busy since you started.
+ *
+ * Keeping the cost down on the read path: only one access in
+ * sampleEvery gets counted (the rest are a thread local countdown and
+ * a branch), and counts are scaled back up when you read them. Each
+ * thread counts into its own shard, so threads reading the same hot ID
+ * don't fight over the same counters, and reading the top K adds the
+ * shards together.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <fr/metadata/codec.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace fr::metadata {
+
+  // A name and about how many times it was used. The real count is
+  // somewhere between count - error and count.
+  struct HotEntry {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t error = 0;
+  };
+
+  class CountMinSketch {
+    size_t width;
+    size_t depth;
+    std::unique_ptr<std::atomic<uint32_t>[]> counters;
+
+    // The counter for hash in row. Each row remixes the hash with its
+    // own odd multiplier, and width is a power of 2.
+    std::atomic<uint32_t>& slot(uint64_t hash, size_t row) const {
+      uint64_t h = (hash + row) * (0x9e3779b97f4a7c15ull + 2 * row);
+      h ^= h >> 31;
+      return counters[row * width + (h & (width - 1))];
+    }
+
+  public:
+
+    // width is rounded up to a power of 2
+    CountMinSketch(size_t width = 4096, size_t depth = 4) : width(std::bit_ceil(std::max<size_t>(width, 16))), depth(std::max<size_t>(depth, 1)),
+							   counters(std::make_unique<std::atomic<uint32_t>[]>(this->width * this->depth)) {}
+
+    // Add n to hash's counters and return its estimate afterwards.
+    // It's a load and a store rather than a fetch_add, which costs a
+    // lot less; two threads adding to the same counter at once can
+    // lose one of the adds, and HotTracker gives each thread its own
+    // sketch where it can so that hardly happens.
+    uint32_t add(uint64_t hash, uint32_t n = 1) {
+      uint32_t least = UINT32_MAX;
+      for (size_t row = 0; row < depth; ++row) {
+	std::atomic<uint32_t>& counter = slot(hash, row);
+	uint32_t now = counter.load(std::memory_order_relaxed) + n;
+	counter.store(now, std::memory_order_relaxed);
+	least = std::min(least, now);
+      }
+      return least;
+    }
+
+    uint32_t estimate(uint64_t hash) const {
+      uint32_t least = UINT32_MAX;
+      for (size_t row = 0; row < depth; ++row) {
+	least = std::min(least, slot(hash, row).load(std::memory_order_relaxed));
+      }
+      return least;
+    }
+
+    // Halve every counter. An add that lands in the middle of this can
+    // get lost, which for counts like these doesn't matter.
+    void halve() {
+      for (size_t i = 0; i < width * depth; ++i) {
+	counters[i].store(counters[i].load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+      }
+    }
+
+    void clear() {
+      for (size_t i = 0; i < width * depth; ++i) {
+	counters[i].store(0, std::memory_order_relaxed);
+      }
+    }
+
+    size_t bytes() const {
+      return width * depth * sizeof(uint32_t);
+    }
+  };
+
+  // The Space-Saving summary. Not thread safe on its own.
+  class SpaceSaving {
+    size_t capacity;
+    std::vector<HotEntry> slots;
+    // Slots by the hash of their names
+    std::unordered_map<uint64_t, size_t> slotOf;
+    // Where the smallest count is, worked out again when it's needed
+    // after it might have moved
+    size_t least = 0;
+    bool leastKnown = false;
+
+    size_t findLeast() {
+      if (!leastKnown) {
+	least = 0;
+	for (size_t i = 1; i < slots.size(); ++i) {
+	  if (slots[i].count < slots[least].count) {
+	    least = i;
+	  }
+	}
+	leastKnown = true;
+      }
+      return least;
+    }
+
+  public:
+
+    explicit SpaceSaving(size_t capacity = 64) : capacity(std::max<size_t>(capacity, 1)) {
+      slots.reserve(this->capacity);
+      slotOf.reserve(this->capacity);
+    }
+
+    // The smallest count in it once it's full, 0 until then. Anything
+    // seen less often than this can't be in the top capacity.
+    uint64_t minimum() {
+      return slots.size() < capacity ? 0 : slots[findLeast()].count;
+    }
+
+    // Count n more uses of name, whose codec::hash64 is hash. If it
+    // isn't in here and there's no room, it only takes over the least
+    // used slot if seen (how often it's been seen in all, as far as
+    // the caller knows) is at least that slot's count. Two names with
+    // the same hash can't both be in here; the second one is ignored.
+    void offer(std::string_view name, uint64_t hash, uint64_t n, uint64_t seen) {
+      auto itr = slotOf.find(hash);
+      if (itr != slotOf.end()) {
+	HotEntry& entry = slots[itr->second];
+	if (entry.name == name) {
+	  entry.count += n;
+	  if (itr->second == least) {
+	    leastKnown = false;
+	  }
+	}
+	return;
+      }
+      if (slots.size() < capacity) {
+	slotOf.emplace(hash, slots.size());
+	slots.push_back(HotEntry{std::string(name), n, 0});
+	leastKnown = false;
+	return;
+      }
+      size_t i = findLeast();
+      HotEntry& victim = slots[i];
+      if (seen < victim.count) {
+	return;
+      }
+      slotOf.erase(codec::hash64(victim.name));
+      slotOf.emplace(hash, i);
+      victim.error = victim.count;
+      victim.count += n;
+      victim.name = name;
+      leastKnown = false;
+    }
+
+    // Plain Space-Saving, with no say from a sketch
+    void offer(std::string_view name, uint64_t n = 1) {
+      offer(name, codec::hash64(name), n, UINT64_MAX);
+    }
+
+    // Halve the counts, dropping names that get down to nothing
+    void halve() {
+      std::vector<HotEntry> kept;
+      kept.reserve(capacity);
+      for (auto& entry : slots) {
+	entry.count /= 2;
+	entry.error /= 2;
+	if (entry.count) {
+	  kept.push_back(std::move(entry));
+	}
+      }
+      slots = std::move(kept);
+      slotOf.clear();
+      for (size_t i = 0; i < slots.size(); ++i) {
+	slotOf.emplace(codec::hash64(slots[i].name), i);
+      }
+      leastKnown = false;
+    }
+
+    void clear() {
+      slots.clear();
+      slotOf.clear();
+      leastKnown = false;
+    }
+
+    const std::vector<HotEntry>& entries() const {
+      return slots;
+    }
+  };
+
+  // How a HotTracker samples, how much it keeps and how fast it forgets
+  struct HotOptions {
+    // Count one access in this many
+    uint32_t sampleEvery = 16;
+    // How many names each shard's summary keeps
+    size_t capacity = 64;
+    // Counters per sketch row, and rows
+    size_t width = 4096;
+    size_t depth = 4;
+    // Counts halve this often. Zero for never.
+    std::chrono::milliseconds halfLife = std::chrono::seconds(60);
+  };
+
+  /**
+   * Sampled, sharded hot name tracking: a sketch and a summary for
+   * each shard, with threads spread across the shards. Safe to record
+   * into from any number of threads at once.
+   */
+  class HotTracker {
+  public:
+    using Options = HotOptions;
+
+  private:
+    static constexpr size_t shardCount = 8;
+    // How many samples a shard takes between looking at the clock
+    static constexpr uint32_t clockEvery = 256;
+
+    struct alignas(64) Shard {
+      CountMinSketch sketch;
+      std::mutex mtx;
+      SpaceSaving summary;
+      uint64_t samples = 0;
+      uint32_t untilClock = clockEvery;
+
+      explicit Shard(const Options& options) : sketch(options.width, options.depth), summary(options.capacity) {}
+    };
+
+    Options options;
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::mutex decayMtx;
+    std::atomic<int64_t> nextDecay;
+
+    static int64_t now() {
+      return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Each thread sticks to one shard, handed out round robin
+    static size_t shardIndex() {
+      static std::atomic<size_t> next{0};
+      thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed) % shardCount;
+      return mine;
+    }
+
+    void maybeDecay(Shard& shard) {
+      if (options.halfLife.count() == 0 || --shard.untilClock) {
+	return;
+      }
+      shard.untilClock = clockEvery;
+      if (now() >= nextDecay.load(std::memory_order_relaxed)) {
+	decay();
+      }
+    }
+
+  public:
+
+    explicit HotTracker(Options options = {}) : options(options), nextDecay(now() + options.halfLife.count()) {
+      this->options.sampleEvery = std::max<uint32_t>(this->options.sampleEvery, 1);
+      for (size_t i = 0; i < shardCount; ++i) {
+	shards.push_back(std::make_unique<Shard>(this->options));
+      }
+    }
+
+    const Options& settings() const {
+      return options;
+    }
+
+    // How many uses to skip before the next sample, for one sample in
+    // every on average. It's random (anywhere from none to twice that)
+    // so that something read in a regular pattern, every fourth call
+    // say, doesn't line up with the samples and get counted every time
+    // or never.
+    static uint32_t skipFor(uint32_t every) {
+      if (every <= 1) {
+	return 0;
+      }
+      thread_local uint64_t state = 0x9e3779b97f4a7c15ull ^ reinterpret_cast<uintptr_t>(&state);
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      return static_cast<uint32_t>(state % (2 * static_cast<uint64_t>(every) - 1));
+    }
+
+    // Count a use of name. Most calls stop at the countdown.
+    void record(std::string_view name) {
+      thread_local uint32_t countdown = 0;
+      if (countdown) {
+	countdown--;
+	return;
+      }
+      countdown = skipFor(options.sampleEvery);
+      sample(name);
+    }
+
+    // Count a use of name without sampling (one sample stands for
+    // sampleEvery uses, like all of them)
+    void sample(std::string_view name) {
+      Shard& shard = *shards[shardIndex()];
+      uint64_t h = codec::hash64(name);
+      uint32_t seen = shard.sketch.add(h);
+      {
+	std::lock_guard<std::mutex> lock(shard.mtx);
+	shard.samples++;
+	shard.summary.offer(name, h, 1, seen);
+      }
+      maybeDecay(shard);
+    }
+
+    // About how many times name has been used lately
+    uint64_t estimate(std::string_view name) const {
+      uint64_t h = codec::hash64(name);
+      uint64_t total = 0;
+      for (const auto& shard : shards) {
+	total += shard->sketch.estimate(h);
+      }
+      return total * options.sampleEvery;
+    }
+
+    // The k busiest names lately, busiest first
+    std::vector<HotEntry> top(size_t k) {
+      std::unordered_map<std::string, HotEntry> merged;
+      for (auto& shard : shards) {
+	std::lock_guard<std::mutex> lock(shard->mtx);
+	for (const auto& entry : shard->summary.entries()) {
+	  HotEntry& into = merged[entry.name];
+	  into.count += entry.count;
+	  into.error += entry.error;
+	}
+      }
+      std::vector<HotEntry> all;
+      all.reserve(merged.size());
+      for (auto& [name, entry] : merged) {
+	entry.name = name;
+	entry.count *= options.sampleEvery;
+	entry.error *= options.sampleEvery;
+	all.push_back(std::move(entry));
+      }
+      size_t keep = std::min(k, all.size());
+      std::partial_sort(all.begin(), all.begin() + keep, all.end(), [](const HotEntry& a, const HotEntry& b) {
+	return a.count != b.count ? a.count > b.count : a.name < b.name;
+      });
+      all.resize(keep);
+      return all;
+    }
+
+    // Halve everything now. Happens by itself every half life.
+    void decay() {
+      std::unique_lock<std::mutex> lock(decayMtx, std::try_to_lock);
+      if (!lock) {
+	// Someone else is already doing it
+	return;
+      }
+      nextDecay.store(now() + options.halfLife.count(), std::memory_order_relaxed);
+      for (auto& shard : shards) {
+	shard->sketch.halve();
+	std::lock_guard<std::mutex> shardLock(shard->mtx);
+	shard->summary.halve();
+      }
+    }
+
+    void clear() {
+      std::lock_guard<std::mutex> lock(decayMtx);
+      for (auto& shard : shards) {
+	shard->sketch.clear();
+	std::lock_guard<std::mutex> shardLock(shard->mtx);
+	shard->summary.clear();
+	shard->samples = 0;
+      }
+    }
+
+    // Samples taken since this started, or since clear
+    uint64_t sampled() {
+      uint64_t total = 0;
+      for (auto& shard : shards) {
+	std::lock_guard<std::mutex> lock(shard->mtx);
+	total += shard->samples;
+      }
+      return total;
+    }
+
+    // Roughly what the sketches and summaries take up
+    size_t bytes() const {
+      return shards.size() * (sizeof(Shard) + shards[0]->sketch.bytes() + options.capacity * (sizeof(HotEntry) + 64));
+    }
+  };
+
+  /**
+   * What Metadata keeps when hot key tracking is on: one tracker for
+   * IDs and one for key names.
+   */
+  class HotKeys {
+    HotTracker idTracker;
+    HotTracker keyTracker;
+
+  public:
+
+    explicit HotKeys(HotTracker::Options options = {}) : idTracker(options), keyTracker(options) {}
+
+    // A read or write of the whole of id
+    void record(std::string_view id) {
+      idTracker.record(id);
+    }
+
+    // A read or write of key in id. When it's sampled, the ID and the
+    // key both are.
+    void record(std::string_view id, std::string_view key) {
+      if (due(idTracker.settings().sampleEvery)) {
+	sample(id, key);
+      }
+    }
+
+    // The sampling countdown on its own, for callers that want to skip
+    // everything else (Metadata doesn't even look at the tracker
+    // unless this says so.) True if this use is one to count.
+    static bool due(uint32_t every) {
+      thread_local uint32_t countdown = 0;
+      if (countdown) {
+	countdown--;
+	return false;
+      }
+      countdown = HotTracker::skipFor(every);
+      return true;
+    }
+
+    // Count a use of key in id without sampling
+    void sample(std::string_view id, std::string_view key) {
+      idTracker.sample(id);
+      keyTracker.sample(key);
+    }
+
+    HotTracker& ids() {
+      return idTracker;
+    }
+
+    HotTracker& keys() {
+      return keyTracker;
+    }
+  };
+
+}
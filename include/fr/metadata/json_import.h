@@ -0,0 +1,1152 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A fast JSON importer for Metadata.
+ *
+ * Metadata::fromJson copies its input into a stringstream and has
+ * cereal build a RapidJSON DOM out of it before a single store gets
+ * created, which is fine for small things and painful for nightly
+ * dumps. JsonImporter only understands the two shapes we actually
+ * use, and builds the stores straight from the text:
+ *
+ *   The one toJson and JsonStreamer write (cereal's layout):
+ *     {"m":{"value0":[{"key":"id","value":{"ptr_wrapper":{"id":2147483649,
+ *        "data":[{"key":"k","value":"v"}, ...]}}}, ...]}}
+ *
+ *   And the obvious one:
+ *     {"m":{"id":{"k":"v", ...}, ...}}
+ *
+ * It works in two stages, the way simdjson does. Stage one runs over
+ * the input 64 bytes at a time and produces the positions of every
+ * structural character ({ } [ ] : , and quotes) that isn't inside a
+ * string, using SSE2 compares to classify the bytes and some bit
+ * twiddling to work out which quotes are escaped and which bytes are
+ * inside strings -- no byte-at-a-time branching. Stage two walks those
+ * positions and builds the stores. Rather than indexing the entire
+ * document up front (the index can be as big as the input), stage one
+ * runs a chunk ahead of stage two, so memory stays flat and the index
+ * stays in cache.
+ *
+ * Machines without SSE2 get a plain loop in stage one that produces
+ * the same thing.
+ *
+ * loadParallel does the same job on several threads for really big
+ * dumps, and also reads JSON Lines. See the notes above readChunk.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fcntl.h>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/thread_pool.h>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__PCLMUL__)
+#include <wmmintrin.h>
+#endif
+
+namespace fr::metadata {
+
+  class JsonImporter {
+  public:
+
+    /**
+     * Stage one. Hands out the offsets of the structural characters in
+     * input, in order, scanning a chunk of blocks at a time as they're
+     * needed.
+     */
+    class StructuralScanner {
+      static constexpr size_t blocksPerChunk = 1024;
+      static constexpr uint64_t oddBits = 0xaaaaaaaaaaaaaaaaull;
+
+      std::string_view input;
+      size_t scanned;
+      // Carried from one block to the next
+      uint64_t prevInString;
+      uint64_t nextIsEscaped;
+      std::vector<size_t> indices;
+      size_t cursor;
+
+      struct Masks {
+	uint64_t quote;
+	uint64_t backslash;
+	uint64_t op;
+	uint64_t open;   // { and [
+	uint64_t close;  // } and ]
+      };
+
+      static Masks classify(const char *block) {
+	Masks masks{0, 0, 0, 0, 0};
+#if defined(__SSE2__)
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i lowerBit = _mm_set1_epi8(0x20);
+	// { and [ differ only in bit 0x20, as do } and ], so or-ing that
+	// bit in folds four compares into two
+	const __m128i openBrace = _mm_set1_epi8('{');
+	const __m128i closeBrace = _mm_set1_epi8('}');
+	const __m128i colon = _mm_set1_epi8(':');
+	const __m128i comma = _mm_set1_epi8(',');
+	for (int i = 0; i < 4; ++i) {
+	  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i));
+	  __m128i folded = _mm_or_si128(v, lowerBit);
+	  __m128i open = _mm_cmpeq_epi8(folded, openBrace);
+	  __m128i close = _mm_cmpeq_epi8(folded, closeBrace);
+	  __m128i op = _mm_or_si128(_mm_or_si128(open, close),
+				    _mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmpeq_epi8(v, comma)));
+	  int shift = 16 * i;
+	  masks.open |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(open))) << shift;
+	  masks.close |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(close))) << shift;
+	  masks.quote |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, quote)))) << shift;
+	  masks.backslash |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, backslash)))) << shift;
+	  masks.op |= static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(op))) << shift;
+	}
+#else
+	for (int i = 0; i < 64; ++i) {
+	  uint64_t bit = 1ull << i;
+	  switch (block[i]) {
+	  case '"':
+	    masks.quote |= bit;
+	    break;
+	  case '\\':
+	    masks.backslash |= bit;
+	    break;
+	  case '{':
+	  case '[':
+	    masks.open |= bit;
+	    masks.op |= bit;
+	    break;
+	  case '}':
+	  case ']':
+	    masks.close |= bit;
+	    masks.op |= bit;
+	    break;
+	  case ':':
+	  case ',':
+	    masks.op |= bit;
+	    break;
+	  default:
+	    break;
+	  }
+	}
+#endif
+	return masks;
+      }
+
+      // Bit i of the result is the xor of bits 0..i. Run over the quote
+      // positions it gives you "inside a string" for every byte.
+      static uint64_t prefixXor(uint64_t x) {
+#if defined(__PCLMUL__)
+	__m128i all = _mm_set1_epi8(static_cast<char>(0xff));
+	__m128i result = _mm_clmulepi64_si128(_mm_set_epi64x(0, static_cast<long long>(x)), all, 0);
+	return static_cast<uint64_t>(_mm_cvtsi128_si64(result));
+#else
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return x;
+#endif
+      }
+
+      // Which bytes are escaped by a backslash. A backslash escapes the
+      // next byte unless it's itself escaped, so this has to find runs
+      // of backslashes and tell odd lengths from even ones. Doing that
+      // with a subtraction (carries run along a series of backslashes)
+      // is the simdjson trick.
+      uint64_t escapedBytes(uint64_t backslash) {
+	if (backslash == 0) {
+	  uint64_t escaped = nextIsEscaped;
+	  nextIsEscaped = 0;
+	  return escaped;
+	}
+	uint64_t potentialEscape = backslash & ~nextIsEscaped;
+	uint64_t maybeEscaped = potentialEscape << 1;
+	uint64_t maybeEscapedAndOddBits = maybeEscaped | oddBits;
+	uint64_t evenSeriesCodesAndOddBits = maybeEscapedAndOddBits - potentialEscape;
+	uint64_t escapeAndTerminalCode = evenSeriesCodesAndOddBits ^ oddBits;
+	uint64_t escaped = escapeAndTerminalCode ^ (backslash | nextIsEscaped);
+	uint64_t escape = escapeAndTerminalCode & backslash;
+	nextIsEscaped = escape >> 63;
+	return escaped;
+      }
+
+      // Work out the quote and in-string masks for a block, carrying
+      // state over from the one before
+      uint64_t stringMasks(const Masks& masks, uint64_t& quote) {
+	uint64_t escaped = escapedBytes(masks.backslash);
+	quote = masks.quote & ~escaped;
+	uint64_t inString = prefixXor(quote) ^ prevInString;
+	prevInString = static_cast<uint64_t>(static_cast<int64_t>(inString) >> 63);
+	return inString;
+      }
+
+      void scanBlock(const char *block, size_t base) {
+	Masks masks = classify(block);
+	uint64_t quote;
+	uint64_t inString = stringMasks(masks, quote);
+	// Every unescaped quote is structural, since stage two needs both
+	// ends of each string. Everything else only counts outside strings.
+	uint64_t structural = (masks.op & ~inString) | quote;
+	while (structural) {
+	  indices.push_back(base + std::countr_zero(structural));
+	  structural &= structural - 1;
+	}
+      }
+
+      // Call fn(masks, quote, inString) for each block from scanned up
+      // to end. The tail gets copied into a padded block so nothing
+      // reads past the end of the input. Spaces are harmless filler.
+      template <typename Fn>
+      void eachBlock(size_t end, Fn&& fn) {
+	while (scanned + 64 <= end) {
+	  fn(input.data() + scanned, scanned);
+	  scanned += 64;
+	}
+	if (scanned < end) {
+	  char padded[64];
+	  std::memset(padded, ' ', sizeof(padded));
+	  std::memcpy(padded, input.data() + scanned, end - scanned);
+	  fn(padded, scanned);
+	  scanned = end;
+	}
+      }
+
+      // Scan the next chunk. Returns false at the end of the input.
+      bool refill() {
+	if (scanned >= input.size()) {
+	  return false;
+	}
+	indices.clear();
+	cursor = 0;
+	eachBlock(std::min(input.size(), scanned + blocksPerChunk * 64),
+		  [this](const char *block, size_t base) { scanBlock(block, base); });
+	return true;
+      }
+
+    public:
+
+      // Scan input from start. If start isn't the beginning, you have to
+      // say whether it's inside a string and whether the byte there is
+      // escaped.
+      StructuralScanner(std::string_view input, size_t start = 0, bool inString = false, bool escaped = false) :
+	input(input), scanned(start), prevInString(inString ? ~0ull : 0), nextIsEscaped(escaped ? 1 : 0), cursor(0) {
+	indices.reserve(blocksPerChunk * 16);
+      }
+
+      // Whether the byte at pos is escaped. Backslashes only turn up
+      // inside strings, so this doesn't need to know anything else.
+      static bool escapedAt(std::string_view input, size_t pos) {
+	size_t run = 0;
+	while (pos > run && input[pos - run - 1] == '\\') {
+	  run++;
+	}
+	return run % 2 == 1;
+      }
+
+      // What a stretch of input does to the parser state, for both
+      // possible states at its start. The parallel importer summarizes
+      // every chunk at once, then adds them up to find out what state
+      // each one starts in.
+      struct Summary {
+	bool flipsString = false;  // Odd number of unescaped quotes
+	int64_t depthIfOutside = 0;  // Change in nesting if it starts outside a string
+	int64_t depthIfInside = 0;   // ... and if it starts inside one
+      };
+
+      static Summary summarize(std::string_view input, size_t start, size_t end) {
+	StructuralScanner scanner(input.substr(0, end), start, false, escapedAt(input, start));
+	Summary summary;
+	scanner.eachBlock(end, [&](const char *block, size_t) {
+	  Masks masks = classify(block);
+	  uint64_t quote;
+	  uint64_t inString = scanner.stringMasks(masks, quote);
+	  // Starting inside a string just flips the in-string mask
+	  summary.depthIfOutside += std::popcount(masks.open & ~inString) - std::popcount(masks.close & ~inString);
+	  summary.depthIfInside += std::popcount(masks.open & inString) - std::popcount(masks.close & inString);
+	});
+	summary.flipsString = scanner.prevInString != 0;
+	return summary;
+      }
+
+      // The offset of the next structural character, or false if there
+      // aren't any more
+      bool next(size_t& pos) {
+	while (cursor == indices.size()) {
+	  if (!refill()) {
+	    return false;
+	  }
+	}
+	pos = indices[cursor++];
+	return true;
+      }
+
+      bool peek(size_t& pos) {
+	if (!next(pos)) {
+	  return false;
+	}
+	cursor--;
+	return true;
+      }
+
+      // True if the input ends partway through a string. Only meaningful
+      // once next() has returned false.
+      bool unterminatedString() const {
+	return prevInString != 0;
+      }
+    };
+
+  private:
+
+    std::string_view input;
+    StructuralScanner scanner;
+    Metadata::MetadataMap stores;
+    // cereal's shared pointer table, so repeated pointers come out
+    // shared. cereal numbers them 1, 2, 3... in the order written.
+    std::vector<Metadata::Data> pointers;
+    // Index of pointers[0]. Only the parallel importer starts partway
+    // through the numbering.
+    uint64_t pointerBase;
+    // When parsing one chunk of a bigger document, pointers defined in
+    // earlier chunks aren't in the table yet, so references to them get
+    // noted here (with the ID they belong to) and patched afterwards
+    bool deferReferences;
+    std::vector<std::pair<std::string, uint64_t>> unresolved;
+    // Position of the last structural character consumed
+    size_t last;
+    // Where the text next() hasn't looked at yet starts. The scanner
+    // only sees structurals, so anything else between two of them has
+    // to be checked by hand or junk like {"a":{} xyz} slips through.
+    size_t gapStart;
+
+    [[noreturn]] void fail(const std::string& what, size_t pos) {
+      throw std::runtime_error(std::format("JSON import failed at offset {}: {}", pos, what));
+    }
+
+    static bool whitespace(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // Fail unless everything from gapStart up to end is whitespace
+    void checkGap(size_t end) {
+      for (size_t i = gapStart; i < end; ++i) {
+	if (!whitespace(input[i])) {
+	  fail(std::format("unexpected '{}'", input[i]), i);
+	}
+      }
+    }
+
+    // The next structural, without looking at what's in between (the
+    // inside of a string, or a value being skipped)
+    size_t nextRaw() {
+      if (!scanner.next(last)) {
+	fail(scanner.unterminatedString() ? "unterminated string" : "unexpected end of input", input.size());
+      }
+      gapStart = last + 1;
+      return last;
+    }
+
+    // The next structural, which must only have whitespace before it
+    size_t next() {
+      if (!scanner.next(last)) {
+	fail(scanner.unterminatedString() ? "unterminated string" : "unexpected end of input", input.size());
+      }
+      checkGap(last);
+      gapStart = last + 1;
+      return last;
+    }
+
+    char peek() {
+      size_t pos;
+      if (!scanner.peek(pos)) {
+	return '\0';
+      }
+      return input[pos];
+    }
+
+    void expect(char c) {
+      size_t pos = next();
+      if (input[pos] != c) {
+	fail(std::format("expected '{}' but found '{}'", c, input[pos]), pos);
+      }
+    }
+
+    static void appendUtf8(std::string& out, uint32_t cp) {
+      if (cp < 0x80) {
+	out.push_back(static_cast<char>(cp));
+      } else if (cp < 0x800) {
+	out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+	out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+      } else if (cp < 0x10000) {
+	out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+	out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+	out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+      } else {
+	out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+	out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+	out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+	out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+      }
+    }
+
+    uint32_t hex4(std::string_view s, size_t at, size_t pos) {
+      uint32_t v = 0;
+      if (at + 4 > s.size() || std::from_chars(s.data() + at, s.data() + at + 4, v, 16).ptr != s.data() + at + 4) {
+	fail("bad \\u escape", pos);
+      }
+      return v;
+    }
+
+    void unescape(std::string_view raw, std::string& out, size_t pos) {
+      out.reserve(raw.size());
+      for (size_t i = 0; i < raw.size(); ++i) {
+	char c = raw[i];
+	if (c != '\\') {
+	  out.push_back(c);
+	  continue;
+	}
+	if (++i == raw.size()) {
+	  fail("dangling backslash", pos);
+	}
+	switch (raw[i]) {
+	case '"': out.push_back('"'); break;
+	case '\\': out.push_back('\\'); break;
+	case '/': out.push_back('/'); break;
+	case 'b': out.push_back('\b'); break;
+	case 'f': out.push_back('\f'); break;
+	case 'n': out.push_back('\n'); break;
+	case 'r': out.push_back('\r'); break;
+	case 't': out.push_back('\t'); break;
+	case 'u': {
+	  uint32_t cp = hex4(raw, i + 1, pos);
+	  i += 4;
+	  if (cp >= 0xd800 && cp < 0xdc00 && i + 6 < raw.size() && raw[i + 1] == '\\' && raw[i + 2] == 'u') {
+	    uint32_t low = hex4(raw, i + 3, pos);
+	    if (low >= 0xdc00 && low < 0xe000) {
+	      cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+	      i += 6;
+	    }
+	  }
+	  appendUtf8(out, cp);
+	  break;
+	}
+	default:
+	  fail(std::format("bad escape '\\{}'", raw[i]), pos);
+	}
+      }
+    }
+
+    // Read a string whose opening quote is the next structural
+    std::string readString() {
+      size_t open = next();
+      if (input[open] != '"') {
+	fail("expected a string", open);
+      }
+      size_t close = nextRaw();
+      std::string_view raw = input.substr(open + 1, close - open - 1);
+      if (raw.find('\\') == std::string_view::npos) {
+	return std::string(raw);
+      }
+      std::string out;
+      unescape(raw, out, open);
+      return out;
+    }
+
+    void expectName(std::string_view name) {
+      size_t pos = last;
+      std::string got = readString();
+      if (got != name) {
+	fail(std::format("expected \"{}\" but found \"{}\"", name, got), pos);
+      }
+      expect(':');
+    }
+
+    // A number isn't structural, so it's whatever is between the last
+    // structural and the next one
+    uint64_t readNumber() {
+      size_t start = last + 1;
+      size_t end;
+      if (!scanner.peek(end)) {
+	fail("unexpected end of input", input.size());
+      }
+      std::string_view text = input.substr(start, end - start);
+      size_t first = text.find_first_not_of(" \t\r\n");
+      size_t lastChar = text.find_last_not_of(" \t\r\n");
+      if (first == std::string_view::npos) {
+	fail("expected a number", start);
+      }
+      text = text.substr(first, lastChar - first + 1);
+      uint64_t v = 0;
+      auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), v);
+      if (ec != std::errc() || ptr != text.data() + text.size()) {
+	fail(std::format("bad number '{}'", text), start);
+      }
+      gapStart = start + first + text.size();
+      return v;
+    }
+
+    // Skip over whatever value comes next
+    void skipValue() {
+      char c = peek();
+      if (c == '"') {
+	readString();
+      } else if (c == '{' || c == '[') {
+	// Only the opening bracket needs to be checked. What's inside
+	// isn't going anywhere.
+	next();
+	int depth = 1;
+	while (depth > 0) {
+	  char t = input[nextRaw()];
+	  if (t == '{' || t == '[') {
+	    depth++;
+	  } else if (t == '}' || t == ']') {
+	    depth--;
+	  } else if (t == '"') {
+	    nextRaw();
+	  }
+	}
+      } else {
+	// A number, true, false or null, which has no structurals of its
+	// own. It's one run of characters with only whitespace around it.
+	size_t end;
+	if (!scanner.peek(end)) {
+	  end = input.size();
+	}
+	size_t begin = gapStart;
+	while (begin < end && whitespace(input[begin])) {
+	  begin++;
+	}
+	size_t stop = begin;
+	while (stop < end && (std::isalnum(static_cast<unsigned char>(input[stop])) || input[stop] == '-' || input[stop] == '+' || input[stop] == '.')) {
+	  stop++;
+	}
+	if (stop == begin) {
+	  fail("expected a value", begin);
+	}
+	gapStart = stop;
+      }
+    }
+
+    // {"k":"v", ...}
+    Metadata::Data readSimpleStore() {
+      auto store = std::make_shared<Metadata::DataType>();
+      expect('{');
+      if (peek() == '}') {
+	next();
+	return store;
+      }
+      do {
+	std::string key = readString();
+	expect(':');
+	std::string value = readString();
+	// Input that's already sorted (anything we wrote) goes in at the
+	// end without a search
+	store->insert_or_assign(store->end(), std::move(key), Value::fromText(std::move(value)));
+      } while (input[next()] == ',');
+      if (input[last] != '}') {
+	fail("expected ',' or '}'", last);
+      }
+      return store;
+    }
+
+    // [{"key":"k","value":"v"}, ...]
+    Metadata::Data readCerealStore() {
+      auto store = std::make_shared<Metadata::DataType>();
+      expect('[');
+      if (peek() == ']') {
+	next();
+	return store;
+      }
+      do {
+	expect('{');
+	expectName("key");
+	std::string key = readString();
+	expect(',');
+	expectName("value");
+	std::string value = readString();
+	expect('}');
+	store->insert_or_assign(store->end(), std::move(key), Value::fromText(std::move(value)));
+      } while (input[next()] == ',');
+      if (input[last] != ']') {
+	fail("expected ',' or ']'", last);
+      }
+      return store;
+    }
+
+    // {"ptr_wrapper":{"id":N,"data":[...]}}. The top bit of N says the
+    // data follows; without it N refers back to an earlier pointer,
+    // and 0 is nullptr.
+    // Sets reference instead of returning anything if N has to be
+    // patched later (see deferReferences.)
+    Metadata::Data readPointer(uint64_t& reference) {
+      expect('{');
+      expectName("ptr_wrapper");
+      expect('{');
+      expectName("id");
+      uint64_t id = readNumber();
+      Metadata::Data store;
+      if (id & 0x80000000ull) {
+	expect(',');
+	expectName("data");
+	store = readCerealStore();
+	uint64_t index = id & 0x7fffffffull;
+	if (pointers.empty()) {
+	  pointerBase = index;
+	}
+	if (index < pointerBase) {
+	  fail(std::format("pointer {} is out of order", index), last);
+	}
+	index -= pointerBase;
+	if (index >= pointers.size()) {
+	  pointers.resize(index + 1);
+	}
+	pointers[index] = store;
+      } else if (id != 0) {
+	if (id >= pointerBase && id - pointerBase < pointers.size() && pointers[id - pointerBase]) {
+	  store = pointers[id - pointerBase];
+	} else if (deferReferences) {
+	  reference = id;
+	} else {
+	  fail(std::format("reference to unknown pointer {}", id), last);
+	}
+      } else {
+	store = std::make_shared<Metadata::DataType>();
+      }
+      expect('}');
+      expect('}');
+      return store;
+    }
+
+    // {"key":"id","value":{"ptr_wrapper":...}}
+    void readCerealEntry() {
+      expect('{');
+      expectName("key");
+      std::string id = readString();
+      expect(',');
+      expectName("value");
+      uint64_t reference = 0;
+      Metadata::Data store = readPointer(reference);
+      expect('}');
+      if (reference) {
+	unresolved.emplace_back(id, reference);
+      }
+      stores.insert_or_assign(stores.end(), std::move(id), std::move(store));
+    }
+
+    // "id":{"k":"v", ...}
+    void readSimpleEntry() {
+      std::string id = readString();
+      expect(':');
+      stores.insert_or_assign(stores.end(), std::move(id), readSimpleStore());
+    }
+
+    // The array that follows "value0"
+    void readCerealIds() {
+      expect('[');
+      if (peek() == ']') {
+	next();
+	return;
+      }
+      do {
+	readCerealEntry();
+      } while (input[next()] == ',');
+      if (input[last] != ']') {
+	fail("expected ',' or ']'", last);
+      }
+    }
+
+    // The object that holds the IDs, in either shape
+    void readIds() {
+      expect('{');
+      if (peek() == '}') {
+	next();
+	return;
+      }
+      std::string first = readString();
+      expect(':');
+      if (first == "value0" && peek() == '[') {
+	readCerealIds();
+	// cereal may add its version info and such after it
+	skipMembers();
+      } else {
+	stores.insert_or_assign(stores.end(), std::move(first), readSimpleStore());
+	while (input[next()] == ',') {
+	  readSimpleEntry();
+	}
+	if (input[last] != '}') {
+	  fail("expected ',' or '}'", last);
+	}
+      }
+    }
+
+    // Skip any more ,"name":value pairs and the } that ends the object
+    void skipMembers() {
+      while (input[next()] == ',') {
+	readString();
+	expect(':');
+	skipValue();
+      }
+      if (input[last] != '}') {
+	fail("expected ',' or '}'", last);
+      }
+    }
+
+    void finish() {
+      size_t extra;
+      if (scanner.next(extra)) {
+	fail("trailing characters after the document", extra);
+      }
+      if (scanner.unterminatedString()) {
+	fail("unterminated string", input.size());
+      }
+      for (size_t i = gapStart; i < input.size(); ++i) {
+	if (!whitespace(input[i])) {
+	  fail("trailing characters after the document", i);
+	}
+      }
+    }
+
+    void parseDocument() {
+      expect('{');
+      if (peek() == '}') {
+	next();
+      } else {
+	// The top level name is whatever the archive called the Metadata
+	// ("m" from toJson.) Anything after it is ignored.
+	readString();
+	expect(':');
+	readIds();
+	skipMembers();
+      }
+      finish();
+    }
+
+    JsonImporter(std::string_view input, size_t start = 0, bool inString = false) :
+      input(input), scanner(input, start, inString, StructuralScanner::escapedAt(input, start)),
+      pointerBase(0), deferReferences(false), last(start), gapStart(start) {}
+
+    /*
+     * The parallel importer. The document gets cut into chunks at
+     * arbitrary byte offsets, and then:
+     *
+     *   1. Every chunk is summarized at once (StructuralScanner::summarize)
+     *      and the summaries are added up in order, which gives the
+     *      string state and nesting depth where each chunk starts.
+     *
+     *   2. Every chunk is parsed at once. Each one starts scanning from
+     *      its first byte in the state worked out in step 1, skips ahead
+     *      to the first ID that starts inside it and parses IDs until
+     *      the next one starts in the following chunk. The last ID it
+     *      parses usually runs on past its end, which is fine.
+     *
+     *   3. The chunks are merged into the Metadata in order as they
+     *      finish, so an ID that appears twice ends up with the later
+     *      one, same as the serial importer.
+     *
+     * For JSON Lines, step 1 is skipped: chunks are cut at newlines,
+     * which can't appear inside a JSON string.
+     */
+
+    struct Chunk {
+      size_t start = 0;
+      size_t end = 0;
+      bool inString = false;
+      int64_t depth = 0;
+      Metadata::MetadataMap stores;
+      std::vector<Metadata::Data> pointers;
+      uint64_t pointerBase = 0;
+      std::vector<std::pair<std::string, uint64_t>> unresolved;
+      // Where the object or array holding the IDs was closed, if it
+      // was closed in this chunk
+      size_t close = std::string_view::npos;
+    };
+
+    // Parse the IDs that start between chunk.start and chunk.end. They
+    // all sit at entryDepth and start with a { in cereal's layout or a
+    // quote in the simple one.
+    void readChunk(Chunk& chunk, bool cereal, int64_t entryDepth) {
+      const char entryStart = cereal ? '{' : '"';
+      const char containerClose = cereal ? ']' : '}';
+      int64_t depth = chunk.depth;
+      size_t pos;
+      if (chunk.inString) {
+	// The end of a string that started in an earlier chunk
+	nextRaw();
+      }
+      while (true) {
+	if (!scanner.peek(pos) || pos >= chunk.end) {
+	  return;
+	}
+	char c = input[pos];
+	if (depth == entryDepth && c == entryStart) {
+	  break;
+	}
+	nextRaw();
+	if (c == '{' || c == '[') {
+	  depth++;
+	} else if (c == '}' || c == ']') {
+	  if (--depth < entryDepth) {
+	    chunk.close = pos;
+	    return;
+	  }
+	} else if (c == '"') {
+	  nextRaw();
+	}
+      }
+      deferReferences = true;
+      while (true) {
+	if (cereal) {
+	  readCerealEntry();
+	} else {
+	  readSimpleEntry();
+	}
+	char c = input[next()];
+	if (c == containerClose) {
+	  chunk.close = last;
+	  break;
+	}
+	if (c != ',') {
+	  fail(std::format("expected ',' or '{}'", containerClose), last);
+	}
+	if (!scanner.peek(pos)) {
+	  fail("unexpected end of input", input.size());
+	}
+	if (pos >= chunk.end) {
+	  break;
+	}
+      }
+      chunk.stores = std::move(stores);
+      chunk.pointers = std::move(pointers);
+      chunk.pointerBase = pointerBase;
+      chunk.unresolved = std::move(unresolved);
+    }
+
+    // One chunk of JSON Lines: each line is an object of IDs, in either
+    // shape
+    void readLines(Chunk& chunk) {
+      size_t pos;
+      while (scanner.peek(pos)) {
+	readIds();
+      }
+      if (scanner.unterminatedString()) {
+	fail("unterminated string", input.size());
+      }
+      checkGap(input.size());
+      chunk.stores = std::move(stores);
+    }
+
+    // Offsets to cut input at, roughly chunkBytes apart
+    static std::vector<size_t> cuts(std::string_view input, size_t begin, size_t chunkBytes, bool atNewlines) {
+      std::vector<size_t> offsets{begin};
+      for (size_t at = begin + chunkBytes; at < input.size(); at += chunkBytes) {
+	if (atNewlines) {
+	  at = input.find('\n', at);
+	  if (at == std::string_view::npos) {
+	    break;
+	  }
+	  at++;
+	}
+	if (at > offsets.back() && at < input.size()) {
+	  offsets.push_back(at);
+	}
+      }
+      offsets.push_back(input.size());
+      return offsets;
+    }
+
+    static size_t pickChunkBytes(size_t size, size_t threads, size_t chunkBytes) {
+      if (chunkBytes == 0) {
+	// A few chunks per thread evens things out when some chunks
+	// are slower than others
+	chunkBytes = std::max<size_t>(size / (threads * 4) + 1, 1024 * 1024);
+      }
+      return chunkBytes;
+    }
+
+    // Wait for every chunk (they point into input, so nothing can be
+    // left running), then merge them into stores in order, later IDs
+    // replacing earlier ones. fix gets a look at each chunk first.
+    // Returns the first chunk that closed the IDs, or chunks.size() if
+    // none did. Nothing goes into the Metadata from here; the callers
+    // merge stores in once the whole document has checked out, so a
+    // failed import leaves it alone.
+    template <typename Fix>
+    static size_t mergeChunks(Metadata::MetadataMap& stores, std::vector<Chunk>& chunks, std::vector<std::future<void>>& done, Fix&& fix) {
+      std::exception_ptr error;
+      size_t closedAt = chunks.size();
+      for (size_t i = 0; i < chunks.size(); ++i) {
+	try {
+	  done[i].get();
+	} catch (...) {
+	  // Chunks past the end of the IDs parse junk and may well fail.
+	  // That doesn't matter.
+	  if (!error && closedAt == chunks.size()) {
+	    error = std::current_exception();
+	  }
+	}
+	if (error || closedAt < chunks.size()) {
+	  continue;
+	}
+	try {
+	  fix(chunks[i]);
+	  // Moves the nodes across, leaving behind IDs stores already has
+	  stores.merge(chunks[i].stores);
+	  for (auto& [id, store] : chunks[i].stores) {
+	    stores[id] = std::move(store);
+	  }
+	} catch (...) {
+	  error = std::current_exception();
+	}
+	if (chunks[i].close != std::string_view::npos) {
+	  closedAt = i;
+	}
+      }
+      if (error) {
+	std::rethrow_exception(error);
+      }
+      return closedAt;
+    }
+
+    static void loadLinesParallel(Metadata& m, std::string_view input, size_t threads, size_t chunkBytes) {
+      auto offsets = cuts(input, 0, pickChunkBytes(input.size(), threads, chunkBytes), true);
+      std::vector<Chunk> chunks(offsets.size() - 1);
+      std::vector<std::future<void>> done;
+      ThreadPool pool(threads);
+      for (size_t i = 0; i < chunks.size(); ++i) {
+	chunks[i].start = offsets[i];
+	chunks[i].end = offsets[i + 1];
+	done.push_back(pool.submit([&input, &chunk = chunks[i]]() {
+	  JsonImporter importer(input.substr(0, chunk.end), chunk.start);
+	  importer.readLines(chunk);
+	}));
+      }
+      Metadata::MetadataMap stores;
+      mergeChunks(stores, chunks, done, [](Chunk&) {});
+      m.merge(std::move(stores));
+    }
+
+    static void loadJsonParallel(Metadata& m, std::string_view input, size_t threads, size_t chunkBytes) {
+      // Read up to the first ID to find out which shape this is and
+      // where the IDs start. Empty documents aren't worth the trouble.
+      JsonImporter head(input);
+      head.expect('{');
+      if (head.peek() == '}') {
+	return m.merge(parse(input));
+      }
+      head.readString();
+      head.expect(':');
+      head.expect('{');
+      size_t begin;
+      if (head.peek() == '}' || !head.scanner.peek(begin)) {
+	return m.merge(parse(input));
+      }
+      std::string first = head.readString();
+      head.expect(':');
+      bool cereal = first == "value0" && head.peek() == '[';
+      int64_t entryDepth = 2;
+      if (cereal) {
+	head.expect('[');
+	if (head.peek() == ']') {
+	  return m.merge(parse(input));
+	}
+	begin = head.last + 1;
+	entryDepth = 3;
+      }
+
+      auto offsets = cuts(input, begin, pickChunkBytes(input.size() - begin, threads, chunkBytes), false);
+      std::vector<Chunk> chunks(offsets.size() - 1);
+      ThreadPool pool(threads);
+
+      // Step 1
+      std::vector<std::future<StructuralScanner::Summary>> summaries;
+      for (size_t i = 0; i < chunks.size(); ++i) {
+	chunks[i].start = offsets[i];
+	chunks[i].end = offsets[i + 1];
+	summaries.push_back(pool.submit([input, start = offsets[i], end = offsets[i + 1]]() {
+	  return StructuralScanner::summarize(input, start, end);
+	}));
+      }
+      bool inString = false;
+      int64_t depth = entryDepth;
+      for (size_t i = 0; i < chunks.size(); ++i) {
+	chunks[i].inString = inString;
+	chunks[i].depth = depth;
+	auto summary = summaries[i].get();
+	depth += inString ? summary.depthIfInside : summary.depthIfOutside;
+	inString ^= summary.flipsString;
+      }
+
+      // Step 2
+      std::vector<std::future<void>> done;
+      for (auto& chunk : chunks) {
+	done.push_back(pool.submit([&input, &chunk, cereal, entryDepth]() {
+	  JsonImporter importer(input, chunk.start, chunk.inString);
+	  importer.readChunk(chunk, cereal, entryDepth);
+	}));
+      }
+
+      // Step 3. References to pointers from earlier chunks get patched
+      // up from everything merged so far.
+      std::vector<Metadata::Data> table;
+      Metadata::MetadataMap stores;
+      size_t closedAt = mergeChunks(stores, chunks, done, [&table](Chunk& chunk) {
+	if (chunk.pointerBase + chunk.pointers.size() > table.size()) {
+	  table.resize(chunk.pointerBase + chunk.pointers.size());
+	}
+	for (size_t i = 0; i < chunk.pointers.size(); ++i) {
+	  if (chunk.pointers[i]) {
+	    table[chunk.pointerBase + i] = std::move(chunk.pointers[i]);
+	  }
+	}
+	for (const auto& [id, reference] : chunk.unresolved) {
+	  if (reference >= table.size() || !table[reference]) {
+	    throw std::runtime_error(std::format("JSON import failed: reference to unknown pointer {}", reference));
+	  }
+	  auto itr = chunk.stores.find(id);
+	  // Unless the same ID turned up again later in the chunk
+	  if (!itr->second) {
+	    itr->second = table[reference];
+	  }
+	}
+      });
+      if (closedAt == chunks.size()) {
+	head.fail("unexpected end of input", input.size());
+      }
+
+      // Whatever follows the IDs gets checked the same way parse does it
+      JsonImporter tail(input, chunks[closedAt].close);
+      tail.next();
+      if (cereal) {
+	tail.skipMembers();
+      }
+      tail.skipMembers();
+      tail.finish();
+      m.merge(std::move(stores));
+    }
+
+  public:
+
+    // Parse json into a map of stores
+    static Metadata::MetadataMap parse(std::string_view json) {
+      JsonImporter importer(json);
+      importer.parseDocument();
+      return std::move(importer.stores);
+    }
+
+    // Replace the contents of m with what's in json. Like fromJson,
+    // listeners aren't told.
+    static void load(Metadata& m, std::string_view json) {
+      m.restore(parse(json));
+    }
+
+  private:
+
+    // mmap path and call fn with its contents
+    template <typename Fn>
+    static void withFile(const std::string& path, Fn&& fn) {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+	throw std::runtime_error(std::format("Unable to open '{}' (errno {})", path, errno));
+      }
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+	int error = errno;
+	::close(fd);
+	throw std::runtime_error(std::format("Unable to stat '{}' (errno {})", path, error));
+      }
+      if (st.st_size == 0) {
+	::close(fd);
+	throw std::runtime_error(std::format("'{}' is empty", path));
+      }
+      void *mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED) {
+	throw std::runtime_error(std::format("Unable to mmap '{}' (errno {})", path, errno));
+      }
+      ::madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+      try {
+	fn(std::string_view(static_cast<const char *>(mapping), st.st_size));
+      } catch (...) {
+	::munmap(mapping, st.st_size);
+	throw;
+      }
+      ::munmap(mapping, st.st_size);
+    }
+
+  public:
+
+    // Same thing straight from a file, which is mmapped rather than read
+    static void loadFile(Metadata& m, const std::string& path) {
+      withFile(path, [&m](std::string_view json) { load(m, json); });
+    }
+
+    enum class Format {
+      Auto,   // Lines for .jsonl and .ndjson files, Json otherwise
+      Json,   // One document, in either shape
+      Lines   // JSON Lines: one object of IDs per line
+    };
+
+    // Parse json on threads threads (0 for one per core) and merge the
+    // result into m. Unlike load, this adds to what's already in m;
+    // IDs that are in both get replaced. If the same ID appears more
+    // than once, the last one wins. Listeners aren't told. If the
+    // document doesn't parse, m is left as it was.
+    //
+    // chunkBytes is how much of the input each task gets. 0 picks
+    // something sensible. Documents with no IDs are just parsed serially.
+    static void loadParallel(Metadata& m, std::string_view json, size_t threads = 0,
+			     Format format = Format::Json, size_t chunkBytes = 0) {
+      if (threads == 0) {
+	threads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      if (format == Format::Lines) {
+	loadLinesParallel(m, json, threads, chunkBytes);
+      } else {
+	loadJsonParallel(m, json, threads, chunkBytes);
+      }
+    }
+
+    static void loadFileParallel(Metadata& m, const std::string& path, size_t threads = 0,
+				 Format format = Format::Auto, size_t chunkBytes = 0) {
+      if (format == Format::Auto) {
+	format = (path.ends_with(".jsonl") || path.ends_with(".ndjson")) ? Format::Lines : Format::Json;
+      }
+      withFile(path, [&](std::string_view json) { loadParallel(m, json, threads, format, chunkBytes); });
+    }
+  };
+
+}
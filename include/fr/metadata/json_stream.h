@@ -0,0 +1,194 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Streaming JSON export.
+ *
+ * Metadata::toJson builds the entire document in a stringstream and
+ * then copies it into a string, so a 2 GB store needs well over 4 GB
+ * of memory to export. JsonStreamer writes the same document a chunk
+ * at a time to wherever you like (a file descriptor, an ostream, a
+ * Pistache response stream, or any function that takes a string_view),
+ * so memory use stays flat no matter how big the store is.
+ *
+ * The output has the same shape cereal's JSON archive produces for
+ * toJson, so Metadata::fromJson reads it back. It's just not indented.
+ *
+ * The Metadata lock is only held while a batch of store pointers is
+ * copied (see Metadata::forEachStore), not while anything is written.
+ * Every store comes out exactly as it was at some moment during the
+ * export, but changes made to other stores while it runs may or may
+ * not be included. Write a Metadata::snapshot() instead if you need a
+ * single point in time.
+ */
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+namespace fr::metadata {
+
+  class JsonStreamer {
+  public:
+    using Sink = std::function<void(std::string_view)>;
+
+  private:
+    // cereal numbers each shared pointer it writes, with the top bit set
+    // to say "the data follows"
+    static constexpr uint64_t firstPointerId = 0x80000001ull;
+
+    Sink sink;
+    size_t chunkSize;
+    std::string buffer;
+
+    void flushIfFull() {
+      if (buffer.size() >= chunkSize) {
+	flush();
+      }
+    }
+
+    void flush() {
+      if (!buffer.empty()) {
+	sink(buffer);
+	buffer.clear();
+      }
+    }
+
+  public:
+
+    // sink gets the output chunkSize bytes (or a bit more) at a time
+    JsonStreamer(Sink sink, size_t chunkSize = 64 * 1024) : sink(std::move(sink)), chunkSize(chunkSize) {
+      buffer.reserve(chunkSize + 1024);
+    }
+
+    // Append s to out as a quoted JSON string
+    static void quote(std::string& out, std::string_view s) {
+      static constexpr char hex[] = "0123456789abcdef";
+      out.push_back('"');
+      for (char c : s) {
+	switch (c) {
+	case '"':
+	  out.append("\\\"");
+	  break;
+	case '\\':
+	  out.append("\\\\");
+	  break;
+	case '\b':
+	  out.append("\\b");
+	  break;
+	case '\f':
+	  out.append("\\f");
+	  break;
+	case '\n':
+	  out.append("\\n");
+	  break;
+	case '\r':
+	  out.append("\\r");
+	  break;
+	case '\t':
+	  out.append("\\t");
+	  break;
+	default:
+	  if (static_cast<unsigned char>(c) < 0x20) {
+	    out.append("\\u00");
+	    out.push_back(hex[(c >> 4) & 0xf]);
+	    out.push_back(hex[c & 0xf]);
+	  } else {
+	    out.push_back(c);
+	  }
+	}
+      }
+      out.push_back('"');
+    }
+
+    // Write all of m to the sink
+    void write(Metadata& m) {
+      uint64_t pointerId = firstPointerId;
+      bool firstStore = true;
+      buffer.append("{\"m\":{\"value0\":[");
+      m.forEachStore([&](const std::string& id, const Metadata::DataType& store) {
+	if (!firstStore) {
+	  buffer.push_back(',');
+	}
+	firstStore = false;
+	buffer.append("{\"key\":");
+	quote(buffer, id);
+	buffer.append(",\"value\":{\"ptr_wrapper\":{\"id\":");
+	buffer.append(std::to_string(pointerId++));
+	buffer.append(",\"data\":[");
+	bool firstKey = true;
+	for (const auto& [key, value] : store) {
+	  if (!firstKey) {
+	    buffer.push_back(',');
+	  }
+	  firstKey = false;
+	  buffer.append("{\"key\":");
+	  quote(buffer, key);
+	  buffer.append(",\"value\":");
+	  if (value.type() == Value::Type::String && !value.bytes().starts_with(Value::marker)) {
+	    quote(buffer, value.bytes());
+	  } else {
+	    quote(buffer, value.toText());
+	  }
+	  buffer.push_back('}');
+	  flushIfFull();
+	}
+	buffer.append("]}}}");
+	flushIfFull();
+      });
+      buffer.append("]}}");
+      flush();
+    }
+
+    // Convenience wrappers for the usual places to send it
+
+    static void write(Metadata& m, std::ostream& out, size_t chunkSize = 64 * 1024) {
+      JsonStreamer streamer([&out](std::string_view chunk) {
+	out.write(chunk.data(), chunk.size());
+	if (!out) {
+	  throw std::runtime_error("Unable to write JSON to stream");
+	}
+      }, chunkSize);
+      streamer.write(m);
+    }
+
+    // Works for sockets and pipes as well as files. The descriptor is
+    // left open.
+    static void write(Metadata& m, int fd, size_t chunkSize = 64 * 1024) {
+      JsonStreamer streamer([fd](std::string_view chunk) {
+	while (!chunk.empty()) {
+	  ssize_t n = ::write(fd, chunk.data(), chunk.size());
+	  if (n < 0) {
+	    if (errno == EINTR) {
+	      continue;
+	    }
+	    throw std::runtime_error(std::format("Unable to write JSON to descriptor {} (errno {})", fd, errno));
+	  }
+	  chunk.remove_prefix(n);
+	}
+      }, chunkSize);
+      streamer.write(m);
+    }
+  };
+
+}
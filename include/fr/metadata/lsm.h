@@ -0,0 +1,1267 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A log-structured merge tree storage engine with the Metadata API, for
+ * data sets that don't fit in memory.
+ *
+ * Writes go into an in-memory sorted table (the memtable.) When that
+ * gets big it's frozen and written out to disk as an immutable sorted
+ * segment file on a background thread, and a new memtable takes its
+ * place. Reads look in the memtable, then the frozen memtables, then
+ * the segments from newest to oldest, and the first hit wins. Each
+ * segment carries a bloom filter, so segments that can't have what
+ * you're looking for are skipped without touching the disk. Once there
+ * are enough segments they're merged into one on the worker pool,
+ * which throws away overwritten values and deleted entries.
+ *
+ * Nothing is ever updated in place, including deletes. Erasing a key
+ * writes a tombstone for it, and erasing an ID writes an "erased"
+ * marker that hides everything in that ID written before it. Writes
+ * never have to read anything first, so they stay cheap no matter how
+ * much is on disk (add() is the exception, since it has to check that
+ * the thing it's adding isn't already there.)
+ *
+ * Every change is also appended to a WriteAheadLog in the store's
+ * directory, so the memtable survives a crash. The log is trimmed
+ * every time a memtable makes it to disk.
+ *
+ * LsmStore stands on its own, but LsmSource (at the bottom) plugs one
+ * into a regular Metadata as its StoreSource, so the Metadata can run
+ * lazily from it or demote cold stores into it.
+ *
+ * Segment file layout (integers little-endian, strings are a varint
+ * length and the bytes):
+ *
+ *   entries  u8 kind | u8 type | u64 seq | string id | string key | string value
+ *   index    every 16th entry: u64 offset | u8 kind | string id | string key
+ *   bloom    bloom bits bits
+ *   footer   u64 entry count | u64 index offset | u64 index count |
+ *            u64 bloom offset | u64 bloom bits | u64 max seq | "FRLSM001"
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/durable.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/thread_pool.h>
+#include <fr/metadata/wal.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fr::metadata {
+
+  class LsmStore {
+  public:
+
+    struct Options {
+      // Freeze the memtable and write it out once it holds this much
+      size_t memtableBytes = 4 * 1024 * 1024;
+      // Merge the segments once there are this many
+      size_t compactionTrigger = 4;
+      // Worker threads for flushes and compactions
+      size_t threads = 2;
+      // Bloom filter size. 10 bits per key is about a 1% false positive rate.
+      size_t bloomBitsPerKey = 10;
+      // Log every change so the memtable survives a crash
+      bool log = true;
+      WriteAheadLog::Durability durability = WriteAheadLog::Durability::PerBatch;
+    };
+
+    struct Stats {
+      uint64_t userBytes = 0;               // Bytes of IDs, keys and values written by callers
+      uint64_t flushBytes = 0;              // Bytes written flushing memtables
+      uint64_t compactionBytesRead = 0;     // Bytes read by compactions
+      uint64_t compactionBytesWritten = 0;  // Bytes written by compactions
+      uint64_t flushes = 0;
+      uint64_t compactions = 0;
+      double compactionSeconds = 0.0;       // Time spent compacting
+      uint64_t bloomChecks = 0;             // Segment lookups that consulted a bloom filter
+      uint64_t bloomNegatives = 0;          // ... and were turned away by it
+      size_t segments = 0;
+      size_t frozenMemtables = 0;
+
+      // Bytes that hit the disk per byte written by callers
+      double writeAmplification() const {
+	return userBytes ? static_cast<double>(flushBytes + compactionBytesWritten) / userBytes : 0.0;
+      }
+
+      // Compaction output in bytes per second
+      double compactionThroughput() const {
+	return compactionSeconds > 0 ? compactionBytesWritten / compactionSeconds : 0.0;
+      }
+    };
+
+  private:
+
+    // What an entry is about. Sorting Erased and Live before Key means
+    // a scan sees what happened to an ID before it sees its keys.
+    enum Kind : uint8_t {
+      Erased = 0,  // The ID was erased. Hides everything in it older than this.
+      Live = 1,    // The ID was created (or written to)
+      Key = 2      // A key in the ID
+    };
+
+    enum Type : uint8_t {
+      Put = 0,
+      Delete = 1
+    };
+
+    struct KeyView {
+      std::string_view id;
+      uint8_t kind;
+      std::string_view key;
+      auto operator<=>(const KeyView&) const = default;
+      bool operator==(const KeyView&) const = default;
+    };
+
+    struct InternalKey {
+      std::string id;
+      uint8_t kind;
+      std::string key;
+      auto operator<=>(const InternalKey&) const = default;
+      bool operator==(const InternalKey&) const = default;
+      KeyView view() const {
+	return KeyView{id, kind, key};
+      }
+    };
+
+    struct Record {
+      uint64_t seq;
+      uint8_t type;
+      std::string value;
+    };
+
+    struct Memtable {
+      std::map<InternalKey, Record> table;
+      size_t bytes = 0;
+      // Last write-ahead log record that went into this table
+      uint64_t maxLsn = 0;
+    };
+
+    // One entry decoded from a segment. The views point into the mapping.
+    struct Entry {
+      KeyView key;
+      uint64_t seq;
+      uint8_t type;
+      std::string_view value;
+    };
+
+    static constexpr std::string_view segmentMagic = "FRLSM001";
+    static constexpr size_t footerSize = 56;
+    static constexpr size_t indexInterval = 16;
+    static constexpr int bloomHashes = 7;
+
+    // The string a key is hashed as for the bloom filters
+    static uint64_t bloomHash(const KeyView& k) {
+      std::string scratch;
+      codec::putString(scratch, k.id);
+      codec::putU8(scratch, k.kind);
+      scratch.append(k.key);
+      return codec::hash64(scratch);
+    }
+
+    /**
+     * An immutable sorted segment file, mmapped
+     */
+    class Segment {
+      std::string path;
+      const char *data;
+      size_t size;
+      uint64_t entries;
+      uint64_t indexOffset;
+      const char *bloom;
+      uint64_t bloomBits;
+      uint64_t maxSequence;
+      std::vector<std::pair<KeyView, uint64_t>> sparse;
+      bool obsolete;
+
+      void fail(const std::string& why) {
+	if (data) {
+	  ::munmap(const_cast<char *>(data), size);
+	  data = nullptr;
+	}
+	throw std::runtime_error(std::format("Segment '{}' is unusable: {}", path, why));
+      }
+
+    public:
+      const uint64_t rank;
+
+      Segment(const std::string& path, uint64_t rank) :
+	path(path), data(nullptr), size(0), entries(0), indexOffset(0), bloom(nullptr),
+	bloomBits(0), maxSequence(0), obsolete(false), rank(rank) {
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+	  throw std::runtime_error(std::format("Unable to open segment '{}' (errno {})", path, errno));
+	}
+	struct stat st;
+	if (::fstat(fd, &st) != 0) {
+	  int error = errno;
+	  ::close(fd);
+	  throw std::runtime_error(std::format("Unable to stat segment '{}' (errno {})", path, error));
+	}
+	size = st.st_size;
+	if (size < footerSize) {
+	  ::close(fd);
+	  fail("too short");
+	}
+	void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED) {
+	  throw std::runtime_error(std::format("Unable to mmap segment '{}' (errno {})", path, errno));
+	}
+	data = static_cast<const char *>(mapping);
+	const char *footer = data + size - footerSize;
+	if (std::string_view(footer + 48, 8) != segmentMagic) {
+	  fail("bad magic");
+	}
+	entries = codec::getU64(footer);
+	indexOffset = codec::getU64(footer + 8);
+	uint64_t indexCount = codec::getU64(footer + 16);
+	uint64_t bloomOffset = codec::getU64(footer + 24);
+	bloomBits = codec::getU64(footer + 32);
+	maxSequence = codec::getU64(footer + 40);
+	if (indexOffset > bloomOffset || bloomOffset + (bloomBits + 7) / 8 > size - footerSize) {
+	  fail("offsets out of range");
+	}
+	bloom = data + bloomOffset;
+	// The sparse index is small (one entry in 16), so it's decoded
+	// up front
+	codec::Reader reader(data + indexOffset, bloomOffset - indexOffset);
+	sparse.reserve(indexCount);
+	for (uint64_t i = 0; i < indexCount; ++i) {
+	  uint64_t offset;
+	  uint8_t kind;
+	  std::string_view id;
+	  std::string_view key;
+	  if (!reader.getU64(offset) || !reader.getU8(kind) || !reader.getString(id) || !reader.getString(key)) {
+	    fail("corrupt index");
+	  }
+	  sparse.push_back({KeyView{id, kind, key}, offset});
+	}
+      }
+
+      Segment(const Segment&) = delete;
+      Segment& operator=(const Segment&) = delete;
+
+      ~Segment() {
+	if (data) {
+	  ::munmap(const_cast<char *>(data), size);
+	}
+	if (obsolete) {
+	  ::unlink(path.c_str());
+	}
+      }
+
+      // Delete the file once the last reader lets go
+      void markObsolete() {
+	obsolete = true;
+      }
+
+      const std::string& filename() const {
+	return path;
+      }
+
+      uint64_t fileSize() const {
+	return size;
+      }
+
+      uint64_t maxSeq() const {
+	return maxSequence;
+      }
+
+      // Offset where the entries stop
+      uint64_t end() const {
+	return indexOffset;
+      }
+
+      bool mayContain(uint64_t hash) const {
+	if (bloomBits == 0) {
+	  return true;
+	}
+	uint64_t h1 = hash;
+	uint64_t h2 = (hash >> 32) | 1;
+	for (int i = 0; i < bloomHashes; ++i) {
+	  uint64_t bit = (h1 + i * h2) % bloomBits;
+	  if (!(static_cast<uint8_t>(bloom[bit / 8]) & (1u << (bit % 8)))) {
+	    return false;
+	  }
+	}
+	return true;
+      }
+
+      // Decode the entry at offset and move offset past it
+      bool decode(uint64_t& offset, Entry& entry) const {
+	if (offset >= indexOffset) {
+	  return false;
+	}
+	codec::Reader reader(data + offset, indexOffset - offset);
+	if (!reader.getU8(entry.key.kind) || !reader.getU8(entry.type) || !reader.getU64(entry.seq) ||
+	    !reader.getString(entry.key.id) || !reader.getString(entry.key.key) ||
+	    !reader.getString(entry.value)) {
+	  throw std::runtime_error(std::format("Corrupt entry in segment '{}' at offset {}", path, offset));
+	}
+	offset = indexOffset - reader.remaining();
+	return true;
+      }
+
+      // Offset of the last indexed entry at or before from (or the start)
+      uint64_t seek(const KeyView& from) const {
+	auto itr = std::upper_bound(sparse.begin(), sparse.end(), from,
+				    [](const KeyView& k, const auto& entry) { return k < entry.first; });
+	if (itr == sparse.begin()) {
+	  return 0;
+	}
+	return std::prev(itr)->second;
+      }
+
+      std::optional<Entry> get(const KeyView& k) const {
+	uint64_t offset = seek(k);
+	Entry entry;
+	while (decode(offset, entry)) {
+	  if (entry.key == k) {
+	    return entry;
+	  }
+	  if (k < entry.key) {
+	    break;
+	  }
+	}
+	return std::nullopt;
+      }
+
+      // Call fn on every entry from the first one at or after from,
+      // until fn returns false or the entries run out
+      template <typename Fn>
+      void scan(const KeyView& from, Fn&& fn) const {
+	uint64_t offset = seek(from);
+	Entry entry;
+	while (decode(offset, entry)) {
+	  if (entry.key < from) {
+	    continue;
+	  }
+	  if (!fn(entry)) {
+	    return;
+	  }
+	}
+      }
+    };
+
+    /**
+     * Writes a segment file one sorted entry at a time
+     */
+    class SegmentWriter {
+      std::string path;
+      std::ofstream out;
+      uint64_t offset;
+      uint64_t count;
+      uint64_t maxSeq;
+      std::string index;
+      uint64_t indexCount;
+      std::vector<uint64_t> hashes;
+      std::string buffer;
+
+    public:
+      SegmentWriter(const std::string& path) :
+	path(path), out(path, std::ios::binary | std::ios::trunc), offset(0), count(0),
+	maxSeq(0), indexCount(0) {
+	if (!out) {
+	  throw std::runtime_error(std::format("Unable to create segment '{}'", path));
+	}
+      }
+
+      void add(const KeyView& k, uint64_t seq, uint8_t type, std::string_view value) {
+	if (count % indexInterval == 0) {
+	  codec::putU64(index, offset);
+	  codec::putU8(index, k.kind);
+	  codec::putString(index, k.id);
+	  codec::putString(index, k.key);
+	  indexCount++;
+	}
+	buffer.clear();
+	codec::putU8(buffer, k.kind);
+	codec::putU8(buffer, type);
+	codec::putU64(buffer, seq);
+	codec::putString(buffer, k.id);
+	codec::putString(buffer, k.key);
+	codec::putString(buffer, value);
+	out.write(buffer.data(), buffer.size());
+	offset += buffer.size();
+	hashes.push_back(bloomHash(k));
+	maxSeq = std::max(maxSeq, seq);
+	count++;
+      }
+
+      // Write the index, bloom filter and footer. Returns the file size.
+      uint64_t finish(size_t bitsPerKey) {
+	uint64_t indexOffset = offset;
+	out.write(index.data(), index.size());
+	offset += index.size();
+	uint64_t bloomOffset = offset;
+	uint64_t bloomBits = std::max<uint64_t>(64, count * bitsPerKey);
+	std::string bloom((bloomBits + 7) / 8, '\0');
+	for (uint64_t hash : hashes) {
+	  uint64_t h1 = hash;
+	  uint64_t h2 = (hash >> 32) | 1;
+	  for (int i = 0; i < bloomHashes; ++i) {
+	    uint64_t bit = (h1 + i * h2) % bloomBits;
+	    bloom[bit / 8] = static_cast<char>(static_cast<uint8_t>(bloom[bit / 8]) | (1u << (bit % 8)));
+	  }
+	}
+	out.write(bloom.data(), bloom.size());
+	offset += bloom.size();
+	std::string footer;
+	codec::putU64(footer, count);
+	codec::putU64(footer, indexOffset);
+	codec::putU64(footer, indexCount);
+	codec::putU64(footer, bloomOffset);
+	codec::putU64(footer, bloomBits);
+	codec::putU64(footer, maxSeq);
+	footer.append(segmentMagic);
+	out.write(footer.data(), footer.size());
+	offset += footer.size();
+	out.close();
+	if (!out) {
+	  throw std::runtime_error(std::format("Unable to write segment '{}'", path));
+	}
+	// The manifest is about to point at this, so it had better be on
+	// disk. Its directory entry is synced along with the manifest.
+	durable::syncFile(path);
+	return offset;
+      }
+    };
+
+    // What a lookup found out about one ID
+    struct IdState {
+      uint64_t erased = 0;  // seq of the most recent erase
+      uint64_t live = 0;    // seq of the most recent create/write
+      bool exists() const {
+	return live > erased;
+      }
+    };
+
+    // Everything a read needs to look at besides the active memtable
+    struct Sources {
+      std::vector<std::shared_ptr<const Memtable>> frozen;
+      std::vector<std::shared_ptr<Segment>> segments;
+    };
+
+    std::string dir;
+    Options options;
+
+    std::mutex mtx;
+    std::shared_ptr<Memtable> memtable;
+    // Newest first
+    std::vector<std::shared_ptr<const Memtable>> frozen;
+    // Newest (highest rank) first
+    std::vector<std::shared_ptr<Segment>> segments;
+    uint64_t nextSeq;
+    uint64_t nextFileId;
+    bool compacting;
+    size_t jobs;
+    std::condition_variable idle;
+    std::string lastError;
+    Stats counters;
+    std::mutex addMtx;
+
+    // Flushes happen one at a time, oldest memtable first
+    std::mutex flushMtx;
+    std::shared_ptr<WriteAheadLog> wal;
+    // Declared last so it's torn down first
+    std::unique_ptr<ThreadPool> pool;
+
+    std::string segmentPath(uint64_t fileId) const {
+      return (std::filesystem::path(dir) / std::format("segment-{}.lsm", fileId)).string();
+    }
+
+    std::string manifestPath() const {
+      return (std::filesystem::path(dir) / "MANIFEST").string();
+    }
+
+    // Write live as the list of live segments. Nothing that depends on
+    // the new list (trimming the log, dropping compaction inputs) may
+    // happen until this returns. Call with mtx held.
+    void writeManifest(const std::vector<std::shared_ptr<Segment>>& live) {
+      std::string tmpPath = manifestPath() + ".tmp";
+      {
+	std::ofstream out(tmpPath, std::ios::trunc);
+	for (const auto& segment : live) {
+	  out << segment->rank << " " << std::filesystem::path(segment->filename()).filename().string() << "\n";
+	}
+	out.close();
+	if (!out) {
+	  throw std::runtime_error(std::format("Unable to write manifest '{}'", tmpPath));
+	}
+      }
+      durable::replace(tmpPath, manifestPath());
+    }
+
+    void readManifest() {
+      std::ifstream in(manifestPath());
+      std::vector<std::string> live;
+      uint64_t rank;
+      std::string name;
+      while (in >> rank >> name) {
+	auto segment = std::make_shared<Segment>((std::filesystem::path(dir) / name).string(), rank);
+	nextSeq = std::max(nextSeq, segment->maxSeq() + 1);
+	segments.push_back(segment);
+	live.push_back(name);
+      }
+      std::sort(segments.begin(), segments.end(),
+		[](const auto& a, const auto& b) { return a->rank > b->rank; });
+      // Anything else is left over from a flush or compaction that
+      // didn't finish. Only files named the way segmentPath names them
+      // are ours; anything else somebody put here is left alone.
+      for (const auto& entry : std::filesystem::directory_iterator(dir)) {
+	std::string file = entry.path().filename().string();
+	if (!file.starts_with("segment-") || !file.ends_with(".lsm")) {
+	  continue;
+	}
+	std::string_view digits = std::string_view(file).substr(8, file.size() - 12);
+	uint64_t fileId;
+	auto [ptr, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), fileId);
+	if (digits.empty() || ec != std::errc() || ptr != digits.data() + digits.size()) {
+	  continue;
+	}
+	if (std::find(live.begin(), live.end(), file) == live.end()) {
+	  std::filesystem::remove(entry.path());
+	}
+	nextFileId = std::max(nextFileId, fileId + 1);
+      }
+    }
+
+    // Call with mtx held
+    void put(InternalKey k, uint8_t type, std::string value, uint64_t userBytes) {
+      size_t bytes = k.id.size() + k.key.size() + value.size() + 32;
+      memtable->table.insert_or_assign(std::move(k), Record{nextSeq++, type, std::move(value)});
+      memtable->bytes += bytes;
+      counters.userBytes += userBytes;
+    }
+
+    // Mark id live unless the memtable already says it is. Call with
+    // mtx held.
+    void touch(const std::string& id) {
+      auto& table = memtable->table;
+      auto live = table.find(InternalKey{id, Live, ""});
+      if (live != table.end()) {
+	auto erased = table.find(InternalKey{id, Erased, ""});
+	if (erased == table.end() || erased->second.seq < live->second.seq) {
+	  return;
+	}
+      }
+      put(InternalKey{id, Live, ""}, Put, "", 0);
+    }
+
+    // Call with mtx held
+    void logged(MutationListener::Op op, const std::string& id, const std::string& key,
+		const std::string& value, uint64_t& lsn) {
+      if (wal) {
+	lsn = wal->record(op, id, key, value);
+	memtable->maxLsn = lsn;
+      }
+    }
+
+    // Freeze the memtable if it's full. Call with mtx held.
+    void maybeFreeze(bool force = false) {
+      if (memtable->table.empty() || (!force && memtable->bytes < options.memtableBytes)) {
+	return;
+      }
+      frozen.insert(frozen.begin(), memtable);
+      memtable = std::make_shared<Memtable>();
+      schedule([this]() { flushOldest(); });
+    }
+
+    // Run a job on the pool, keeping track of it so we can wait for
+    // everything to finish. Call with mtx held.
+    template <typename Fn>
+    void schedule(Fn&& fn) {
+      jobs++;
+      pool->submit([this, fn]() {
+	std::string error;
+	try {
+	  fn();
+	} catch (std::exception& e) {
+	  error = e.what();
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!error.empty()) {
+	  lastError = error;
+	}
+	jobs--;
+	idle.notify_all();
+      });
+    }
+
+    void flushOldest() {
+      std::lock_guard<std::mutex> flushLock(flushMtx);
+      std::shared_ptr<const Memtable> table;
+      uint64_t fileId;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (frozen.empty()) {
+	  return;
+	}
+	table = frozen.back();
+	fileId = nextFileId++;
+      }
+      std::string path = segmentPath(fileId);
+      SegmentWriter writer(path);
+      for (const auto& [k, record] : table->table) {
+	writer.add(k.view(), record.seq, record.type, record.value);
+      }
+      uint64_t bytes = writer.finish(options.bloomBitsPerKey);
+      auto segment = std::make_shared<Segment>(path, fileId);
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	// If the manifest can't be written the memtable stays frozen and
+	// the log keeps its records
+	std::vector<std::shared_ptr<Segment>> live = segments;
+	live.insert(live.begin(), segment);
+	writeManifest(live);
+	segments = std::move(live);
+	frozen.pop_back();
+	counters.flushes++;
+	counters.flushBytes += bytes;
+	if (segments.size() >= options.compactionTrigger && !compacting) {
+	  compacting = true;
+	  schedule([this]() { compact(); });
+	}
+      }
+      if (wal && table->maxLsn > 0) {
+	wal->truncateThrough(table->maxLsn);
+      }
+    }
+
+    // A cursor over one segment for the k-way merge
+    struct Cursor {
+      const Segment *segment;
+      uint64_t offset;
+      Entry entry;
+      bool valid;
+
+      void next() {
+	valid = segment->decode(offset, entry);
+      }
+    };
+
+    void compact() {
+      try {
+	mergeSegments();
+      } catch (...) {
+	// The inputs are still the live segments, so a later flush can
+	// try again
+	std::lock_guard<std::mutex> lock(mtx);
+	compacting = false;
+	throw;
+      }
+    }
+
+    // Merge every segment that exists right now into one. Segments
+    // flushed while this runs are newer than everything being merged
+    // and are left alone.
+    void mergeSegments() {
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::shared_ptr<Segment>> inputs;
+      uint64_t fileId;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	inputs = segments;
+	fileId = nextFileId++;
+      }
+      if (inputs.size() < 2) {
+	std::lock_guard<std::mutex> lock(mtx);
+	compacting = false;
+	return;
+      }
+      uint64_t rank = inputs.front()->rank;
+      uint64_t bytesRead = 0;
+      std::vector<Cursor> cursors;
+      for (const auto& segment : inputs) {
+	bytesRead += segment->fileSize();
+	Cursor cursor{segment.get(), 0, {}, false};
+	cursor.next();
+	if (cursor.valid) {
+	  cursors.push_back(cursor);
+	}
+      }
+      // Smallest key first, and for equal keys the newest first
+      auto later = [&cursors](size_t a, size_t b) {
+	const Entry& x = cursors[a].entry;
+	const Entry& y = cursors[b].entry;
+	if (x.key != y.key) {
+	  return y.key < x.key;
+	}
+	return x.seq < y.seq;
+      };
+      std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+      for (size_t i = 0; i < cursors.size(); ++i) {
+	heap.push(i);
+      }
+
+      std::string path = segmentPath(fileId);
+      SegmentWriter writer(path);
+      std::string currentId;
+      bool haveId = false;
+      uint64_t erasedSeq = 0;
+      while (!heap.empty()) {
+	size_t top = heap.top();
+	heap.pop();
+	// Copy out what we need before the cursor moves on
+	Entry newest = cursors[top].entry;
+	InternalKey k{std::string(newest.key.id), newest.key.kind, std::string(newest.key.key)};
+	std::string value(newest.value);
+	cursors[top].next();
+	if (cursors[top].valid) {
+	  heap.push(top);
+	}
+	// Skip older versions of the same key
+	while (!heap.empty() && cursors[heap.top()].entry.key == k.view()) {
+	  size_t older = heap.top();
+	  heap.pop();
+	  cursors[older].next();
+	  if (cursors[older].valid) {
+	    heap.push(older);
+	  }
+	}
+	if (!haveId || currentId != k.id) {
+	  currentId = k.id;
+	  haveId = true;
+	  erasedSeq = 0;
+	}
+	// Everything older than this is in the merge, so the erased
+	// marker has done its job once the entries it hides are dropped
+	if (k.kind == Erased) {
+	  erasedSeq = newest.seq;
+	  continue;
+	}
+	if (newest.seq < erasedSeq) {
+	  continue;
+	}
+	if (k.kind == Key && newest.type == Delete) {
+	  continue;
+	}
+	writer.add(k.view(), newest.seq, newest.type, value);
+      }
+      uint64_t bytes = writer.finish(options.bloomBitsPerKey);
+      auto output = std::make_shared<Segment>(path, rank);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+      std::lock_guard<std::mutex> lock(mtx);
+      std::vector<std::shared_ptr<Segment>> remaining;
+      for (const auto& segment : segments) {
+	if (std::find(inputs.begin(), inputs.end(), segment) == inputs.end()) {
+	  remaining.push_back(segment);
+	}
+      }
+      remaining.push_back(output);
+      writeManifest(remaining);
+      segments = std::move(remaining);
+      for (const auto& segment : inputs) {
+	segment->markObsolete();
+      }
+      counters.compactions++;
+      counters.compactionBytesRead += bytesRead;
+      counters.compactionBytesWritten += bytes;
+      counters.compactionSeconds += elapsed.count();
+      compacting = false;
+      if (segments.size() >= options.compactionTrigger) {
+	compacting = true;
+	schedule([this]() { compact(); });
+      }
+    }
+
+    // Grab what a read needs. Call with mtx held.
+    Sources sources() {
+      return Sources{frozen, segments};
+    }
+
+    // Look k up everywhere but the active memtable, newest first
+    std::optional<Record> find(const Sources& from, const KeyView& k) {
+      InternalKey owned{std::string(k.id), k.kind, std::string(k.key)};
+      for (const auto& table : from.frozen) {
+	auto itr = table->table.find(owned);
+	if (itr != table->table.end()) {
+	  return itr->second;
+	}
+      }
+      uint64_t hash = bloomHash(k);
+      uint64_t checks = 0;
+      uint64_t negatives = 0;
+      std::optional<Record> found;
+      for (const auto& segment : from.segments) {
+	checks++;
+	if (!segment->mayContain(hash)) {
+	  negatives++;
+	  continue;
+	}
+	if (auto entry = segment->get(k)) {
+	  found = Record{entry->seq, entry->type, std::string(entry->value)};
+	  break;
+	}
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      counters.bloomChecks += checks;
+      counters.bloomNegatives += negatives;
+      return found;
+    }
+
+    // Look k up in the active memtable. Call with mtx held.
+    std::optional<Record> findActive(const KeyView& k) {
+      auto itr = memtable->table.find(InternalKey{std::string(k.id), k.kind, std::string(k.key)});
+      if (itr == memtable->table.end()) {
+	return std::nullopt;
+      }
+      return itr->second;
+    }
+
+    // Find out whether id exists, and optionally look up one key in it
+    // while we're at it
+    IdState lookup(const std::string& id, const std::string* key = nullptr,
+		   std::optional<Record>* keyRecord = nullptr) {
+      KeyView erasedKey{id, Erased, ""};
+      KeyView liveKey{id, Live, ""};
+      KeyView keyKey{id, Key, key ? std::string_view(*key) : std::string_view()};
+      std::optional<Record> erased;
+      std::optional<Record> live;
+      std::optional<Record> value;
+      Sources from;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	erased = findActive(erasedKey);
+	live = findActive(liveKey);
+	if (key) {
+	  value = findActive(keyKey);
+	}
+	from = sources();
+      }
+      if (!erased) {
+	erased = find(from, erasedKey);
+      }
+      if (!live) {
+	live = find(from, liveKey);
+      }
+      if (key && !value) {
+	value = find(from, keyKey);
+      }
+      IdState state;
+      state.erased = erased ? erased->seq : 0;
+      state.live = live ? live->seq : 0;
+      if (keyRecord) {
+	if (value && value->type == Put && value->seq > state.erased && state.exists()) {
+	  *keyRecord = value;
+	} else {
+	  keyRecord->reset();
+	}
+      }
+      return state;
+    }
+
+    // Call fn(key, record) for the newest version of every entry in
+    // [from, to), newest source first
+    template <typename Fn>
+    void scanRange(const KeyView& from, const std::optional<KeyView>& to, Fn&& fn) {
+      auto before = [&to](const KeyView& k) { return !to || k < *to; };
+      std::map<InternalKey, Record> merged;
+      Sources src;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (auto itr = memtable->table.lower_bound(InternalKey{std::string(from.id), from.kind, std::string(from.key)});
+	     itr != memtable->table.end() && before(itr->first.view()); ++itr) {
+	  merged.emplace(itr->first, itr->second);
+	}
+	src = sources();
+      }
+      // try_emplace keeps whatever got there first, which is the newest
+      for (const auto& table : src.frozen) {
+	for (auto itr = table->table.lower_bound(InternalKey{std::string(from.id), from.kind, std::string(from.key)});
+	     itr != table->table.end() && before(itr->first.view()); ++itr) {
+	  merged.try_emplace(itr->first, itr->second);
+	}
+      }
+      for (const auto& segment : src.segments) {
+	segment->scan(from, [&](const Entry& entry) {
+	  if (!before(entry.key)) {
+	    return false;
+	  }
+	  merged.try_emplace(InternalKey{std::string(entry.key.id), entry.key.kind, std::string(entry.key.key)},
+			     Record{entry.seq, entry.type, std::string(entry.value)});
+	  return true;
+	});
+      }
+      for (const auto& [k, record] : merged) {
+	fn(k, record);
+      }
+    }
+
+  public:
+
+    // Open (or create) the store in directory dir. Any segments listed
+    // in its manifest are mapped, and anything left in the log is
+    // replayed into a fresh memtable.
+    LsmStore(const std::string& dir, Options options) :
+      dir(dir), options(options), memtable(std::make_shared<Memtable>()), nextSeq(1),
+      nextFileId(1), compacting(false), jobs(0) {
+      std::filesystem::create_directories(dir);
+      readManifest();
+      pool = std::make_unique<ThreadPool>(options.threads);
+      if (options.log) {
+	std::string logPath = (std::filesystem::path(dir) / "wal.log").string();
+	uint64_t replayed = WriteAheadLog::replay(logPath, *this);
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  memtable->maxLsn = replayed;
+	}
+	wal = std::make_shared<WriteAheadLog>(logPath, options.durability);
+      }
+    }
+
+    LsmStore(const std::string& dir) : LsmStore(dir, Options()) {}
+
+    LsmStore(const LsmStore&) = delete;
+    LsmStore& operator=(const LsmStore&) = delete;
+
+    // Waits for background work to finish. The active memtable is not
+    // flushed (the log has it); call flush() first if you want it in a
+    // segment.
+    ~LsmStore() {
+      std::unique_lock<std::mutex> lock(mtx);
+      idle.wait(lock, [this]() { return jobs == 0; });
+      lock.unlock();
+      pool.reset();
+    }
+
+    bool contains(const std::string& id) {
+      return lookup(id).exists();
+    }
+
+    bool idContains(const std::string& id, const std::string& key) {
+      std::optional<Record> record;
+      lookup(id, &key, &record);
+      return record.has_value();
+    }
+
+    void add(const std::string& id) {
+      // addMtx keeps anyone else from adding it between the check and
+      // the write
+      std::lock_guard<std::mutex> adding(addMtx);
+      if (contains(id)) {
+	std::string errstr = std::format("'{}' already exists in metadata", id);
+	throw std::runtime_error(errstr);
+      }
+      uint64_t lsn = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	put(InternalKey{id, Live, ""}, Put, "", id.size());
+	logged(MutationListener::Op::AddId, id, "", "", lsn);
+	maybeFreeze();
+      }
+      if (wal) {
+	wal->commit(lsn);
+      }
+    }
+
+    void add(const std::string& id, const std::string& key, const std::string& value) {
+      std::lock_guard<std::mutex> adding(addMtx);
+      if (idContains(id, key)) {
+	std::string errstr = std::format("'{}' already exists in the unique id '{}'", key, id);
+	throw std::runtime_error(errstr);
+      }
+      update(id, key, value);
+    }
+
+    // Blind write; never reads anything from disk
+    void update(const std::string& id, const std::string& key, const std::string& value) {
+      uint64_t lsn = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	touch(id);
+	put(InternalKey{id, Key, key}, Put, value, id.size() + key.size() + value.size());
+	logged(MutationListener::Op::Update, id, key, value, lsn);
+	maybeFreeze();
+      }
+      if (wal) {
+	wal->commit(lsn);
+      }
+    }
+
+    void erase(const std::string& id) {
+      uint64_t lsn = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	put(InternalKey{id, Erased, ""}, Put, "", id.size());
+	logged(MutationListener::Op::EraseId, id, "", "", lsn);
+	maybeFreeze();
+      }
+      if (wal) {
+	wal->commit(lsn);
+      }
+    }
+
+    // erase, without waiting for the log to reach the disk. The erase
+    // is logged and visible when this returns, and is durable once a
+    // later change has been committed, sync() has been called, the
+    // memtable holding it is flushed or the store is closed. For
+    // callers holding a lock that other threads are waiting on.
+    void eraseUnsynced(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      uint64_t lsn = 0;
+      put(InternalKey{id, Erased, ""}, Put, "", id.size());
+      logged(MutationListener::Op::EraseId, id, "", "", lsn);
+      maybeFreeze();
+    }
+
+    // Get everything logged so far onto disk
+    void sync() {
+      if (wal) {
+	wal->sync();
+      }
+    }
+
+    void erase(const std::string& id, const std::string& key) {
+      uint64_t lsn = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	put(InternalKey{id, Key, key}, Delete, "", id.size() + key.size());
+	logged(MutationListener::Op::EraseKey, id, key, "", lsn);
+	maybeFreeze();
+      }
+      if (wal) {
+	wal->commit(lsn);
+      }
+    }
+
+    // Replace everything in id with pairs (creating it if need be), as
+    // one write to the log
+    void replace(const std::string& id, const std::vector<std::pair<std::string, std::string>>& pairs) {
+      uint64_t lsn = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	put(InternalKey{id, Erased, ""}, Put, "", id.size());
+	logged(MutationListener::Op::EraseId, id, "", "", lsn);
+	put(InternalKey{id, Live, ""}, Put, "", 0);
+	logged(MutationListener::Op::AddId, id, "", "", lsn);
+	for (const auto& [key, value] : pairs) {
+	  put(InternalKey{id, Key, key}, Put, value, key.size() + value.size());
+	  logged(MutationListener::Op::Update, id, key, value, lsn);
+	}
+	maybeFreeze();
+      }
+      if (wal) {
+	wal->commit(lsn);
+      }
+    }
+
+    std::string value(const std::string& id, const std::string& key) {
+      std::optional<Record> record;
+      lookup(id, &key, &record);
+      if (!record) {
+	std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
+	throw std::runtime_error(errstr);
+      }
+      return record->value;
+    }
+
+    std::vector<std::string> keys(const std::string& id) {
+      IdState state;
+      std::vector<std::pair<std::string, uint64_t>> candidates;
+      scanRange(KeyView{id, Erased, ""}, KeyView{id, static_cast<uint8_t>(Key + 1), ""},
+		[&](const InternalKey& k, const Record& record) {
+		  if (k.kind == Erased) {
+		    state.erased = record.seq;
+		  } else if (k.kind == Live) {
+		    state.live = record.seq;
+		  } else if (record.type == Put) {
+		    candidates.push_back({k.key, record.seq});
+		  }
+		});
+      if (!state.exists()) {
+	std::string errstr = std::format("Unique ID '{}' does not exist", id);
+	throw std::runtime_error(errstr);
+      }
+      std::vector<std::string> allKeys;
+      for (auto& [key, seq] : candidates) {
+	if (seq > state.erased) {
+	  allKeys.push_back(std::move(key));
+	}
+      }
+      return allKeys;
+    }
+
+    // All of id's keys and values in one pass, sorted by key, or
+    // nothing if there's no such ID
+    std::optional<std::vector<std::pair<std::string, std::string>>> read(const std::string& id) {
+      IdState state;
+      std::vector<std::pair<std::string, std::string>> pairs;
+      std::vector<uint64_t> seqs;
+      scanRange(KeyView{id, Erased, ""}, KeyView{id, static_cast<uint8_t>(Key + 1), ""},
+		[&](const InternalKey& k, const Record& record) {
+		  if (k.kind == Erased) {
+		    state.erased = record.seq;
+		  } else if (k.kind == Live) {
+		    state.live = record.seq;
+		  } else if (record.type == Put) {
+		    pairs.emplace_back(k.key, record.value);
+		    seqs.push_back(record.seq);
+		  }
+		});
+      if (!state.exists()) {
+	return std::nullopt;
+      }
+      std::vector<std::pair<std::string, std::string>> kept;
+      kept.reserve(pairs.size());
+      for (size_t i = 0; i < pairs.size(); ++i) {
+	if (seqs[i] > state.erased) {
+	  kept.push_back(std::move(pairs[i]));
+	}
+      }
+      return kept;
+    }
+
+    // Walks everything, so it's as slow as you'd expect
+    std::vector<std::string> ids() {
+      std::map<std::string, IdState> states;
+      scanRange(KeyView{"", Erased, ""}, std::nullopt,
+		[&](const InternalKey& k, const Record& record) {
+		  if (k.kind == Erased) {
+		    states[k.id].erased = record.seq;
+		  } else if (k.kind == Live) {
+		    states[k.id].live = record.seq;
+		  }
+		});
+      std::vector<std::string> allIds;
+      for (const auto& [id, state] : states) {
+	if (state.exists()) {
+	  allIds.push_back(id);
+	}
+      }
+      return allIds;
+    }
+
+    // Freeze the active memtable and wait until it (and everything else
+    // in flight) has made it to disk
+    void flush() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	maybeFreeze(true);
+      }
+      waitIdle();
+    }
+
+    // Merge all the segments now rather than waiting for the trigger
+    void compactNow() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!compacting && segments.size() > 1) {
+	  compacting = true;
+	  schedule([this]() { compact(); });
+	}
+      }
+      waitIdle();
+    }
+
+    // Wait for background flushes and compactions. Throws if one of
+    // them failed.
+    void waitIdle() {
+      std::unique_lock<std::mutex> lock(mtx);
+      idle.wait(lock, [this]() { return jobs == 0; });
+      if (!lastError.empty()) {
+	std::string error = lastError;
+	lastError.clear();
+	throw std::runtime_error(error);
+      }
+    }
+
+    Stats stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      Stats current = counters;
+      current.segments = segments.size();
+      current.frozenMemtables = frozen.size();
+      return current;
+    }
+  };
+
+  /**
+   * LsmSource is a StoreSource backed by an LsmStore, for a Metadata
+   * whose stores don't all fit in memory. attach() puts every ID in the
+   * store into the Metadata's directory and each one is loaded the
+   * first time it's used. It's writable, so demoteCold can push idle
+   * stores back out to it, and erasing an ID from the Metadata erases
+   * it here too. Values are kept in their Value::toText form.
+   */
+
+  class LsmSource : public Metadata::StoreSource {
+    std::shared_ptr<LsmStore> store;
+
+  public:
+    LsmSource(std::shared_ptr<LsmStore> store) : store(store) {}
+
+    Metadata::Data load(const std::string& id) override {
+      auto pairs = store->read(id);
+      if (!pairs) {
+	return nullptr;
+      }
+      auto loaded = std::make_shared<Metadata::DataType>();
+      for (auto& [key, value] : *pairs) {
+	loaded->emplace_hint(loaded->end(), std::move(key), Value::fromText(std::move(value)));
+      }
+      return loaded;
+    }
+
+    bool writable() const override {
+      return true;
+    }
+
+    void save(const std::string& id, const Metadata::DataType& stored) override {
+      std::vector<std::pair<std::string, std::string>> pairs;
+      pairs.reserve(stored.size());
+      for (const auto& [key, value] : stored) {
+	pairs.emplace_back(key, value.toText());
+      }
+      store->replace(id, pairs);
+    }
+
+    // Called with the Metadata lock held, so the erase doesn't wait
+    // for the disk. It goes out with the next save or anything else
+    // that commits the store's log; call sync on the store if you need
+    // it there sooner.
+    void forget(const std::string& id) override {
+      store->eraseUnsynced(id);
+    }
+
+    static void attach(Metadata& m, std::shared_ptr<LsmStore> store) {
+      m.attachSource(std::make_shared<LsmSource>(store), store->ids());
+    }
+  };
+
+}
@@ -0,0 +1,642 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * An immutable on-disk format for metadata that can be mmapped and read
+ * in place. Loading a big store with fromJson means parsing every byte
+ * and building millions of map nodes before you can answer a single
+ * question. With this format "loading" is an open and an mmap, and the
+ * pages you never look at never get read.
+ *
+ * File layout (all integers little-endian):
+ *
+ *   header  "FRMMAP01" | u64 id count | u64 index offset | u64 file size
+ *   blocks  one per ID, see below
+ *   ids     the ID strings, back to back
+ *   index   id count entries, sorted by ID:
+ *             u64 ID offset | u32 ID length | u32 reserved | u64 block offset
+ *
+ * Each block is:
+ *
+ *   u32 key count | key count u32 entry offsets (from block start)
+ *   entries: u32 key length | key | u32 value length | value
+ *
+ * with entries sorted by key. Values are in their Value::toText form,
+ * which for plain strings is just the string. Every lookup is a binary
+ * search over fixed size records, so nothing has to be parsed up front.
+ * Opening one only checks the header. Index entries and blocks are
+ * checked as they're read, so a corrupt file gets you an exception
+ * rather than a read off the end of the mapping.
+ *
+ * MappedFile is the raw reader. MappedMetadata puts the Metadata API
+ * on top of one, with changes going to an in-memory overlay.
+ * MappedSource lets a regular Metadata run lazily from one, faulting
+ * stores in as they're used.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/durable.h>
+#include <fr/metadata/metadata.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace fr::metadata {
+
+  /**
+   * MappedFile maps a file written by MappedFile::write and reads
+   * straight out of the mapping. Opening one only reads the header,
+   * however big the file is. Everything it hands back as a string_view
+   * points into the mapping and is good for as long as the MappedFile
+   * is.
+   *
+   * It's immutable, so it's safe to read from as many threads as you
+   * like without locking.
+   */
+
+  class MappedFile {
+  public:
+    static constexpr std::string_view fileMagic = "FRMMAP01";
+    static constexpr size_t headerSize = 32;
+    static constexpr size_t indexEntrySize = 24;
+
+    /**
+     * A view of one ID's key/value block
+     */
+    class Block {
+      const char *base;
+      // How far the block could possibly run (the start of the index)
+      size_t room;
+      uint32_t count;
+
+      [[noreturn]] static void corrupt() {
+	throw std::runtime_error("Mapped metadata block runs past the end of the file");
+      }
+
+      // The length prefixed field at offset in the block
+      std::string_view field(size_t offset) const {
+	if (offset > room - 4) {
+	  corrupt();
+	}
+	uint32_t length = codec::getU32(base + offset);
+	if (length > room - offset - 4) {
+	  corrupt();
+	}
+	return std::string_view(base + offset + 4, length);
+      }
+
+      size_t entry(size_t i) const {
+	return codec::getU32(base + 4 + 4 * i);
+      }
+
+    public:
+      Block(const char *base, size_t room) : base(base), room(room), count(codec::getU32(base)) {
+	if (count > (room - 4) / 4) {
+	  corrupt();
+	}
+      }
+
+      size_t size() const {
+	return count;
+      }
+
+      std::string_view keyAt(size_t i) const {
+	return field(entry(i));
+      }
+
+      std::string_view valueAt(size_t i) const {
+	size_t offset = entry(i);
+	return field(offset + 4 + field(offset).size());
+      }
+
+      // Binary search for key
+      std::optional<std::string_view> find(std::string_view key) const {
+	size_t lo = 0;
+	size_t hi = count;
+	while (lo < hi) {
+	  size_t mid = lo + (hi - lo) / 2;
+	  std::string_view candidate = keyAt(mid);
+	  if (candidate < key) {
+	    lo = mid + 1;
+	  } else if (key < candidate) {
+	    hi = mid;
+	  } else {
+	    return valueAt(mid);
+	  }
+	}
+	return std::nullopt;
+      }
+
+      // Copy the whole block into a regular store
+      Metadata::DataType materialize() const {
+	Metadata::DataType store;
+	for (size_t i = 0; i < count; ++i) {
+	  store.emplace_hint(store.end(), std::string(keyAt(i)), Value::fromText(valueAt(i)));
+	}
+	return store;
+      }
+    };
+
+  private:
+    std::string path;
+    const char *data;
+    size_t size;
+    uint64_t count;
+    const char *index;
+    // Where the index starts. IDs and blocks all have to fit before it.
+    uint64_t indexOffset;
+
+    void fail(const std::string& why) {
+      if (data) {
+	::munmap(const_cast<char *>(data), size);
+	data = nullptr;
+      }
+      throw std::runtime_error(std::format("'{}' is not a usable mapped metadata file: {}", path, why));
+    }
+
+    [[noreturn]] void corruptEntry(const char *what, size_t i) const {
+      throw std::runtime_error(std::format("'{}' is corrupt: {} {} is out of range", path, what, i));
+    }
+
+  public:
+
+    MappedFile(const std::string& path) : path(path), data(nullptr), size(0), count(0), index(nullptr), indexOffset(0) {
+      int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+	throw std::runtime_error(std::format("Unable to open '{}' (errno {})", path, errno));
+      }
+      struct stat st;
+      if (::fstat(fd, &st) != 0) {
+	::close(fd);
+	throw std::runtime_error(std::format("Unable to stat '{}' (errno {})", path, errno));
+      }
+      size = st.st_size;
+      if (size < headerSize) {
+	::close(fd);
+	fail("too short");
+      }
+      void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED) {
+	throw std::runtime_error(std::format("Unable to mmap '{}' (errno {})", path, errno));
+      }
+      data = static_cast<const char *>(mapping);
+      // Lookups jump around, so don't bother reading ahead
+      ::madvise(mapping, size, MADV_RANDOM);
+
+      if (std::string_view(data, fileMagic.size()) != fileMagic) {
+	fail("bad magic");
+      }
+      count = codec::getU64(data + 8);
+      indexOffset = codec::getU64(data + 16);
+      if (codec::getU64(data + 24) != size) {
+	fail("size doesn't match header (truncated?)");
+      }
+      if (indexOffset < headerSize || indexOffset > size || count > (size - indexOffset) / indexEntrySize) {
+	fail("index out of range");
+      }
+      // Index entries are checked by idAt and blockAt as they're used,
+      // so opening doesn't touch the index pages at all
+      index = data + indexOffset;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+      if (data) {
+	::munmap(const_cast<char *>(data), size);
+      }
+    }
+
+    const std::string& filename() const {
+      return path;
+    }
+
+    size_t idCount() const {
+      return count;
+    }
+
+    // IDs and blocks have to sit between the header and the index
+    std::string_view idAt(size_t i) const {
+      const char *entry = index + i * indexEntrySize;
+      uint64_t offset = codec::getU64(entry);
+      uint32_t length = codec::getU32(entry + 8);
+      if (offset < headerSize || offset > indexOffset || length > indexOffset - offset) {
+	corruptEntry("ID", i);
+      }
+      return std::string_view(data + offset, length);
+    }
+
+    Block blockAt(size_t i) const {
+      uint64_t offset = codec::getU64(index + i * indexEntrySize + 16);
+      if (offset < headerSize || offset > indexOffset - 4) {
+	corruptEntry("block", i);
+      }
+      return Block(data + offset, indexOffset - offset);
+    }
+
+    // Binary search the index for id
+    std::optional<size_t> find(std::string_view id) const {
+      size_t lo = 0;
+      size_t hi = count;
+      while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	std::string_view candidate = idAt(mid);
+	if (candidate < id) {
+	  lo = mid + 1;
+	} else if (id < candidate) {
+	  hi = mid;
+	} else {
+	  return mid;
+	}
+      }
+      return std::nullopt;
+    }
+
+    std::optional<Block> block(std::string_view id) const {
+      auto i = find(id);
+      if (!i) {
+	return std::nullopt;
+      }
+      return blockAt(*i);
+    }
+
+    // Write stores out in this format. Blocks are streamed to the file
+    // one at a time, so this doesn't need much more memory than the
+    // stores themselves.
+    static void write(const std::string& path, const Metadata::MetadataMap& stores) {
+      std::string tmpPath = path + ".tmp";
+      std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+      if (!out) {
+	throw std::runtime_error(std::format("Unable to create '{}'", tmpPath));
+      }
+      // Header gets filled in at the end
+      out.write(std::string(headerSize, '\0').data(), headerSize);
+      uint64_t offset = headerSize;
+      std::vector<uint64_t> blockOffsets;
+      blockOffsets.reserve(stores.size());
+      std::string block;
+      for (const auto& [id, store] : stores) {
+	block.clear();
+	static const Metadata::DataType empty;
+	const Metadata::DataType& kv = store ? *store : empty;
+	codec::putU32(block, kv.size());
+	size_t entryTable = block.size();
+	block.append(4 * kv.size(), '\0');
+	size_t i = 0;
+	for (const auto& [key, value] : kv) {
+	  codec::patchU32(block, entryTable + 4 * i++, block.size());
+	  codec::putU32(block, key.size());
+	  block.append(key);
+	  std::string text = value.toText();
+	  codec::putU32(block, text.size());
+	  block.append(text);
+	}
+	blockOffsets.push_back(offset);
+	out.write(block.data(), block.size());
+	offset += block.size();
+      }
+      std::vector<uint64_t> idOffsets;
+      idOffsets.reserve(stores.size());
+      for (const auto& [id, store] : stores) {
+	idOffsets.push_back(offset);
+	out.write(id.data(), id.size());
+	offset += id.size();
+      }
+      uint64_t indexOffset = offset;
+      std::string entry;
+      size_t i = 0;
+      for (const auto& [id, store] : stores) {
+	entry.clear();
+	codec::putU64(entry, idOffsets[i]);
+	codec::putU32(entry, id.size());
+	codec::putU32(entry, 0);
+	codec::putU64(entry, blockOffsets[i]);
+	out.write(entry.data(), entry.size());
+	++i;
+      }
+      offset += stores.size() * indexEntrySize;
+      std::string header(fileMagic);
+      codec::putU64(header, stores.size());
+      codec::putU64(header, indexOffset);
+      codec::putU64(header, offset);
+      out.seekp(0);
+      out.write(header.data(), header.size());
+      out.close();
+      if (!out) {
+	throw std::runtime_error(std::format("Unable to write '{}'", tmpPath));
+      }
+      // The data has to be on disk before the rename is, or a crash can
+      // leave a file with the right name and nothing in it
+      durable::replace(tmpPath, path);
+    }
+
+    // Convenience version for a live Metadata. Only holds its lock long
+    // enough to take a snapshot.
+    static void write(const std::string& path, Metadata& m) {
+      write(path, m.snapshot());
+    }
+  };
+
+  /**
+   * MappedMetadata serves the Metadata API from a MappedFile. Reads go
+   * to the mapping, with no parsing and no copying until you ask for a
+   * std::string back. Changes go into an in-memory overlay that sits on
+   * top of the file; the file itself is never touched. When you want
+   * the changes to stick, materialize() everything into a Metadata and
+   * write a new file from that.
+   */
+
+  class MappedMetadata {
+    // What the overlay knows about one ID
+    struct Overlay {
+      // The ID has been erased
+      bool erased = false;
+      // Don't look in the file for this ID (it was erased and re-added)
+      bool replacesBase = false;
+      Metadata::DataType values;
+      // Keys erased from the file's copy of this ID
+      std::set<std::string> erasedKeys;
+    };
+
+    std::shared_ptr<MappedFile> base;
+    std::map<std::string, Overlay> overlay;
+    std::mutex mtx;
+
+    // Call with mtx held
+    bool exists(const std::string& id) {
+      auto o = overlay.find(id);
+      if (o != overlay.end()) {
+	return !o->second.erased;
+      }
+      return base->find(id).has_value();
+    }
+
+    // Call with mtx held
+    std::optional<Value> lookup(const std::string& id, const std::string& key) {
+      auto o = overlay.find(id);
+      if (o != overlay.end()) {
+	if (o->second.erased) {
+	  return std::nullopt;
+	}
+	auto v = o->second.values.find(key);
+	if (v != o->second.values.end()) {
+	  return v->second;
+	}
+	if (o->second.replacesBase || o->second.erasedKeys.contains(key)) {
+	  return std::nullopt;
+	}
+      }
+      auto block = base->block(id);
+      if (!block) {
+	return std::nullopt;
+      }
+      auto value = block->find(key);
+      if (!value) {
+	return std::nullopt;
+      }
+      return Value::fromText(*value);
+    }
+
+    // Call with mtx held. Creates the overlay entry for an existing ID.
+    Overlay& overlayFor(const std::string& id) {
+      return overlay[id];
+    }
+
+    // Call with mtx held
+    std::vector<std::string> allIds() {
+      std::vector<std::string> found;
+      found.reserve(base->idCount());
+      auto o = overlay.begin();
+      // Both are sorted, so merge them
+      for (size_t i = 0; i < base->idCount(); ++i) {
+	std::string_view id = base->idAt(i);
+	for (; o != overlay.end() && o->first < id; ++o) {
+	  if (!o->second.erased) {
+	    found.push_back(o->first);
+	  }
+	}
+	if (o != overlay.end() && o->first == id) {
+	  if (!o->second.erased) {
+	    found.push_back(o->first);
+	  }
+	  ++o;
+	} else {
+	  found.emplace_back(id);
+	}
+      }
+      for (; o != overlay.end(); ++o) {
+	if (!o->second.erased) {
+	  found.push_back(o->first);
+	}
+      }
+      return found;
+    }
+
+    // The keys in an ID that exists. Call with mtx held.
+    std::vector<std::string> allKeys(const std::string& id) {
+      std::set<std::string> found;
+      auto o = overlay.find(id);
+      if (o == overlay.end() || !o->second.replacesBase) {
+	if (auto block = base->block(id)) {
+	  for (size_t i = 0; i < block->size(); ++i) {
+	    found.emplace(block->keyAt(i));
+	  }
+	}
+      }
+      if (o != overlay.end()) {
+	for (const auto& key : o->second.erasedKeys) {
+	  found.erase(key);
+	}
+	for (const auto& [key, value] : o->second.values) {
+	  found.insert(key);
+	}
+      }
+      return std::vector<std::string>(found.begin(), found.end());
+    }
+
+  public:
+
+    MappedMetadata(std::shared_ptr<MappedFile> file) : base(file) {}
+    MappedMetadata(const std::string& path) : base(std::make_shared<MappedFile>(path)) {}
+    ~MappedMetadata() = default;
+
+    bool contains(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      return exists(id);
+    }
+
+    bool idContains(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      return lookup(id, key).has_value();
+    }
+
+    void add(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (exists(id)) {
+	std::string errstr = std::format("'{}' already exists in metadata", id);
+	throw std::runtime_error(errstr);
+      }
+      // Either brand new or previously erased. Either way, the file's
+      // copy (if any) is dead.
+      overlay[id] = Overlay{false, true, {}, {}};
+    }
+
+    void add(const std::string& id, const std::string& key, const std::string& value) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (lookup(id, key)) {
+	std::string errstr = std::format("'{}' already exists in the unique id '{}'", key, id);
+	throw std::runtime_error(errstr);
+      }
+      if (!exists(id)) {
+	overlay[id] = Overlay{false, true, {}, {}};
+      }
+      overlayFor(id).values[key] = value;
+    }
+
+    void update(const std::string& id, const std::string& key, const std::string& value) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!exists(id)) {
+	overlay[id] = Overlay{false, true, {}, {}};
+      }
+      Overlay& o = overlayFor(id);
+      o.values[key] = value;
+      o.erasedKeys.erase(key);
+    }
+
+    std::vector<std::string> ids() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return allIds();
+    }
+
+    std::vector<std::string> keys(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!exists(id)) {
+	std::string errstr = std::format("Unique ID '{}' does not exist", id);
+	throw std::runtime_error(errstr);
+      }
+      return allKeys(id);
+    }
+
+    std::string value(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto v = lookup(id, key);
+      if (!v) {
+	std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
+	throw std::runtime_error(errstr);
+      }
+      return v->str();
+    }
+
+    void erase(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (exists(id)) {
+	overlay[id] = Overlay{true, true, {}, {}};
+      }
+    }
+
+    void erase(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!exists(id)) {
+	return;
+      }
+      Overlay& o = overlayFor(id);
+      o.values.erase(key);
+      if (!o.replacesBase) {
+	o.erasedKeys.insert(key);
+      }
+    }
+
+    // True if nothing has been changed since the file was opened
+    bool clean() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return overlay.empty();
+    }
+
+    std::shared_ptr<MappedFile> file() {
+      return base;
+    }
+
+    // Copy everything (file plus overlay) into a regular Metadata. The
+    // lock is held for the whole walk, so it's one consistent copy.
+    void materialize(Metadata& m) {
+      Metadata::MetadataMap stores;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	for (const auto& id : allIds()) {
+	  auto data = std::make_shared<Metadata::DataType>();
+	  for (const auto& key : allKeys(id)) {
+	    if (auto v = lookup(id, key)) {
+	      data->emplace_hint(data->end(), key, std::move(*v));
+	    }
+	  }
+	  stores.emplace_hint(stores.end(), id, data);
+	}
+      }
+      m.restore(std::move(stores));
+    }
+  };
+
+  /**
+   * MappedSource feeds stores out of a MappedFile to a Metadata that's
+   * running lazily (see Metadata::attachSource.)
+   */
+
+  class MappedSource : public Metadata::StoreSource {
+    std::shared_ptr<MappedFile> file;
+  public:
+    MappedSource(std::shared_ptr<MappedFile> file) : file(file) {}
+
+    Metadata::Data load(const std::string& id) override {
+      auto block = file->block(id);
+      if (!block) {
+	return nullptr;
+      }
+      return std::make_shared<Metadata::DataType>(block->materialize());
+    }
+
+    // Point m at file. Every ID in the file goes into m's directory and
+    // its store is loaded the first time somebody uses it.
+    static void attach(Metadata& m, std::shared_ptr<MappedFile> file) {
+      std::vector<std::string> ids;
+      ids.reserve(file->idCount());
+      for (size_t i = 0; i < file->idCount(); ++i) {
+	ids.emplace_back(file->idAt(i));
+      }
+      m.attachSource(std::make_shared<MappedSource>(file), ids);
+    }
+
+    static void attach(Metadata& m, const std::string& path) {
+      attach(m, std::make_shared<MappedFile>(path));
+    }
+  };
+
+}
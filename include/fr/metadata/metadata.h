@@ -15,12 +15,40 @@
  *
  * This is a object used to store metadata. It is fairly trivial, basically
  * a std::map of keys, which are unique identifiers of the metadata being
- * stored, and a shared pointer to a map<string,string> of key/value pairs.
+ * stored, and a shared pointer to a map<string,Value> of key/value pairs.
  * This does not allow you to store arbitrary objects as metadata, but
- * you can still store a lot of useful stuff.
+ * you can still store a lot of useful stuff. Values are usually
+ * strings, but can also be integers, doubles, bools or raw bytes (see
+ * value.h), which are kept as they are rather than formatted and
+ * parsed again on every read.
  *
  * This object provides serialization/deserialziation via cereal and
  * is able to use the json, XML or binary archivers.
+ *
+ * The key/value stores are copy-on-write. snapshot() hands you the ID
+ * map with the stores shared rather than copied, and the next change
+ * to a shared store makes a private copy of it first. That way a
+ * snapshot can be serialized at leisure on another thread without
+ * holding everyone else up.
+ *
+ * Metadata can also run lazily. attachSource gives it a directory of
+ * IDs whose stores haven't been loaded yet; each store is faulted in
+ * from the source the first time somebody touches it. Stores that were
+ * loaded and never changed can be dropped again (pageOut) since they
+ * can always be reloaded.
+ *
+ * If the source can take stores back (see tiered.h), Metadata can also
+ * keep track of how often each ID gets used and push the ones nobody
+ * has touched in a while out to it with demoteCold. They come back the
+ * same way lazily loaded stores do, the next time someone asks.
+ *
+ * The ID map is copy-on-write as well, so fork() can hand you an
+ * independent copy of the whole thing without copying anything.
+ *
+ * Integer keys can also be used as counters (see increment.) Those
+ * live in a table of atomics off to the side, so a busy counter
+ * doesn't fight everyone else for the lock, and their counts are
+ * written back into the stores whenever a snapshot is taken.
  */
 
 #pragma once
@@ -31,16 +59,72 @@
 #include <cereal/archives/xml.hpp>
 #include <cereal/types/map.hpp>
 #include <cereal/types/memory.hpp>
+#include <cereal/types/string.hpp>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <format>
+#include <functional>
+#include <fr/metadata/counters.h>
+#include <fr/metadata/filter.h>
+#include <fr/metadata/hotkeys.h>
+#include <fr/metadata/paths.h>
+#include <fr/metadata/thread_pool.h>
+#include <fr/metadata/value.h>
+#include <future>
+#include <iterator>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 namespace fr::metadata {
 
+  /**
+   * A MutationListener gets told about every change made to a Metadata
+   * object. The write-ahead log is the main customer, but anything that
+   * needs to follow along with changes can hook in here.
+   *
+   * record() is called while the Metadata lock is held, so the order
+   * listeners see changes in is the order they were applied in. It
+   * needs to be quick -- stash the change somewhere and hand back a
+   * ticket. commit() is called with that ticket once the lock has been
+   * released, and can take as long as it likes (waiting for an fsync,
+   * for example) without holding up anyone else.
+   */
+
+  class MutationListener {
+  public:
+    enum class Op : uint8_t {
+      AddId = 1,     // An empty store was created at id
+      Update = 2,    // key was set to value in id
+      EraseId = 3,   // The store at id was removed
+      EraseKey = 4,  // key was removed from id
+      Set = 5        // key was set to a typed value in id (value is Value::toText)
+    };
+
+    virtual ~MutationListener() = default;
+    virtual uint64_t record(Op op, const std::string& id,
+			    const std::string& key, const std::string& value) = 0;
+    virtual void commit(uint64_t /*ticket*/) {}
+  };
+
   // Metadata provides thread-safe metadata lookup
   // Metadata stores a map of unique string IDs and each
   // ID provides access to a map of string key/value pairs.
@@ -52,17 +136,711 @@ namespace fr::metadata {
     // Set up some type names
     
     // Define storage for the actual key/value pairs
-    using DataType = std::map<std::string,std::string>;
+    using DataType = std::map<std::string,Value>;
     using Data = std::shared_ptr<DataType>;
     // Define storage for the metadata itself. The first
     // element must be a unique identifier of some sort (A
     // UUID or sha5sum would be good for larger scale things.)
     using MetadataMap = std::map<std::string, Data>;
 
+    /**
+     * A StoreSource is somewhere stores can be faulted in from when
+     * Metadata is running lazily. load() is called without the Metadata
+     * lock held, possibly from several threads at once for different
+     * IDs, but never twice at once for the same ID. Returning nullptr
+     * means "nothing there" and gets you an empty store.
+     *
+     * Sources that can take stores back (a cold storage tier, say)
+     * override writable, save and forget. save is called without the
+     * Metadata lock held. forget is called with it held when an ID is
+     * erased, so keep it quick.
+     */
+    class StoreSource {
+    public:
+      virtual ~StoreSource() = default;
+      virtual Data load(const std::string& id) = 0;
+      virtual bool writable() const { return false; }
+      virtual void save(const std::string& /*id*/, const DataType& /*store*/) {}
+      virtual void forget(const std::string& /*id*/) {}
+    };
+
+    /**
+     * A Loader is what read-through mode (see setLoader) calls for an ID
+     * that isn't here at all. Return the ID's store, or nullptr if
+     * there's no such ID. Like StoreSource::load, it's called without
+     * the lock held and never twice at once for the same ID.
+     */
+    using Loader = std::function<Data(const std::string& id)>;
+
+    struct LoadStats {
+      uint64_t loads = 0;        // Stores faulted in from the source
+      uint64_t waits = 0;        // Times a thread waited on someone else's load
+      uint64_t evictions = 0;    // Clean stores paged back out
+      uint64_t resident = 0;     // Clean stores currently loaded
+      uint64_t hot = 0;          // Stores in memory
+      uint64_t cold = 0;         // Stores out in the source
+      uint64_t demotions = 0;    // Stores pushed out by demoteCold
+      uint64_t writeBacks = 0;   // ... that had changed and had to be saved
+      double loadSeconds = 0.0;  // Time spent waiting on the source
+      double maxLoadSeconds = 0.0;
+
+      // The extra latency a read pays when its store is cold
+      double averageLoadSeconds() const {
+	return loads ? loadSeconds / loads : 0.0;
+      }
+    };
+
+    struct ReadThroughStats {
+      bool enabled = false;
+      uint64_t hits = 0;          // Reads of IDs that were already here
+      uint64_t loads = 0;         // Calls to the loader
+      uint64_t coalesced = 0;     // Reads that waited on a load someone else started
+      uint64_t notFound = 0;      // Loads that said there's no such ID
+      uint64_t negativeHits = 0;  // Reads turned away by a remembered notFound
+      uint64_t errors = 0;        // Loads that threw
+      double loadSeconds = 0.0;
+      double maxLoadSeconds = 0.0;
+      // Loads by how long they took: bucket i is under 2^i microseconds
+      // (and at least half that)
+      std::array<uint64_t, 32> latency{};
+
+      // Of the reads that were answered here or by the loader, the
+      // fraction that didn't need the loader
+      double hitRatio() const {
+	uint64_t reads = hits + negativeHits + loads + coalesced;
+	return reads ? static_cast<double>(hits + negativeHits) / reads : 0.0;
+      }
+
+      double averageLoadSeconds() const {
+	return loads ? loadSeconds / loads : 0.0;
+      }
+
+      // About how long fraction (0.99, say) of the loads took at most,
+      // to within a factor of 2
+      double loadSecondsAt(double fraction) const {
+	uint64_t total = 0;
+	for (uint64_t n : latency) {
+	  total += n;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < latency.size(); ++i) {
+	  seen += latency[i];
+	  if (total && seen >= fraction * total) {
+	    return std::ldexp(1.0, static_cast<int>(i)) / 1e6;
+	  }
+	}
+	return 0.0;
+      }
+    };
+
+    struct FilterStats {
+      bool enabled = false;
+      uint64_t ids = 0;               // IDs in the filter
+      size_t capacity = 0;            // IDs it's sized for (it grows past twice this)
+      size_t bytes = 0;
+      double estimatedFalsePositiveRate = 0.0;
+      uint64_t definiteMisses = 0;    // Lookups turned away without the lock
+      uint64_t falsePositives = 0;    // Lookups it let through that missed anyway
+
+      // Of the lookups for IDs that weren't there, the fraction the
+      // filter let through
+      double observedFalsePositiveRate() const {
+	uint64_t misses = definiteMisses + falsePositives;
+	return misses ? static_cast<double>(falsePositives) / misses : 0.0;
+      }
+    };
+
+    struct HotStats {
+      bool enabled = false;
+      uint32_t sampleEvery = 0;       // One access in this many is counted
+      uint64_t sampled = 0;           // Accesses counted so far
+      size_t bytes = 0;
+      std::vector<HotEntry> ids;      // Busiest first, counts scaled back up
+      std::vector<HotEntry> keys;
+    };
+
+    /**
+     * What changed between two sequence numbers (see exportSince.) IDs
+     * come over whole: if any key in an ID changed, its entire store is
+     * in stores. If full is set, the delta is everything there is and
+     * replaces whatever the receiver had.
+     */
+    struct Delta {
+      uint64_t since = 0;    // The sequence number it was asked for
+      uint64_t through = 0;  // The one it brings you up to
+      bool full = false;
+      MetadataMap stores;    // Added or changed IDs
+      std::vector<std::string> erased;
+    };
+
   private:
 
-    MetadataMap metadata;
+    // The ID map is copy-on-write too, so fork() can hand out a copy
+    // without copying anything. Call unshare() before changing it.
+    std::shared_ptr<MetadataMap> metadata = std::make_shared<MetadataMap>();
     std::mutex mtx;
+    std::vector<std::shared_ptr<MutationListener>> listeners;
+
+    // Lazy loading. Stores in metadata that are nullptr haven't been
+    // loaded from source yet.
+    std::shared_ptr<StoreSource> source;
+    // IDs currently being loaded, so two threads don't load the same one
+    std::unordered_set<std::string> loading;
+    std::condition_variable loaded;
+    // Stores loaded from source and not changed since, oldest first.
+    // These are the ones that can be paged out.
+    std::list<std::string> cleanOrder;
+    std::unordered_map<std::string, std::list<std::string>::iterator> clean;
+    // Page out clean stores once there are more than this many (0 means
+    // never)
+    size_t residentLimit = 0;
+    LoadStats loadStats;
+    // Number of stores in metadata that are nullptr
+    size_t unloaded = 0;
+
+    // Read-through (see setLoader.) fetched is the IDs the loader
+    // brought in that haven't changed since; they're all clean too, and
+    // get dropped altogether rather than unloaded when they're paged
+    // out, since the loader can always bring them back. absent is the
+    // IDs it said don't exist and when to stop believing it. Readers
+    // check readingThrough without the lock, to know the ID filter
+    // can't be trusted.
+    Loader loader;
+    std::atomic<bool> readingThrough{false};
+    std::chrono::milliseconds negativeTtl{0};
+    std::unordered_set<std::string> fetched;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> absent;
+    ReadThroughStats readStats;
+    // Once absent has this many in it, the expired ones are swept out,
+    // and if that doesn't help it starts over
+    static constexpr size_t absentLimit = 65536;
+
+    // Access counts for demoteCold, bumped on every read or write and
+    // halved every sweep, so they reflect both how often and how
+    // recently an ID was used. IDs that decay to zero are dropped, so
+    // this only ever holds the ones that have been busy lately.
+    bool trackAccess = false;
+    std::unordered_map<std::string, uint32_t> heat;
+
+    // Change tracking for exportSince. Every change bumps sequence.
+    // With tracking on, each ID also remembers the sequence number of
+    // its last change, and changes indexes the IDs by that number (the
+    // pointers are the keys in changedAt, which stay put.) Erased IDs
+    // stay in both as tombstones until forgetChangesBefore drops them.
+    // Deltas from before horizon can't be worked out any more and come
+    // out full.
+    uint64_t sequence = 0;
+    bool trackChanges = false;
+    uint64_t horizon = 0;
+    std::unordered_map<std::string, uint64_t> changedAt;
+    std::map<uint64_t, const std::string *> changes;
+
+    // Live counters (see increment.) The stores hold the count as of
+    // the last syncCounters, the table holds the real one. Lock mtx
+    // before a shard in there if you need both.
+    CounterTable counters;
+
+    // Note a change to id. Call with mtx held.
+    void stamp(const std::string& id) {
+      sequence++;
+      if (!trackChanges) {
+	return;
+      }
+      auto [itr, added] = changedAt.try_emplace(id, sequence);
+      if (!added) {
+	changes.erase(itr->second);
+	itr->second = sequence;
+      }
+      changes.emplace(sequence, &itr->first);
+    }
+
+    // Everything changed at once (a restore, say.) Call with mtx held.
+    void stampAll() {
+      sequence++;
+      horizon = sequence;
+      changedAt.clear();
+      changes.clear();
+    }
+
+    // The ID filter and the hot key tracker are used without the lock.
+    // While a thread has hold of one it bumps the count for its stripe,
+    // and whoever swaps one out (with mtx held) waits for every stripe
+    // to drop to zero before deleting the old one. A thread that comes
+    // in after the swap gets the new one, and nobody blocks while
+    // they're counted, so the wait is short. The stripes keep threads
+    // from all fighting over one cache line.
+    struct alignas(64) ReaderCount {
+      std::atomic<uint32_t> n{0};
+    };
+    std::array<ReaderCount, 16> readers;
+
+    class Reading {
+      std::atomic<uint32_t>& count;
+
+    public:
+      explicit Reading(Metadata& m) : count(m.readers[stripe() % m.readers.size()].n) {
+	count.fetch_add(1, std::memory_order_seq_cst);
+      }
+
+      ~Reading() {
+	count.fetch_sub(1, std::memory_order_release);
+      }
+
+      static size_t stripe() {
+	static std::atomic<size_t> next{0};
+	thread_local size_t mine = next.fetch_add(1, std::memory_order_relaxed);
+	return mine;
+      }
+    };
+
+    // Wait until nobody can still be using whatever was swapped out
+    // before this was called. Call with mtx held, never while Reading.
+    void waitForReaders() {
+      for (auto& count : readers) {
+	while (count.n.load(std::memory_order_seq_cst) != 0) {
+	  std::this_thread::yield();
+	}
+      }
+    }
+
+    // Optional filter in front of contains and friends (see
+    // setIdFilter.) idFilter is what readers load; filterOwned is the
+    // same filter, and only changes with mtx held.
+    std::atomic<CountingBloomFilter *> idFilter{nullptr};
+    std::unique_ptr<CountingBloomFilter> filterOwned;
+    std::atomic<uint64_t> filterMisses{0};
+    uint64_t filterFalsePositives = 0;
+
+    // Swap in a new filter (or none) and free the old one once nobody's
+    // using it. Call with mtx held.
+    void replaceFilter(std::unique_ptr<CountingBloomFilter> filter) {
+      idFilter.store(filter.get(), std::memory_order_seq_cst);
+      std::swap(filterOwned, filter);
+      if (filter) {
+	waitForReaders();
+      }
+    }
+
+    // Build a fresh filter holding every ID. Call with mtx held.
+    void rebuildFilter(size_t expected) {
+      auto filter = std::make_unique<CountingBloomFilter>(std::max<size_t>({expected, metadata->size() * 2, 1024}));
+      for (const auto& [id, store] : *metadata) {
+	filter->insert(id);
+      }
+      replaceFilter(std::move(filter));
+    }
+
+    // Optional hot ID and key tracking (see setHotKeyTracking.) Handled
+    // the same way as the filter. hotEvery is its sample rate, so the
+    // countdown can run without looking at the tracker.
+    std::atomic<HotKeys *> hotKeys{nullptr};
+    std::unique_ptr<HotKeys> hotOwned;
+    std::atomic<uint32_t> hotEvery{1};
+
+    // Count a read or write for hot key tracking, if it's on. This is
+    // on every read path, so when it's off it's one load and a branch,
+    // and when it's on most calls stop at the countdown.
+    void noteAccess(const std::string& id) {
+      if (hotKeys.load(std::memory_order_relaxed) && HotKeys::due(hotEvery.load(std::memory_order_relaxed))) {
+	Reading reading(*this);
+	if (HotKeys *hot = hotKeys.load(std::memory_order_seq_cst)) {
+	  hot->ids().sample(id);
+	}
+      }
+    }
+
+    void noteAccess(const std::string& id, const std::string& key) {
+      if (hotKeys.load(std::memory_order_relaxed) && HotKeys::due(hotEvery.load(std::memory_order_relaxed))) {
+	Reading reading(*this);
+	if (HotKeys *hot = hotKeys.load(std::memory_order_seq_cst)) {
+	  hot->sample(id, key);
+	}
+      }
+    }
+
+    // Optional radix tree of the IDs, for IDs that are paths (see
+    // setPathIndex.) Only touched with mtx held.
+    std::unique_ptr<PathTree> pathTree;
+    char pathSeparator = '/';
+
+    // An ID just went into the map. Keeps the filter and the path tree
+    // up to date, if they're on. Call with mtx held.
+    void indexAdd(const std::string& id) {
+      CountingBloomFilter *filter = idFilter.load(std::memory_order_relaxed);
+      if (filter) {
+	filter->insert(id);
+	// Past twice what it was sized for, false positives pile up fast
+	if (filter->size() > filter->capacity() * 2) {
+	  rebuildFilter(filter->size() * 2);
+	}
+      }
+      if (pathTree) {
+	pathTree->insert(id);
+      }
+      if (!absent.empty()) {
+	absent.erase(id);
+      }
+    }
+
+    // An ID just came out of the map. Call with mtx held.
+    void indexErase(const std::string& id) {
+      CountingBloomFilter *filter = idFilter.load(std::memory_order_relaxed);
+      if (filter) {
+	filter->erase(id);
+      }
+      if (pathTree) {
+	pathTree->erase(id);
+      }
+    }
+
+    // The whole ID map just changed. Call with mtx held.
+    void rebuildIndexes() {
+      absent.clear();
+      if (idFilter.load(std::memory_order_relaxed)) {
+	rebuildFilter(0);
+      }
+      if (pathTree) {
+	pathTree->clear();
+	for (const auto& [id, store] : *metadata) {
+	  pathTree->insert(id);
+	}
+      }
+    }
+
+    // Call fn(itr) for the ID path and every ID under it (the ones that
+    // start with path and then the separator), in order. An empty path
+    // is everything. fn mustn't erase anything but itr, and has to
+    // hand back the iterator after it. Call with mtx held.
+    template <typename Fn>
+    void forSubtree(const std::string& path, Fn&& fn) {
+      if (path.empty()) {
+	for (auto itr = metadata->begin(); itr != metadata->end();) {
+	  itr = fn(itr);
+	}
+	return;
+      }
+      auto exact = metadata->find(path);
+      if (exact != metadata->end()) {
+	fn(exact);
+      }
+      std::string prefix = path + pathSeparator;
+      for (auto itr = metadata->lower_bound(prefix); itr != metadata->end() && itr->first.starts_with(prefix);) {
+	itr = fn(itr);
+      }
+    }
+
+    // True if the filter says id definitely isn't here. Doesn't need
+    // the lock.
+    bool definitelyMissing(const std::string& id) {
+      // The loader might have it
+      if (readingThrough.load(std::memory_order_relaxed)) {
+	return false;
+      }
+      if (!idFilter.load(std::memory_order_relaxed)) {
+	return false;
+      }
+      Reading reading(*this);
+      CountingBloomFilter *filter = idFilter.load(std::memory_order_seq_cst);
+      if (filter && !filter->maybeContains(id)) {
+	filterMisses.fetch_add(1, std::memory_order_relaxed);
+	return true;
+      }
+      return false;
+    }
+
+    // Forget that id was clean. Call with mtx held.
+    void dirty(const std::string& id) {
+      auto itr = clean.find(id);
+      if (itr != clean.end()) {
+	cleanOrder.erase(itr->second);
+	clean.erase(itr);
+	fetched.erase(id);
+      }
+    }
+
+    // Get a private copy of the ID map if a fork is still sharing it.
+    // The stores themselves stay shared. Call with mtx held.
+    void unshare() {
+      if (metadata.use_count() > 1) {
+	metadata = std::make_shared<MetadataMap>(*metadata);
+      }
+    }
+
+    // Drop clean stores, oldest first, until there are no more than
+    // keep of them. Call with mtx held.
+    size_t evict(size_t keep) {
+      size_t evicted = 0;
+      if (clean.size() > keep) {
+	unshare();
+      }
+      while (clean.size() > keep) {
+	const std::string& id = cleanOrder.front();
+	auto itr = metadata->find(id);
+	if (fetched.erase(id)) {
+	  if (itr != metadata->end()) {
+	    metadata->erase(itr);
+	    indexErase(id);
+	  }
+	} else if (itr != metadata->end() && itr->second) {
+	  itr->second = nullptr;
+	  unloaded++;
+	}
+	clean.erase(id);
+	cleanOrder.pop_front();
+	++evicted;
+      }
+      loadStats.evictions += evicted;
+      return evicted;
+    }
+
+    // Returns the store at id, faulting it in from the source if it
+    // hasn't been loaded yet, or nullptr if there's no such ID. Call with
+    // lock held. It gets dropped while the load happens, so anything you
+    // looked up before calling this may be stale afterwards.
+    Data resident(std::unique_lock<std::mutex>& lock, const std::string& id) {
+      if (trackAccess) {
+	uint32_t& count = heat[id];
+	if (count < UINT32_MAX) {
+	  count++;
+	}
+      }
+      // Set once this read has had to go to the loader, or wait on it
+      bool missed = false;
+      while (true) {
+	auto itr = metadata->find(id);
+	if (itr == metadata->end()) {
+	  if (!loader) {
+	    return nullptr;
+	  }
+	  if (loading.contains(id)) {
+	    if (!missed) {
+	      readStats.coalesced++;
+	      missed = true;
+	    }
+	    loaded.wait(lock);
+	    continue;
+	  }
+	  if (missed) {
+	    // The load came back with nothing (or threw)
+	    return nullptr;
+	  }
+	  if (knownAbsent(id)) {
+	    readStats.negativeHits++;
+	    return nullptr;
+	  }
+	  missed = true;
+	  readThrough(lock, id);
+	  continue;
+	}
+	if (itr->second) {
+	  if (loader && !missed) {
+	    readStats.hits++;
+	  }
+	  return itr->second;
+	}
+	if (loading.contains(id)) {
+	  // Somebody else is already on it
+	  loadStats.waits++;
+	  loaded.wait(lock);
+	  continue;
+	}
+	loading.insert(id);
+	std::shared_ptr<StoreSource> from = source;
+	lock.unlock();
+	Data store;
+	auto start = std::chrono::steady_clock::now();
+	try {
+	  store = from ? from->load(id) : nullptr;
+	} catch (...) {
+	  lock.lock();
+	  loading.erase(id);
+	  loaded.notify_all();
+	  throw;
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	lock.lock();
+	loading.erase(id);
+	loaded.notify_all();
+	loadStats.loads++;
+	loadStats.loadSeconds += elapsed.count();
+	loadStats.maxLoadSeconds = std::max(loadStats.maxLoadSeconds, elapsed.count());
+	unshare();
+	itr = metadata->find(id);
+	// If it was erased (or erased and re-added) while we were loading,
+	// what we loaded is stale
+	if (itr != metadata->end() && !itr->second) {
+	  itr->second = store ? store : std::make_shared<DataType>();
+	  unloaded--;
+	  cleanOrder.push_back(id);
+	  clean[id] = std::prev(cleanOrder.end());
+	  if (residentLimit > 0) {
+	    // Oldest first, so the one we just loaded stays
+	    evict(residentLimit);
+	  }
+	}
+      }
+    }
+
+    // Whether the loader said id doesn't exist recently enough to
+    // believe it. Call with mtx held.
+    bool knownAbsent(const std::string& id) {
+      if (absent.empty()) {
+	return false;
+      }
+      auto itr = absent.find(id);
+      if (itr == absent.end()) {
+	return false;
+      }
+      if (std::chrono::steady_clock::now() < itr->second) {
+	return true;
+      }
+      absent.erase(itr);
+      return false;
+    }
+
+    // Call the loader for id, which isn't here, and keep what it hands
+    // back. Call with the lock held; it's dropped while the loader runs.
+    void readThrough(std::unique_lock<std::mutex>& lock, const std::string& id) {
+      loading.insert(id);
+      // A copy, in case setLoader swaps it out while this runs
+      Loader load = loader;
+      lock.unlock();
+      Data store;
+      auto start = std::chrono::steady_clock::now();
+      // The copy goes before the lock's taken back, since it might be
+      // the last one and a loader can have cleanup of its own to do
+      try {
+	store = load(id);
+	load = nullptr;
+      } catch (...) {
+	load = nullptr;
+	lock.lock();
+	loading.erase(id);
+	loaded.notify_all();
+	readStats.errors++;
+	throw;
+      }
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      lock.lock();
+      loading.erase(id);
+      loaded.notify_all();
+      readStats.loads++;
+      readStats.loadSeconds += elapsed.count();
+      readStats.maxLoadSeconds = std::max(readStats.maxLoadSeconds, elapsed.count());
+      uint64_t micros = static_cast<uint64_t>(elapsed.count() * 1e6);
+      readStats.latency[std::min<size_t>(std::bit_width(micros), readStats.latency.size() - 1)]++;
+      if (metadata->contains(id)) {
+	// Somebody added it while we were loading, and theirs is newer
+	return;
+      }
+      if (!store) {
+	readStats.notFound++;
+	if (negativeTtl.count() > 0) {
+	  if (absent.size() >= absentLimit) {
+	    auto now = std::chrono::steady_clock::now();
+	    std::erase_if(absent, [now](const auto& entry) { return entry.second <= now; });
+	    if (absent.size() >= absentLimit) {
+	      absent.clear();
+	    }
+	  }
+	  absent[id] = std::chrono::steady_clock::now() + negativeTtl;
+	}
+	return;
+      }
+      // It's only being cached, so it isn't a change; listeners and
+      // exportSince don't hear about it
+      unshare();
+      metadata->emplace(id, std::move(store));
+      indexAdd(id);
+      fetched.insert(id);
+      cleanOrder.push_back(id);
+      clean[id] = std::prev(cleanOrder.end());
+      if (residentLimit > 0) {
+	evict(residentLimit);
+      }
+    }
+
+    // Fill in any stores in a copy of the ID map that haven't been
+    // loaded yet, straight from the source. Call without mtx held. The
+    // stores loaded here aren't kept.
+    static void fillIn(MetadataMap& stores, const std::shared_ptr<StoreSource>& from) {
+      if (!from) {
+	return;
+      }
+      for (auto& [id, store] : stores) {
+	if (!store) {
+	  store = from->load(id);
+	  if (!store) {
+	    store = std::make_shared<DataType>();
+	  }
+	}
+      }
+    }
+
+    // Tickets handed out by listeners while mtx was held, waiting to be
+    // committed once it's released.
+    using Tickets = std::vector<std::pair<std::shared_ptr<MutationListener>, uint64_t>>;
+
+    // Tell the listeners key in id was set to value. Strings go out as
+    // plain Updates like they always have, so listeners that only know
+    // about strings keep working. Must be called with mtx held.
+    void notifyValue(Tickets& tickets, const std::string& id, const std::string& key, const Value& value) {
+      if (value.type() == Value::Type::String) {
+	notify(tickets, MutationListener::Op::Update, id, key, value.bytes());
+      } else {
+	notify(tickets, MutationListener::Op::Set, id, key, listeners.empty() ? std::string() : value.toText());
+      }
+    }
+
+    // Tell the listeners about a change. Must be called with mtx held.
+    void notify(Tickets& tickets, MutationListener::Op op, const std::string& id,
+		const std::string& key = "", const std::string& value = "") {
+      stamp(id);
+      for (const auto& listener : listeners) {
+	tickets.push_back({listener, listener->record(op, id, key, value)});
+      }
+    }
+
+    // Must be called without mtx held
+    void commit(Tickets& tickets) {
+      for (auto& [listener, ticket] : tickets) {
+	listener->commit(ticket);
+      }
+    }
+
+    // Everything erase(id) does to the ID at itr. Returns the iterator
+    // after it. Call with mtx held and the ID map unshared.
+    MetadataMap::iterator eraseAt(MetadataMap::iterator itr, Tickets& tickets) {
+      std::string id = itr->first;
+      if (!itr->second) {
+	unloaded--;
+      }
+      auto next = metadata->erase(itr);
+      indexErase(id);
+      dirty(id);
+      heat.erase(id);
+      counters.erase(id);
+      if (source) {
+	source->forget(id);
+      }
+      notify(tickets, MutationListener::Op::EraseId, id);
+      return next;
+    }
+
+    // Returns the store at id, ready to be changed. If anyone else
+    // (a snapshot, say) still holds a reference to it, it gets copied
+    // first so they don't see the change. Must be called with mtx held
+    // and the store already resident. Throws std::out_of_range if id
+    // doesn't exist.
+    DataType& mutableStore(const std::string& id) {
+      unshare();
+      Data& store = metadata->at(id);
+      if (store.use_count() > 1) {
+	store = std::make_shared<DataType>(*store);
+      }
+      dirty(id);
+      return *store;
+    }
 
     // Checks to see if an ID exists in metadata. You can
     // override lock if you know you don't need to be thread safe.
@@ -70,9 +848,9 @@ namespace fr::metadata {
       bool retval = false;
       if (lock) {
 	std::lock_guard<std::mutex> lock(mtx);
-	retval = metadata.contains(id);
+	retval = metadata->contains(id);
       } else {
-	retval = metadata.contains(id);
+	retval = metadata->contains(id);
       }
       return retval;
     }
@@ -87,27 +865,47 @@ namespace fr::metadata {
     // metadata maps contained by metadata
 
     bool contains(const std::string& id) {
-      return(contains(id, true));
+      if (definitelyMissing(id)) {
+	return false;
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      bool found = metadata->contains(id);
+      if (!found && idFilter.load(std::memory_order_relaxed)) {
+	filterFalsePositives++;
+      }
+      return found;
     }
 
     // Checks to see if a key exists in the map contained in
     // ID. Also returns false if ID does not exist.
 
     bool idContains(const std::string& id, const std::string& key) {
-      std::lock_guard<std::mutex> lock(mtx);
-      bool retval = false;
-      retval = contains(id, false) && metadata.at(id)->contains(key);
-      return retval;
+      if (definitelyMissing(id)) {
+	return false;
+      }
+      std::unique_lock<std::mutex> lock(mtx);
+      Data store = resident(lock, id);
+      if (!store && idFilter.load(std::memory_order_relaxed) && !loader) {
+	filterFalsePositives++;
+      }
+      return store && store->contains(key);
     }
 
     // Create an empty metadata store at an ID
     void add(const std::string& id) {
-      std::lock_guard<std::mutex> lock(mtx);
-      if (contains(id, false)) {
-	std::string errstr = std::format("'{}' already exists in metadata", id);
-	throw std::runtime_error(errstr);
+      Tickets tickets;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	if (contains(id, false)) {
+	  std::string errstr = std::format("'{}' already exists in metadata", id);
+	  throw std::runtime_error(errstr);
+	}
+	unshare();
+	metadata->insert({id, std::make_shared<DataType>()});
+	indexAdd(id);
+	notify(tickets, MutationListener::Op::AddId, id);
       }
-      metadata.insert({id, std::make_shared<DataType>()});
+      commit(tickets);
     }
 
     // Create a key/value pair in a metadata store.
@@ -133,19 +931,25 @@ namespace fr::metadata {
 	  add(id);
 	}
       }
-      std::lock_guard<std::mutex> lock(mtx);
-      try {
-	const auto [itr, success] = metadata.at(id)->insert({key, value});
-	if (!success) {
-	  // This can only happen if key already existed in the store
-	  std::string errstr = std::format("Key '{}' already exists in the unique id '{}'", key, id);
+      Tickets tickets;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	try {
+	  resident(lock, id);
+	  const auto [itr, success] = mutableStore(id).insert({key, value});
+	  if (!success) {
+	    // This can only happen if key already existed in the store
+	    std::string errstr = std::format("Key '{}' already exists in the unique id '{}'", key, id);
+	    throw std::runtime_error(errstr);
+	  }
+	} catch (std::exception& e) {
+	  // This can only happen if id does not exist
+	  std::string errstr = std::format("Unique ID '{}' does not exist", id);
 	  throw std::runtime_error(errstr);
 	}
-      } catch (std::exception& e) {
-	// This can only happen if id does not exist
-	std::string errstr = std::format("Unique ID '{}' does not exist", id);
-	throw std::runtime_error(errstr);
+	notify(tickets, MutationListener::Op::Update, id, key, value);
       }
+      commit(tickets);
     }
 
     // Returns a vector of strings containing all the IDs currently
@@ -154,7 +958,7 @@ namespace fr::metadata {
     std::vector<std::string> ids() {
       std::vector<std::string> allIds;
       std::lock_guard<std::mutex> lock(mtx);
-      for (auto itr = metadata.begin(); itr != metadata.end(); ++itr) {
+      for (auto itr = metadata->begin(); itr != metadata->end(); ++itr) {
 	allIds.push_back(itr->first);
       }
       return allIds;
@@ -164,66 +968,1285 @@ namespace fr::metadata {
     // id metadata store.
     std::vector<std::string> keys(const std::string& id) {
       std::vector<std::string> allKeys;
-      std::lock_guard<std::mutex> lock(mtx);
-      if (!contains(id, false)) {
+      noteAccess(id);
+      std::unique_lock<std::mutex> lock(mtx);
+      Data store = resident(lock, id);
+      if (!store) {
 	std::string errstr = std::format("Unique ID '{}' does not exist", id);
 	throw std::runtime_error(errstr);	
       }
-      for (auto itr = metadata.at(id)->begin();
-	   itr != metadata.at(id)->end(); ++itr) {
+      for (auto itr = store->begin(); itr != store->end(); ++itr) {
 	allKeys.push_back(itr->first);
       }
       return allKeys;
     }
 
-    // Returns the string value stored at id,key
+    // Returns the value stored at id,key as a string. Numbers and bools
+    // are formatted; use get (or getInt and friends) to have them as
+    // they are.
     std::string value(const std::string& id, const std::string& key) {
-      std::string retval;
-      if (!idContains(id, key)) {
-	std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
-	throw std::runtime_error(errstr);
-      }
-      std::lock_guard<std::mutex> lock(mtx);
-      try {
-	retval = metadata.at(id)->at(key);
-      } catch (std::exception& e) {
-	// I'm not even sure I could make it happen to test
-	// if you ever actually get this exception
-	std::string errstr = std::format("ID '{}' or key '{}' was deleted before I could access it (This is probably highly unusual but technically possible.)", id, key);
-	throw(errstr);
+      noteAccess(id, key);
+      if (!definitelyMissing(id)) {
+	std::unique_lock<std::mutex> lock(mtx);
+	Data store = resident(lock, id);
+	if (store) {
+	  auto itr = store->find(key);
+	  if (itr != store->end()) {
+	    auto counter = itr->second.type() == Value::Type::Int ? counters.find(id, key) : nullptr;
+	    return counter ? Value::ofInt(counter->load()).str() : itr->second.str();
+	  }
+	} else if (idFilter.load(std::memory_order_relaxed) && !loader) {
+	  filterFalsePositives++;
+	}
       }
-      return retval;
+      std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
+      throw std::runtime_error(errstr);
     }
 
     // Erase an entire ID
     void erase(const std::string& id) {
-      std::lock_guard<std::mutex> lock(mtx);
-      metadata.erase(id);
+      noteAccess(id);
+      Tickets tickets;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	unshare();
+	auto itr = metadata->find(id);
+	if (itr != metadata->end()) {
+	  eraseAt(itr, tickets);
+	}
+      }
+      commit(tickets);
     }
 
     // Erase a key in an ID
     void erase(const std::string& id, const std::string& key) {
-      std::lock_guard<std::mutex> lock(mtx);
-      if (contains(id, false)) {
-	metadata.at(id)->erase(key);
+      noteAccess(id, key);
+      Tickets tickets;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	Data store = resident(lock, id);
+	bool found = store && store->contains(key);
+	// Let go of it so mutableStore doesn't think it's shared
+	store.reset();
+	if (found) {
+	  mutableStore(id).erase(key);
+	  counters.erase(id, key);
+	  notify(tickets, MutationListener::Op::EraseKey, id, key);
+	}
       }
+      commit(tickets);
     }
 
     // Update a key in an ID. This will create the key if it doesn't
     // already exist, so it can also be used as a no-throw create
     // if you want to use it that way.
     void update(const std::string& id, const std::string &key, const std::string& value) {
-      if (!contains(id)) {
-	add(id);
+      set(id, key, Value(value));
+    }
+
+    // update for typed values
+    void set(const std::string& id, const std::string& key, Value value) {
+      noteAccess(id, key);
+      Tickets tickets;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	// This brings the store in from the source (or the loader, in
+	// read-through mode) if there's one to be had. If not, the ID is
+	// created here, under the same lock, so an erase can't get in
+	// between that and the change.
+	if (!resident(lock, id)) {
+	  unshare();
+	  metadata->try_emplace(id, std::make_shared<DataType>());
+	  indexAdd(id);
+	  notify(tickets, MutationListener::Op::AddId, id);
+	}
+	// Setting a counter resets it. Anything else takes its place.
+	if (auto counter = counters.find(id, key)) {
+	  if (value.type() == Value::Type::Int) {
+	    counter->store(value.asInt());
+	  } else {
+	    counters.erase(id, key);
+	  }
+	}
+	// Listeners only hear about it once it's actually been made
+	Value& stored = mutableStore(id)[key];
+	stored = std::move(value);
+	notifyValue(tickets, id, key, stored);
+      }
+      commit(tickets);
+    }
+
+    // Returns the value stored at id,key with its type intact
+    Value get(const std::string& id, const std::string& key) {
+      noteAccess(id, key);
+      if (!definitelyMissing(id)) {
+	std::unique_lock<std::mutex> lock(mtx);
+	Data store = resident(lock, id);
+	if (store) {
+	  auto itr = store->find(key);
+	  if (itr != store->end()) {
+	    if (itr->second.type() == Value::Type::Int && counters.size()) {
+	      if (auto counter = counters.find(id, key)) {
+		return Value::ofInt(counter->load());
+	      }
+	    }
+	    return itr->second;
+	  }
+	}
+      }
+      std::string errstr = std::format("Key '{}' or unique ID '{}' do not exist", key, id);
+      throw std::runtime_error(errstr);
+    }
+
+    // These throw if the key holds some other type (see Value)
+
+    int64_t getInt(const std::string& id, const std::string& key) {
+      return get(id, key).asInt();
+    }
+
+    double getDouble(const std::string& id, const std::string& key) {
+      return get(id, key).asDouble();
+    }
+
+    bool getBool(const std::string& id, const std::string& key) {
+      return get(id, key).asBool();
+    }
+
+    void setInt(const std::string& id, const std::string& key, int64_t value) {
+      set(id, key, Value::ofInt(value));
+    }
+
+    void setDouble(const std::string& id, const std::string& key, double value) {
+      set(id, key, Value::ofDouble(value));
+    }
+
+    void setBool(const std::string& id, const std::string& key, bool value) {
+      set(id, key, Value::ofBool(value));
+    }
+
+    void setBytes(const std::string& id, const std::string& key, std::string bytes) {
+      set(id, key, Value::ofBytes(std::move(bytes)));
+    }
+
+    // Bytes without copying them, in or out. The blob you get back is
+    // shared with the store (and anyone else who asked), and stays
+    // good after the key is changed or erased.
+    Blob getBlob(const std::string& id, const std::string& key) {
+      return get(id, key).blob();
+    }
+
+    void setBlob(const std::string& id, const std::string& key, Blob blob) {
+      set(id, key, Value::ofBlob(std::move(blob)));
+    }
+
+    // The counter at id,key. Adding to it is a single atomic operation
+    // that doesn't go anywhere near the lock, so hang on to it if you're
+    // going to be bumping it a lot. The ID and key are made if they
+    // aren't there yet, starting at 0. A key that's already there has
+    // to hold an int (or a string that reads as one), which the counter
+    // starts from; anything else gets you a std::runtime_error.
+    //
+    // Listeners aren't told about each increment, just the counts that
+    // moved whenever syncCounters runs (or the count incrementSynced
+    // leaves behind.)
+    std::shared_ptr<Counter> counter(const std::string& id, const std::string& key) {
+      if (auto found = counters.find(id, key)) {
+	return found;
+      }
+      Tickets tickets;
+      std::shared_ptr<Counter> made;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	Data store = resident(lock, id);
+	if (!store) {
+	  // Not add(), which would throw if another thread got here first
+	  unshare();
+	  store = std::make_shared<DataType>();
+	  metadata->insert({id, store});
+	  indexAdd(id);
+	  notify(tickets, MutationListener::Op::AddId, id);
+	}
+	int64_t start = 0;
+	bool convert = true;
+	auto itr = store->find(key);
+	if (itr != store->end()) {
+	  const Value& current = itr->second;
+	  if (current.type() == Value::Type::Int) {
+	    start = current.asInt();
+	    convert = false;
+	  } else {
+	    bool counted = false;
+	    if (current.type() == Value::Type::String) {
+	      const std::string& text = current.bytes();
+	      auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), start);
+	      counted = ec == std::errc() && ptr == text.data() + text.size();
+	    }
+	    if (!counted) {
+	      std::string errstr = std::format("Key '{}' in unique ID '{}' holds a {}, which can't be counted", key, id, Value::typeName(current.type()));
+	      throw std::runtime_error(errstr);
+	    }
+	  }
+	}
+	store.reset();
+	made = counters.insert(id, key, start);
+	if (convert) {
+	  Value value = Value::ofInt(start);
+	  notifyValue(tickets, id, key, value);
+	  mutableStore(id)[key] = std::move(value);
+	}
+      }
+      commit(tickets);
+      return made;
+    }
+
+    // Add delta to the counter at id,key and return what it was before
+    int64_t fetchAdd(const std::string& id, const std::string& key, int64_t delta) {
+      noteAccess(id, key);
+      return counter(id, key)->fetchAdd(delta);
+    }
+
+    // Add delta to the counter at id,key and return what it is now
+    int64_t increment(const std::string& id, const std::string& key, int64_t delta = 1) {
+      return fetchAdd(id, key, delta) + delta;
+    }
+
+    // increment, but the count is written back to the store and handed
+    // to the listeners before this returns. With a write-ahead log
+    // attached the new count is then as durable as any other change,
+    // so use this when you're about to tell somebody it's stored. It
+    // takes the lock and costs a log record every time, which plain
+    // increment doesn't.
+    int64_t incrementSynced(const std::string& id, const std::string& key, int64_t delta = 1) {
+      int64_t count = increment(id, key, delta);
+      Tickets tickets;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	if (listeners.empty()) {
+	  return count;
+	}
+	Data store = resident(lock, id);
+	// If it's been erased since, the erase is what gets logged
+	auto counter = counters.find(id, key);
+	if (!store || !counter) {
+	  return count;
+	}
+	// Sent even if the store already holds this count. Whoever wrote
+	// it there may not have committed it yet, and this has to be on
+	// disk before it returns.
+	Value value = Value::ofInt(counter->load());
+	store.reset();
+	notifyValue(tickets, id, key, value);
+	mutableStore(id)[key] = std::move(value);
+      }
+      commit(tickets);
+      return count;
+    }
+
+    // The current counts of the counters in id. Keys that have never
+    // been counted aren't in here even if they hold ints.
+    std::map<std::string, int64_t> counts(const std::string& id) {
+      return counters.counts(id);
+    }
+
+    // Write the live count of every counter back into its store, so
+    // anything that reads the stores directly sees it. Listeners get a
+    // Set for each count that's moved since last time. snapshot, fork,
+    // forEachStore and exportSince all do this first, so you only need
+    // it yourself if you want the write-ahead log to catch up.
+    void syncCounters() {
+      if (!counters.size()) {
+	return;
+      }
+      auto live = counters.all();
+      Tickets tickets;
+      {
+	std::unique_lock<std::mutex> lock(mtx);
+	for (const auto& [id, key, ignored] : live) {
+	  Data store = resident(lock, id);
+	  // Look again now that we have the lock, in case it was erased
+	  auto counter = counters.find(id, key);
+	  if (!store || !counter) {
+	    continue;
+	  }
+	  Value value = Value::ofInt(counter->load());
+	  auto itr = store->find(key);
+	  if (itr == store->end() || itr->second == value) {
+	    continue;
+	  }
+	  store.reset();
+	  notifyValue(tickets, id, key, value);
+	  mutableStore(id)[key] = std::move(value);
+	}
+      }
+      commit(tickets);
+    }
+
+    // Listeners are told about every change made from here on. Anything
+    // already in the metadata is not replayed to them.
+    void addListener(std::shared_ptr<MutationListener> listener) {
+      std::lock_guard<std::mutex> lock(mtx);
+      listeners.push_back(listener);
+    }
+
+    void removeListener(const std::shared_ptr<MutationListener>& listener) {
+      std::lock_guard<std::mutex> lock(mtx);
+      std::erase(listeners, listener);
+    }
+
+    // Returns a point-in-time copy of the ID map. The stores are shared,
+    // not copied, and since they're copy-on-write nothing in what you
+    // get back will change under you. This costs one string and one
+    // shared pointer per ID, which is a lot less than serializing
+    // everything while holding the lock.
+    //
+    // If this Metadata is running lazily, stores that haven't been
+    // loaded yet are read from the source after the lock is released.
+    MetadataMap snapshot() {
+      return snapshot([](){});
+    }
+
+    // Same thing, but calls whileLocked before the lock is released.
+    // Use it to grab anything that needs to line up exactly with the
+    // snapshot, like a write-ahead log position. Don't call back into
+    // this Metadata from it.
+    template <typename Fn>
+    MetadataMap snapshot(Fn&& whileLocked) {
+      syncCounters();
+      MetadataMap stores;
+      std::shared_ptr<StoreSource> from;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	whileLocked();
+	stores = *metadata;
+	from = source;
+      }
+      fillIn(stores, from);
+      return stores;
+    }
+
+    // Call fn(id, store) for every store, without the lock held. IDs
+    // are grabbed batch at a time (the lock is only held while a batch
+    // is copied), so memory use stays flat however big this gets, and
+    // everyone else can carry on while fn does its thing. Each store is
+    // exactly as it was when its batch was taken, since stores are
+    // copy-on-write, but the walk as a whole isn't a point-in-time
+    // snapshot; take one of those if you need it. Stores that haven't
+    // been loaded yet are read from the source and not kept.
+    template <typename Fn>
+    void forEachStore(Fn&& fn, size_t batch = 256) {
+      syncCounters();
+      std::string cursor;
+      bool first = true;
+      while (true) {
+	std::vector<std::pair<std::string, Data>> stores;
+	std::shared_ptr<StoreSource> from;
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  from = source;
+	  auto itr = first ? metadata->begin() : metadata->upper_bound(cursor);
+	  for (; itr != metadata->end() && stores.size() < batch; ++itr) {
+	    stores.push_back(*itr);
+	  }
+	}
+	if (stores.empty()) {
+	  return;
+	}
+	first = false;
+	cursor = stores.back().first;
+	for (auto& [id, store] : stores) {
+	  if (!store) {
+	    store = from ? from->load(id) : nullptr;
+	    if (!store) {
+	      store = std::make_shared<DataType>();
+	    }
+	  }
+	  fn(id, *store);
+	}
+      }
+    }
+
+    /**
+     * The ID map as it was at one moment, and where to get any stores in
+     * it that haven't been loaded. The map is copy-on-write, so rather
+     * than copying it a View just hangs on to the current one, which
+     * takes the lock for about as long as copying a shared pointer does.
+     * Anyone who changes something while you're looking gets their own
+     * copy, and you don't see it. Nothing is locked while you use it.
+     *
+     * It also has the machinery the parallel walks use: split cuts a
+     * range of IDs into chunks and run works through them on a thread
+     * pool.
+     */
+    class View {
+      friend class Metadata;
+      std::shared_ptr<const MetadataMap> stores;
+      std::shared_ptr<StoreSource> from;
+      uint64_t seq = 0;
+
+    public:
+      using Bounds = std::vector<MetadataMap::const_iterator>;
+
+      // Below this many IDs, split doesn't bother; starting threads
+      // would take longer than the walk.
+      static constexpr size_t parallelThreshold = 4096;
+
+      const MetadataMap& map() const {
+	return *stores;
+      }
+
+      // The sequence number (see currentSequence) this was taken at
+      uint64_t sequence() const {
+	return seq;
+      }
+
+      size_t size() const {
+	return stores->size();
+      }
+
+      // The store at id, read from the source if it hasn't been loaded
+      // (and not kept), or nullptr if there's no such ID
+      Data find(const std::string& id) const {
+	auto itr = stores->find(id);
+	if (itr == stores->end()) {
+	  return nullptr;
+	}
+	return load(itr);
+      }
+
+      Data load(MetadataMap::const_iterator itr) const {
+	if (itr->second) {
+	  return itr->second;
+	}
+	Data loaded = from ? from->load(itr->first) : nullptr;
+	return loaded ? loaded : std::make_shared<DataType>();
+      }
+
+      // Call fn(id, store) for the IDs from begin to end
+      template <typename Fn>
+      void visit(MetadataMap::const_iterator begin, MetadataMap::const_iterator end, Fn&& fn) const {
+	for (; begin != end; ++begin) {
+	  if (begin->second) {
+	    fn(begin->first, static_cast<const DataType&>(*begin->second));
+	  } else {
+	    fn(begin->first, static_cast<const DataType&>(*load(begin)));
+	  }
+	}
+      }
+
+      static size_t threadsFor(size_t threads) {
+	return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+      }
+
+      // Cut the count IDs from begin to end into chunks of about the
+      // same size, a few per thread. Chunk i runs from bounds[i] to
+      // bounds[i + 1].
+      static Bounds split(MetadataMap::const_iterator begin, MetadataMap::const_iterator end, size_t count, size_t threads) {
+	Bounds bounds{begin};
+	if (threads > 1 && count >= parallelThreshold) {
+	  size_t step = count / (threads * 8) + 1;
+	  size_t n = 0;
+	  for (auto itr = begin; itr != end; ++itr) {
+	    if (n++ % step == 0 && n > 1) {
+	      bounds.push_back(itr);
+	    }
+	  }
+	}
+	bounds.push_back(end);
+	return bounds;
+      }
+
+      Bounds split(size_t threads) const {
+	return split(stores->begin(), stores->end(), stores->size(), threads);
+      }
+
+      // The pool every parallel walk shares, one thread per core. It's
+      // started the first time a walk needs it and lives until exit.
+      static ThreadPool& pool() {
+	static ThreadPool shared;
+	return shared;
+      }
+
+      // Call fn(chunk, begin, end) for each chunk on threads threads.
+      // Each worker grabs the next chunk nobody has started yet when it
+      // finishes one, so a thread that lands on a run of big stores
+      // doesn't hold everyone else up. The calling thread is one of the
+      // workers and the rest come from pool(), so a walk that starts
+      // another walk (or a pool that's busy with someone else's) still
+      // gets through it, just on fewer threads.
+      template <typename Fn>
+      static void run(const Bounds& bounds, size_t threads, Fn&& fn) {
+	size_t chunks = bounds.size() - 1;
+	if (threads <= 1 || chunks == 1) {
+	  for (size_t chunk = 0; chunk < chunks; ++chunk) {
+	    fn(chunk, bounds[chunk], bounds[chunk + 1]);
+	  }
+	  return;
+	}
+	// Helpers that only get going after everything is done still hold
+	// this, but they never touch bounds or fn because there's no chunk
+	// left for them
+	struct Batch {
+	  std::atomic<size_t> next{0};
+	  size_t chunks;
+	  size_t finished = 0;
+	  std::exception_ptr failed;
+	  std::mutex mtx;
+	  std::condition_variable cv;
+	};
+	auto batch = std::make_shared<Batch>();
+	batch->chunks = chunks;
+	auto work = [batch, &bounds, &fn]() {
+	  for (size_t chunk = batch->next++; chunk < batch->chunks; chunk = batch->next++) {
+	    size_t done = 1;
+	    std::exception_ptr failed;
+	    try {
+	      fn(chunk, bounds[chunk], bounds[chunk + 1]);
+	    } catch (...) {
+	      failed = std::current_exception();
+	      // Stop the others picking up more work, and count what
+	      // nobody will start now as done
+	      size_t claimed = batch->next.exchange(batch->chunks);
+	      done += batch->chunks - std::min(claimed, batch->chunks);
+	    }
+	    std::lock_guard<std::mutex> lock(batch->mtx);
+	    if (failed && !batch->failed) {
+	      batch->failed = failed;
+	    }
+	    batch->finished += done;
+	    if (batch->finished == batch->chunks) {
+	      batch->cv.notify_all();
+	    }
+	  }
+	};
+	size_t helpers = std::min({threads, chunks, pool().size() + 1}) - 1;
+	for (size_t i = 0; i < helpers; ++i) {
+	  pool().submit(work);
+	}
+	work();
+	// Wait for every chunk before letting an exception out, since
+	// they're all using things on this stack
+	std::unique_lock<std::mutex> lock(batch->mtx);
+	batch->cv.wait(lock, [&batch]() { return batch->finished == batch->chunks; });
+	if (batch->failed) {
+	  std::rethrow_exception(batch->failed);
+	}
+      }
+
+      // See Metadata::parallelForEach
+      template <typename Fn>
+      void parallelForEach(Fn&& fn, size_t threads = 0) const {
+	threads = threadsFor(threads);
+	run(split(threads), threads, [&](size_t, MetadataMap::const_iterator begin, MetadataMap::const_iterator end) {
+	  visit(begin, end, fn);
+	});
+      }
+
+      // See Metadata::parallelReduce
+      template <typename T, typename Fold, typename Combine>
+      T parallelReduce(T identity, Fold&& fold, Combine&& combine, size_t threads = 0) const {
+	threads = threadsFor(threads);
+	Bounds bounds = split(threads);
+	std::vector<std::optional<T>> partial(bounds.size() - 1);
+	run(bounds, threads, [&](size_t chunk, MetadataMap::const_iterator begin, MetadataMap::const_iterator end) {
+	  T acc = identity;
+	  visit(begin, end, [&](const std::string& id, const DataType& store) {
+	    fold(acc, id, store);
+	  });
+	  partial[chunk] = std::move(acc);
+	});
+	T result = std::move(identity);
+	for (auto& part : partial) {
+	  combine(result, std::move(*part));
+	}
+	return result;
+      }
+    };
+
+    View view() {
+      syncCounters();
+      View v;
+      std::lock_guard<std::mutex> lock(mtx);
+      v.stores = metadata;
+      v.from = source;
+      v.seq = sequence;
+      return v;
+    }
+
+    // The parallel walks below work on a view(), so they see every
+    // store exactly as it was at one moment without the ID map being
+    // copied. Neither the lock nor the GIL (from Python) is held while
+    // they run, so writers carry on as usual. threads is how many
+    // threads to use, 0 for one per core. fn and friends get called
+    // from several threads at once, so they mustn't share anything that
+    // isn't thread safe, and mustn't count on any particular order.
+
+    // Call fn(id, store) for every ID
+    template <typename Fn>
+    void parallelForEach(Fn&& fn, size_t threads = 0) {
+      view().parallelForEach(std::forward<Fn>(fn), threads);
+    }
+
+    // Map-reduce: each chunk of IDs starts from its own copy of identity
+    // and folds stores into it with fold(T& acc, id, store), then those
+    // all get rolled up with combine(T& into, T&& from), in ID order,
+    // so combine doesn't need to be commutative. Counting mime types
+    // with this is a map from mime to count for T, ++acc[mime] for fold
+    // and adding the counts together for combine.
+    template <typename T, typename Fold, typename Combine>
+    T parallelReduce(T identity, Fold&& fold, Combine&& combine, size_t threads = 0) {
+      return view().parallelReduce(std::move(identity), std::forward<Fold>(fold), std::forward<Combine>(combine), threads);
+    }
+
+    // The IDs whose stores pred(id, store) is true for, sorted. A
+    // KeyPredicate (predicate.h) works here.
+    template <typename Pred>
+    std::vector<std::string> parallelFilter(Pred&& pred, size_t threads = 0) {
+      return parallelReduce(std::vector<std::string>(),
+			    [&pred](std::vector<std::string>& found, const std::string& id, const DataType& store) {
+			      if (pred(id, store)) {
+				found.push_back(id);
+			      }
+			    },
+			    [](std::vector<std::string>& into, std::vector<std::string>&& from) {
+			      if (into.empty()) {
+				into = std::move(from);
+			      } else {
+				std::move(from.begin(), from.end(), std::back_inserter(into));
+			      }
+			    }, threads);
+    }
+
+    // A copy of this metadata that shares everything with it. The ID map
+    // and the stores are all copy-on-write, so this takes the same time
+    // however big the metadata is. The first change on either side
+    // copies the ID map (just the IDs and pointers), and after that
+    // only the stores that actually get changed are copied. The fork
+    // starts with no listeners, no ID filter, no loader and without
+    // change, access or hot key tracking.
+    //
+    // Unloaded stores are read from the same source, which is fine for
+    // one that never changes, like a mapped file. A writable source (a
+    // ColdTier, say) changes as this metadata demotes and erases
+    // things, and the fork would save and forget things in it too, so
+    // a fork never gets one. It loads its unloaded stores up front
+    // instead, and its demoteCold does nothing until you give it a tier
+    // of its own.
+    std::shared_ptr<Metadata> fork() {
+      syncCounters();
+      auto copy = std::make_shared<Metadata>();
+      std::shared_ptr<StoreSource> from;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	copy->sequence = sequence;
+	if (!source || !source->writable()) {
+	  copy->metadata = metadata;
+	  copy->source = source;
+	  copy->unloaded = unloaded;
+	  return copy;
+	}
+	if (unloaded == 0) {
+	  copy->metadata = metadata;
+	  return copy;
+	}
+	from = source;
+	copy->metadata = std::make_shared<MetadataMap>(*metadata);
+      }
+      fillIn(*copy->metadata, from);
+      return copy;
+    }
+
+    // Replace everything in this metadata with stores. Listeners are
+    // not told about it; this is for loading snapshots, which carry
+    // their own log position.
+    void restore(MetadataMap stores) {
+      std::lock_guard<std::mutex> lock(mtx);
+      metadata = std::make_shared<MetadataMap>(std::move(stores));
+      counters.clear();
+      clean.clear();
+      cleanOrder.clear();
+      fetched.clear();
+      stampAll();
+      rebuildIndexes();
+      unloaded = 0;
+      for (const auto& [id, store] : *metadata) {
+	if (!store) {
+	  unloaded++;
+	}
+      }
+    }
+
+    // Add stores to what's already here, replacing any IDs that are in
+    // both. Like restore, listeners aren't told. The parallel JSON
+    // importer calls this once per chunk, so the lock is only held for
+    // the map inserts, not the parsing.
+    void merge(MetadataMap&& stores) {
+      size_t missing = std::count_if(stores.begin(), stores.end(), [](const auto& entry) { return !entry.second; });
+      std::lock_guard<std::mutex> lock(mtx);
+      if (trackChanges) {
+	for (const auto& [id, store] : stores) {
+	  stamp(id);
+	}
+      } else {
+	sequence++;
+      }
+      std::vector<std::string> added;
+      if (idFilter.load(std::memory_order_relaxed) || pathTree) {
+	for (const auto& [id, store] : stores) {
+	  if (!metadata->contains(id)) {
+	    added.push_back(id);
+	  }
+	}
+      }
+      // This moves the nodes across without copying anything, and leaves
+      // behind the IDs that are already here
+      unshare();
+      metadata->merge(stores);
+      unloaded += missing;
+      // The new IDs are only indexed once they're in the map, since a
+      // filter that grows is rebuilt from the map. If it's going to
+      // grow anyway it's rebuilt once up front, with all of them in it.
+      CountingBloomFilter *filter = idFilter.load(std::memory_order_relaxed);
+      if (filter && filter->size() + added.size() > filter->capacity() * 2) {
+	rebuildFilter((filter->size() + added.size()) * 2);
+	filter = nullptr;
+      }
+      for (const auto& id : added) {
+	if (filter) {
+	  filter->insert(id);
+	}
+	if (pathTree) {
+	  pathTree->insert(id);
+	}
+      }
+      for (auto& [id, store] : stores) {
+	auto& existing = (*metadata)[id];
+	if (!existing) {
+	  unloaded--;
+	}
+	existing = std::move(store);
+	dirty(id);
+	// The merged store's count wins over the live one
+	counters.erase(id);
+	if (!absent.empty()) {
+	  absent.erase(id);
+	}
+      }
+    }
+
+    // Start (or stop) keeping track of what changed when, for
+    // exportSince. It costs a hash lookup and a tree insert per change,
+    // so it's off until you ask for it. Deltas from before tracking was
+    // turned on come out full.
+    void setChangeTracking(bool on) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (on && !trackChanges) {
+	horizon = sequence;
+      }
+      trackChanges = on;
+      if (!on) {
+	changedAt.clear();
+	changes.clear();
+      }
+    }
+
+    bool changeTracking() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return trackChanges;
+    }
+
+    // The sequence number of the latest change. Hand it to exportSince
+    // later on to find out what's changed since now.
+    uint64_t currentSequence() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return sequence;
+    }
+
+    // Everything that changed after since: the current store of every
+    // ID that was added or changed, and the names of the ones that were
+    // erased. The lock is only held while the IDs are looked up. If
+    // since is too old (from before tracking started or before
+    // forgetChangesBefore dropped it) you get a full delta instead.
+    Delta exportSince(uint64_t since) {
+      syncCounters();
+      Delta delta;
+      delta.since = since;
+      std::shared_ptr<StoreSource> from;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	from = source;
+	delta.through = sequence;
+	if (!trackChanges || since < horizon || since > sequence) {
+	  delta.full = true;
+	  delta.stores = *metadata;
+	} else {
+	  for (auto itr = changes.upper_bound(since); itr != changes.end(); ++itr) {
+	    const std::string& id = *itr->second;
+	    auto found = metadata->find(id);
+	    if (found == metadata->end()) {
+	      delta.erased.push_back(id);
+	    } else {
+	      delta.stores.emplace(id, found->second);
+	    }
+	  }
+	}
+      }
+      fillIn(delta.stores, from);
+      return delta;
+    }
+
+    // Bring this metadata up to date with a delta from exportSince on
+    // another one. Like restore, listeners aren't told, but the changes
+    // are tracked, so this one can pass them on in turn.
+    void applyDelta(const Delta& delta) {
+      if (delta.full) {
+	restore(delta.stores);
+	return;
       }
       std::lock_guard<std::mutex> lock(mtx);
-      (*metadata.at(id))[key]=value;
+      unshare();
+      for (const auto& id : delta.erased) {
+	auto itr = metadata->find(id);
+	if (itr == metadata->end()) {
+	  continue;
+	}
+	if (!itr->second) {
+	  unloaded--;
+	}
+	metadata->erase(itr);
+	indexErase(id);
+	dirty(id);
+	heat.erase(id);
+	counters.erase(id);
+	if (source) {
+	  source->forget(id);
+	}
+	stamp(id);
+      }
+      for (const auto& [id, store] : delta.stores) {
+	auto [itr, added] = metadata->try_emplace(id, store);
+	if (added) {
+	  indexAdd(id);
+	} else {
+	  if (!itr->second) {
+	    unloaded--;
+	  }
+	  itr->second = store;
+	  dirty(id);
+	  counters.erase(id);
+	}
+	stamp(id);
+      }
+    }
+
+    // Drop what's remembered about changes up to and including seq,
+    // tombstones included. Deltas since anything before seq come out
+    // full from then on. Returns the number of IDs forgotten.
+    size_t forgetChangesBefore(uint64_t seq) {
+      std::lock_guard<std::mutex> lock(mtx);
+      size_t forgotten = 0;
+      auto end = changes.upper_bound(seq);
+      for (auto itr = changes.begin(); itr != end; ++itr) {
+	changedAt.erase(changedAt.find(*itr->second));
+	forgotten++;
+      }
+      changes.erase(changes.begin(), end);
+      horizon = std::max(horizon, std::min(seq, sequence));
+      return forgotten;
+    }
+
+    // Run lazily from source. Each ID in ids gets an entry in the
+    // directory (unless it's already here) and its store is loaded the
+    // first time it's used. Only the ID strings are held in memory
+    // until then.
+    //
+    // Throws if a different source is already attached and some of its
+    // stores haven't been loaded yet. Those IDs would come back empty
+    // from the new one, so load them first (or pageOut nothing and
+    // fork) if you really want to switch.
+    void attachSource(std::shared_ptr<StoreSource> from, const std::vector<std::string>& ids) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (source && source != from && unloaded > 0) {
+	throw std::runtime_error(std::format("Can't attach a new source while {} stores are still out in the old one", unloaded));
+      }
+      // Stores that were clean against the old source are news to this
+      // one, so paging them out has to save them now
+      if (source != from) {
+	for (auto itr = clean.begin(); itr != clean.end();) {
+	  if (fetched.contains(itr->first)) {
+	    ++itr;
+	  } else {
+	    cleanOrder.erase(itr->second);
+	    itr = clean.erase(itr);
+	  }
+	}
+      }
+      source = from;
+      unshare();
+      for (const auto& id : ids) {
+	if (metadata->try_emplace(id, nullptr).second) {
+	  unloaded++;
+	  indexAdd(id);
+	}
+      }
+    }
+
+    // Page clean stores (loaded from the source and not changed since)
+    // back out whenever there are more than limit of them. 0 turns it
+    // off.
+    void setResidentLimit(size_t limit) {
+      std::lock_guard<std::mutex> lock(mtx);
+      residentLimit = limit;
+      if (limit > 0) {
+	evict(limit);
+      }
+    }
+
+    // Page out every clean store right now. Handy when you know memory
+    // is getting tight. Returns the number of stores dropped.
+    size_t pageOut() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return evict(0);
+    }
+
+    // Read-through mode, for using this as a cache in front of
+    // something slow. An ID that isn't here when somebody reads it
+    // (value, get, keys, idContains and so on, or set, which starts
+    // from what's loaded) gets handed to loader, and whatever it
+    // returns is kept. Several threads after the same ID wait for the
+    // one load rather than all calling the loader. If it comes back
+    // with nothing, readers are told the ID doesn't exist, and with a
+    // negativeTtl that answer is remembered for that long so the loader
+    // isn't asked again every time. Adding the ID yourself forgets it
+    // straight away.
+    //
+    // Loaded stores count as clean, so setResidentLimit and pageOut
+    // drop them again (the loader can always fetch them back.) Changing
+    // one makes it yours, and it stays. Nothing is ever written back
+    // through the loader, and contains() and ids() only know about
+    // what's here now. Pass a null loader to turn it off.
+    void setLoader(Loader load, std::chrono::milliseconds negativeFor = std::chrono::milliseconds(0)) {
+      std::lock_guard<std::mutex> lock(mtx);
+      loader = std::move(load);
+      negativeTtl = negativeFor;
+      absent.clear();
+      readingThrough.store(static_cast<bool>(loader), std::memory_order_relaxed);
+    }
+
+    ReadThroughStats readThroughStatistics() {
+      std::lock_guard<std::mutex> lock(mtx);
+      ReadThroughStats stats = readStats;
+      stats.enabled = static_cast<bool>(loader);
+      return stats;
+    }
+
+    LoadStats loadStatistics() {
+      std::lock_guard<std::mutex> lock(mtx);
+      LoadStats stats = loadStats;
+      stats.resident = clean.size();
+      stats.cold = unloaded;
+      stats.hot = metadata->size() - unloaded;
+      return stats;
+    }
+
+    // Start (or stop) counting accesses for demoteCold. It costs a hash
+    // table bump per read or write, so it's off until you ask for it.
+    void setAccessTracking(bool on) {
+      std::lock_guard<std::mutex> lock(mtx);
+      trackAccess = on;
+      if (!on) {
+	heat.clear();
+      }
+    }
+
+    // Put a bloom filter in front of contains, idContains and value,
+    // so lookups for IDs that don't exist are turned away without
+    // taking the lock. It costs about 8 bytes per ID, plus a bit of
+    // work on every add and erase. expectedIds is what to size it for
+    // (0 sizes it from what's here now); it's rebuilt bigger if it
+    // fills up.
+    void setIdFilter(bool on, size_t expectedIds = 0) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (on) {
+	rebuildFilter(expectedIds);
+      } else {
+	replaceFilter(nullptr);
+      }
+      filterMisses = 0;
+      filterFalsePositives = 0;
     }
 
-    // Cereal archiver
+    FilterStats filterStatistics() {
+      std::lock_guard<std::mutex> lock(mtx);
+      FilterStats stats;
+      CountingBloomFilter *filter = idFilter.load(std::memory_order_relaxed);
+      if (filter) {
+	stats.enabled = true;
+	stats.ids = filter->size();
+	stats.capacity = filter->capacity();
+	stats.bytes = filter->bytes();
+	stats.estimatedFalsePositiveRate = filter->estimatedFalsePositiveRate();
+      }
+      stats.definiteMisses = filterMisses.load(std::memory_order_relaxed);
+      stats.falsePositives = filterFalsePositives;
+      return stats;
+    }
+
+    // Keep track of which IDs and keys are read and written the most
+    // (see hotkeys.h), to find out what's hot-spotting you. Every get,
+    // value, set, erase, keys and increment goes through it. With the
+    // default one in sixteen sampling that costs a few nanoseconds a
+    // call on average; bench/HotKeyBench measures it. Turning it on
+    // again starts over with the new options.
+    void setHotKeyTracking(bool on, HotTracker::Options options = {}) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto hot = on ? std::make_unique<HotKeys>(options) : nullptr;
+      hotEvery.store(options.sampleEvery, std::memory_order_relaxed);
+      hotKeys.store(hot.get(), std::memory_order_seq_cst);
+      std::swap(hotOwned, hot);
+      if (hot) {
+	waitForReaders();
+      }
+    }
+
+    // The k busiest IDs and keys lately
+    HotStats hotKeyStatistics(size_t k = 10) {
+      HotStats stats;
+      Reading reading(*this);
+      HotKeys *hot = hotKeys.load(std::memory_order_seq_cst);
+      if (hot) {
+	stats.enabled = true;
+	stats.sampleEvery = hot->ids().settings().sampleEvery;
+	stats.sampled = hot->ids().sampled();
+	stats.bytes = hot->ids().bytes() + hot->keys().bytes();
+	stats.ids = hot->ids().top(k);
+	stats.keys = hot->keys().top(k);
+      }
+      return stats;
+    }
+
+    // About how many times id has been read or written lately, 0 if
+    // hot key tracking is off
+    uint64_t accessEstimate(const std::string& id) {
+      Reading reading(*this);
+      HotKeys *hot = hotKeys.load(std::memory_order_seq_cst);
+      return hot ? hot->ids().estimate(id) : 0;
+    }
+
+    // For IDs that are paths (tenant/project/file), keep a radix tree
+    // of them (see paths.h) so subtreeCount and listChildren don't have
+    // to look at every ID under the path. It takes a node or so per ID,
+    // less where IDs share long prefixes. The subtree calls below work
+    // without it, just more slowly; separator is the one they use
+    // either way.
+    void setPathIndex(bool on, char separator = '/') {
+      std::lock_guard<std::mutex> lock(mtx);
+      pathSeparator = separator;
+      if (on) {
+	pathTree = std::make_unique<PathTree>();
+	rebuildIndexes();
+      } else {
+	pathTree.reset();
+      }
+    }
+
+    // Roughly how much memory the path index is using, 0 if it's off
+    size_t pathIndexBytes() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return pathTree ? pathTree->bytes() : 0;
+    }
+
+    // The names one level down from path. With IDs a/b/c and a/b/d/e,
+    // listChildren("a/b") is c and d, and listChildren("") is a.
+    // Sorted.
+    std::vector<std::string> listChildren(const std::string& path) {
+      std::string prefix = path.empty() ? path : path + pathSeparator;
+      std::lock_guard<std::mutex> lock(mtx);
+      if (pathTree) {
+	return pathTree->children(prefix, pathSeparator);
+      }
+      // No tree, but the map is sorted, so skip over each child's
+      // subtree rather than walking it
+      std::vector<std::string> children;
+      auto itr = metadata->lower_bound(prefix);
+      while (itr != metadata->end() && itr->first.starts_with(prefix)) {
+	std::string_view rest = std::string_view(itr->first).substr(prefix.size());
+	size_t cut = rest.find(pathSeparator);
+	std::string child(rest.substr(0, cut));
+	if (!child.empty()) {
+	  children.push_back(child);
+	}
+	if (cut == std::string_view::npos) {
+	  ++itr;
+	} else {
+	  itr = metadata->lower_bound(prefix + child + static_cast<char>(pathSeparator + 1));
+	}
+      }
+      std::sort(children.begin(), children.end());
+      children.erase(std::unique(children.begin(), children.end()), children.end());
+      return children;
+    }
+
+    // The number of IDs that are path or under it
+    size_t subtreeCount(const std::string& path) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (pathTree) {
+	if (path.empty()) {
+	  return pathTree->size();
+	}
+	return (pathTree->contains(path) ? 1 : 0) + pathTree->count(path + pathSeparator);
+      }
+      size_t count = 0;
+      forSubtree(path, [&count](MetadataMap::iterator itr) {
+	count++;
+	return std::next(itr);
+      });
+      return count;
+    }
+
+    // Erase path and everything under it, the same as calling erase on
+    // each of them. Returns how many went.
+    size_t eraseSubtree(const std::string& path) {
+      Tickets tickets;
+      size_t erased = 0;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	unshare();
+	forSubtree(path, [&](MetadataMap::iterator itr) {
+	  erased++;
+	  return eraseAt(itr, tickets);
+	});
+      }
+      commit(tickets);
+      return erased;
+    }
+
+    // A snapshot (see snapshot()) of just path and everything under it
+    MetadataMap exportSubtree(const std::string& path) {
+      syncCounters();
+      MetadataMap stores;
+      std::shared_ptr<StoreSource> from;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	from = source;
+	forSubtree(path, [&stores](MetadataMap::iterator itr) {
+	  stores.emplace_hint(stores.end(), itr->first, itr->second);
+	  return std::next(itr);
+	});
+      }
+      fillIn(stores, from);
+      return stores;
+    }
+
+    // Push every in-memory store used fewer than threshold times lately
+    // out to the source, then age the access counts. Stores that
+    // haven't changed since they were loaded are just dropped; changed
+    // ones are saved first, which needs a writable source (without one
+    // they stay put.) The map is walked batch IDs at a time and the
+    // lock is let go in between, and saving happens without it, so
+    // readers and writers carry on while this runs. Returns the number
+    // of stores demoted.
+    size_t demoteCold(uint32_t threshold = 1, size_t batch = 1024) {
+      struct Candidate {
+	std::string id;
+	Data store;
+	bool changed;
+      };
+      size_t demoted = 0;
+      std::string cursor;
+      bool more = true;
+      bool first = true;
+      while (more) {
+	std::vector<Candidate> cold;
+	std::shared_ptr<StoreSource> to;
+	{
+	  std::lock_guard<std::mutex> lock(mtx);
+	  to = source;
+	  if (!to) {
+	    return 0;
+	  }
+	  bool writable = to->writable();
+	  auto itr = first ? metadata->begin() : metadata->upper_bound(cursor);
+	  first = false;
+	  for (size_t n = 0; itr != metadata->end() && n < batch; ++itr, ++n) {
+	    cursor = itr->first;
+	    // The source never had the loader's stores; pageOut drops those
+	    if (!itr->second || fetched.contains(itr->first)) {
+	      continue;
+	    }
+	    auto h = heat.find(itr->first);
+	    if (h != heat.end() && h->second >= threshold) {
+	      continue;
+	    }
+	    bool changed = !clean.contains(itr->first);
+	    if (changed && !writable) {
+	      continue;
+	    }
+	    cold.push_back({itr->first, itr->second, changed});
+	  }
+	  more = itr != metadata->end();
+	}
+	for (const auto& candidate : cold) {
+	  if (candidate.changed) {
+	    to->save(candidate.id, *candidate.store);
+	  }
+	}
+	std::lock_guard<std::mutex> lock(mtx);
+	if (!cold.empty()) {
+	  unshare();
+	}
+	for (const auto& candidate : cold) {
+	  auto itr = metadata->find(candidate.id);
+	  // We were holding a reference the whole time, so any change made
+	  // in the meantime went to a fresh copy and the pointer won't match
+	  if (itr == metadata->end() || itr->second != candidate.store) {
+	    // If it was erased while we were saving it, the erase may have
+	    // told the source to forget it before our save landed. Tell it
+	    // again so the stale copy doesn't come back.
+	    if (itr == metadata->end() && candidate.changed && to == source) {
+	      to->forget(candidate.id);
+	    }
+	    continue;
+	  }
+	  itr->second = nullptr;
+	  unloaded++;
+	  dirty(candidate.id);
+	  loadStats.demotions++;
+	  if (candidate.changed) {
+	    loadStats.writeBacks++;
+	  }
+	  demoted++;
+	}
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      for (auto itr = heat.begin(); itr != heat.end();) {
+	itr->second /= 2;
+	if (itr->second == 0) {
+	  itr = heat.erase(itr);
+	} else {
+	  ++itr;
+	}
+      }
+      return demoted;
+    }
+
+    // Cereal archiver. Saving works from a snapshot, so it doesn't hold
+    // the lock while the archive does its thing.
     template <class Archive>
     void serialize(Archive& archive) {
-      archive(metadata);
+      if constexpr (Archive::is_saving::value) {
+	MetadataMap stores = snapshot();
+	archive(stores);
+      } else {
+	metadata = std::make_shared<MetadataMap>();
+	archive(*metadata);
+	counters.clear();
+	clean.clear();
+	cleanOrder.clear();
+	fetched.clear();
+	stampAll();
+	rebuildIndexes();
+	unloaded = 0;
+      }
     }
 
     // Convert a Metadata to JSON (Using the cereal archiver)
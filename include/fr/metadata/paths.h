@@ -0,0 +1,240 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A radix tree of IDs, for IDs that are paths (tenant/project/file.)
+ *
+ * Each edge is labelled with a run of bytes rather than just one, so a
+ * long prefix that a lot of IDs share (tenant/project/) is kept once
+ * instead of once per ID, and a chain of nodes with only one child
+ * each gets squashed into a single edge. Every node also knows how many
+ * IDs are at or below it, so "how many IDs start with this" is a walk
+ * down the tree the length of the prefix, however many there are.
+ *
+ * Metadata keeps one of these alongside the ID map when you turn on
+ * setPathIndex. It isn't thread safe on its own.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace fr::metadata {
+
+  class PathTree {
+    struct Node {
+      // The bytes on the edge from the parent. Only the root's is empty.
+      std::string label;
+      // Sorted by the first byte of their labels, which all differ
+      std::vector<std::unique_ptr<Node>> children;
+      // IDs that end here or further down
+      size_t count = 0;
+      // An ID ends here
+      bool terminal = false;
+    };
+
+    Node root;
+
+    static size_t common(std::string_view a, std::string_view b) {
+      size_t n = 0;
+      while (n < a.size() && n < b.size() && a[n] == b[n]) {
+	n++;
+      }
+      return n;
+    }
+
+    // Where the child starting with c is, or would go. Node is either
+    // constness so the iterator matches.
+    template <typename NodeType>
+    static auto childFor(NodeType& node, char c) {
+      return std::lower_bound(node.children.begin(), node.children.end(), c, [](const std::unique_ptr<Node>& child, char c) {
+	return static_cast<unsigned char>(child->label[0]) < static_cast<unsigned char>(c);
+      });
+    }
+
+    static bool insert(Node& node, std::string_view rest) {
+      if (rest.empty()) {
+	if (node.terminal) {
+	  return false;
+	}
+	node.terminal = true;
+	node.count++;
+	return true;
+      }
+      auto itr = childFor(node, rest[0]);
+      if (itr == node.children.end() || (*itr)->label[0] != rest[0]) {
+	auto leaf = std::make_unique<Node>();
+	leaf->label = rest;
+	leaf->terminal = true;
+	leaf->count = 1;
+	node.children.insert(itr, std::move(leaf));
+	node.count++;
+	return true;
+      }
+      size_t shared = common((*itr)->label, rest);
+      if (shared < (*itr)->label.size()) {
+	// Split the edge where rest goes its own way
+	auto middle = std::make_unique<Node>();
+	middle->label = (*itr)->label.substr(0, shared);
+	middle->count = (*itr)->count;
+	(*itr)->label.erase(0, shared);
+	middle->children.push_back(std::move(*itr));
+	*itr = std::move(middle);
+      }
+      if (!insert(**itr, rest.substr(shared))) {
+	return false;
+      }
+      node.count++;
+      return true;
+    }
+
+    static bool erase(Node& node, std::string_view rest) {
+      if (rest.empty()) {
+	if (!node.terminal) {
+	  return false;
+	}
+	node.terminal = false;
+	node.count--;
+	return true;
+      }
+      auto itr = childFor(node, rest[0]);
+      if (itr == node.children.end() || !rest.starts_with((*itr)->label)) {
+	return false;
+      }
+      Node& child = **itr;
+      if (!erase(child, rest.substr(child.label.size()))) {
+	return false;
+      }
+      node.count--;
+      if (child.count == 0) {
+	node.children.erase(itr);
+      } else if (!child.terminal && child.children.size() == 1) {
+	// Squash it into its only child
+	auto only = std::move(child.children[0]);
+	only->label.insert(0, child.label);
+	*itr = std::move(only);
+      }
+      return true;
+    }
+
+    // The node prefix ends in, and the rest of its label past the end
+    // of prefix if that's partway down an edge. nullptr if nothing
+    // starts with prefix.
+    std::pair<const Node *, std::string_view> descend(std::string_view prefix) const {
+      const Node *node = &root;
+      while (!prefix.empty()) {
+	auto itr = childFor(*node, prefix[0]);
+	if (itr == node->children.end() || (*itr)->label[0] != prefix[0]) {
+	  return {nullptr, {}};
+	}
+	std::string_view label = (*itr)->label;
+	size_t shared = common(label, prefix);
+	if (shared == prefix.size()) {
+	  return {itr->get(), label.substr(shared)};
+	}
+	if (shared < label.size()) {
+	  return {nullptr, {}};
+	}
+	node = itr->get();
+	prefix.remove_prefix(shared);
+      }
+      return {node, {}};
+    }
+
+    static void collect(const Node& node, std::string& below, char separator, std::vector<std::string>& found) {
+      size_t cut = below.find(separator);
+      if (cut != std::string::npos) {
+	found.emplace_back(below, 0, cut);
+	return;
+      }
+      if (node.terminal && !below.empty()) {
+	found.push_back(below);
+      }
+      for (const auto& child : node.children) {
+	size_t size = below.size();
+	below += child->label;
+	collect(*child, below, separator, found);
+	below.resize(size);
+      }
+    }
+
+    static size_t bytes(const Node& node) {
+      size_t total = sizeof(Node) + node.children.capacity() * sizeof(std::unique_ptr<Node>);
+      if (node.label.capacity() > 15) {
+	total += node.label.capacity() + 1;
+      }
+      for (const auto& child : node.children) {
+	total += bytes(*child);
+      }
+      return total;
+    }
+
+  public:
+
+    // Returns false if id was already in it
+    bool insert(std::string_view id) {
+      return insert(root, id);
+    }
+
+    // Returns false if id wasn't in it
+    bool erase(std::string_view id) {
+      return erase(root, id);
+    }
+
+    bool contains(std::string_view id) const {
+      auto [node, rest] = descend(id);
+      return node && rest.empty() && node->terminal;
+    }
+
+    // How many IDs start with prefix
+    size_t count(std::string_view prefix) const {
+      auto [node, rest] = descend(prefix);
+      return node ? node->count : 0;
+    }
+
+    // The distinct names that come after prefix in the IDs that start
+    // with it, up to the next separator. With IDs a/b/c, a/b/d/e and
+    // a/bz, children("a/b/", '/') is c and d. Sorted.
+    std::vector<std::string> children(std::string_view prefix, char separator) const {
+      std::vector<std::string> found;
+      auto [node, rest] = descend(prefix);
+      if (node) {
+	std::string below(rest);
+	collect(*node, below, separator, found);
+	std::sort(found.begin(), found.end());
+	found.erase(std::unique(found.begin(), found.end()), found.end());
+      }
+      return found;
+    }
+
+    size_t size() const {
+      return root.count;
+    }
+
+    void clear() {
+      root = Node();
+    }
+
+    // Roughly what the tree takes up, nodes and labels
+    size_t bytes() const {
+      return bytes(root);
+    }
+  };
+
+}
@@ -0,0 +1,191 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Simple tests on one key of a store, which can be built at run time
+ * and handed to Metadata::parallelFilter and friends. This is mostly
+ * so Python can say "mime is image/png" or "size is between 1k and 1m"
+ * and have every store checked in C++, without a round trip through
+ * the interpreter for each one.
+ */
+
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <fr/metadata/value.h>
+#include <optional>
+#include <string>
+
+namespace fr::metadata {
+
+  struct KeyPredicate {
+    enum class Op : uint8_t {
+      // The key is there at all
+      Exists,
+      // It's value
+      Equals,
+      // Its text starts with value's
+      Prefix,
+      // It's between low and high. Either end can be left off, and
+      // each one is included unless it's marked exclusive.
+      Range
+    };
+
+    Op op = Op::Exists;
+    std::string key;
+    Value value;
+    std::optional<Value> low;
+    std::optional<Value> high;
+    bool lowExclusive = false;
+    bool highExclusive = false;
+
+    static KeyPredicate exists(std::string key) {
+      KeyPredicate p;
+      p.key = std::move(key);
+      return p;
+    }
+
+    static KeyPredicate equals(std::string key, Value value) {
+      KeyPredicate p;
+      p.op = Op::Equals;
+      p.key = std::move(key);
+      p.value = std::move(value);
+      return p;
+    }
+
+    static KeyPredicate prefix(std::string key, std::string prefix) {
+      KeyPredicate p;
+      p.op = Op::Prefix;
+      p.key = std::move(key);
+      p.value = Value(std::move(prefix));
+      return p;
+    }
+
+    static KeyPredicate range(std::string key, std::optional<Value> low, std::optional<Value> high,
+			      bool lowExclusive = false, bool highExclusive = false) {
+      KeyPredicate p;
+      p.op = Op::Range;
+      p.key = std::move(key);
+      p.low = std::move(low);
+      p.high = std::move(high);
+      p.lowExclusive = lowExclusive;
+      p.highExclusive = highExclusive;
+      return p;
+    }
+
+    // Whether a value in key passes
+    bool matches(const Value& v) const {
+      switch (op) {
+      case Op::Exists:
+	return true;
+      case Op::Equals:
+	// Lots of data is still all strings, so "7" equals 7
+	return v == value || (v.type() != value.type() && v.str() == value.str());
+      case Op::Prefix:
+	return startsWith(v, value.bytes());
+      case Op::Range:
+	return inRange(v);
+      }
+      return false;
+    }
+
+    // Whether a store passes. Stores without the key never do.
+    template <typename Store>
+    bool matches(const Store& store) const {
+      auto itr = store.find(key);
+      return itr != store.end() && matches(itr->second);
+    }
+
+    template <typename Store>
+    bool operator()(const std::string&, const Store& store) const {
+      return matches(store);
+    }
+
+    static bool numeric(const Value& v) {
+      return v.type() == Value::Type::Int || v.type() == Value::Type::Double;
+    }
+
+    // v as a number, if it is one or is a string that reads as one.
+    // Handy for adding things up, too. NaN and the infinities (which
+    // from_chars is happy to read out of "nan" and "inf") don't count,
+    // since NaN doesn't sort and would match every range.
+    static std::optional<double> number(const Value& v) {
+      double d;
+      if (numeric(v)) {
+	d = v.asDouble();
+      } else if (v.type() == Value::Type::String) {
+	const std::string& s = v.bytes();
+	auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), d);
+	if (ec != std::errc() || end != s.data() + s.size()) {
+	  return std::nullopt;
+	}
+      } else {
+	return std::nullopt;
+      }
+      if (!std::isfinite(d)) {
+	return std::nullopt;
+      }
+      return d;
+    }
+
+  private:
+
+    // Whether v starts with prefix, without copying strings and bytes
+    static bool startsWith(const Value& v, const std::string& prefix) {
+      if (v.type() == Value::Type::String || v.type() == Value::Type::Bytes) {
+	return v.bytes().starts_with(prefix);
+      }
+      return v.str().starts_with(prefix);
+    }
+
+    // <0, 0 or >0 like strcmp. A number bound compares numerically
+    // (ints exactly), and nothing is returned for a v that isn't a
+    // number, which is out of range. Otherwise it's the text that gets
+    // compared.
+    static std::optional<int> compare(const Value& v, const Value& bound) {
+      if (v.type() == Value::Type::Int && bound.type() == Value::Type::Int) {
+	return v.asInt() < bound.asInt() ? -1 : v.asInt() > bound.asInt() ? 1 : 0;
+      }
+      if (numeric(bound)) {
+	auto n = number(v);
+	double b = bound.asDouble();
+	if (!n || std::isnan(b)) {
+	  return std::nullopt;
+	}
+	return *n < b ? -1 : *n > b ? 1 : 0;
+      }
+      bool stringy = v.type() == Value::Type::String || v.type() == Value::Type::Bytes;
+      return stringy ? v.bytes().compare(bound.str()) : v.str().compare(bound.str());
+    }
+
+    bool inRange(const Value& v) const {
+      if (low) {
+	auto c = compare(v, *low);
+	if (!c || *c < 0 || (*c == 0 && lowExclusive)) {
+	  return false;
+	}
+      }
+      if (high) {
+	auto c = compare(v, *high);
+	if (!c || *c > 0 || (*c == 0 && highExclusive)) {
+	  return false;
+	}
+      }
+      return true;
+    }
+  };
+
+}
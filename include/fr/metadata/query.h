@@ -0,0 +1,1551 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Queries over a Metadata.
+ *
+ * "IDs where mime starts with image/ and size is over a meg, biggest
+ * first, top 100" is a lot of value() calls from Python. This lets you
+ * write it down instead:
+ *
+ *   select size, mime where mime ^= 'image/' and size > 1048576
+ *     order by size desc limit 100
+ *
+ * and have it run in C++. Query::parse turns text like that into a
+ * Query (you can also build one by hand), and a QueryEngine runs it
+ * against a Metadata.
+ *
+ * The language, with keywords in any case:
+ *
+ *   [select * | key, key...] [where condition]
+ *     [order by key [asc|desc]] [limit n]
+ *
+ * Conditions are key = value, != , <, <=, >, >=, ^= (starts with),
+ * key between low and high, has key, id = 'x', id ^= 'prefix', and
+ * and/or/not/parentheses to put them together. Values are 'quoted' or
+ * "quoted" strings, numbers, true or false. Keys are bare words, or
+ * `backquoted` for anything else (a key called id, say.) Without a
+ * select you just get IDs back.
+ *
+ * How it runs is up to the planner (QueryEngine::plan, and explain to
+ * see what it picked):
+ *
+ *   - id = 'x' anywhere at the top level of the where clause is a
+ *     single lookup, and id ^= 'prefix' only looks at that range of
+ *     the sorted ID map.
+ *   - Conditions on keys with a ValueIndex (QueryEngine::addIndex) get
+ *     their candidates from the index, when it says there aren't many.
+ *   - order by an indexed key with a limit walks the index in order
+ *     and stops once it has enough.
+ *   - Anything else is a parallel scan of a Metadata::View.
+ *
+ * Whichever it is, the rows it comes up with are checked against the
+ * whole where clause a batch at a time: each condition narrows a list
+ * of the rows in the batch still in the running, and only those get
+ * looked at by the next one. Scans with a limit and no order stop once
+ * they have enough rows, and with an order keep only the best limit
+ * rows per chunk.
+ *
+ * Everything runs against a Metadata::View, so a query sees the data
+ * as it was when it started. Indexes catch up with changes through
+ * exportSince, the same way a replica does, so adding one turns on
+ * change tracking.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/predicate.h>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fr::metadata {
+
+  /**
+   * A where clause, or a piece of one
+   */
+  struct Condition {
+    enum class Kind : uint8_t {
+      Key,       // test passes
+      IdEquals,  // The ID is id
+      IdPrefix,  // The ID starts with id
+      And,       // All the children pass
+      Or,        // Any of them does
+      Not        // The one child doesn't
+    };
+
+    Kind kind = Kind::Key;
+    KeyPredicate test;
+    std::string id;
+    std::vector<Condition> children;
+
+    static Condition key(KeyPredicate test) {
+      Condition c;
+      c.test = std::move(test);
+      return c;
+    }
+
+    static Condition idEquals(std::string id) {
+      Condition c;
+      c.kind = Kind::IdEquals;
+      c.id = std::move(id);
+      return c;
+    }
+
+    static Condition idPrefix(std::string prefix) {
+      Condition c;
+      c.kind = Kind::IdPrefix;
+      c.id = std::move(prefix);
+      return c;
+    }
+
+    static Condition all(std::vector<Condition> children) {
+      Condition c;
+      c.kind = Kind::And;
+      c.children = std::move(children);
+      return c;
+    }
+
+    static Condition any(std::vector<Condition> children) {
+      Condition c;
+      c.kind = Kind::Or;
+      c.children = std::move(children);
+      return c;
+    }
+
+    static Condition negate(Condition child) {
+      Condition c;
+      c.kind = Kind::Not;
+      c.children.push_back(std::move(child));
+      return c;
+    }
+
+    bool matches(const std::string& id, const Metadata::DataType& store) const {
+      switch (kind) {
+      case Kind::Key:
+	return test.matches(store);
+      case Kind::IdEquals:
+	return id == this->id;
+      case Kind::IdPrefix:
+	return id.starts_with(this->id);
+      case Kind::And:
+	return std::all_of(children.begin(), children.end(), [&](const Condition& c) { return c.matches(id, store); });
+      case Kind::Or:
+	return std::any_of(children.begin(), children.end(), [&](const Condition& c) { return c.matches(id, store); });
+      case Kind::Not:
+	return !children[0].matches(id, store);
+      }
+      return false;
+    }
+
+    // Back to query text
+    std::string str() const {
+      switch (kind) {
+      case Kind::Key:
+	return testText(test);
+      case Kind::IdEquals:
+	return std::format("id = {}", literal(Value(id)));
+      case Kind::IdPrefix:
+	return std::format("id ^= {}", literal(Value(id)));
+      case Kind::Not:
+	return std::format("not ({})", children[0].str());
+      default:
+	{
+	  std::string text;
+	  for (const auto& child : children) {
+	    if (!text.empty()) {
+	      text += kind == Kind::And ? " and " : " or ";
+	    }
+	    bool wrap = child.kind == Kind::And || child.kind == Kind::Or;
+	    text += wrap ? std::format("({})", child.str()) : child.str();
+	  }
+	  return text;
+	}
+      }
+    }
+
+    static std::string literal(const Value& v) {
+      switch (v.type()) {
+      case Value::Type::String:
+      case Value::Type::Bytes:
+	{
+	  std::string quoted = "'";
+	  for (char c : v.bytes()) {
+	    if (c == '\'' || c == '\\') {
+	      quoted.push_back('\\');
+	    }
+	    quoted.push_back(c);
+	  }
+	  return quoted + "'";
+	}
+      default:
+	return v.str();
+      }
+    }
+
+    static std::string keyText(const std::string& key) {
+      bool bare = !key.empty() && (std::isalpha(static_cast<unsigned char>(key[0])) || key[0] == '_');
+      for (char c : key) {
+	bare = bare && (std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '-' || c == '/' || c == ':');
+      }
+      static const char *keywords[] = {"select", "where", "order", "by", "asc", "desc", "limit", "and", "or",
+				       "not", "has", "between", "id", "true", "false"};
+      for (const char *keyword : keywords) {
+	bare = bare && !equalsIgnoringCase(key, keyword);
+      }
+      return bare ? key : std::format("`{}`", key);
+    }
+
+    static bool equalsIgnoringCase(std::string_view a, std::string_view b) {
+      return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+	return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+      });
+    }
+
+  private:
+
+    static std::string testText(const KeyPredicate& p) {
+      std::string key = keyText(p.key);
+      switch (p.op) {
+      case KeyPredicate::Op::Exists:
+	return std::format("has {}", key);
+      case KeyPredicate::Op::Equals:
+	return std::format("{} = {}", key, literal(p.value));
+      case KeyPredicate::Op::Prefix:
+	return std::format("{} ^= {}", key, literal(p.value));
+      case KeyPredicate::Op::Range:
+	break;
+      }
+      if (p.low && p.high && !p.lowExclusive && !p.highExclusive) {
+	return std::format("{} between {} and {}", key, literal(*p.low), literal(*p.high));
+      }
+      std::string text;
+      if (p.low) {
+	text = std::format("{} {} {}", key, p.lowExclusive ? ">" : ">=", literal(*p.low));
+      }
+      if (p.high) {
+	text += std::format("{}{} {} {}", text.empty() ? "" : " and ", key, p.highExclusive ? "<" : "<=", literal(*p.high));
+      }
+      return text.empty() ? std::format("has {}", key) : text;
+    }
+  };
+
+  struct Query {
+    // Keys to send back with each ID. "*" is all of them.
+    std::vector<std::string> select;
+    std::optional<Condition> where;
+    // Sort by this key's value, if it's set. Numbers come before
+    // anything else and sort as numbers (strings that read as numbers
+    // included), everything else sorts as text, and IDs without the key
+    // come last either way. Ties go by ID.
+    std::string orderBy;
+    bool descending = false;
+    // At most this many rows, 0 for no limit
+    size_t limit = 0;
+
+    bool selectsAll() const {
+      return select.size() == 1 && select[0] == "*";
+    }
+
+    // Parse the query language (see the top of query.h.) Throws
+    // std::runtime_error saying where it went wrong if it can't.
+    static Query parse(std::string_view text) {
+      Parser parser{text};
+      return parser.query();
+    }
+
+    std::string str() const {
+      std::string text;
+      if (!select.empty()) {
+	text = "select ";
+	for (size_t i = 0; i < select.size(); ++i) {
+	  text += i ? ", " : "";
+	  text += select[i] == "*" ? "*" : Condition::keyText(select[i]);
+	}
+      }
+      if (where) {
+	text += std::format("{}where {}", text.empty() ? "" : " ", where->str());
+      }
+      if (!orderBy.empty()) {
+	text += std::format("{}order by {}{}", text.empty() ? "" : " ", Condition::keyText(orderBy), descending ? " desc" : "");
+      }
+      if (limit) {
+	text += std::format("{}limit {}", text.empty() ? "" : " ", limit);
+      }
+      return text;
+    }
+
+  private:
+
+    struct Parser {
+      std::string_view text;
+      size_t pos = 0;
+      // How many NOTs and parentheses we're inside. Conditions are
+      // parsed (and later tested and freed) recursively, so a query
+      // that's nothing but "not not not..." could run the stack out.
+      size_t depth = 0;
+      static constexpr size_t maxDepth = 100;
+
+      [[noreturn]] void fail(const std::string& what) const {
+	throw std::runtime_error(std::format("Query error at position {}: {}", pos, what));
+      }
+
+      void skipSpace() {
+	while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) {
+	  pos++;
+	}
+      }
+
+      bool atEnd() {
+	skipSpace();
+	return pos >= text.size();
+      }
+
+      static bool wordChar(char c) {
+	return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '.' || c == '-' || c == '/' || c == ':';
+      }
+
+      // The bare word at pos, without moving past it
+      std::string_view peekWord() {
+	skipSpace();
+	size_t end = pos;
+	if (end < text.size() && (std::isalpha(static_cast<unsigned char>(text[end])) || text[end] == '_')) {
+	  while (end < text.size() && wordChar(text[end])) {
+	    end++;
+	  }
+	}
+	return text.substr(pos, end - pos);
+      }
+
+      // Move past keyword if it's next
+      bool keyword(std::string_view word) {
+	if (Condition::equalsIgnoringCase(peekWord(), word)) {
+	  pos += word.size();
+	  return true;
+	}
+	return false;
+      }
+
+      void expectKeyword(std::string_view word) {
+	if (!keyword(word)) {
+	  fail(std::format("expected '{}'", word));
+	}
+      }
+
+      // Move past symbol if it's next
+      bool symbol(std::string_view sym) {
+	skipSpace();
+	if (text.substr(pos).starts_with(sym)) {
+	  pos += sym.size();
+	  return true;
+	}
+	return false;
+      }
+
+      std::string quoted(char quote) {
+	std::string out;
+	pos++;
+	while (pos < text.size() && text[pos] != quote) {
+	  if (text[pos] == '\\' && pos + 1 < text.size()) {
+	    pos++;
+	  }
+	  out.push_back(text[pos++]);
+	}
+	if (pos >= text.size()) {
+	  fail("unterminated string");
+	}
+	pos++;
+	return out;
+      }
+
+      std::string key() {
+	skipSpace();
+	if (pos < text.size() && text[pos] == '`') {
+	  return quoted('`');
+	}
+	std::string_view word = peekWord();
+	if (word.empty()) {
+	  fail("expected a key");
+	}
+	pos += word.size();
+	return std::string(word);
+      }
+
+      Value literal() {
+	skipSpace();
+	if (pos >= text.size()) {
+	  fail("expected a value");
+	}
+	char c = text[pos];
+	if (c == '\'' || c == '"') {
+	  return Value(quoted(c));
+	}
+	if (keyword("true")) {
+	  return Value::ofBool(true);
+	}
+	if (keyword("false")) {
+	  return Value::ofBool(false);
+	}
+	size_t end = pos;
+	while (end < text.size() && (std::isalnum(static_cast<unsigned char>(text[end])) || text[end] == '.' || text[end] == '-' || text[end] == '+')) {
+	  end++;
+	}
+	std::string_view number = text.substr(pos, end - pos);
+	const char *first = number.data();
+	const char *last = first + number.size();
+	int64_t i;
+	auto [iend, iec] = std::from_chars(first, last, i);
+	if (iec == std::errc() && iend == last && !number.empty()) {
+	  pos = end;
+	  return Value::ofInt(i);
+	}
+	double d;
+	auto [dend, dec] = std::from_chars(first, last, d);
+	if (dec == std::errc() && dend == last && !number.empty()) {
+	  pos = end;
+	  return Value::ofDouble(d);
+	}
+	fail("expected a string, number, true or false");
+      }
+
+      Query query() {
+	Query q;
+	if (keyword("select")) {
+	  if (symbol("*")) {
+	    q.select.push_back("*");
+	  } else {
+	    do {
+	      q.select.push_back(key());
+	    } while (symbol(","));
+	  }
+	}
+	if (keyword("where")) {
+	  q.where = condition();
+	}
+	if (keyword("order")) {
+	  expectKeyword("by");
+	  q.orderBy = key();
+	  if (keyword("desc")) {
+	    q.descending = true;
+	  } else {
+	    keyword("asc");
+	  }
+	}
+	if (keyword("limit")) {
+	  Value n = literal();
+	  if (n.type() != Value::Type::Int || n.asInt() < 0) {
+	    fail("limit needs a whole number");
+	  }
+	  q.limit = static_cast<size_t>(n.asInt());
+	}
+	if (!atEnd()) {
+	  fail(std::format("unexpected '{}'", text.substr(pos)));
+	}
+	return q;
+      }
+
+      void nest() {
+	if (++depth > maxDepth) {
+	  fail(std::format("conditions nested more than {} deep", maxDepth));
+	}
+      }
+
+      Condition condition() {
+	std::vector<Condition> terms{conjunction()};
+	while (keyword("or")) {
+	  terms.push_back(conjunction());
+	}
+	return terms.size() == 1 ? std::move(terms[0]) : Condition::any(std::move(terms));
+      }
+
+      Condition conjunction() {
+	std::vector<Condition> terms{unary()};
+	while (keyword("and")) {
+	  terms.push_back(unary());
+	}
+	return terms.size() == 1 ? std::move(terms[0]) : Condition::all(std::move(terms));
+      }
+
+      Condition unary() {
+	if (keyword("not")) {
+	  nest();
+	  Condition c = Condition::negate(unary());
+	  depth--;
+	  return c;
+	}
+	if (symbol("(")) {
+	  nest();
+	  Condition c = condition();
+	  if (!symbol(")")) {
+	    fail("expected ')'");
+	  }
+	  depth--;
+	  return c;
+	}
+	if (keyword("has")) {
+	  return Condition::key(KeyPredicate::exists(key()));
+	}
+	if (keyword("id")) {
+	  bool prefix = symbol("^=");
+	  if (!prefix && !symbol("=")) {
+	    fail("id only does = and ^=");
+	  }
+	  Value v = literal();
+	  return prefix ? Condition::idPrefix(v.str()) : Condition::idEquals(v.str());
+	}
+	std::string k = key();
+	if (keyword("between")) {
+	  Value low = literal();
+	  expectKeyword("and");
+	  return Condition::key(KeyPredicate::range(k, low, literal()));
+	}
+	// Longest first, so <= isn't read as <
+	if (symbol("^=")) {
+	  Value v = literal();
+	  return Condition::key(KeyPredicate::prefix(k, v.str()));
+	}
+	if (symbol("!=")) {
+	  return Condition::negate(Condition::key(KeyPredicate::equals(k, literal())));
+	}
+	if (symbol("<=")) {
+	  return Condition::key(KeyPredicate::range(k, std::nullopt, literal()));
+	}
+	if (symbol(">=")) {
+	  return Condition::key(KeyPredicate::range(k, literal(), std::nullopt));
+	}
+	if (symbol("<")) {
+	  return Condition::key(KeyPredicate::range(k, std::nullopt, literal(), false, true));
+	}
+	if (symbol(">")) {
+	  return Condition::key(KeyPredicate::range(k, literal(), std::nullopt, true, false));
+	}
+	if (symbol("==") || symbol("=")) {
+	  return Condition::key(KeyPredicate::equals(k, literal()));
+	}
+	fail(std::format("expected a comparison after '{}'", k));
+      }
+    };
+  };
+
+  // One result: an ID, and the values of the selected keys it has
+  struct QueryRow {
+    std::string id;
+    std::vector<std::pair<std::string, Value>> values;
+  };
+
+  /**
+   * Where a value goes in an order by. See Query::orderBy.
+   */
+  struct OrderKey {
+    enum class Rank : uint8_t { Number, Text, Missing };
+    Rank rank = Rank::Missing;
+    bool isInt = false;
+    int64_t i = 0;
+    double d = 0;
+    std::string text;
+
+    static OrderKey of(const Value *v) {
+      OrderKey k;
+      if (!v) {
+	return k;
+      }
+      if (v->type() == Value::Type::Int) {
+	k.rank = Rank::Number;
+	k.isInt = true;
+	k.i = v->asInt();
+	k.d = static_cast<double>(k.i);
+      } else if (auto n = KeyPredicate::number(*v)) {
+	k.rank = Rank::Number;
+	k.d = *n;
+      } else {
+	k.rank = Rank::Text;
+	k.text = v->str();
+      }
+      return k;
+    }
+
+    // <0, 0 or >0, ascending. Missing is always last, which the caller
+    // has to keep in mind when flipping this around for descending.
+    static int compare(const OrderKey& a, const OrderKey& b) {
+      if (a.rank != b.rank) {
+	return a.rank < b.rank ? -1 : 1;
+      }
+      switch (a.rank) {
+      case Rank::Number:
+	if (a.isInt && b.isInt) {
+	  return a.i < b.i ? -1 : a.i > b.i ? 1 : 0;
+	}
+	return a.d < b.d ? -1 : a.d > b.d ? 1 : 0;
+      case Rank::Text:
+	return a.text.compare(b.text);
+      default:
+	return 0;
+      }
+    }
+  };
+
+  /**
+   * A secondary index on one key: the IDs sorted by its value, once as
+   * text and once as a number for the values that are numbers (or
+   * strings that read as them.) That covers every KeyPredicate on the
+   * key, and order by. What it hands out are candidates; the query
+   * still checks them.
+   *
+   * It catches up with its Metadata through exportSince before each
+   * query, so it only costs anything for IDs that changed since last
+   * time. Not thread safe on its own; QueryEngine locks it.
+   */
+  class ValueIndex {
+    struct Entry;
+    using TextMap = std::multimap<std::string, const std::string *>;
+    using NumberMap = std::multimap<double, const std::string *>;
+
+    struct Entry {
+      TextMap::iterator text;
+      NumberMap::iterator number;
+      TextMap::iterator word;
+      bool numeric = false;
+    };
+
+    std::string indexedKey;
+    // The sequence number it's caught up to, and whether it's ever
+    // been built at all
+    uint64_t through = 0;
+    bool built = false;
+    // The maps point at the IDs in here, which stay put
+    std::unordered_map<std::string, Entry> entries;
+    TextMap text;
+    NumberMap numbers;
+    // The values that aren't numbers again, so an order by can walk
+    // them without stepping over all the ones that are
+    TextMap words;
+
+    void remove(const std::string& id) {
+      auto itr = entries.find(id);
+      if (itr == entries.end()) {
+	return;
+      }
+      text.erase(itr->second.text);
+      if (itr->second.numeric) {
+	numbers.erase(itr->second.number);
+      } else {
+	words.erase(itr->second.word);
+      }
+      entries.erase(itr);
+    }
+
+    void put(const std::string& id, const Metadata::DataType& store) {
+      remove(id);
+      auto found = store.find(indexedKey);
+      if (found == store.end()) {
+	return;
+      }
+      auto [itr, added] = entries.try_emplace(id);
+      const std::string *idp = &itr->first;
+      itr->second.text = text.emplace(found->second.str(), idp);
+      // number() never gives back NaN, which would break the map's
+      // ordering, but check anyway since everything here depends on it
+      if (auto n = KeyPredicate::number(found->second); n && std::isfinite(*n)) {
+	itr->second.number = numbers.emplace(*n, idp);
+	itr->second.numeric = true;
+      } else {
+	itr->second.word = words.emplace(itr->second.text->first, idp);
+      }
+    }
+
+    // Numeric bounds for a range, widened to inclusive. Only the bounds
+    // that are numbers; the other one (if any) is left open.
+    static std::pair<double, double> numericRange(const KeyPredicate& p) {
+      double low = -std::numeric_limits<double>::infinity();
+      double high = std::numeric_limits<double>::infinity();
+      if (p.low) {
+	if (auto n = KeyPredicate::number(*p.low); n && KeyPredicate::numeric(*p.low)) {
+	  low = *n;
+	}
+      }
+      if (p.high) {
+	if (auto n = KeyPredicate::number(*p.high); n && KeyPredicate::numeric(*p.high)) {
+	  high = *n;
+	}
+      }
+      return {low, high};
+    }
+
+    static bool numericBound(const KeyPredicate& p) {
+      return (p.low && KeyPredicate::numeric(*p.low)) || (p.high && KeyPredicate::numeric(*p.high));
+    }
+
+    // Call fn(begin, end) with the range of one of the maps that covers
+    // every value p could match
+    template <typename Fn>
+    void withRange(const KeyPredicate& p, Fn&& fn) const {
+      switch (p.op) {
+      case KeyPredicate::Op::Exists:
+	fn(text.begin(), text.end());
+	return;
+      case KeyPredicate::Op::Equals:
+	{
+	  // A match has the same text, even "7" and 7
+	  auto [begin, end] = text.equal_range(p.value.str());
+	  fn(begin, end);
+	  return;
+	}
+      case KeyPredicate::Op::Prefix:
+	{
+	  // Everything from prefix up to the first string past all the
+	  // ones starting with it, which is prefix with its last byte
+	  // bumped (after dropping any trailing 0xff bytes)
+	  std::string past = p.value.bytes();
+	  auto begin = text.lower_bound(past);
+	  while (!past.empty() && static_cast<unsigned char>(past.back()) == 0xff) {
+	    past.pop_back();
+	  }
+	  if (past.empty()) {
+	    fn(begin, text.end());
+	    return;
+	  }
+	  past.back() = static_cast<char>(static_cast<unsigned char>(past.back()) + 1);
+	  fn(begin, text.lower_bound(past));
+	  return;
+	}
+      case KeyPredicate::Op::Range:
+	if (numericBound(p)) {
+	  auto [low, high] = numericRange(p);
+	  fn(numbers.lower_bound(low), numbers.upper_bound(high));
+	} else {
+	  fn(p.low ? text.lower_bound(p.low->str()) : text.begin(), p.high ? text.upper_bound(p.high->str()) : text.end());
+	}
+	return;
+      }
+    }
+
+  public:
+
+    explicit ValueIndex(std::string key) : indexedKey(std::move(key)) {}
+
+    const std::string& key() const {
+      return indexedKey;
+    }
+
+    // The sequence number of the last change it's seen
+    uint64_t caughtUpTo() const {
+      return through;
+    }
+
+    // False until the first catchUp. An index that hasn't been built
+    // starts from a full delta, so it doesn't need any changes kept.
+    bool isBuilt() const {
+      return built;
+    }
+
+    size_t size() const {
+      return entries.size();
+    }
+
+    // Bring the index up to date with m, if it's behind sequence
+    void catchUp(Metadata& m, uint64_t sequence) {
+      if (built && through >= sequence) {
+	return;
+      }
+      Metadata::Delta delta = m.exportSince(built ? through : 0);
+      if (delta.full || !built) {
+	entries.clear();
+	text.clear();
+	numbers.clear();
+	words.clear();
+      }
+      for (const auto& id : delta.erased) {
+	remove(id);
+      }
+      for (const auto& [id, store] : delta.stores) {
+	if (store) {
+	  put(id, *store);
+	} else {
+	  remove(id);
+	}
+      }
+      through = delta.through;
+      built = true;
+    }
+
+    // How many candidates p would turn up, counting no further than cap
+    size_t estimate(const KeyPredicate& p, size_t cap) const {
+      size_t count = 0;
+      withRange(p, [&](auto begin, auto end) {
+	for (; begin != end && count < cap; ++begin) {
+	  count++;
+	}
+      });
+      return count;
+    }
+
+    // Call fn(id) for every ID whose value could match p
+    template <typename Fn>
+    void candidates(const KeyPredicate& p, Fn&& fn) const {
+      withRange(p, [&](auto begin, auto end) {
+	for (; begin != end; ++begin) {
+	  fn(*begin->second);
+	}
+      });
+    }
+
+    // Call fn(id, key) for the IDs with the key, in order (see
+    // Query::orderBy) or the reverse, until it returns false. Equal
+    // values come out in no particular order.
+    template <typename Fn>
+    void ordered(bool descending, Fn&& fn) const {
+      auto numbersThen = [&](auto nbegin, auto nend, auto tbegin, auto tend, bool numbersFirst) {
+	auto walkNumbers = [&]() {
+	  for (auto itr = nbegin; itr != nend; ++itr) {
+	    if (!fn(*itr->second)) {
+	      return false;
+	    }
+	  }
+	  return true;
+	};
+	auto walkText = [&]() {
+	  for (auto itr = tbegin; itr != tend; ++itr) {
+	    if (!fn(*itr->second)) {
+	      return false;
+	    }
+	  }
+	  return true;
+	};
+	if (numbersFirst) {
+	  walkNumbers() && walkText();
+	} else {
+	  walkText() && walkNumbers();
+	}
+      };
+      if (descending) {
+	numbersThen(numbers.rbegin(), numbers.rend(), words.rbegin(), words.rend(), false);
+      } else {
+	numbersThen(numbers.begin(), numbers.end(), words.begin(), words.end(), true);
+      }
+    }
+  };
+
+  /**
+   * Runs queries against a Metadata, keeping whatever indexes you ask
+   * for up to date as it goes. Safe to use from several threads.
+   */
+  class QueryEngine {
+  public:
+
+    // What the planner decided
+    struct Plan {
+      enum class Access : uint8_t {
+	Point,         // One ID
+	IdRange,       // IDs starting with a prefix
+	Index,         // Candidates from indexes
+	OrderedIndex,  // Walk the order by key's index until there's enough
+	Scan           // Everything
+      };
+      Access access = Access::Scan;
+      // The ID or prefix for Point and IdRange
+      std::string id;
+      // For Index, the index lookups, any one of which can turn up a
+      // row, and the index each one uses. For OrderedIndex, the order
+      // by key's index.
+      std::vector<KeyPredicate> lookups;
+      std::vector<std::shared_ptr<ValueIndex>> indexes;
+      size_t estimate = 0;
+
+      std::string str() const {
+	switch (access) {
+	case Access::Point:
+	  return std::format("point lookup of {}", Condition::literal(Value(id)));
+	case Access::IdRange:
+	  return std::format("ID range {}*", Condition::literal(Value(id)));
+	case Access::Index:
+	  {
+	    std::string text = "index lookup of ";
+	    for (size_t i = 0; i < lookups.size(); ++i) {
+	      text += (i ? " or " : "") + Condition::key(lookups[i]).str();
+	    }
+	    return std::format("{} (about {} candidates)", text, estimate);
+	  }
+	case Access::OrderedIndex:
+	  return "ordered index walk";
+	default:
+	  return "parallel scan";
+	}
+      }
+    };
+
+  private:
+    // Rows are checked this many at a time
+    static constexpr size_t batchSize = 1024;
+    // An index is only worth it if it cuts things down to this fraction
+    // of the IDs or less
+    static constexpr size_t indexFraction = 4;
+
+    std::shared_ptr<Metadata> data;
+    // Guards the map of indexes
+    std::shared_mutex mtx;
+    std::map<std::string, std::shared_ptr<ValueIndex>> indexes;
+    // True if change tracking was off until the first index turned it
+    // on. The engine then trims the change log as the indexes catch up
+    // and turns tracking off again when the last index goes. If
+    // somebody else turned it on, it's theirs to look after.
+    bool ownsTracking = false;
+    // Guards what's in the indexes. Queries catch them up as they go,
+    // so reading one while another query does that won't work.
+    std::mutex indexMtx;
+
+    // A row that made it through the where clause
+    struct Match {
+      const std::string *id;
+      Metadata::Data store;
+      OrderKey order;
+    };
+
+    // A batch of rows, and which of them are still in the running
+    struct Batch {
+      std::vector<const std::string *> ids;
+      std::vector<Metadata::Data> stores;
+      std::vector<uint32_t> selected;
+
+      void clear() {
+	ids.clear();
+	stores.clear();
+      }
+
+      void add(const std::string *id, Metadata::Data store) {
+	ids.push_back(id);
+	stores.push_back(std::move(store));
+      }
+    };
+
+    // Narrow sel down to the rows in batch that pass c
+    static void narrow(const Condition& c, const Batch& batch, std::vector<uint32_t>& sel) {
+      switch (c.kind) {
+      case Condition::Kind::Key:
+	std::erase_if(sel, [&](uint32_t row) { return !c.test.matches(*batch.stores[row]); });
+	return;
+      case Condition::Kind::IdEquals:
+	std::erase_if(sel, [&](uint32_t row) { return *batch.ids[row] != c.id; });
+	return;
+      case Condition::Kind::IdPrefix:
+	std::erase_if(sel, [&](uint32_t row) { return !batch.ids[row]->starts_with(c.id); });
+	return;
+      case Condition::Kind::And:
+	for (const auto& child : c.children) {
+	  if (sel.empty()) {
+	    return;
+	  }
+	  narrow(child, batch, sel);
+	}
+	return;
+      case Condition::Kind::Or:
+	{
+	  // Each branch only looks at what the ones before it didn't take
+	  std::vector<uint32_t> passed;
+	  std::vector<uint32_t> rest = sel;
+	  for (const auto& child : c.children) {
+	    std::vector<uint32_t> took = rest;
+	    narrow(child, batch, took);
+	    passed.insert(passed.end(), took.begin(), took.end());
+	    std::vector<uint32_t> left;
+	    std::set_difference(rest.begin(), rest.end(), took.begin(), took.end(), std::back_inserter(left));
+	    rest = std::move(left);
+	  }
+	  std::sort(passed.begin(), passed.end());
+	  sel = std::move(passed);
+	  return;
+	}
+      case Condition::Kind::Not:
+	{
+	  std::vector<uint32_t> took = sel;
+	  narrow(c.children[0], batch, took);
+	  std::vector<uint32_t> left;
+	  std::set_difference(sel.begin(), sel.end(), took.begin(), took.end(), std::back_inserter(left));
+	  sel = std::move(left);
+	  return;
+	}
+      }
+    }
+
+    // Whether a goes before b in the results
+    static bool before(const Query& q, const Match& a, const Match& b) {
+      if (!q.orderBy.empty()) {
+	int c = OrderKey::compare(a.order, b.order);
+	if (q.descending && a.order.rank != OrderKey::Rank::Missing && b.order.rank != OrderKey::Rank::Missing) {
+	  c = -c;
+	}
+	if (c != 0) {
+	  return c < 0;
+	}
+      }
+      return *a.id < *b.id;
+    }
+
+    // Collects the rows that pass, keeping no more than it has to
+    class Collector {
+      const Query& q;
+      std::vector<Match> matches;
+
+    public:
+      explicit Collector(const Query& q) : q(q) {}
+
+      // Enough rows that nothing after these can make the cut. Only
+      // for queries with a limit and no order, which come in ID order.
+      bool full() const {
+	return q.limit && q.orderBy.empty() && matches.size() >= q.limit;
+      }
+
+      void add(const Batch& batch, const std::vector<uint32_t>& sel) {
+	for (uint32_t row : sel) {
+	  if (full()) {
+	    return;
+	  }
+	  Match m{batch.ids[row], batch.stores[row], {}};
+	  if (!q.orderBy.empty()) {
+	    auto found = m.store->find(q.orderBy);
+	    m.order = OrderKey::of(found == m.store->end() ? nullptr : &found->second);
+	  }
+	  matches.push_back(std::move(m));
+	}
+	// Keep a top-K from getting any bigger than twice K
+	if (q.limit && !q.orderBy.empty() && matches.size() >= q.limit * 2) {
+	  trim();
+	}
+      }
+
+      void trim() {
+	if (q.limit && matches.size() > q.limit) {
+	  std::nth_element(matches.begin(), matches.begin() + q.limit, matches.end(),
+			   [this](const Match& a, const Match& b) { return before(q, a, b); });
+	  matches.resize(q.limit);
+	}
+      }
+
+      size_t size() const {
+	return matches.size();
+      }
+
+      std::vector<Match>& results() {
+	return matches;
+      }
+    };
+
+    // Check the rows from begin to end against the where clause a batch
+    // at a time, handing the ones that pass to out. Stops early when
+    // out is full or stop says to.
+    template <typename Itr, typename Lookup, typename Stop>
+    static void filter(const Query& q, Itr begin, Itr end, Lookup&& lookup, Collector& out, Stop&& stop) {
+      Batch batch;
+      while (begin != end && !out.full() && !stop()) {
+	batch.clear();
+	for (; begin != end && batch.ids.size() < batchSize; ++begin) {
+	  auto [id, store] = lookup(begin);
+	  if (store) {
+	    batch.add(id, std::move(store));
+	  }
+	}
+	batch.selected.resize(batch.ids.size());
+	for (uint32_t i = 0; i < batch.selected.size(); ++i) {
+	  batch.selected[i] = i;
+	}
+	if (q.where) {
+	  narrow(*q.where, batch, batch.selected);
+	}
+	out.add(batch, batch.selected);
+      }
+    }
+
+    // The top level and-ed conditions in c
+    static std::vector<const Condition *> conjuncts(const std::optional<Condition>& where) {
+      std::vector<const Condition *> found;
+      if (where) {
+	if (where->kind == Condition::Kind::And) {
+	  for (const auto& child : where->children) {
+	    found.push_back(&child);
+	  }
+	} else {
+	  found.push_back(&*where);
+	}
+      }
+      return found;
+    }
+
+    std::shared_ptr<ValueIndex> indexFor(const std::string& key) {
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      auto itr = indexes.find(key);
+      return itr == indexes.end() ? nullptr : itr->second;
+    }
+
+    // Add the index lookups that between them turn up every row c
+    // passes to p. Returns false if c can't be done that way. Call with
+    // indexMtx held.
+    bool lookupsFor(const Condition& c, uint64_t sequence, Plan& p) {
+      if (c.kind == Condition::Kind::Key) {
+	auto index = indexFor(c.test.key);
+	if (!index) {
+	  return false;
+	}
+	index->catchUp(*data, sequence);
+	// Catching up goes as far as the Metadata has got, which can be
+	// past the view if something changed since it was taken. Rows the
+	// index has moved on from would go missing, so scan instead.
+	if (index->caughtUpTo() != sequence) {
+	  return false;
+	}
+	p.lookups.push_back(c.test);
+	p.indexes.push_back(index);
+	return true;
+      }
+      if (c.kind == Condition::Kind::Or) {
+	for (const auto& child : c.children) {
+	  if (!lookupsFor(child, sequence, p)) {
+	    return false;
+	  }
+	}
+	return true;
+      }
+      return false;
+    }
+
+    // The indexes q might use
+    void indexesIn(const Condition& c, std::vector<std::shared_ptr<ValueIndex>>& found) {
+      if (c.kind == Condition::Kind::Key) {
+	if (auto index = indexFor(c.test.key)) {
+	  found.push_back(index);
+	}
+      }
+      for (const auto& child : c.children) {
+	indexesIn(child, found);
+      }
+    }
+
+    // A view with the indexes q might use caught up to exactly where
+    // it is, so plan can use them. Writers don't wait for this, so if
+    // one gets in between catching up and taking the view it tries
+    // again a couple of times, and after that plan falls back on a scan
+    // for any index that doesn't match.
+    Metadata::View caughtUpView(const Query& q) {
+      std::vector<std::shared_ptr<ValueIndex>> wanted;
+      if (q.where) {
+	indexesIn(*q.where, wanted);
+      }
+      if (!q.orderBy.empty()) {
+	if (auto index = indexFor(q.orderBy)) {
+	  wanted.push_back(index);
+	}
+      }
+      std::lock_guard<std::mutex> lock(indexMtx);
+      Metadata::View view;
+      for (int attempt = 0; attempt < 3; ++attempt) {
+	for (const auto& index : wanted) {
+	  index->catchUp(*data, std::numeric_limits<uint64_t>::max());
+	}
+	view = data->view();
+	if (std::all_of(wanted.begin(), wanted.end(), [&](const auto& index) { return index->caughtUpTo() == view.sequence(); })) {
+	  break;
+	}
+      }
+      forgetSeenChanges();
+      return view;
+    }
+
+    // Let the Metadata drop the changes every built index has already
+    // caught up past, so the change log doesn't grow for as long as
+    // there are indexes. Call with indexMtx held.
+    void forgetSeenChanges() {
+      uint64_t seen = std::numeric_limits<uint64_t>::max();
+      {
+	std::shared_lock<std::shared_mutex> lock(mtx);
+	if (!ownsTracking) {
+	  return;
+	}
+	for (const auto& [key, index] : indexes) {
+	  if (index->isBuilt()) {
+	    seen = std::min(seen, index->caughtUpTo());
+	  }
+	}
+      }
+      if (seen != std::numeric_limits<uint64_t>::max()) {
+	data->forgetChangesBefore(seen);
+      }
+    }
+
+    Plan plan(const Query& q, const Metadata::View& view) {
+      Plan p;
+      auto terms = conjuncts(q.where);
+      for (const Condition *c : terms) {
+	if (c->kind == Condition::Kind::IdEquals) {
+	  p.access = Plan::Access::Point;
+	  p.id = c->id;
+	  p.estimate = 1;
+	  return p;
+	}
+      }
+      for (const Condition *c : terms) {
+	if (c->kind == Condition::Kind::IdPrefix && c->id.size() >= p.id.size()) {
+	  p.access = Plan::Access::IdRange;
+	  p.id = c->id;
+	}
+      }
+      if (p.access == Plan::Access::IdRange) {
+	return p;
+      }
+      std::lock_guard<std::mutex> lock(indexMtx);
+      size_t cap = view.size() / indexFraction + 1;
+      if (q.limit && q.orderBy.empty()) {
+	// A scan can stop once it has the limit, which if c candidates
+	// match out of n takes about limit * n / c rows. Going through
+	// the index means all c of them, so it only wins when c * c is
+	// under limit * n.
+	cap = std::min(cap, static_cast<size_t>(std::sqrt(static_cast<double>(q.limit) * view.size())) + 1);
+      }
+      p.estimate = cap;
+      for (const Condition *c : terms) {
+	Plan lookup;
+	if (!lookupsFor(*c, view.sequence(), lookup)) {
+	  continue;
+	}
+	size_t estimate = 0;
+	for (size_t i = 0; i < lookup.lookups.size(); ++i) {
+	  estimate += lookup.indexes[i]->estimate(lookup.lookups[i], cap);
+	}
+	if (estimate < p.estimate) {
+	  p.access = Plan::Access::Index;
+	  p.lookups = std::move(lookup.lookups);
+	  p.indexes = std::move(lookup.indexes);
+	  p.estimate = estimate;
+	}
+      }
+      if (p.access == Plan::Access::Index) {
+	return p;
+      }
+      p.estimate = view.size();
+      if (q.limit && !q.orderBy.empty()) {
+	auto index = indexFor(q.orderBy);
+	if (index) {
+	  index->catchUp(*data, view.sequence());
+	}
+	if (index && index->caughtUpTo() == view.sequence()) {
+	  p.access = Plan::Access::OrderedIndex;
+	  p.indexes.push_back(index);
+	}
+      }
+      return p;
+    }
+
+    // Run the plan and return the rows in order, no more than the limit
+    std::vector<Match> execute(const Query& q, const Plan& p, const Metadata::View& view, size_t threads) {
+      const auto& map = view.map();
+      auto fromMap = [&view](Metadata::MetadataMap::const_iterator itr) {
+	return std::make_pair(&itr->first, view.load(itr));
+      };
+      auto never = []() { return false; };
+      Collector out(q);
+      switch (p.access) {
+      case Plan::Access::Point:
+	{
+	  auto itr = map.find(p.id);
+	  filter(q, itr, itr == map.end() ? itr : std::next(itr), fromMap, out, never);
+	  break;
+	}
+      case Plan::Access::Index:
+	{
+	  // Where the candidates are in the view, sorted and without
+	  // repeats, so the rows come out in ID order like they would from
+	  // a scan. Another query may have caught the indexes up past the
+	  // view since this was planned, in which case it's a scan after
+	  // all.
+	  std::vector<Metadata::MetadataMap::const_iterator> rows;
+	  bool stale = false;
+	  {
+	    std::lock_guard<std::mutex> lock(indexMtx);
+	    stale = std::any_of(p.indexes.begin(), p.indexes.end(), [&](const auto& index) { return index->caughtUpTo() != view.sequence(); });
+	    for (size_t i = 0; i < p.lookups.size() && !stale; ++i) {
+	      p.indexes[i]->candidates(p.lookups[i], [&](const std::string& id) {
+		auto itr = map.find(id);
+		if (itr != map.end()) {
+		  rows.push_back(itr);
+		}
+	      });
+	    }
+	  }
+	  if (stale) {
+	    return execute(q, Plan{}, view, threads);
+	  }
+	  auto byId = [](Metadata::MetadataMap::const_iterator a, Metadata::MetadataMap::const_iterator b) { return a->first < b->first; };
+	  std::sort(rows.begin(), rows.end(), byId);
+	  rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+	  filter(q, rows.begin(), rows.end(), [&](auto itr) { return fromMap(*itr); }, out, never);
+	  break;
+	}
+      case Plan::Access::OrderedIndex:
+	if (auto rows = orderedWalk(q, *p.indexes[0], view)) {
+	  return std::move(*rows);
+	}
+	return execute(q, Plan{}, view, threads);
+      default:
+	{
+	  auto begin = map.begin();
+	  auto end = map.end();
+	  size_t count = map.size();
+	  if (p.access == Plan::Access::IdRange) {
+	    begin = map.lower_bound(p.id);
+	    end = begin;
+	    count = 0;
+	    while (end != map.end() && end->first.starts_with(p.id)) {
+	      ++end;
+	      ++count;
+	    }
+	  }
+	  threads = Metadata::View::threadsFor(threads);
+	  auto bounds = Metadata::View::split(begin, end, count, threads);
+	  size_t chunks = bounds.size() - 1;
+	  std::vector<Collector> parts(chunks, Collector(q));
+	  // With a limit and no order, once the chunks from the start up
+	  // to some point have enough rows between them nothing after
+	  // that point is needed
+	  std::atomic<size_t> cutoff{chunks};
+	  std::mutex doneMtx;
+	  std::vector<bool> done(chunks);
+	  Metadata::View::run(bounds, threads, [&](size_t chunk, Metadata::MetadataMap::const_iterator b,
+						   Metadata::MetadataMap::const_iterator e) {
+	    if (chunk >= cutoff) {
+	      return;
+	    }
+	    filter(q, b, e, fromMap, parts[chunk], [&]() { return chunk >= cutoff; });
+	    if (q.limit && q.orderBy.empty()) {
+	      std::lock_guard<std::mutex> lock(doneMtx);
+	      done[chunk] = true;
+	      size_t rows = 0;
+	      for (size_t i = 0; i < chunks && done[i]; ++i) {
+		rows += parts[i].size();
+		if (rows >= q.limit) {
+		  cutoff = std::min(cutoff.load(), i + 1);
+		  break;
+		}
+	      }
+	    }
+	  });
+	  std::vector<Match> all;
+	  for (size_t i = 0; i < chunks && i < cutoff; ++i) {
+	    parts[i].trim();
+	    auto& rows = parts[i].results();
+	    std::move(rows.begin(), rows.end(), std::back_inserter(all));
+	  }
+	  out.results() = std::move(all);
+	  break;
+	}
+      }
+      auto& rows = out.results();
+      if (!q.orderBy.empty()) {
+	size_t keep = q.limit ? std::min(q.limit, rows.size()) : rows.size();
+	std::partial_sort(rows.begin(), rows.begin() + keep, rows.end(), [&q](const Match& a, const Match& b) { return before(q, a, b); });
+	rows.resize(keep);
+      } else if (q.limit && rows.size() > q.limit) {
+	rows.resize(q.limit);
+      }
+      return std::move(rows);
+    }
+
+    // Top K by walking the order by key's index, checking each ID
+    // against the where clause, until there are K. Rows that tie with
+    // the last one are picked up too and sorted out afterwards. IDs
+    // without the key go last, so they're only looked for if the index
+    // runs out first. Returns nothing if the index has been caught up
+    // past the view since the plan was made.
+    std::optional<std::vector<Match>> orderedWalk(const Query& q, const ValueIndex& index, const Metadata::View& view) {
+      const auto& map = view.map();
+      std::vector<Match> rows;
+      {
+	std::lock_guard<std::mutex> lock(indexMtx);
+	if (index.caughtUpTo() != view.sequence()) {
+	  return std::nullopt;
+	}
+	Batch batch;
+	std::optional<OrderKey> last;
+	bool more = true;
+	auto flush = [&]() {
+	  batch.selected.resize(batch.ids.size());
+	  for (uint32_t i = 0; i < batch.selected.size(); ++i) {
+	    batch.selected[i] = i;
+	  }
+	  if (q.where) {
+	    narrow(*q.where, batch, batch.selected);
+	  }
+	  for (uint32_t row : batch.selected) {
+	    auto found = batch.stores[row]->find(q.orderBy);
+	    OrderKey key = OrderKey::of(found == batch.stores[row]->end() ? nullptr : &found->second);
+	    if (rows.size() >= q.limit && last && OrderKey::compare(key, *last) != 0) {
+	      more = false;
+	      break;
+	    }
+	    if (rows.size() + 1 == q.limit) {
+	      last = key;
+	    }
+	    rows.push_back(Match{batch.ids[row], batch.stores[row], std::move(key)});
+	  }
+	  batch.clear();
+	};
+	index.ordered(q.descending, [&](const std::string& id) {
+	  auto itr = map.find(id);
+	  if (itr != map.end()) {
+	    batch.add(&itr->first, view.load(itr));
+	  }
+	  if (batch.ids.size() >= batchSize) {
+	    flush();
+	  }
+	  return more;
+	});
+	if (more) {
+	  flush();
+	}
+      }
+      if (rows.size() < q.limit) {
+	// Not enough with the key, so look for rows without it
+	auto missing = [&view](Metadata::MetadataMap::const_iterator itr) {
+	  return std::make_pair(&itr->first, view.load(itr));
+	};
+	Query without = q;
+	without.where = q.where ? Condition::all({*q.where, Condition::negate(Condition::key(KeyPredicate::exists(q.orderBy)))})
+	  : Condition::negate(Condition::key(KeyPredicate::exists(q.orderBy)));
+	Collector extra(without);
+	filter(without, map.begin(), map.end(), missing, extra, []() { return false; });
+	for (auto& m : extra.results()) {
+	  rows.push_back(std::move(m));
+	}
+      }
+      size_t keep = std::min(q.limit, rows.size());
+      std::partial_sort(rows.begin(), rows.begin() + keep, rows.end(), [&q](const Match& a, const Match& b) { return before(q, a, b); });
+      rows.resize(keep);
+      return rows;
+    }
+
+    static QueryRow rowFor(const Query& q, const Match& m) {
+      QueryRow row;
+      row.id = *m.id;
+      if (q.selectsAll()) {
+	for (const auto& [key, value] : *m.store) {
+	  row.values.emplace_back(key, value);
+	}
+      } else {
+	for (const auto& key : q.select) {
+	  auto found = m.store->find(key);
+	  if (found != m.store->end()) {
+	    row.values.emplace_back(key, found->second);
+	  }
+	}
+      }
+      return row;
+    }
+
+  public:
+
+    explicit QueryEngine(std::shared_ptr<Metadata> data) : data(std::move(data)) {}
+
+    // Keep an index on key. It's built the first time a query wants it,
+    // and turns on change tracking (see Metadata::setChangeTracking) so
+    // it can keep up cheaply after that. Changes the indexes have all
+    // seen are forgotten as queries catch them up.
+    void addIndex(const std::string& key) {
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      if (indexes.empty() && !ownsTracking && !data->changeTracking()) {
+	data->setChangeTracking(true);
+	ownsTracking = true;
+      }
+      indexes.try_emplace(key, std::make_shared<ValueIndex>(key));
+    }
+
+    // Dropping the last index turns change tracking back off, if the
+    // engine was the one that turned it on
+    bool dropIndex(const std::string& key) {
+      std::unique_lock<std::shared_mutex> lock(mtx);
+      if (indexes.erase(key) == 0) {
+	return false;
+      }
+      if (indexes.empty() && ownsTracking) {
+	data->setChangeTracking(false);
+	ownsTracking = false;
+      }
+      return true;
+    }
+
+    std::vector<std::string> indexedKeys() {
+      std::vector<std::string> keys;
+      std::shared_lock<std::shared_mutex> lock(mtx);
+      for (const auto& [key, index] : indexes) {
+	keys.push_back(key);
+      }
+      return keys;
+    }
+
+    // How q would be run right now
+    Plan plan(const Query& q) {
+      return plan(q, caughtUpView(q));
+    }
+
+    std::string explain(const Query& q) {
+      return std::format("{}: {}", q.str(), plan(q).str());
+    }
+
+    // Run q, handing each row to sink in order until it runs out or
+    // sink returns false. Returns the number of rows sunk. The rows are
+    // all found before the first one goes out, but they're only built
+    // (values copied out and so on) as they're sent, so a sink that's
+    // writing to a socket doesn't need room for all of them at once.
+    size_t run(const Query& q, const std::function<bool(const QueryRow&)>& sink, size_t threads = 0) {
+      Metadata::View view = caughtUpView(q);
+      Plan p = plan(q, view);
+      size_t sent = 0;
+      for (const auto& m : execute(q, p, view, threads)) {
+	sent++;
+	if (!sink(rowFor(q, m))) {
+	  break;
+	}
+      }
+      return sent;
+    }
+
+    std::vector<QueryRow> run(const Query& q, size_t threads = 0) {
+      std::vector<QueryRow> rows;
+      run(q, [&rows](const QueryRow& row) {
+	rows.push_back(row);
+	return true;
+      }, threads);
+      return rows;
+    }
+
+    std::vector<QueryRow> run(std::string_view text, size_t threads = 0) {
+      return run(Query::parse(text), threads);
+    }
+  };
+
+}
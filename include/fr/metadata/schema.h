@@ -0,0 +1,421 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Stores with a schema.
+ *
+ * A lot of data has the same handful of keys in every ID (mime, size,
+ * mtime, path...), and looking each of those up by string in a map
+ * every time is a waste when we knew what they'd be when we compiled.
+ * So you can write the keys down as a C++ type:
+ *
+ *   struct FileMeta {
+ *     FR_SCHEMA;
+ *     FR_FIELD(mime);
+ *     FR_FIELD(size);
+ *     FR_FIELD(mtime);
+ *     FR_FIELD(path);
+ *   };
+ *
+ * Each field gets a slot number, worked out at compile time, and a
+ * Record<FileMeta> keeps the values for them in a fixed array. Reading
+ * record.get(FileMeta::size) is an array index, not a lookup. Keys that
+ * aren't in the schema still work; they go in a regular DataType off
+ * to the side, and the string API (get("size"), keys() and so on) looks
+ * in the slots first and then there.
+ *
+ * SchemaMetadata<FileMeta> is a Metadata with Records for stores. It
+ * has the usual string API plus typed access by field, and converts
+ * to and from a MetadataMap so all the existing formats work with it.
+ *
+ * FR_FIELD numbers its slots by asking how many fields were declared
+ * before it in the same struct (see FieldRank below), so the numbers
+ * only depend on the struct itself. A schema in a header comes out the
+ * same in every file that includes it, and nothing else in the file
+ * can shift the slots. A schema can have up to maxSchemaFields fields.
+ */
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace fr::metadata {
+
+  // The handle FR_FIELD declares for each known key. All it carries is
+  // its slot, as a compile time constant.
+  template <size_t Slot>
+  struct Field {
+    static constexpr size_t slot = Slot;
+  };
+
+  // How the fields count themselves. Each field declares an overload
+  // of frFieldsBefore taking FieldRank<its slot + 1>. FieldRank<N>
+  // derives from FieldRank<N - 1>, so calling it with the highest rank
+  // picks the overload with the highest rank declared so far, and the
+  // type it returns says how many fields there are before this one.
+  // Only the declarations are ever looked at.
+  inline constexpr size_t maxSchemaFields = 256;
+
+  template <size_t N>
+  struct FieldRank : FieldRank<N - 1> {};
+
+  template <>
+  struct FieldRank<0> {};
+
+  template <size_t N>
+  struct FieldCount {
+    static constexpr size_t value = N;
+  };
+
+// Start a schema. Goes before the fields.
+#define FR_SCHEMA							\
+  static auto frFieldsBefore(::fr::metadata::FieldRank<0>) -> ::fr::metadata::FieldCount<0>
+
+// Declare a known key. name is both the C++ name and the key.
+#define FR_FIELD(name)							\
+  static constexpr ::fr::metadata::Field<decltype(frFieldsBefore(::fr::metadata::FieldRank<::fr::metadata::maxSchemaFields>{}))::value> name{}; \
+  static auto frFieldsBefore(::fr::metadata::FieldRank<std::remove_cvref_t<decltype(name)>::slot + 1>) \
+    -> ::fr::metadata::FieldCount<std::remove_cvref_t<decltype(name)>::slot + 1>; \
+  static constexpr std::string_view frFieldName(::fr::metadata::Field<std::remove_cvref_t<decltype(name)>::slot>) { return #name; }
+
+  // What can be worked out about a schema at compile time
+  template <typename Schema>
+  struct SchemaTraits {
+    template <size_t I>
+    static constexpr bool hasField = requires { Schema::frFieldName(Field<I>{}); };
+
+    template <size_t I = 0>
+    static constexpr size_t countFields() {
+      if constexpr (hasField<I>) {
+	return countFields<I + 1>();
+      } else {
+	return I;
+      }
+    }
+
+    static constexpr size_t size = countFields();
+
+    template <size_t... I>
+    static constexpr std::array<std::string_view, size> fieldNames(std::index_sequence<I...>) {
+      return {Schema::frFieldName(Field<I>{})...};
+    }
+
+    static constexpr std::array<std::string_view, size> names = fieldNames(std::make_index_sequence<size>{});
+
+    // The slot for key, or size if it isn't one of the fields. It's a
+    // straight walk through the names, which for the handful of fields
+    // a schema has is quicker than anything cleverer.
+    static constexpr size_t slotOf(std::string_view key) {
+      for (size_t i = 0; i < size; ++i) {
+	if (names[i] == key) {
+	  return i;
+	}
+      }
+      return size;
+    }
+
+    static constexpr bool unique() {
+      for (size_t i = 0; i < size; ++i) {
+	if (slotOf(names[i]) != i) {
+	  return false;
+	}
+      }
+      return true;
+    }
+  };
+
+  /**
+   * One ID's worth of keys and values for a schema: a slot for each
+   * field, plus a map for anything else.
+   */
+  template <typename Schema>
+  class Record {
+  public:
+    using Traits = SchemaTraits<Schema>;
+    static constexpr size_t fields = Traits::size;
+    static_assert(fields > 0, "A schema needs FR_SCHEMA and at least one FR_FIELD");
+    static_assert(Traits::unique(), "A schema can't have the same field twice");
+
+  private:
+    std::array<Value, fields> slots;
+    std::bitset<fields> present;
+    Metadata::DataType extra;
+
+  public:
+
+    // Typed access. These compile down to an array index.
+
+    template <size_t I>
+    const Value *find(Field<I>) const {
+      static_assert(I < fields);
+      return present[I] ? &slots[I] : nullptr;
+    }
+
+    template <size_t I>
+    const Value& get(Field<I> field) const {
+      const Value *found = find(field);
+      if (!found) {
+	throw std::runtime_error(std::format("Key '{}' does not exist", Traits::names[I]));
+      }
+      return *found;
+    }
+
+    template <size_t I>
+    void set(Field<I>, Value value) {
+      static_assert(I < fields);
+      slots[I] = std::move(value);
+      present[I] = true;
+    }
+
+    template <size_t I>
+    bool erase(Field<I>) {
+      static_assert(I < fields);
+      bool was = present[I];
+      slots[I] = Value();
+      present[I] = false;
+      return was;
+    }
+
+    // String access, for when the key isn't known until run time
+
+    const Value *find(std::string_view key) const {
+      size_t slot = Traits::slotOf(key);
+      if (slot < fields) {
+	return present[slot] ? &slots[slot] : nullptr;
+      }
+      auto itr = extra.find(std::string(key));
+      return itr == extra.end() ? nullptr : &itr->second;
+    }
+
+    bool contains(std::string_view key) const {
+      return find(key) != nullptr;
+    }
+
+    void set(const std::string& key, Value value) {
+      size_t slot = Traits::slotOf(key);
+      if (slot < fields) {
+	slots[slot] = std::move(value);
+	present[slot] = true;
+      } else {
+	extra[key] = std::move(value);
+      }
+    }
+
+    bool erase(const std::string& key) {
+      size_t slot = Traits::slotOf(key);
+      if (slot < fields) {
+	bool was = present[slot];
+	slots[slot] = Value();
+	present[slot] = false;
+	return was;
+      }
+      return extra.erase(key) > 0;
+    }
+
+    // Every key that's set, sorted the same way a DataType would be
+    std::vector<std::string> keys() const {
+      std::vector<std::string> all;
+      all.reserve(size());
+      for (const auto& [key, value] : toData()) {
+	all.push_back(key);
+      }
+      return all;
+    }
+
+    size_t size() const {
+      return present.count() + extra.size();
+    }
+
+    // Everything in it as a regular store
+    Metadata::DataType toData() const {
+      Metadata::DataType data = extra;
+      for (size_t i = 0; i < fields; ++i) {
+	if (present[i]) {
+	  data.emplace(std::string(Traits::names[i]), slots[i]);
+	}
+      }
+      return data;
+    }
+
+    static Record fromData(const Metadata::DataType& data) {
+      Record record;
+      for (const auto& [key, value] : data) {
+	record.set(key, value);
+      }
+      return record;
+    }
+  };
+
+  /**
+   * Metadata with a schema. Works the way Metadata does (there's just
+   * the one lock, and the string API is the same), but each ID's store
+   * is a Record, so fields can be read and written by slot.
+   */
+  template <typename Schema>
+  class SchemaMetadata {
+  public:
+    using RecordType = Record<Schema>;
+
+  private:
+    std::mutex mtx;
+    std::map<std::string, RecordType> records;
+
+    [[noreturn]] static void missing(const std::string& id, std::string_view key) {
+      throw std::runtime_error(std::format("Key '{}' or unique ID '{}' do not exist", key, id));
+    }
+
+  public:
+
+    bool contains(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      return records.contains(id);
+    }
+
+    bool idContains(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      return itr != records.end() && itr->second.contains(key);
+    }
+
+    void add(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!records.try_emplace(id).second) {
+	throw std::runtime_error(std::format("'{}' already exists in metadata", id));
+      }
+    }
+
+    std::vector<std::string> ids() {
+      std::vector<std::string> allIds;
+      std::lock_guard<std::mutex> lock(mtx);
+      allIds.reserve(records.size());
+      for (const auto& [id, record] : records) {
+	allIds.push_back(id);
+      }
+      return allIds;
+    }
+
+    std::vector<std::string> keys(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      if (itr == records.end()) {
+	throw std::runtime_error(std::format("Unique ID '{}' does not exist", id));
+      }
+      return itr->second.keys();
+    }
+
+    std::string value(const std::string& id, const std::string& key) {
+      return get(id, key).str();
+    }
+
+    Value get(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      const Value *found = itr == records.end() ? nullptr : itr->second.find(key);
+      if (!found) {
+	missing(id, key);
+      }
+      return *found;
+    }
+
+    // Creates the ID if it isn't there, like Metadata::update
+    void update(const std::string& id, const std::string& key, const std::string& value) {
+      set(id, key, Value(value));
+    }
+
+    void set(const std::string& id, const std::string& key, Value value) {
+      std::lock_guard<std::mutex> lock(mtx);
+      records[id].set(key, std::move(value));
+    }
+
+    void erase(const std::string& id) {
+      std::lock_guard<std::mutex> lock(mtx);
+      records.erase(id);
+    }
+
+    void erase(const std::string& id, const std::string& key) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      if (itr != records.end()) {
+	itr->second.erase(key);
+      }
+    }
+
+    // Typed access by field, for example m.get(id, FileMeta::size)
+
+    template <size_t I>
+    Value get(const std::string& id, Field<I> field) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      const Value *found = itr == records.end() ? nullptr : itr->second.find(field);
+      if (!found) {
+	missing(id, RecordType::Traits::names[I]);
+      }
+      return *found;
+    }
+
+    template <size_t I>
+    void set(const std::string& id, Field<I> field, Value value) {
+      std::lock_guard<std::mutex> lock(mtx);
+      records[id].set(field, std::move(value));
+    }
+
+    // Call fn(const RecordType&) with the lock held, to read several
+    // fields without copying any of them. Throws if id doesn't exist.
+    // Don't call back into this SchemaMetadata from fn.
+    template <typename Fn>
+    decltype(auto) read(const std::string& id, Fn&& fn) {
+      std::lock_guard<std::mutex> lock(mtx);
+      auto itr = records.find(id);
+      if (itr == records.end()) {
+	throw std::runtime_error(std::format("Unique ID '{}' does not exist", id));
+      }
+      return fn(static_cast<const RecordType&>(itr->second));
+    }
+
+    // A copy of everything as a regular ID map, for handing to
+    // BinaryFormat, a Metadata, or anything else that takes one
+    Metadata::MetadataMap snapshot() {
+      Metadata::MetadataMap stores;
+      std::lock_guard<std::mutex> lock(mtx);
+      for (const auto& [id, record] : records) {
+	stores.emplace_hint(stores.end(), id, std::make_shared<Metadata::DataType>(record.toData()));
+      }
+      return stores;
+    }
+
+    // Replace everything with the stores in an ID map (Metadata::snapshot,
+    // say.) Keys that match fields go into their slots.
+    void restore(const Metadata::MetadataMap& stores) {
+      std::map<std::string, RecordType> loaded;
+      for (const auto& [id, store] : stores) {
+	loaded.emplace_hint(loaded.end(), id, store ? RecordType::fromData(*store) : RecordType());
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      records = std::move(loaded);
+    }
+  };
+
+}
@@ -18,12 +18,18 @@
 
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <filesystem>
 #include <format>
 #include <mutex>
+#include <stdexcept>
 #include <thread>
+#include <fr/metadata/binary.h>
+#include <fr/metadata/json_stream.h>
 #include <fr/metadata/metadata.h>
+#include <fr/metadata/query.h>
 #include <fr/metadata/ui_helper.h>
 #include <pistache/common.h>
 #include <pistache/endpoint.h>
@@ -47,6 +53,8 @@ namespace fr::metadata {
   class Server {
     // Metdata object to provide data to the REST API
     std::shared_ptr<Metadata> data;
+    // Runs GET /query, and keeps any indexes for it
+    std::shared_ptr<QueryEngine> queries;
     // The actual Pistache server that handles the requests
     Pistache::Http::Endpoint server;
     // The Pistache rotuer that has all my REST routes defined
@@ -111,6 +119,220 @@ namespace fr::metadata {
       }
     }
 
+    // Stream the whole thing out as JSON (the same document toJson
+    // makes) without building it in memory first
+    void exportJson(const Pistache::Rest::Request& request,
+		    Pistache::Http::ResponseWriter response) {
+      response.headers().add<Pistache::Http::Header::ContentType>(MIME(Application, Json));
+      auto stream = response.stream(Pistache::Http::Code::Ok);
+      JsonStreamer streamer([&stream](std::string_view chunk) {
+	stream.write(chunk.data(), chunk.size());
+	stream.flush();
+      });
+      try {
+	streamer.write(*data);
+      } catch (const std::exception& e) {
+	// The 200 went out with the first chunk, so it's too late to send
+	// an error code. Leave a note where the document stops instead;
+	// what came before it won't parse as JSON, so nobody mistakes it
+	// for the whole thing. If the stream itself is what broke, there's
+	// nobody left to tell.
+	try {
+	  std::string message = std::format("\nExport failed: {}\n", e.what());
+	  stream.write(message.data(), message.size());
+	} catch (const std::exception&) {
+	  return;
+	}
+      }
+      stream << Pistache::Http::ends;
+    }
+
+    // The same thing in BinaryFormat, which is a lot smaller. This one
+    // is built in memory and sent in one go.
+    void exportBinary(const Pistache::Rest::Request& request,
+		      Pistache::Http::ResponseWriter response) {
+      response.send(Pistache::Http::Code::Ok, BinaryFormat::toBinary(*data), MIME(Application, OctetStream));
+    }
+
+    // Just what changed since sequence number :seq, as a binary delta
+    // (see BinaryFormat::encodeDelta.) The X-Sequence header says what
+    // to ask for next time. Unless change tracking is turned on for the
+    // metadata, every delta is a full one.
+    void exportSince(const Pistache::Rest::Request& request,
+		     Pistache::Http::ResponseWriter response) {
+      std::string text = request.param(":seq").as<std::string>();
+      uint64_t since = 0;
+      auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), since);
+      if (ec != std::errc() || ptr != text.data() + text.size()) {
+	error(response, std::format("'{}' is not a sequence number", text));
+	return;
+      }
+      Metadata::Delta delta = data->exportSince(since);
+      response.headers().addRaw(Pistache::Http::Header::Raw("X-Sequence", std::to_string(delta.through)));
+      response.send(Pistache::Http::Code::Ok, BinaryFormat::encodeDelta(delta), MIME(Application, OctetStream));
+    }
+
+    // The current count of the counter at :id/:key, as plain text
+    void getCounter(const Pistache::Rest::Request& request,
+		    Pistache::Http::ResponseWriter response) {
+      auto id = request.param(":id").as<std::string>();
+      auto key = request.param(":key").as<std::string>();
+      try {
+	response.send(Pistache::Http::Code::Ok, std::format("{}\n", data->getInt(id, key)));
+      } catch(std::exception &e) {
+	error(response, e.what(), Pistache::Http::Code::Not_Found);
+      }
+    }
+
+    // Add :delta (1 if there isn't one) to the counter at :id/:key and
+    // send back the new count. Both get made if they aren't there. The
+    // count is passed on to the listeners (the write-ahead log, say)
+    // before it's sent, so a count the client sees has been stored.
+    void incrementCounter(const Pistache::Rest::Request& request,
+			  Pistache::Http::ResponseWriter response) {
+      auto id = request.param(":id").as<std::string>();
+      auto key = request.param(":key").as<std::string>();
+      int64_t delta = 1;
+      if (request.hasParam(":delta")) {
+	std::string text = request.param(":delta").as<std::string>();
+	auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), delta);
+	if (ec != std::errc() || ptr != text.data() + text.size()) {
+	  error(response, std::format("'{}' is not an integer", text));
+	  return;
+	}
+      }
+      try {
+	response.send(Pistache::Http::Code::Ok, std::format("{}\n", data->incrementSynced(id, key, delta)));
+      } catch(std::exception &e) {
+	error(response, e.what());
+      }
+    }
+
+    // The bytes in :id/:key sent as they are, straight out of the blob
+    // they're stored in
+    void getBlob(const Pistache::Rest::Request& request,
+		 Pistache::Http::ResponseWriter response) {
+      auto id = request.param(":id").as<std::string>();
+      auto key = request.param(":key").as<std::string>();
+      Blob blob;
+      try {
+	blob = data->getBlob(id, key);
+      } catch(std::exception &e) {
+	error(response, e.what(), Pistache::Http::Code::Not_Found);
+	return;
+      }
+      response.send(Pistache::Http::Code::Ok, *blob, MIME(Application, OctetStream));
+    }
+
+    // Store the request body in :id/:key as bytes
+    void putBlob(const Pistache::Rest::Request& request,
+		 Pistache::Http::ResponseWriter response) {
+      auto id = request.param(":id").as<std::string>();
+      auto key = request.param(":key").as<std::string>();
+      try {
+	data->setBytes(id, key, request.body());
+	response.send(Pistache::Http::Code::Ok, "Blob stored\n");
+      } catch(std::exception &e) {
+	error(response, e.what());
+      }
+    }
+
+    // Run the query in ?q= (see query.h) and stream the rows back as
+    // JSON lines, {"id": ..., "values": {key: value...}}, as they're
+    // built. Values go out as strings. ?threads= says how many threads
+    // a scan gets, up to the number of cores. Anyone who can reach the
+    // server can set it, so it doesn't get to start thousands. If the
+    // query fails after rows have started going out, the last line is
+    // {"error": message}.
+    void query(const Pistache::Rest::Request& request,
+	       Pistache::Http::ResponseWriter response) {
+      auto text = request.query().get("q");
+      if (!text) {
+	error(response, "Pass the query in ?q=");
+	return;
+      }
+      size_t threads = 0;
+      if (auto t = request.query().get("threads")) {
+	auto [ptr, ec] = std::from_chars(t->data(), t->data() + t->size(), threads);
+	if (ec != std::errc() || ptr != t->data() + t->size()) {
+	  error(response, std::format("'{}' is not a thread count", *t));
+	  return;
+	}
+	threads = std::min<size_t>(threads, std::max(1u, std::thread::hardware_concurrency()));
+      }
+      Query q;
+      try {
+	q = Query::parse(*text);
+      } catch(std::exception &e) {
+	error(response, e.what());
+	return;
+      }
+      response.headers().add<Pistache::Http::Header::ContentType>(MIME(Application, Json));
+      auto stream = response.stream(Pistache::Http::Code::Ok);
+      std::string line;
+      try {
+	queries->run(q, [&](const QueryRow& row) {
+	  line = "{\"id\":";
+	  JsonStreamer::quote(line, row.id);
+	  line += ",\"values\":{";
+	  for (size_t i = 0; i < row.values.size(); ++i) {
+	    line += i ? "," : "";
+	    JsonStreamer::quote(line, row.values[i].first);
+	    line += ":";
+	    JsonStreamer::quote(line, row.values[i].second.str());
+	  }
+	  line += "}}\n";
+	  stream.write(line.data(), line.size());
+	  stream.flush();
+	  return true;
+	}, threads);
+      } catch (const std::exception& e) {
+	// The 200 is already out (a load from the source or an index
+	// catching up can fail part way through), so finish with an
+	// error line that no row looks like. If the stream is what
+	// broke, there's nobody left to tell.
+	try {
+	  line = "{\"error\":";
+	  JsonStreamer::quote(line, e.what());
+	  line += "}\n";
+	  stream.write(line.data(), line.size());
+	} catch (const std::exception&) {
+	  return;
+	}
+      }
+      stream << Pistache::Http::ends;
+    }
+
+    // The busiest IDs and keys lately as JSON, :k of each (10 if
+    // there's no :k.) Hot key tracking has to be turned on for the
+    // metadata; if it isn't, enabled is false and the lists are empty.
+    void hotKeys(const Pistache::Rest::Request& request,
+		 Pistache::Http::ResponseWriter response) {
+      size_t k = 10;
+      if (request.hasParam(":k")) {
+	std::string text = request.param(":k").as<std::string>();
+	auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), k);
+	if (ec != std::errc() || ptr != text.data() + text.size()) {
+	  error(response, std::format("'{}' is not a count", text));
+	  return;
+	}
+      }
+      auto stats = data->hotKeyStatistics(k);
+      auto entries = [](const std::vector<HotEntry>& hot) {
+	std::string out = "[";
+	for (size_t i = 0; i < hot.size(); ++i) {
+	  out += i ? "," : "";
+	  out += "{\"name\":";
+	  JsonStreamer::quote(out, hot[i].name);
+	  out += std::format(",\"count\":{},\"error\":{}}}", hot[i].count, hot[i].error);
+	}
+	return out + "]";
+      };
+      std::string body = std::format("{{\"enabled\":{},\"sampleEvery\":{},\"sampled\":{},\"ids\":{},\"keys\":{}}}\n",
+				     stats.enabled, stats.sampleEvery, stats.sampled, entries(stats.ids), entries(stats.keys));
+      response.send(Pistache::Http::Code::Ok, body, MIME(Application, Json));
+    }
+
     void uiTopLevel(const Pistache::Rest::Request& request,
 		    Pistache::Http::ResponseWriter response) {
       // Expect ui directory to be in current directory
@@ -138,6 +360,24 @@ namespace fr::metadata {
 				   Pistache::Rest::Routes::bind(&Server::addId, this));
       Pistache::Rest::Routes::Get(router, "/metadata/:id",
 				  Pistache::Rest::Routes::bind(&Server::getId, this));
+      Pistache::Rest::Routes::Get(router, "/export",
+				  Pistache::Rest::Routes::bind(&Server::exportJson, this));
+      Pistache::Rest::Routes::Get(router, "/export/binary",
+				  Pistache::Rest::Routes::bind(&Server::exportBinary, this));
+      Pistache::Rest::Routes::Get(router, "/export/since/:seq",
+				  Pistache::Rest::Routes::bind(&Server::exportSince, this));
+      Pistache::Rest::Routes::Get(router, "/counter/:id/:key",
+				  Pistache::Rest::Routes::bind(&Server::getCounter, this));
+      Pistache::Rest::Routes::Post(router, "/counter/:id/:key/:delta?",
+				   Pistache::Rest::Routes::bind(&Server::incrementCounter, this));
+      Pistache::Rest::Routes::Get(router, "/blob/:id/:key",
+				  Pistache::Rest::Routes::bind(&Server::getBlob, this));
+      Pistache::Rest::Routes::Post(router, "/blob/:id/:key",
+				   Pistache::Rest::Routes::bind(&Server::putBlob, this));
+      Pistache::Rest::Routes::Get(router, "/query",
+				  Pistache::Rest::Routes::bind(&Server::query, this));
+      Pistache::Rest::Routes::Get(router, "/stats/hot/:k?",
+				  Pistache::Rest::Routes::bind(&Server::hotKeys, this));
 
 
       // Set up routes to expose UI. React seems to want the various directories under "dist" set up as
@@ -167,14 +407,19 @@ namespace fr::metadata {
     
   public:
     
-    Server(std::shared_ptr<Metadata> meatdata, int port) : data(meatdata), server({Pistache::Ipv4::any(), Pistache::Port(port)}) {
+    Server(std::shared_ptr<Metadata> meatdata, int port) : data(meatdata), queries(std::make_shared<QueryEngine>(meatdata)), server({Pistache::Ipv4::any(), Pistache::Port(port)}) {
       setupRoutes();
     }
     
-    Server(std::shared_ptr<Metadata> meatdata, const Pistache::Address &address) : data(meatdata), server(address) {
+    Server(std::shared_ptr<Metadata> meatdata, const Pistache::Address &address) : data(meatdata), queries(std::make_shared<QueryEngine>(meatdata)), server(address) {
       setupRoutes();
     }
 
+    // The engine behind GET /query, so you can give it indexes
+    std::shared_ptr<QueryEngine> queryEngine() {
+      return queries;
+    }
+
     ~Server() {
       if (running) {
 	shutdown();
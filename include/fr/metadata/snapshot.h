@@ -0,0 +1,224 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Background snapshots of a Metadata object.
+ *
+ * toJson holds the Metadata lock for as long as it takes to serialize
+ * the whole thing, which for a big store is long enough that every REST
+ * request piles up behind it. Snapshotter grabs a point-in-time copy of
+ * the ID map (Metadata::snapshot, which only copies pointers) and writes
+ * it out with cereal's portable binary archive on its own thread. The
+ * file is written next to the real one and renamed over it, so there's
+ * always one complete snapshot on disk.
+ *
+ * If you give it the write-ahead log that's attached to the Metadata,
+ * the snapshot records the log position it covers and the log is
+ * trimmed back to just the records after it. Recovery is then "load
+ * the snapshot and replay whatever's left in the log", and the log
+ * never gets longer than one snapshot interval's worth of changes.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/durable.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/wal.h>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace fr::metadata {
+
+  class Snapshotter {
+    std::shared_ptr<Metadata> data;
+    std::string path;
+    std::shared_ptr<WriteAheadLog> wal;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::thread worker;
+    // Number of snapshots asked for and number written
+    uint64_t requested;
+    uint64_t completed;
+    bool stopping;
+    // Zero means only snapshot on request
+    std::chrono::milliseconds period;
+    // Message from the last snapshot that failed, if any
+    std::string lastError;
+    // Held for the whole of a snapshot, from copying the ID map to
+    // trimming the log, so the worker and snapshotNow callers take
+    // turns. They all write the same temporary file, and a snapshot
+    // that finished after a newer one would put an older file in place
+    // of one the log has already been trimmed behind.
+    std::mutex snapshotMtx;
+    // The log position the snapshot on disk covers
+    uint64_t covered;
+
+    void run() {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!stopping) {
+	if (requested == completed) {
+	  if (period.count() > 0) {
+	    if (!cv.wait_for(lock, period, [this]() { return stopping || requested != completed; })) {
+	      // Timed out, so it's time for a periodic one
+	      requested++;
+	    }
+	  } else {
+	    cv.wait(lock, [this]() { return stopping || requested != completed; });
+	  }
+	  continue;
+	}
+	// Anything requested up to now is covered by this snapshot
+	uint64_t target = requested;
+	lock.unlock();
+	std::string error;
+	try {
+	  snapshotNow();
+	} catch (std::exception& e) {
+	  error = e.what();
+	}
+	lock.lock();
+	lastError = error;
+	completed = target;
+	cv.notify_all();
+      }
+    }
+
+  public:
+
+    // Snapshots of data go to path. wal should be the log attached to
+    // data, if there is one. If period is non-zero a snapshot is taken
+    // that often, otherwise only when you call request().
+    Snapshotter(std::shared_ptr<Metadata> data, const std::string& path,
+		std::shared_ptr<WriteAheadLog> wal = nullptr,
+		std::chrono::milliseconds period = std::chrono::milliseconds(0)) :
+      data(data), path(path), wal(wal), requested(0), completed(0), stopping(false),
+      period(period), covered(0) {
+      worker = std::thread([this]() { run(); });
+    }
+
+    Snapshotter(const Snapshotter&) = delete;
+    Snapshotter& operator=(const Snapshotter&) = delete;
+
+    ~Snapshotter() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stopping = true;
+      }
+      cv.notify_all();
+      worker.join();
+    }
+
+    // Ask for a snapshot in the background. Returns right away. If one
+    // is already being written, another is taken once it's done.
+    void request() {
+      std::lock_guard<std::mutex> lock(mtx);
+      requested++;
+      cv.notify_all();
+    }
+
+    // Wait for every snapshot requested so far to finish. Throws if the
+    // last one failed.
+    void wait() {
+      std::unique_lock<std::mutex> lock(mtx);
+      uint64_t target = requested;
+      cv.wait(lock, [this, target]() { return completed >= target || stopping; });
+      if (!lastError.empty()) {
+	throw std::runtime_error(lastError);
+      }
+    }
+
+    // Take a snapshot on the calling thread. The Metadata lock is only
+    // held long enough to copy the ID map. Returns the log position the
+    // snapshot covers (0 if there's no log.) Waits for any snapshot
+    // the worker (or another thread) is already writing.
+    uint64_t snapshotNow() {
+      std::lock_guard<std::mutex> lock(snapshotMtx);
+      uint64_t lsn = 0;
+      Metadata::MetadataMap stores = data->snapshot([this, &lsn]() {
+	if (wal) {
+	  lsn = wal->lastLsn();
+	}
+      });
+      write(path, stores, lsn);
+      // The log is never trimmed back past what the file on disk covers
+      covered = std::max(covered, lsn);
+      if (wal) {
+	wal->truncateThrough(covered);
+      }
+      return lsn;
+    }
+
+    // Write stores to a snapshot file at path, atomically replacing
+    // whatever was there.
+    static void write(const std::string& path, const Metadata::MetadataMap& stores, uint64_t lsn) {
+      std::string tmpPath = path + ".tmp";
+      {
+	std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+	if (!out) {
+	  throw std::runtime_error(std::format("Unable to create snapshot file '{}'", tmpPath));
+	}
+	cereal::PortableBinaryOutputArchive archive(out);
+	archive(lsn, stores);
+	out.flush();
+	if (!out) {
+	  throw std::runtime_error(std::format("Unable to write snapshot file '{}'", tmpPath));
+	}
+      }
+      // Throws if the snapshot didn't make it to disk, so snapshotNow
+      // never trims the log on the strength of one that didn't
+      durable::replace(tmpPath, path);
+    }
+
+    // Load a snapshot into m, replacing whatever was there. Returns the
+    // log position the snapshot covers.
+    static uint64_t load(const std::string& path, Metadata& m) {
+      std::ifstream in(path, std::ios::binary);
+      if (!in) {
+	throw std::runtime_error(std::format("Unable to open snapshot file '{}'", path));
+      }
+      uint64_t lsn;
+      Metadata::MetadataMap stores;
+      {
+	cereal::PortableBinaryInputArchive archive(in);
+	archive(lsn, stores);
+      }
+      m.restore(std::move(stores));
+      return lsn;
+    }
+
+    // Bring m back to where it was: load the snapshot (if there is one)
+    // and replay the log records that came after it. Returns the last
+    // LSN applied.
+    static uint64_t recover(const std::string& snapshotPath, const std::string& walPath, Metadata& m) {
+      uint64_t lsn = 0;
+      if (std::filesystem::exists(snapshotPath)) {
+	lsn = load(snapshotPath, m);
+      }
+      return WriteAheadLog::replay(walPath, m, lsn);
+    }
+
+  };
+
+}
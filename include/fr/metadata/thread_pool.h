@@ -0,0 +1,106 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A plain fixed-size thread pool. Hand it a callable with submit() and
+ * you get a std::future back for the result.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace fr::metadata {
+
+  class ThreadPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping;
+
+    void work() {
+      while (true) {
+	std::function<void()> task;
+	{
+	  std::unique_lock<std::mutex> lock(mtx);
+	  cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+	  if (tasks.empty()) {
+	    // Only get here when stopping and everything's done
+	    return;
+	  }
+	  task = std::move(tasks.front());
+	  tasks.pop_front();
+	}
+	task();
+      }
+    }
+
+  public:
+
+    // 0 threads means one per core
+    ThreadPool(size_t nthreads = 0) : stopping(false) {
+      if (nthreads == 0) {
+	nthreads = std::max(1u, std::thread::hardware_concurrency());
+      }
+      for (size_t i = 0; i < nthreads; ++i) {
+	workers.emplace_back([this]() { work(); });
+      }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Anything already submitted gets run before the workers exit
+    ~ThreadPool() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stopping = true;
+      }
+      cv.notify_all();
+      for (auto& worker : workers) {
+	worker.join();
+      }
+    }
+
+    size_t size() const {
+      return workers.size();
+    }
+
+    template <typename Fn>
+    auto submit(Fn&& fn) -> std::future<std::invoke_result_t<Fn>> {
+      using Result = std::invoke_result_t<Fn>;
+      // std::function has to be copyable and packaged_task isn't, hence
+      // the shared pointer
+      auto task = std::make_shared<std::packaged_task<Result()>>(std::forward<Fn>(fn));
+      std::future<Result> result = task->get_future();
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	tasks.emplace_back([task]() { (*task)(); });
+      }
+      cv.notify_one();
+      return result;
+    }
+  };
+
+}
@@ -0,0 +1,433 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Hot/cold tiering for Metadata.
+ *
+ * Most of the time a handful of IDs get nearly all the traffic and the
+ * rest just sit there taking up RAM. ColdTier is a compressed on-disk
+ * home for those. It plugs into Metadata as a writable StoreSource, so
+ * Metadata::demoteCold can push idle stores out to it and they're
+ * faulted back in (promoted) the next time anyone touches them, all
+ * behind the usual Metadata API.
+ *
+ * The tier is one append-only file of zlib-compressed stores with an
+ * in-memory index of where each ID's latest copy lives. Demoting an ID
+ * again appends a new copy; the old one is garbage until compact()
+ * rewrites the file. It's scratch space, not persistence -- the file
+ * starts empty and is removed when the tier goes away. Use the
+ * write-ahead log and snapshots for durability; snapshots read cold
+ * stores back out of the tier like any other lazily loaded store.
+ *
+ * TierManager runs demoteCold (and compact) on a timer, so that's all
+ * you need for it to happen automatically.
+ *
+ * Record layout (integers little-endian):
+ *
+ *   u32 payload length | u32 crc32 of payload |
+ *   payload: string id | varint uncompressed size | compressed bytes
+ *
+ * The uncompressed store is a varint key count followed by each key and
+ * value as strings (values in their Value::toText form.)
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/metadata.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <zlib.h>
+
+namespace fr::metadata {
+
+  class ColdTier : public Metadata::StoreSource {
+  public:
+
+    struct Stats {
+      uint64_t ids = 0;          // IDs with a copy in the tier
+      uint64_t fileBytes = 0;    // Size of the tier file
+      uint64_t liveBytes = 0;    // ... of which is current copies
+      uint64_t rawBytes = 0;     // Uncompressed size of the current copies
+      uint64_t saves = 0;
+      uint64_t loads = 0;
+      uint64_t compactions = 0;
+
+      double compressionRatio() const {
+	return liveBytes ? static_cast<double>(rawBytes) / liveBytes : 0.0;
+      }
+    };
+
+  private:
+
+    struct Location {
+      uint64_t offset;
+      uint32_t length;   // Whole record, header included
+      uint64_t rawSize;
+    };
+
+    static constexpr size_t recordHeaderSize = 8;
+
+    std::string path;
+    int level;
+    int fd;
+    uint64_t fileSize;
+    std::unordered_map<std::string, Location> index;
+    Stats counters;
+    std::mutex mtx;
+    // IDs forgotten but not dropped from the index yet. forget is called
+    // with the Metadata lock held and mtx can be held for a whole
+    // compaction, so forget only takes forgetMtx and leaves the rest to
+    // whoever takes mtx next.
+    std::mutex forgetMtx;
+    std::vector<std::string> forgotten;
+
+    static int openFile(const std::string& name) {
+      int handle = ::open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+      if (handle < 0) {
+	throw std::runtime_error(std::format("Unable to open cold tier file '{}' (errno {})", name, errno));
+      }
+      return handle;
+    }
+
+    static void writeAll(int handle, const std::string& data, uint64_t offset, const std::string& name) {
+      size_t written = 0;
+      while (written < data.size()) {
+	ssize_t n = ::pwrite(handle, data.data() + written, data.size() - written, offset + written);
+	if (n < 0) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+	  throw std::runtime_error(std::format("Unable to write cold tier file '{}' (errno {})", name, errno));
+	}
+	written += n;
+      }
+    }
+
+    static std::string readAt(int handle, uint64_t offset, size_t length, const std::string& name) {
+      std::string data(length, '\0');
+      size_t got = 0;
+      while (got < length) {
+	ssize_t n = ::pread(handle, data.data() + got, length - got, offset + got);
+	if (n < 0 && errno == EINTR) {
+	  continue;
+	}
+	if (n <= 0) {
+	  throw std::runtime_error(std::format("Unable to read cold tier file '{}' (errno {})", name, errno));
+	}
+	got += n;
+      }
+      return data;
+    }
+
+    // Build a complete record for id holding store
+    std::string encode(const std::string& id, const Metadata::DataType& store, uint64_t& rawSize) const {
+      std::string raw;
+      codec::putVarint(raw, store.size());
+      for (const auto& [key, value] : store) {
+	codec::putString(raw, key);
+	codec::putString(raw, value.toText());
+      }
+      rawSize = raw.size();
+      uLongf compressedSize = ::compressBound(raw.size());
+      std::string compressed(compressedSize, '\0');
+      int result = ::compress2(reinterpret_cast<Bytef *>(compressed.data()), &compressedSize,
+			       reinterpret_cast<const Bytef *>(raw.data()), raw.size(), level);
+      if (result != Z_OK) {
+	throw std::runtime_error(std::format("Unable to compress store '{}' (zlib error {})", id, result));
+      }
+      compressed.resize(compressedSize);
+
+      std::string record(recordHeaderSize, '\0');
+      codec::putString(record, id);
+      codec::putVarint(record, raw.size());
+      record.append(compressed);
+      std::string_view payload(record.data() + recordHeaderSize, record.size() - recordHeaderSize);
+      codec::patchU32(record, 0, payload.size());
+      codec::patchU32(record, 4, codec::crc32(payload));
+      return record;
+    }
+
+    Metadata::Data decode(const std::string& id, const std::string& record) const {
+      std::string_view payload(record.data() + recordHeaderSize, record.size() - recordHeaderSize);
+      if (codec::crc32(payload) != codec::getU32(record.data() + 4)) {
+	throw std::runtime_error(std::format("Cold tier record for '{}' is corrupt", id));
+      }
+      codec::Reader reader(payload);
+      std::string_view storedId;
+      uint64_t rawSize;
+      if (!reader.getString(storedId) || storedId != id || !reader.getVarint(rawSize)) {
+	throw std::runtime_error(std::format("Cold tier record for '{}' is corrupt", id));
+      }
+      std::string raw(rawSize, '\0');
+      uLongf rawLength = rawSize;
+      const char *compressed = payload.data() + (payload.size() - reader.remaining());
+      int result = ::uncompress(reinterpret_cast<Bytef *>(raw.data()), &rawLength,
+				reinterpret_cast<const Bytef *>(compressed), reader.remaining());
+      if (result != Z_OK || rawLength != rawSize) {
+	throw std::runtime_error(std::format("Unable to decompress store '{}' (zlib error {})", id, result));
+      }
+      auto store = std::make_shared<Metadata::DataType>();
+      codec::Reader storeReader(raw);
+      uint64_t count;
+      if (!storeReader.getVarint(count)) {
+	throw std::runtime_error(std::format("Cold tier record for '{}' is corrupt", id));
+      }
+      for (uint64_t i = 0; i < count; ++i) {
+	std::string key;
+	std::string value;
+	if (!storeReader.getString(key) || !storeReader.getString(value)) {
+	  throw std::runtime_error(std::format("Cold tier record for '{}' is corrupt", id));
+	}
+	store->emplace_hint(store->end(), std::move(key), Value::fromText(std::move(value)));
+      }
+      return store;
+    }
+
+    // Drop forgotten IDs from the index. Call with mtx held.
+    void dropForgotten() {
+      std::vector<std::string> ids;
+      {
+	std::lock_guard<std::mutex> lock(forgetMtx);
+	ids.swap(forgotten);
+      }
+      for (const auto& id : ids) {
+	auto itr = index.find(id);
+	if (itr != index.end()) {
+	  counters.liveBytes -= itr->second.length;
+	  counters.rawBytes -= itr->second.rawSize;
+	  index.erase(itr);
+	}
+      }
+    }
+
+  public:
+
+    // level is the zlib compression level. The default (1) is the
+    // fastest, since promotions are on somebody's read path.
+    ColdTier(const std::string& path, int level = Z_BEST_SPEED) :
+      path(path), level(level), fd(openFile(path)), fileSize(0) {
+    }
+
+    ColdTier(const ColdTier&) = delete;
+    ColdTier& operator=(const ColdTier&) = delete;
+
+    ~ColdTier() override {
+      ::close(fd);
+      ::unlink(path.c_str());
+    }
+
+    Metadata::Data load(const std::string& id) override {
+      std::string record;
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	dropForgotten();
+	auto itr = index.find(id);
+	if (itr == index.end()) {
+	  return nullptr;
+	}
+	record = readAt(fd, itr->second.offset, itr->second.length, path);
+	counters.loads++;
+      }
+      // Decompressing doesn't need the lock
+      return decode(id, record);
+    }
+
+    bool writable() const override {
+      return true;
+    }
+
+    void save(const std::string& id, const Metadata::DataType& store) override {
+      uint64_t rawSize;
+      std::string record = encode(id, store, rawSize);
+      std::lock_guard<std::mutex> lock(mtx);
+      // A forget that came in before this save is older than it, so it
+      // has to be dropped first or it would drop this copy later
+      dropForgotten();
+      writeAll(fd, record, fileSize, path);
+      auto itr = index.find(id);
+      if (itr != index.end()) {
+	counters.liveBytes -= itr->second.length;
+	counters.rawBytes -= itr->second.rawSize;
+      }
+      index[id] = Location{fileSize, static_cast<uint32_t>(record.size()), rawSize};
+      fileSize += record.size();
+      counters.liveBytes += record.size();
+      counters.rawBytes += rawSize;
+      counters.saves++;
+    }
+
+    // Doesn't wait for a compaction. The ID is dropped from the index
+    // the next time anything else takes the tier's lock.
+    void forget(const std::string& id) override {
+      std::lock_guard<std::mutex> lock(forgetMtx);
+      forgotten.push_back(id);
+    }
+
+    // Rewrite the file with just the current copies if at least
+    // garbageRatio of it is stale. Loads and saves wait while this
+    // runs. Returns true if it compacted.
+    bool compact(double garbageRatio = 0.5) {
+      std::lock_guard<std::mutex> lock(mtx);
+      dropForgotten();
+      if (fileSize == 0 || fileSize - counters.liveBytes < garbageRatio * fileSize) {
+	return false;
+      }
+      std::string tmpPath = path + ".tmp";
+      int out = openFile(tmpPath);
+      uint64_t offset = 0;
+      // The index keeps pointing into the old file until the new one
+      // has replaced it, so a failure part way through loses nothing
+      std::unordered_map<std::string, uint64_t> moved;
+      moved.reserve(index.size());
+      try {
+	for (const auto& [id, location] : index) {
+	  std::string record = readAt(fd, location.offset, location.length, path);
+	  writeAll(out, record, offset, tmpPath);
+	  moved.emplace(id, offset);
+	  offset += record.size();
+	}
+	if (::rename(tmpPath.c_str(), path.c_str()) != 0) {
+	  throw std::runtime_error(std::format("Unable to rename '{}' to '{}' (errno {})", tmpPath, path, errno));
+	}
+      } catch (...) {
+	::close(out);
+	::unlink(tmpPath.c_str());
+	throw;
+      }
+      for (auto& [id, location] : index) {
+	location.offset = moved[id];
+      }
+      ::close(fd);
+      fd = out;
+      fileSize = offset;
+      counters.compactions++;
+      // Whatever was forgotten while this ran
+      dropForgotten();
+      return true;
+    }
+
+    Stats stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      dropForgotten();
+      Stats current = counters;
+      current.ids = index.size();
+      current.fileBytes = fileSize;
+      return current;
+    }
+
+    const std::string& filename() const {
+      return path;
+    }
+  };
+
+  /**
+   * Runs the demotion sweep on a timer. Every period, stores used fewer
+   * than threshold times since the last couple of sweeps go out to the
+   * tier, and the tier is compacted if it's mostly garbage.
+   */
+
+  class TierManager {
+    std::shared_ptr<Metadata> data;
+    std::shared_ptr<ColdTier> tier;
+    std::chrono::milliseconds period;
+    uint32_t threshold;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping;
+    uint64_t sweeps;
+    std::string lastError;
+    std::thread worker;
+
+    void run() {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!stopping) {
+	if (cv.wait_for(lock, period, [this]() { return stopping; })) {
+	  break;
+	}
+	lock.unlock();
+	std::string error;
+	try {
+	  sweep();
+	} catch (std::exception& e) {
+	  error = e.what();
+	}
+	lock.lock();
+	lastError = error;
+	sweeps++;
+	cv.notify_all();
+      }
+    }
+
+  public:
+
+    // Attaches tier to data as its source and turns on access
+    // tracking. This replaces any source already attached, so it
+    // doesn't mix with lazy loading from somewhere else. If that
+    // source still has stores data hasn't loaded, this throws rather
+    // than lose them (see Metadata::attachSource.)
+    TierManager(std::shared_ptr<Metadata> data, std::shared_ptr<ColdTier> tier,
+		std::chrono::milliseconds period = std::chrono::seconds(10),
+		uint32_t threshold = 1) :
+      data(data), tier(tier), period(period), threshold(threshold), stopping(false), sweeps(0) {
+      data->attachSource(tier, {});
+      data->setAccessTracking(true);
+      worker = std::thread([this]() { run(); });
+    }
+
+    TierManager(const TierManager&) = delete;
+    TierManager& operator=(const TierManager&) = delete;
+
+    ~TierManager() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stopping = true;
+      }
+      cv.notify_all();
+      worker.join();
+    }
+
+    // Run a sweep now on the calling thread. Returns the number of
+    // stores demoted.
+    size_t sweep() {
+      size_t demoted = data->demoteCold(threshold);
+      tier->compact();
+      return demoted;
+    }
+
+    // Number of timed sweeps finished so far. Throws if the last one
+    // failed.
+    uint64_t completedSweeps() {
+      std::lock_guard<std::mutex> lock(mtx);
+      if (!lastError.empty()) {
+	throw std::runtime_error(lastError);
+      }
+      return sweeps;
+    }
+  };
+
+}
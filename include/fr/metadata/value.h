@@ -0,0 +1,301 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * A metadata value: a string, a 64 bit integer, a double, a bool or a
+ * run of raw bytes.
+ *
+ * Everything used to be a string, so numbers got formatted on the way
+ * in and parsed again on every read. A Value keeps them as numbers.
+ * Strings live in a std::string, which keeps short ones inline (up to
+ * 15 bytes in libstdc++) without touching the heap. Numbers share that
+ * same storage rather than sitting next to it, so a Value costs no
+ * more than the string plus a byte saying which one it is. A plain
+ * string converts to a Value implicitly, so code that only ever dealt
+ * in strings doesn't have to care.
+ *
+ * Bytes are different: they're held in a Blob, a reference counted
+ * buffer that never changes once it's made. Copying the Value (into a
+ * snapshot, out of get, across to Python) just copies the pointer, so
+ * a big thumbnail gets stored once and handed around for free. The
+ * Blob takes the string's place in the same storage, so a bytes value
+ * is no bigger than any other.
+ *
+ * Formats that can only hold strings (cereal archives, JSON, the
+ * write-ahead log, the cold tier) use toText and fromText. Plain
+ * strings come out unchanged, so files written before there were types
+ * read the same as they always did. Typed values are a 0x1f (ASCII
+ * unit separator) marker, a letter for the type, then the value:
+ *
+ *   \x1fi42    integer
+ *   \x1fd2.5   double (the shortest form that reads back the same)
+ *   \x1fb1     bool (1 or 0)
+ *   \x1fx...   bytes, base64 encoded so they're safe in JSON
+ *   \x1fs...   a string that happens to start with the marker
+ *
+ * Text that starts with the marker but doesn't parse is taken to be an
+ * ordinary string.
+ */
+
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+
+namespace fr::metadata {
+
+  // An immutable run of bytes, shared by every Value that holds it
+  using Blob = std::shared_ptr<const std::string>;
+
+  class Value {
+  public:
+    enum class Type : uint8_t {
+      String = 0,
+      Int = 1,
+      Double = 2,
+      Bool = 3,
+      Bytes = 4
+    };
+
+    static constexpr char marker = '\x1f';
+
+  private:
+    // The alternatives are in the same order as Type, so the index is
+    // the type
+    std::variant<std::string, int64_t, double, bool, Blob> data;
+
+    [[noreturn]] void wrongType(const char *wanted) const {
+      throw std::runtime_error(std::format("Value is a {}, not a {}", typeName(type()), wanted));
+    }
+
+  public:
+    Value() = default;
+    Value(std::string s) : data(std::move(s)) {}
+    Value(std::string_view s) : data(std::in_place_type<std::string>, s) {}
+    Value(const char *s) : data(std::in_place_type<std::string>, s) {}
+
+    static Value ofInt(int64_t v) {
+      Value value;
+      value.data.emplace<int64_t>(v);
+      return value;
+    }
+
+    static Value ofDouble(double v) {
+      Value value;
+      value.data.emplace<double>(v);
+      return value;
+    }
+
+    static Value ofBool(bool v) {
+      Value value;
+      value.data.emplace<bool>(v);
+      return value;
+    }
+
+    static Value ofBytes(std::string bytes) {
+      return ofBlob(std::make_shared<const std::string>(std::move(bytes)));
+    }
+
+    // Doesn't copy anything. A null blob is taken to be empty.
+    static Value ofBlob(Blob blob) {
+      Value value;
+      value.data.emplace<Blob>(blob ? std::move(blob) : std::make_shared<const std::string>());
+      return value;
+    }
+
+    static const char *typeName(Type type) {
+      switch(type) {
+      case Type::String: return "string";
+      case Type::Int: return "int";
+      case Type::Double: return "double";
+      case Type::Bool: return "bool";
+      case Type::Bytes: return "bytes";
+      }
+      return "unknown";
+    }
+
+    Type type() const {
+      return static_cast<Type>(data.index());
+    }
+
+    // The typed getters throw std::runtime_error if the value is some
+    // other type, except that an int will happily read as a double.
+
+    int64_t asInt() const {
+      if (auto i = std::get_if<int64_t>(&data)) {
+	return *i;
+      }
+      wrongType("int");
+    }
+
+    double asDouble() const {
+      if (auto i = std::get_if<int64_t>(&data)) {
+	return static_cast<double>(*i);
+      }
+      if (auto d = std::get_if<double>(&data)) {
+	return *d;
+      }
+      wrongType("double");
+    }
+
+    bool asBool() const {
+      if (auto b = std::get_if<bool>(&data)) {
+	return *b;
+      }
+      wrongType("bool");
+    }
+
+    // The contents of a string or bytes value, without copying
+    const std::string& bytes() const {
+      if (auto blob = std::get_if<Blob>(&data)) {
+	return **blob;
+      }
+      if (auto text = std::get_if<std::string>(&data)) {
+	return *text;
+      }
+      wrongType("string");
+    }
+
+    // The buffer behind a bytes value, which you can hang on to for as
+    // long as you like after the value itself is gone
+    const Blob& blob() const {
+      if (auto blob = std::get_if<Blob>(&data)) {
+	return *blob;
+      }
+      wrongType("bytes");
+    }
+
+    // What it looks like as a string: strings and bytes as they are,
+    // numbers in decimal and bools as true or false. This is what
+    // Metadata::value hands back.
+    std::string str() const {
+      char buffer[32];
+      switch(type()) {
+      case Type::Int:
+	return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), std::get<int64_t>(data)).ptr);
+      case Type::Double:
+	return std::string(buffer, std::to_chars(buffer, buffer + sizeof(buffer), std::get<double>(data)).ptr);
+      case Type::Bool:
+	return std::get<bool>(data) ? "true" : "false";
+      default:
+	return bytes();
+      }
+    }
+
+    std::string toText() const {
+      switch(type()) {
+      case Type::Int:
+	return std::string{marker, 'i'} + str();
+      case Type::Double:
+	return std::string{marker, 'd'} + str();
+      case Type::Bool:
+	return std::string{marker, 'b', std::get<bool>(data) ? '1' : '0'};
+      case Type::Bytes:
+	return std::string{marker, 'x'} + codec::base64Encode(bytes());
+      default: {
+	const std::string& text = std::get<std::string>(data);
+	if (!text.empty() && text[0] == marker) {
+	  return std::string{marker, 's'} + text;
+	}
+	return text;
+      }
+      }
+    }
+
+    static Value fromText(std::string_view text) {
+      if (text.size() < 2 || text[0] != marker) {
+	return Value(text);
+      }
+      std::string_view rest = text.substr(2);
+      const char *end = rest.data() + rest.size();
+      switch(text[1]) {
+      case 's':
+	return Value(rest);
+      case 'i': {
+	int64_t v;
+	auto [ptr, ec] = std::from_chars(rest.data(), end, v);
+	if (ec == std::errc() && ptr == end) {
+	  return ofInt(v);
+	}
+	break;
+      }
+      case 'd': {
+	double v;
+	auto [ptr, ec] = std::from_chars(rest.data(), end, v);
+	if (ec == std::errc() && ptr == end) {
+	  return ofDouble(v);
+	}
+	break;
+      }
+      case 'b':
+	if (rest == "1" || rest == "0") {
+	  return ofBool(rest == "1");
+	}
+	break;
+      case 'x': {
+	std::string bytes;
+	if (codec::base64Decode(rest, bytes)) {
+	  return ofBytes(std::move(bytes));
+	}
+	break;
+      }
+      }
+      return Value(text);
+    }
+
+    // Same thing, but plain strings (nearly everything) are moved in
+    // rather than copied
+    static Value fromText(std::string&& text) {
+      if (text.size() < 2 || text[0] != marker) {
+	return Value(std::move(text));
+      }
+      return fromText(std::string_view(text));
+    }
+
+    bool operator==(const Value& other) const {
+      if (data.index() != other.data.index()) {
+	return false;
+      }
+      if (auto blob = std::get_if<Blob>(&data)) {
+	const Blob& theirs = std::get<Blob>(other.data);
+	return *blob == theirs || **blob == *theirs;
+      }
+      return data == other.data;
+    }
+  };
+
+  // The whole point of sharing the storage
+  static_assert(sizeof(Value) <= sizeof(std::string) + sizeof(int64_t));
+
+  // cereal stores a Value as its text form, so archives written before
+  // there were types still load
+  template <class Archive>
+  std::string save_minimal(const Archive&, const Value& value) {
+    return value.toText();
+  }
+
+  template <class Archive>
+  void load_minimal(const Archive&, Value& value, const std::string& text) {
+    value = Value::fromText(text);
+  }
+
+}
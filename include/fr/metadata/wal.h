@@ -0,0 +1,574 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * An append-only write-ahead log for Metadata. Hook one up to a
+ * Metadata with addListener and every add, update and erase gets
+ * written to disk as a small binary record. If the process goes
+ * away, replay() puts it all back.
+ *
+ * The file starts with an 8 byte magic string and the u64 LSN of the
+ * last record trimmed off the front of the log (see truncateThrough),
+ * so LSNs keep counting up even when the log is empty. After that
+ * each record on disk looks like:
+ *
+ *   u32 payload length | u32 crc32 of payload | payload
+ *
+ * and the payload is:
+ *
+ *   u64 lsn | u8 op | string id | string key | string value
+ *
+ * with strings stored as a varint length and the bytes (see codec.h.)
+ * The checksum lets replay tell the difference between the end of the
+ * log and a record that was only half written when the power went out.
+ *
+ * Writers don't each get their own write and fdatasync. Records pile
+ * up in a pending buffer and whichever writer gets to the disk first
+ * writes everyone's records out with one write and one fdatasync
+ * ("group commit.") How long a writer waits is up to the Durability
+ * setting.
+ *
+ * If a write fails, the file is cut back to the last good record and
+ * the batch is tried again on the next flush. If an fdatasync fails
+ * (or the cut does), the log is marked failed and every writer waiting
+ * on it from then on gets an exception, since there's no knowing what
+ * actually reached the disk.
+ *
+ * Bulk loads (fromJson and friends) don't go through the listener
+ * interface and aren't logged.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fcntl.h>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/codec.h>
+#include <fr/metadata/durable.h>
+#include <fr/metadata/metadata.h>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+namespace fr::metadata {
+
+  class WriteAheadLog : public MutationListener {
+  public:
+
+    enum class Durability {
+      // Every change gets its own write and fdatasync before the
+      // Metadata call returns. Slowest, but nothing is ever batched.
+      PerOperation,
+      // Changes are batched with whatever other threads are writing
+      // at the same time. The Metadata call still doesn't return until
+      // its record is on disk.
+      PerBatch,
+      // A background thread flushes every interval. Metadata calls
+      // return immediately, so you can lose up to an interval's worth
+      // of changes in a crash.
+      Interval
+    };
+
+    struct Stats {
+      uint64_t records = 0;  // Records logged
+      uint64_t writes = 0;   // write() calls made
+      uint64_t syncs = 0;    // fdatasync() calls made
+      uint64_t bytes = 0;    // Bytes written
+    };
+
+    // Every log file starts with this
+    static constexpr std::string_view fileMagic = "FRWAL001";
+
+  private:
+
+    // Length and checksum in front of every record
+    static constexpr size_t frameHeaderSize = 8;
+    // Magic and base LSN at the start of the file
+    static constexpr size_t fileHeaderSize = 16;
+
+    std::string path;
+    Durability durability;
+    std::chrono::milliseconds interval;
+    int fd;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    // Records that have been handed to us but not written yet
+    std::string pending;
+    // Next LSN to hand out
+    uint64_t nextLsn;
+    // Everything up to and including this LSN is on disk
+    uint64_t durableLsn;
+    // Where the last good record ends in the file
+    off_t fileEnd;
+    // Somebody is currently writing a batch out
+    bool flushing;
+    bool stopping;
+    // Set once the log can't be trusted any more. Every wait for
+    // durability throws this from then on.
+    std::string failure;
+    Stats counters;
+    std::thread flusher;
+
+    static void writeAll(int fd, const char *data, size_t size) {
+      while (size > 0) {
+	ssize_t written = ::write(fd, data, size);
+	if (written < 0) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+	  throw std::runtime_error(std::format("Write-ahead log write failed (errno {})", errno));
+	}
+	data += written;
+	size -= written;
+      }
+    }
+
+    // Pull one framed record out of a buffer. Returns false if the
+    // frame is short or fails its checksum. On success payload holds
+    // the record payload and size is the total frame size.
+    static bool readFrame(std::string_view buffer, std::string_view& payload, size_t& size) {
+      if (buffer.size() < frameHeaderSize) {
+	return false;
+      }
+      uint32_t length = codec::getU32(buffer.data());
+      uint32_t crc = codec::getU32(buffer.data() + 4);
+      if (buffer.size() - frameHeaderSize < length) {
+	return false;
+      }
+      payload = buffer.substr(frameHeaderSize, length);
+      if (codec::crc32(payload) != crc) {
+	return false;
+      }
+      size = frameHeaderSize + length;
+      return true;
+    }
+
+    struct Record {
+      uint64_t lsn;
+      Op op;
+      std::string_view id;
+      std::string_view key;
+      std::string_view value;
+    };
+
+    static bool decode(std::string_view payload, Record& record) {
+      codec::Reader reader(payload);
+      uint8_t op;
+      if (!reader.getU64(record.lsn) || !reader.getU8(op) ||
+	  !reader.getString(record.id) || !reader.getString(record.key) ||
+	  !reader.getString(record.value)) {
+	return false;
+      }
+      if (op < static_cast<uint8_t>(Op::AddId) || op > static_cast<uint8_t>(Op::Set)) {
+	return false;
+      }
+      record.op = static_cast<Op>(op);
+      return true;
+    }
+
+    static std::string readFile(const std::string& path) {
+      std::string contents;
+      int in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (in < 0) {
+	if (errno == ENOENT) {
+	  return contents;
+	}
+	throw std::runtime_error(std::format("Unable to open write-ahead log '{}' (errno {})", path, errno));
+      }
+      char buffer[65536];
+      ssize_t got;
+      while ((got = ::read(in, buffer, sizeof(buffer))) != 0) {
+	if (got < 0) {
+	  if (errno == EINTR) {
+	    continue;
+	  }
+	  ::close(in);
+	  throw std::runtime_error(std::format("Unable to read write-ahead log '{}' (errno {})", path, errno));
+	}
+	contents.append(buffer, got);
+      }
+      ::close(in);
+      return contents;
+    }
+
+    static std::string fileHeader(uint64_t baseLsn) {
+      std::string header(fileMagic);
+      codec::putU64(header, baseLsn);
+      return header;
+    }
+
+    // Walk every good record in a log. Returns the offset just past
+    // the last good record, which is where new records should go, and
+    // sets baseLsn from the file header.
+    template <typename Fn>
+    static size_t scan(const std::string& contents, const std::string& path, uint64_t& baseLsn, Fn&& fn) {
+      baseLsn = 0;
+      if (contents.size() < fileHeaderSize) {
+	return 0;
+      }
+      if (std::string_view(contents).substr(0, fileMagic.size()) != fileMagic) {
+	throw std::runtime_error(std::format("'{}' is not a write-ahead log", path));
+      }
+      baseLsn = codec::getU64(contents.data() + fileMagic.size());
+      size_t offset = fileHeaderSize;
+      std::string_view remaining(contents);
+      std::string_view payload;
+      size_t frameSize;
+      Record record;
+      while (readFrame(remaining.substr(offset), payload, frameSize) && decode(payload, record)) {
+	fn(record);
+	offset += frameSize;
+      }
+      return offset;
+    }
+
+    // Write one batch out. Call with mtx held and flushing set by the
+    // caller; the lock is dropped for the actual I/O.
+    void flushBatch(std::unique_lock<std::mutex>& lock) {
+      std::string batch;
+      uint64_t batchEnd;
+      if (durability == Durability::PerOperation) {
+	// Just the first record. It's always the oldest one.
+	size_t frameSize = frameHeaderSize + codec::getU32(pending.data());
+	batch = pending.substr(0, frameSize);
+	pending.erase(0, frameSize);
+	batchEnd = durableLsn + 1;
+      } else {
+	batch.swap(pending);
+	batchEnd = nextLsn - 1;
+      }
+      lock.unlock();
+      try {
+	writeAll(fd, batch.data(), batch.size());
+      } catch (std::exception& e) {
+	// Part of the batch may be in the file, and replay stops at the
+	// first torn frame, so anything written after it would be lost.
+	// Cut it back to the last good record before the next flush has
+	// another go at it. If even that fails, give up on the log.
+	bool trimmed = ::ftruncate(fd, fileEnd) == 0 && ::lseek(fd, fileEnd, SEEK_SET) == fileEnd;
+	lock.lock();
+	if (trimmed) {
+	  pending.insert(0, batch);
+	} else {
+	  failure = std::format("{}, and the torn record couldn't be trimmed off (errno {})", e.what(), errno);
+	}
+	flushing = false;
+	cv.notify_all();
+	throw;
+      }
+      if (::fdatasync(fd) != 0) {
+	// After a failed fdatasync there's no telling what made it to
+	// disk (the kernel may have dropped the dirty pages), so trying
+	// again could report records as durable that aren't
+	lock.lock();
+	failure = std::format("Write-ahead log fdatasync failed (errno {})", errno);
+	flushing = false;
+	cv.notify_all();
+	throw std::runtime_error(failure);
+      }
+      lock.lock();
+      counters.writes++;
+      counters.syncs++;
+      counters.bytes += batch.size();
+      fileEnd += batch.size();
+      durableLsn = batchEnd;
+      flushing = false;
+      cv.notify_all();
+    }
+
+    // Wait until lsn is on disk, writing a batch out ourselves if
+    // nobody else is.
+    void waitDurable(std::unique_lock<std::mutex>& lock, uint64_t lsn) {
+      while (durableLsn < lsn) {
+	if (!failure.empty()) {
+	  throw std::runtime_error(failure);
+	}
+	if (!flushing) {
+	  flushing = true;
+	  flushBatch(lock);
+	} else {
+	  cv.wait(lock);
+	}
+      }
+    }
+
+    void flushLoop() {
+      std::unique_lock<std::mutex> lock(mtx);
+      while (!stopping) {
+	cv.wait_for(lock, interval);
+	if (!pending.empty() && !flushing && failure.empty()) {
+	  flushing = true;
+	  try {
+	    flushBatch(lock);
+	  } catch (std::exception& e) {
+	    // The records are still pending, so the next interval (or the
+	    // sync() in the destructor) will try again.
+	  }
+	}
+      }
+    }
+
+  public:
+
+    // Opens (or creates) the log at path. If the log already exists,
+    // new records are appended after the last good one and anything
+    // torn off the end is discarded. Replay the log into your Metadata
+    // before you hook this up to it.
+    WriteAheadLog(const std::string& path, Durability durability = Durability::PerBatch,
+		  std::chrono::milliseconds interval = std::chrono::milliseconds(10)) :
+      path(path), durability(durability), interval(interval), fd(-1), nextLsn(1),
+      durableLsn(0), fileEnd(0), flushing(false), stopping(false) {
+      std::string contents = readFile(path);
+      uint64_t baseLsn;
+      uint64_t lastLsn = 0;
+      size_t goodEnd = scan(contents, path, baseLsn, [&lastLsn](const Record& record) {
+	lastLsn = record.lsn;
+      });
+      lastLsn = std::max(lastLsn, baseLsn);
+      fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+      if (fd < 0) {
+	throw std::runtime_error(std::format("Unable to open write-ahead log '{}' (errno {})", path, errno));
+      }
+      if (goodEnd == 0) {
+	// New (or too short to even hold the header)
+	if (::ftruncate(fd, 0) != 0) {
+	  ::close(fd);
+	  throw std::runtime_error(std::format("Unable to truncate write-ahead log '{}'", path));
+	}
+	std::string header = fileHeader(0);
+	writeAll(fd, header.data(), header.size());
+	goodEnd = header.size();
+      } else if (goodEnd < contents.size() && ::ftruncate(fd, goodEnd) != 0) {
+	::close(fd);
+	throw std::runtime_error(std::format("Unable to trim torn records from write-ahead log '{}'", path));
+      }
+      if (::lseek(fd, goodEnd, SEEK_SET) < 0 || ::fdatasync(fd) != 0) {
+	int error = errno;
+	::close(fd);
+	throw std::runtime_error(std::format("Unable to sync write-ahead log '{}' (errno {})", path, error));
+      }
+      if (contents.empty()) {
+	try {
+	  durable::syncParent(path);
+	} catch (...) {
+	  ::close(fd);
+	  throw;
+	}
+      }
+      fileEnd = goodEnd;
+      nextLsn = lastLsn + 1;
+      durableLsn = lastLsn;
+      if (durability == Durability::Interval) {
+	flusher = std::thread([this]() { flushLoop(); });
+      }
+    }
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    ~WriteAheadLog() {
+      {
+	std::lock_guard<std::mutex> lock(mtx);
+	stopping = true;
+      }
+      cv.notify_all();
+      if (flusher.joinable()) {
+	flusher.join();
+      }
+      try {
+	sync();
+      } catch (std::exception& e) {
+	// Nothing useful to be done about it in a destructor
+      }
+      ::close(fd);
+    }
+
+    // Called by Metadata with its lock held. Encodes the record into
+    // the pending buffer and hands back its LSN.
+    uint64_t record(Op op, const std::string& id, const std::string& key,
+		    const std::string& value) override {
+      std::lock_guard<std::mutex> lock(mtx);
+      uint64_t lsn = nextLsn++;
+      size_t start = pending.size();
+      // Reserve room for the length and checksum
+      codec::putU64(pending, 0);
+      codec::putU64(pending, lsn);
+      codec::putU8(pending, static_cast<uint8_t>(op));
+      codec::putString(pending, id);
+      codec::putString(pending, key);
+      codec::putString(pending, value);
+      std::string_view payload(pending.data() + start + frameHeaderSize,
+			       pending.size() - start - frameHeaderSize);
+      codec::patchU32(pending, start, payload.size());
+      codec::patchU32(pending, start + 4, codec::crc32(payload));
+      counters.records++;
+      return lsn;
+    }
+
+    // Called by Metadata after it drops its lock
+    void commit(uint64_t lsn) override {
+      if (durability == Durability::Interval) {
+	return;
+      }
+      std::unique_lock<std::mutex> lock(mtx);
+      waitDurable(lock, lsn);
+    }
+
+    // Get everything logged so far onto disk
+    void sync() {
+      std::unique_lock<std::mutex> lock(mtx);
+      waitDurable(lock, nextLsn - 1);
+    }
+
+    // LSN of the most recent record handed to the log
+    uint64_t lastLsn() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return nextLsn - 1;
+    }
+
+    Stats stats() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return counters;
+    }
+
+    // True once a write couldn't be undone or an fdatasync failed.
+    // Nothing logged after that is waited on; it all throws instead.
+    bool failed() {
+      std::lock_guard<std::mutex> lock(mtx);
+      return !failure.empty();
+    }
+
+    const std::string& filename() const {
+      return path;
+    }
+
+    // Drop every record at or below lsn from the log. Once a snapshot
+    // covering those records is safely on disk they're dead weight,
+    // and getting rid of them keeps replay time bounded. The records
+    // worth keeping are copied to a new file which is renamed over the
+    // old one. Writers can keep handing us records while this happens;
+    // they just wait a bit longer for them to hit the disk.
+    void truncateThrough(uint64_t lsn) {
+      std::unique_lock<std::mutex> lock(mtx);
+      // Take the flushing flag so nobody writes to fd while we work
+      cv.wait(lock, [this]() { return !flushing; });
+      flushing = true;
+      lock.unlock();
+
+      std::string tmpPath = path + ".tmp";
+      int newFd = -1;
+      off_t newEnd = 0;
+      try {
+	std::string contents = readFile(path);
+	uint64_t baseLsn;
+	std::string_view view(contents);
+	size_t offset = fileHeaderSize;
+	std::string records;
+	scan(contents, path, baseLsn, [&](const Record& record) {
+	  size_t frameSize = frameHeaderSize + codec::getU32(view.data() + offset);
+	  if (record.lsn > lsn) {
+	    records.append(view.substr(offset, frameSize));
+	  }
+	  offset += frameSize;
+	});
+	std::string kept = fileHeader(std::max(baseLsn, lsn));
+	kept.append(records);
+	newEnd = kept.size();
+	newFd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (newFd < 0) {
+	  throw std::runtime_error(std::format("Unable to create '{}' (errno {})", tmpPath, errno));
+	}
+	writeAll(newFd, kept.data(), kept.size());
+	if (::fdatasync(newFd) != 0 || ::rename(tmpPath.c_str(), path.c_str()) != 0) {
+	  throw std::runtime_error(std::format("Unable to replace write-ahead log '{}' (errno {})", path, errno));
+	}
+      } catch (...) {
+	if (newFd >= 0) {
+	  ::close(newFd);
+	}
+	lock.lock();
+	flushing = false;
+	cv.notify_all();
+	throw;
+      }
+
+      lock.lock();
+      ::close(fd);
+      fd = newFd;
+      fileEnd = newEnd;
+      flushing = false;
+      cv.notify_all();
+      lock.unlock();
+      // The new file is already in use either way, but if the rename
+      // isn't durable the caller shouldn't count on the old records
+      // being gone
+      durable::syncParent(path);
+    }
+
+    // Apply every good record in the log at path to m, skipping any
+    // at or below afterLsn. Returns the LSN of the last record applied
+    // (or afterLsn if there were none.) A missing log is treated as an
+    // empty one. m is usually a Metadata, but anything with the same
+    // contains/add/update/erase calls will do.
+    template <typename Target>
+    static uint64_t replay(const std::string& path, Target& m, uint64_t afterLsn = 0) {
+      std::string contents = readFile(path);
+      uint64_t last = afterLsn;
+      uint64_t baseLsn;
+      scan(contents, path, baseLsn, [&m, &last, afterLsn](const Record& record) {
+	if (record.lsn <= afterLsn) {
+	  return;
+	}
+	std::string id(record.id);
+	switch(record.op) {
+	case Op::AddId:
+	  if (!m.contains(id)) {
+	    m.add(id);
+	  }
+	  break;
+	case Op::Update:
+	  m.update(id, std::string(record.key), std::string(record.value));
+	  break;
+	case Op::EraseId:
+	  m.erase(id);
+	  break;
+	case Op::EraseKey:
+	  m.erase(id, std::string(record.key));
+	  break;
+	case Op::Set:
+	  // Targets that don't know about typed values get the text form
+	  if constexpr (requires { m.set(id, id, Value()); }) {
+	    m.set(id, std::string(record.key), Value::fromText(record.value));
+	  } else {
+	    m.update(id, std::string(record.key), std::string(record.value));
+	  }
+	  break;
+	}
+	last = record.lsn;
+      });
+      return last;
+    }
+
+  };
+
+}
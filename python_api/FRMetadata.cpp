@@ -17,35 +17,526 @@
  */
 
 
+#include <fr/metadata/binary.h>
+#include <fr/metadata/diff.h>
+#include <fr/metadata/frozen.h>
+#include <fr/metadata/generic.h>
+#include <fr/metadata/json_import.h>
+#include <fr/metadata/json_stream.h>
+#include <fr/metadata/mapped.h>
 #include <fr/metadata/metadata.h>
+#include <fr/metadata/predicate.h>
+#include <fr/metadata/query.h>
 #include <fr/metadata/server.h>
+#include <fr/metadata/tiered.h>
 #include <nanobind/nanobind.h>
+#include <nanobind/stl/map.h>
 #include <nanobind/stl/shared_ptr.h>
 #include <nanobind/stl/string.h>
 #include <nanobind/stl/vector.h>
+#include <chrono>
+#include <fstream>
 #include <memory>
+#include <sstream>
 
 using namespace fr::metadata;
 
+namespace {
+
+  // Values come back to Python as str, int, float, bool or bytes
+  nanobind::object toPython(const Value& value) {
+    switch(value.type()) {
+    case Value::Type::Int:
+      return nanobind::int_(value.asInt());
+    case Value::Type::Double:
+      return nanobind::float_(value.asDouble());
+    case Value::Type::Bool:
+      return nanobind::bool_(value.asBool());
+    case Value::Type::Bytes:
+      return nanobind::bytes(value.bytes().data(), value.bytes().size());
+    default:
+      return nanobind::str(value.bytes().data(), value.bytes().size());
+    }
+  }
+
+  // bool has to be checked before int, since Python's bool is an int
+  Value fromPython(nanobind::handle object) {
+    if (nanobind::isinstance<nanobind::bool_>(object)) {
+      return Value::ofBool(nanobind::cast<bool>(object));
+    }
+    if (nanobind::isinstance<nanobind::int_>(object)) {
+      return Value::ofInt(nanobind::cast<int64_t>(object));
+    }
+    if (nanobind::isinstance<nanobind::float_>(object)) {
+      return Value::ofDouble(nanobind::cast<double>(object));
+    }
+    if (nanobind::isinstance<nanobind::bytes>(object)) {
+      auto bytes = nanobind::borrow<nanobind::bytes>(object);
+      return Value::ofBytes(std::string(bytes.c_str(), bytes.size()));
+    }
+    return Value(nanobind::cast<std::string>(object));
+  }
+
+  // A blob handed out to Python. It supports the buffer protocol, so
+  // memoryview, numpy.frombuffer and friends read the stored bytes
+  // where they are. Holding the blob keeps them alive.
+  struct BlobView {
+    Blob blob;
+  };
+
+  int blobBuffer(PyObject *self, Py_buffer *view, int flags) {
+    const std::string& bytes = *nanobind::inst_ptr<BlobView>(nanobind::handle(self))->blob;
+    return PyBuffer_FillInfo(view, self, const_cast<char *>(bytes.data()), static_cast<Py_ssize_t>(bytes.size()), 1, flags);
+  }
+
+  PyType_Slot blobSlots[] = {
+    {Py_bf_getbuffer, reinterpret_cast<void *>(blobBuffer)},
+    {0, nullptr}
+  };
+
+  nanobind::object memoryviewOf(Blob blob) {
+    nanobind::object owner = nanobind::cast(BlobView{std::move(blob)});
+    return nanobind::steal(PyMemoryView_FromObject(owner.ptr()));
+  }
+
+  // Anything with the buffer protocol, copied once into a new blob,
+  // unless it's a view of a blob already, which is just shared
+  Blob blobFromPython(nanobind::handle object) {
+    if (PyMemoryView_Check(object.ptr())) {
+      // The module's built against the stable ABI, which doesn't have
+      // PyMemoryView_GET_BUFFER, so ask the view for what it's a view
+      // of the way Python code would. A released view has nothing, and
+      // PyObject_GetBuffer below says so.
+      nanobind::object base = nanobind::getattr(object, "obj", nanobind::none());
+      if (nanobind::isinstance<BlobView>(base)) {
+	return nanobind::cast<BlobView&>(base).blob;
+      }
+    }
+    Py_buffer view;
+    if (PyObject_GetBuffer(object.ptr(), &view, PyBUF_SIMPLE) != 0) {
+      throw nanobind::python_error();
+    }
+    auto blob = std::make_shared<const std::string>(static_cast<const char *>(view.buf), static_cast<size_t>(view.len));
+    PyBuffer_Release(&view);
+    return blob;
+  }
+
+  // The Python side of a BasicMetadata. IDs and keys come and go as
+  // strings and are converted with their KeyTraits.
+  template <typename M>
+  void bindGeneric(nanobind::module_& m, const char *name) {
+    using IdTraits = KeyTraits<typename M::IdType>;
+    using KeyTraitsType = KeyTraits<typename M::KeyType>;
+    nanobind::class_<M>(m, name)
+      .def(nanobind::new_([](){ return std::make_shared<M>(); }))
+      .def("contains", [](M& self, const std::string& id) { return self.contains(IdTraits::fromString(id)); }, "Returns true if the ID exists.")
+      .def("idContains", [](M& self, const std::string& id, const std::string& key) { return self.idContains(IdTraits::fromString(id), KeyTraitsType::fromString(key)); }, "Returns true if metadata stored in ID contains a key.")
+      .def("add", [](M& self, const std::string& id) { self.add(IdTraits::fromString(id)); }, "Add an empty metadata store with a specified ID.")
+      .def("ids", [](M& self) {
+	std::vector<std::string> ids;
+	for (const auto& id : self.ids()) {
+	  ids.push_back(IdTraits::toString(id));
+	}
+	return ids;
+      }, "Returns all the IDs.")
+      .def("keys", [](M& self, const std::string& id) {
+	std::vector<std::string> keys;
+	for (const auto& key : self.keys(IdTraits::fromString(id))) {
+	  keys.push_back(KeyTraitsType::toString(key));
+	}
+	return keys;
+      }, "Returns all the keys in the metadata stored in the provided ID.")
+      .def("value", [](M& self, const std::string& id, const std::string& key) { return self.get(IdTraits::fromString(id), KeyTraitsType::fromString(key)).str(); }, "Returns the value stored in a key as a string")
+      .def("get", [](M& self, const std::string& id, const std::string& key) { return toPython(self.get(IdTraits::fromString(id), KeyTraitsType::fromString(key))); }, "Returns the value stored in a key as whatever it was stored as: str, int, float, bool or bytes.")
+      .def("set", [](M& self, const std::string& id, const std::string& key, nanobind::handle value) { self.set(IdTraits::fromString(id), KeyTraitsType::fromString(key), fromPython(value)); }, "Set a key in an ID to a str, int, float, bool or bytes value, creating either if they don't exist.")
+      .def("update", [](M& self, const std::string& id, const std::string& key, const std::string& value) { self.set(IdTraits::fromString(id), KeyTraitsType::fromString(key), Value(value)); }, "Set a key in an ID to a string, creating either if they don't exist.")
+      .def("erase", [](M& self, const std::string& id) { self.erase(IdTraits::fromString(id)); }, "Erases all the metadata stored in ID")
+      .def("erase", [](M& self, const std::string& id, const std::string& key) { self.erase(IdTraits::fromString(id), KeyTraitsType::fromString(key)); }, "Erases the provided key stored in the provided ID (call order is ID, key)")
+      .def("__len__", &M::size)
+      .def_static("toJson", [](M& self) {
+	std::stringstream stream;
+	{
+	  cereal::JSONOutputArchive archive(stream);
+	  archive(cereal::make_nvp("m", self));
+	}
+	return stream.str();
+      }, "Convert to the same JSON Metadata.toJson writes. This is a static method and must be passed the object")
+      .def_static("fromJson", [](M& self, const std::string& json) {
+	std::stringstream stream(json);
+	cereal::JSONInputArchive archive(stream);
+	archive(cereal::make_nvp("m", self));
+      }, "Replace the contents with JSON from toJson (this one's or Metadata's). Call order is object, json.")
+      ;
+  }
+
+  // What parallelFilter and friends take from Python: a key and at most
+  // one of equals, prefix or a low/high range. Just the key means any
+  // store that has it.
+  KeyPredicate predicateFromPython(const std::string& key, nanobind::handle equals, nanobind::handle prefix,
+				   nanobind::handle low, nanobind::handle high) {
+    bool ranged = !low.is_none() || !high.is_none();
+    if (!equals.is_none() + !prefix.is_none() + ranged > 1) {
+      throw std::runtime_error("Only one of equals, prefix or low/high can be given");
+    }
+    if (!equals.is_none()) {
+      return KeyPredicate::equals(key, fromPython(equals));
+    }
+    if (!prefix.is_none()) {
+      return KeyPredicate::prefix(key, nanobind::cast<std::string>(prefix));
+    }
+    if (ranged) {
+      return KeyPredicate::range(key, low.is_none() ? std::nullopt : std::optional<Value>(fromPython(low)),
+				 high.is_none() ? std::nullopt : std::optional<Value>(fromPython(high)));
+    }
+    return KeyPredicate::exists(key);
+  }
+
+}
+
 NB_MODULE(FRMetadata, m) {
 
+  // What getBlob hands back a memoryview of
+
+  nanobind::class_<BlobView>(m, "Blob", nanobind::type_slots(blobSlots))
+    .def("__len__", [](const BlobView& self) { return self.blob->size(); })
+    ;
+
   // Python API for Metadata object
   
   nanobind::class_<Metadata>(m, "Metadata")
     // We want it to return a shared pointer so we can share it with C++ objects that use its resources
     .def(nanobind::new_([](){ return std::make_shared<Metadata>(); }))
     .def("contains", nanobind::overload_cast<const std::string&>(&Metadata::contains), "Returns true if metadata contains the specified ID or false if it does not. Each ID in a Metadata object will point to a separate key/value store.")
-    .def("idContains", &Metadata::idContains, "Returns true if metadata stored in ID contains a key.")
-    .def("add", nanobind::overload_cast<const std::string&>(&Metadata::add), "Add an empty metadata store with a specified ID.")
-    .def("add", nanobind::overload_cast<const std::string&, const std::string&, const std::string&>(&Metadata::add), "Adds a key/value pair to a metadata store.")
+    .def("idContains", &Metadata::idContains, nanobind::call_guard<nanobind::gil_scoped_release>(), "Returns true if metadata stored in ID contains a key.")
+    .def("add", nanobind::overload_cast<const std::string&>(&Metadata::add), nanobind::call_guard<nanobind::gil_scoped_release>(), "Add an empty metadata store with a specified ID.")
+    .def("add", nanobind::overload_cast<const std::string&, const std::string&, const std::string&>(&Metadata::add), nanobind::call_guard<nanobind::gil_scoped_release>(), "Adds a key/value pair to a metadata store.")
     .def("ids", &Metadata::ids, "Returns all the IDs stored in this Metadata object")
-    .def("keys", &Metadata::keys, "Returns all the keys in the metadata stored in the provided ID.")
-    .def("value", &Metadata::value, "Returns the value stored in a key")
-    .def("erase", nanobind::overload_cast<const std::string&>(&Metadata::erase), "Erases all the metadata stored in ID")
-    .def("erase", nanobind::overload_cast<const std::string&, const std::string&>(&Metadata::erase), "Erases the provided key stored in the provided ID (call order is ID, key)")
-    .def("update", &Metadata::update, "Update the value of a key in an ID. This will create the ID and the key if they don't exist, so you can use it to create them if you don't care if they already exist.")
-    .def_static("toJson", &Metadata::toJson, "Convert a metadata to json. This is a static method and must be passed a metadata object")
+    .def("keys", &Metadata::keys, nanobind::call_guard<nanobind::gil_scoped_release>(), "Returns all the keys in the metadata stored in the provided ID.")
+    .def("value", &Metadata::value, nanobind::call_guard<nanobind::gil_scoped_release>(), "Returns the value stored in a key")
+    .def("erase", nanobind::overload_cast<const std::string&>(&Metadata::erase), nanobind::call_guard<nanobind::gil_scoped_release>(), "Erases all the metadata stored in ID")
+    .def("erase", nanobind::overload_cast<const std::string&, const std::string&>(&Metadata::erase), nanobind::call_guard<nanobind::gil_scoped_release>(), "Erases the provided key stored in the provided ID (call order is ID, key)")
+    .def("update", &Metadata::update, nanobind::call_guard<nanobind::gil_scoped_release>(), "Update the value of a key in an ID. This will create the ID and the key if they don't exist, so you can use it to create them if you don't care if they already exist.")
+    .def("get", [](Metadata& self, const std::string& id, const std::string& key) {
+      // Anything that can wait on a load can end up waiting on a Python
+      // loader (see setLoader), which needs the GIL, so all of those
+      // let go of it while they run
+      Value value;
+      {
+	nanobind::gil_scoped_release release;
+	value = self.get(id, key);
+      }
+      return toPython(value);
+    }, "Returns the value stored in a key as whatever it was stored as: str, int, float, bool or bytes.")
+    .def("set", [](Metadata& self, const std::string& id, const std::string& key, nanobind::handle value) {
+      Value converted = fromPython(value);
+      nanobind::gil_scoped_release release;
+      self.set(id, key, std::move(converted));
+    }, "Like update, but an int, float, bool or bytes value is stored as it is rather than as a string, so reading it back with get doesn't parse anything.")
+    .def("getBlob", [](Metadata& self, const std::string& id, const std::string& key) {
+      Blob blob;
+      {
+	nanobind::gil_scoped_release release;
+	blob = self.getBlob(id, key);
+      }
+      return memoryviewOf(std::move(blob));
+    }, "Returns the bytes stored in a key as a read-only memoryview of the stored buffer. Nothing is copied, and the view stays good after the key changes.")
+    .def("setBlob", [](Metadata& self, const std::string& id, const std::string& key, nanobind::handle value) {
+      Blob blob = blobFromPython(value);
+      nanobind::gil_scoped_release release;
+      self.setBlob(id, key, std::move(blob));
+    }, "Store anything that supports the buffer protocol (bytes, bytearray, memoryview, numpy arrays...) in a key as bytes. A memoryview from getBlob is shared rather than copied.")
+    .def("increment", &Metadata::incrementSynced, nanobind::call_guard<nanobind::gil_scoped_release>(), nanobind::arg("id"), nanobind::arg("key"), nanobind::arg("delta") = 1, "Atomically add delta to the counter in a key and return the new count. The ID and key are created if they don't exist. The new count has been passed on to any listeners (a write-ahead log, say) by the time this returns.")
+    .def("fetchAdd", [](Metadata& self, const std::string& id, const std::string& key, int64_t delta) {
+      return self.incrementSynced(id, key, delta) - delta;
+    }, nanobind::call_guard<nanobind::gil_scoped_release>(), "Atomically add delta to the counter in a key and return the count from before it was added. Like increment, the new count has been passed on to any listeners by the time this returns.")
+    .def("counts", &Metadata::counts, "Returns a dict of the live counters in an ID and their current counts.")
+    .def("syncCounters", &Metadata::syncCounters, nanobind::call_guard<nanobind::gil_scoped_release>(), "Write the live counts of all the counters back into their keys, telling any listeners.")
+    .def_static("toJson", &Metadata::toJson, nanobind::call_guard<nanobind::gil_scoped_release>(), "Convert a metadata to json. This is a static method and must be passed a metadata object")
+    .def_static("writeJson", [](Metadata& self, const std::string& path) {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      if (!out) {
+	throw std::runtime_error(std::format("Unable to open '{}'", path));
+      }
+      nanobind::gil_scoped_release release;
+      JsonStreamer::write(self, out);
+    }, "Stream a metadata object out to a JSON file a chunk at a time, without building the whole document in memory first. Call order is metadata, path. Read it back with fromJson.")
     .def_static("fromJson", &Metadata::fromJson, "Populate a (presumably empty) metadata object from JSON. This is a static method and must be provided a Metadata object and the JSON string you want to populate it with.")
+    .def_static("toBinary", [](Metadata& self) {
+      std::string binary;
+      {
+	nanobind::gil_scoped_release release;
+	binary = BinaryFormat::toBinary(self);
+      }
+      return nanobind::bytes(binary.data(), binary.size());
+    }, "Convert a metadata to the compact binary format, which is a good deal smaller and faster than JSON. Returns bytes. This is a static method and must be passed a metadata object")
+    .def_static("fromBinary", [](Metadata& self, nanobind::bytes data) { BinaryFormat::fromBinary(self, std::string_view(data.c_str(), data.size())); }, "Replace the contents of a metadata object with what toBinary wrote. Call order is metadata, bytes.")
+    .def("fork", &Metadata::fork, nanobind::call_guard<nanobind::gil_scoped_release>(), "Returns an independent copy of this metadata right away, however big it is. Everything is shared copy-on-write, so only what gets changed afterwards is actually copied.")
+    .def("setChangeTracking", &Metadata::setChangeTracking, "Start or stop keeping track of what changed when, so exportSince can send just the changes. Off by default.")
+    .def("currentSequence", &Metadata::currentSequence, "The sequence number of the latest change. Pass it to exportSince later to get what changed after it.")
+    .def("exportSince", [](Metadata& self, uint64_t since) {
+      std::string delta;
+      {
+	nanobind::gil_scoped_release release;
+	delta = BinaryFormat::exportSince(self, since);
+      }
+      return nanobind::bytes(delta.data(), delta.size());
+    }, "Returns bytes holding every ID added, changed or erased after sequence number since. If since is too old (or change tracking is off) you get everything.")
+    .def("applyDelta", [](Metadata& self, nanobind::bytes delta) {
+      std::string_view data(delta.c_str(), delta.size());
+      nanobind::gil_scoped_release release;
+      return BinaryFormat::applyDelta(self, data);
+    }, "Apply what exportSince returned on another metadata. Returns the sequence number to pass to exportSince next time.")
+    .def_static("diff", [](Metadata& a, Metadata& b, size_t threads) {
+      static const char *kinds[] = {"id added", "id removed", "key added", "key removed", "key changed"};
+      std::vector<MetadataDiff::Change> found;
+      {
+	nanobind::gil_scoped_release release;
+	found = MetadataDiff::diff(a, b, threads);
+      }
+      nanobind::list changes;
+      for (const auto& change : found) {
+	changes.append(nanobind::make_tuple(kinds[static_cast<int>(change.kind)], change.id, change.key, toPython(change.before), toPython(change.after)));
+      }
+      return changes;
+    }, nanobind::arg("a"), nanobind::arg("b"), nanobind::arg("threads") = 1, "Everything it would take to turn metadata a into b, as a list of (kind, id, key, before, after) tuples sorted by ID and key.")
+    .def_static("threeWayMerge", [](Metadata& base, Metadata& ours, Metadata& theirs, const std::string& policy) {
+      MetadataDiff::Policy p = policy == "theirs" ? MetadataDiff::Policy::Theirs
+	: policy == "fail" ? MetadataDiff::Policy::Fail : MetadataDiff::Policy::Ours;
+      auto merged = std::make_shared<Metadata>();
+      nanobind::gil_scoped_release release;
+      merged->restore(MetadataDiff::merge(base, ours, theirs, p).merged);
+      return merged;
+    }, nanobind::arg("base"), nanobind::arg("ours"), nanobind::arg("theirs"), nanobind::arg("policy") = "ours", "Merge what ours and theirs each changed since base into a new metadata. policy is \"ours\", \"theirs\" or \"fail\" and decides conflicts.")
+    .def_static("importJson", [](Metadata& self, const std::string& json) { JsonImporter::load(self, json); }, nanobind::call_guard<nanobind::gil_scoped_release>(), "A much faster fromJson. Reads what toJson and writeJson write, as well as the simpler {\"m\":{\"id\":{\"key\":\"value\"}}} shape. Replaces whatever is in the metadata. Call order is metadata, json.")
+    .def_static("readJson", [](Metadata& self, const std::string& path) { JsonImporter::loadFile(self, path); }, nanobind::call_guard<nanobind::gil_scoped_release>(), "importJson straight from a file, which is mmapped rather than read. Call order is metadata, path.")
+    .def("loadParallel", [](Metadata& self, const std::string& path, size_t threads) { JsonImporter::loadFileParallel(self, path, threads); }, nanobind::call_guard<nanobind::gil_scoped_release>(), nanobind::arg("path"), nanobind::arg("threads") = 0, "Import a big JSON dump on several threads (0 for one per core). Files ending in .jsonl or .ndjson are read as JSON Lines, one object of IDs per line. Adds to what's already in the metadata rather than replacing it.")
+    .def("loadLazily", [](Metadata& self, const std::string& path) { MappedSource::attach(self, path); }, nanobind::call_guard<nanobind::gil_scoped_release>(), "Run lazily from a file written by MappedMetadata.write. IDs are available right away and each store is loaded from the file the first time it's used.")
+    .def("pageOut", &Metadata::pageOut, nanobind::call_guard<nanobind::gil_scoped_release>(), "Drop every store that was loaded lazily and hasn't changed since. They'll be reloaded if they're used again. Returns the number dropped.")
+    .def("setResidentLimit", &Metadata::setResidentLimit, "Page out lazily loaded, unchanged stores whenever there are more than this many of them. 0 turns it off.")
+    .def("loadStatistics", [](Metadata& self) {
+      auto stats = self.loadStatistics();
+      nanobind::dict d;
+      d["loads"] = stats.loads;
+      d["waits"] = stats.waits;
+      d["evictions"] = stats.evictions;
+      d["hot"] = stats.hot;
+      d["cold"] = stats.cold;
+      d["demotions"] = stats.demotions;
+      d["writeBacks"] = stats.writeBacks;
+      d["averageLoadSeconds"] = stats.averageLoadSeconds();
+      d["maxLoadSeconds"] = stats.maxLoadSeconds;
+      return d;
+    }, "Returns a dict of lazy loading and tiering counters: loads (promotions), demotions, hot and cold store counts and how long cold reads waited.")
+    .def("setLoader", [](Metadata& self, nanobind::object loader, double negativeTtlSeconds) {
+      auto ttl = std::chrono::milliseconds(static_cast<int64_t>(negativeTtlSeconds * 1000.0));
+      if (loader.is_none()) {
+	self.setLoader(nullptr, ttl);
+	return;
+      }
+      // The loader gets called (and copied, and eventually dropped) on
+      // whatever thread missed, which may not be holding the GIL
+      std::shared_ptr<nanobind::object> callable(new nanobind::object(std::move(loader)), [](nanobind::object *held) {
+	nanobind::gil_scoped_acquire acquire;
+	delete held;
+      });
+      self.setLoader([callable](const std::string& id) -> Metadata::Data {
+	nanobind::gil_scoped_acquire acquire;
+	nanobind::object found = (*callable)(id);
+	if (found.is_none()) {
+	  return nullptr;
+	}
+	auto store = std::make_shared<Metadata::DataType>();
+	for (auto [key, value] : nanobind::cast<nanobind::dict>(found)) {
+	  (*store)[nanobind::cast<std::string>(key)] = fromPython(value);
+	}
+	return store;
+      }, ttl);
+    }, nanobind::arg("loader"), nanobind::arg("negativeTtlSeconds") = 0.0,
+      "Use this metadata as a cache in front of something slower. loader(id) is called for an ID that isn't here when it's read, and returns a dict of its keys and values (kept from then on) or None if there's no such ID. With negativeTtlSeconds, None is remembered that long. Concurrent misses on one ID share a single call. Pass None to turn it off.")
+    .def("readThroughStatistics", [](Metadata& self) {
+      auto stats = self.readThroughStatistics();
+      nanobind::dict d;
+      d["enabled"] = stats.enabled;
+      d["hits"] = stats.hits;
+      d["loads"] = stats.loads;
+      d["coalesced"] = stats.coalesced;
+      d["notFound"] = stats.notFound;
+      d["negativeHits"] = stats.negativeHits;
+      d["errors"] = stats.errors;
+      d["hitRatio"] = stats.hitRatio();
+      d["averageLoadSeconds"] = stats.averageLoadSeconds();
+      d["maxLoadSeconds"] = stats.maxLoadSeconds;
+      d["p50LoadSeconds"] = stats.loadSecondsAt(0.5);
+      d["p99LoadSeconds"] = stats.loadSecondsAt(0.99);
+      return d;
+    }, "Returns a dict of read-through counters: hits, loads, coalesced waits, notFound and negativeHits, errors, the hit ratio and load times (p50 and p99 to within a factor of 2).")
+    .def("setIdFilter", &Metadata::setIdFilter, nanobind::arg("on"), nanobind::arg("expectedIds") = 0, "Put a bloom filter in front of contains, idContains and value so lookups for IDs that don't exist return right away. Costs about 8 bytes per ID.")
+    .def("filterStatistics", [](Metadata& self) {
+      auto stats = self.filterStatistics();
+      nanobind::dict d;
+      d["enabled"] = stats.enabled;
+      d["ids"] = stats.ids;
+      d["capacity"] = stats.capacity;
+      d["bytes"] = stats.bytes;
+      d["estimatedFalsePositiveRate"] = stats.estimatedFalsePositiveRate;
+      d["observedFalsePositiveRate"] = stats.observedFalsePositiveRate();
+      d["definiteMisses"] = stats.definiteMisses;
+      d["falsePositives"] = stats.falsePositives;
+      return d;
+    }, "Returns a dict describing the ID filter: its size in bytes, false positive rates (estimated and seen so far) and how many lookups it turned away.")
+    .def("setHotKeyTracking", [](Metadata& self, bool on, uint32_t sampleEvery, size_t capacity, double halfLifeSeconds) {
+      HotTracker::Options options;
+      options.sampleEvery = sampleEvery;
+      options.capacity = capacity;
+      options.halfLife = std::chrono::milliseconds(static_cast<int64_t>(halfLifeSeconds * 1000.0));
+      self.setHotKeyTracking(on, options);
+    }, nanobind::arg("on"), nanobind::arg("sampleEvery") = 16, nanobind::arg("capacity") = 64, nanobind::arg("halfLifeSeconds") = 60.0,
+      "Keep track of the most read and written IDs and keys, counting one access in sampleEvery. Counts halve every halfLifeSeconds (0 for never).")
+    .def("hotKeyStatistics", [](Metadata& self, size_t k) {
+      auto stats = self.hotKeyStatistics(k);
+      auto entries = [](const std::vector<HotEntry>& hot) {
+	nanobind::list out;
+	for (const auto& entry : hot) {
+	  out.append(nanobind::make_tuple(entry.name, entry.count, entry.error));
+	}
+	return out;
+      };
+      nanobind::dict d;
+      d["enabled"] = stats.enabled;
+      d["sampleEvery"] = stats.sampleEvery;
+      d["sampled"] = stats.sampled;
+      d["bytes"] = stats.bytes;
+      d["ids"] = entries(stats.ids);
+      d["keys"] = entries(stats.keys);
+      return d;
+    }, nanobind::arg("k") = 10, "Returns a dict with the k busiest IDs and keys lately, as lists of (name, count, error) busiest first. The real count is between count - error and count.")
+    .def("accessEstimate", &Metadata::accessEstimate, "About how many times an ID has been read or written lately. 0 if hot key tracking is off.")
+    .def("parallelFilter", [](Metadata& self, const std::string& key, nanobind::handle equals, nanobind::handle prefix,
+			      nanobind::handle low, nanobind::handle high, size_t threads) {
+      KeyPredicate pred = predicateFromPython(key, equals, prefix, low, high);
+      nanobind::gil_scoped_release release;
+      return self.parallelFilter(pred, threads);
+    }, nanobind::arg("key"), nanobind::arg("equals") = nanobind::none(), nanobind::arg("prefix") = nanobind::none(),
+      nanobind::arg("low") = nanobind::none(), nanobind::arg("high") = nanobind::none(), nanobind::arg("threads") = 0,
+      "The sorted IDs whose key is equal to equals, starts with prefix, or is between low and high (inclusive, either can be left off). With none of them, every ID that has the key. Runs on a snapshot on threads threads (0 for one per core) without holding the GIL; numbers compare as numbers, including strings that read as them.")
+    .def("countValues", [](Metadata& self, const std::string& key, size_t threads) {
+      using Counts = std::map<std::string, int64_t>;
+      nanobind::gil_scoped_release release;
+      return self.parallelReduce(Counts(),
+				 [&key](Counts& counts, const std::string&, const Metadata::DataType& store) {
+				   auto itr = store.find(key);
+				   if (itr != store.end()) {
+				     counts[itr->second.str()]++;
+				   }
+				 },
+				 [](Counts& into, Counts&& from) {
+				   for (const auto& [value, count] : from) {
+				     into[value] += count;
+				   }
+				 }, threads);
+    }, nanobind::arg("key"), nanobind::arg("threads") = 0, "A dict of how many IDs have each value of key (as a string), counted in parallel on a snapshot without holding the GIL.")
+    .def("sumValues", [](Metadata& self, const std::string& key, size_t threads) {
+      nanobind::gil_scoped_release release;
+      return self.parallelReduce(0.0,
+				 [&key](double& sum, const std::string&, const Metadata::DataType& store) {
+				   auto itr = store.find(key);
+				   if (itr != store.end()) {
+				     auto n = KeyPredicate::number(itr->second);
+				     sum += n ? *n : 0.0;
+				   }
+				 },
+				 [](double& into, double&& from) { into += from; }, threads);
+    }, nanobind::arg("key"), nanobind::arg("threads") = 0, "The total of key over every ID where it's a number (or a string that reads as one), added up in parallel on a snapshot without holding the GIL.")
+    .def("setPathIndex", &Metadata::setPathIndex, nanobind::arg("on"), nanobind::arg("separator") = '/', "For IDs that are paths (tenant/project/file), keep a radix tree of them so subtreeCount and listChildren are quick. separator is what the subtree calls split paths on, with or without the tree.")
+    .def("pathIndexBytes", &Metadata::pathIndexBytes, "Roughly how many bytes the path index is using, 0 if it's off.")
+    .def("listChildren", &Metadata::listChildren, "The sorted names one level down from a path. With IDs a/b/c and a/b/d/e, listChildren(\"a/b\") is [\"c\", \"d\"].")
+    .def("subtreeCount", &Metadata::subtreeCount, "The number of IDs that are the path or under it.")
+    .def("eraseSubtree", &Metadata::eraseSubtree, "Erase a path and every ID under it. Returns how many were erased.")
+    .def("exportSubtree", [](Metadata& self, const std::string& path) {
+      auto exported = std::make_shared<Metadata>();
+      nanobind::gil_scoped_release release;
+      exported->restore(self.exportSubtree(path));
+      return exported;
+    }, "A new metadata holding a copy of a path and every ID under it. Stores are shared copy-on-write, so this is cheap.")
+    ;
+
+  // Metadata keyed by UUIDs with interned keys, which takes a lot less
+  // memory, and the same with plain string IDs
+
+  bindGeneric<UuidMetadata>(m, "UuidMetadata");
+  bindGeneric<SymbolMetadata>(m, "SymbolMetadata");
+
+  // Immutable, lock-free metadata for data that's built once and read a lot
+
+  nanobind::class_<FrozenMetadata>(m, "FrozenMetadata")
+    .def(nanobind::new_([](const std::string& path){ return std::shared_ptr<FrozenMetadata>(new FrozenMetadata(path)); }))
+    .def_static("build", nanobind::overload_cast<Metadata&>(&FrozenMetadata::build), nanobind::call_guard<nanobind::gil_scoped_release>(), "Freeze a copy of a Metadata object. Lookups in the result never take a lock.")
+    .def("write", nanobind::overload_cast<const std::string&>(&FrozenMetadata::write, nanobind::const_), "Write it out to a file. Passing the path to the constructor mmaps it straight back in.")
+    .def("contains", [](const FrozenMetadata& self, const std::string& id) { return self.contains(id); }, "Returns true if the ID exists.")
+    .def("idContains", [](const FrozenMetadata& self, const std::string& id, const std::string& key) { return self.idContains(id, key); }, "Returns true if metadata stored in ID contains a key.")
+    .def("ids", &FrozenMetadata::ids, "Returns all the IDs, sorted.")
+    .def("keys", &FrozenMetadata::keys, "Returns all the keys stored in the provided ID.")
+    .def("value", &FrozenMetadata::value, "Returns the value stored in a key")
+    .def("get", [](const FrozenMetadata& self, const std::string& id, const std::string& key) { return toPython(self.get(id, key)); }, "Returns the value stored in a key as whatever it was stored as: str, int, float, bool or bytes.")
+    .def("materialize", &FrozenMetadata::materialize, "Copy everything into a regular Metadata object so it can be changed")
+    ;
+
+  // Demotes idle stores to a compressed file on a timer
+
+  nanobind::class_<TierManager>(m, "TierManager")
+    .def(nanobind::new_([](std::shared_ptr<Metadata> data, const std::string& path, int periodMs, uint32_t threshold) {
+      return std::make_shared<TierManager>(data, std::make_shared<ColdTier>(path), std::chrono::milliseconds(periodMs), threshold);
+    }), nanobind::arg("data"), nanobind::arg("path"), nanobind::arg("periodMs") = 10000, nanobind::arg("threshold") = 1)
+    .def("sweep", &TierManager::sweep, nanobind::call_guard<nanobind::gil_scoped_release>(), "Demote idle stores right now. Returns the number demoted.")
+    ;
+
+  // Read-only metadata served straight out of an mmapped file
+
+  nanobind::class_<MappedMetadata>(m, "MappedMetadata")
+    .def(nanobind::new_([](const std::string& path){ return std::make_shared<MappedMetadata>(path); }))
+    .def("contains", &MappedMetadata::contains, "Returns true if the ID exists in the file or overlay.")
+    .def("idContains", &MappedMetadata::idContains, "Returns true if metadata stored in ID contains a key.")
+    .def("add", nanobind::overload_cast<const std::string&>(&MappedMetadata::add), "Add an empty metadata store to the overlay.")
+    .def("add", nanobind::overload_cast<const std::string&, const std::string&, const std::string&>(&MappedMetadata::add), "Adds a key/value pair to the overlay.")
+    .def("ids", &MappedMetadata::ids, "Returns all the IDs in the file and overlay.")
+    .def("keys", &MappedMetadata::keys, "Returns all the keys stored in the provided ID.")
+    .def("value", &MappedMetadata::value, "Returns the value stored in a key")
+    .def("erase", nanobind::overload_cast<const std::string&>(&MappedMetadata::erase), "Erases an ID (in the overlay; the file is never changed)")
+    .def("erase", nanobind::overload_cast<const std::string&, const std::string&>(&MappedMetadata::erase), "Erases a key from an ID (in the overlay)")
+    .def("update", &MappedMetadata::update, "Update the value of a key in an ID (in the overlay)")
+    .def("materialize", &MappedMetadata::materialize, "Copy the file and overlay into a regular Metadata object")
+    .def_static("write", [](const std::string& path, Metadata& m) { MappedFile::write(path, m); }, nanobind::call_guard<nanobind::gil_scoped_release>(), "Write a Metadata object out in the mmappable format. Call order is path, metadata.")
+    ;
+
+  // Queries, with optional indexes
+
+  nanobind::class_<QueryEngine>(m, "QueryEngine")
+    .def(nanobind::new_([](std::shared_ptr<Metadata> data) { return std::make_shared<QueryEngine>(data); }))
+    .def("addIndex", &QueryEngine::addIndex, "Keep an index on a key, for queries that test it or order by it. Turns on change tracking for the metadata.")
+    .def("dropIndex", &QueryEngine::dropIndex, "Stop indexing a key. Returns false if it wasn't.")
+    .def("indexedKeys", &QueryEngine::indexedKeys, "The keys with indexes.")
+    .def("explain", [](QueryEngine& self, const std::string& text) { return self.explain(Query::parse(text)); }, nanobind::call_guard<nanobind::gil_scoped_release>(), "How a query would be run right now: point lookup, ID range, index lookup, ordered index walk or parallel scan.")
+    .def("query", [](QueryEngine& self, const std::string& text, size_t threads) {
+      Query q = Query::parse(text);
+      std::vector<QueryRow> rows;
+      {
+	nanobind::gil_scoped_release release;
+	rows = self.run(q, threads);
+      }
+      nanobind::list out;
+      for (const auto& row : rows) {
+	if (q.select.empty()) {
+	  out.append(nanobind::str(row.id.data(), row.id.size()));
+	} else {
+	  nanobind::dict values;
+	  for (const auto& [key, value] : row.values) {
+	    values[nanobind::str(key.data(), key.size())] = toPython(value);
+	  }
+	  out.append(nanobind::make_tuple(row.id, values));
+	}
+      }
+      return out;
+    }, nanobind::arg("text"), nanobind::arg("threads") = 0, "Run a query, for example \"select size where mime ^= 'image/' and size > 1048576 order by size desc limit 100\". Returns a list of IDs, or of (id, {key: value}) tuples if the query selects keys. Runs without holding the GIL.")
     ;
 
   // Python API for server object
@@ -54,6 +545,7 @@ NB_MODULE(FRMetadata, m) {
     .def(nanobind::init<std::shared_ptr<Metadata>,int >())
     .def("start", &Server::start, "Starts server.")
     .def("shutdown", &Server::shutdown, "Shuts server down.")
+    .def("queryEngine", &Server::queryEngine, "The QueryEngine behind GET /query, for adding indexes to.")
     ;
   
 }
@@ -0,0 +1,105 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the compact binary format
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/binary.h>
+#include <fr/metadata/metadata.h>
+#include <string>
+
+using namespace fr::metadata;
+
+TEST(Binary, RoundTrip) {
+  Metadata m;
+  for (int i = 0; i < 1000; ++i) {
+    std::string id = std::format("/data/run{}/file{}", i / 100, i);
+    m.update(id, "owner", "bruce");
+    m.update(id, "size", std::to_string(i * 1024));
+    if (i % 3 == 0) {
+      m.update(id, "note", std::string(i % 20, '\0') + "\xff binary is fine");
+    }
+  }
+  m.add("empty");
+  m.add("");
+  std::string binary = BinaryFormat::toBinary(m);
+
+  Metadata loaded;
+  loaded.update("stale", "key", "value");
+  BinaryFormat::fromBinary(loaded, binary);
+  auto want = m.snapshot();
+  auto got = loaded.snapshot();
+  ASSERT_EQ(got.size(), want.size());
+  for (const auto& [id, store] : want) {
+    ASSERT_EQ(*got.at(id), *store) << id;
+  }
+  ASSERT_FALSE(loaded.contains("stale"));
+
+  // Three key names and shared ID prefixes should come in well under
+  // the size of the raw strings
+  size_t raw = 0;
+  for (const auto& [id, store] : want) {
+    raw += id.size();
+    for (const auto& [key, value] : *store) {
+      raw += key.size() + value.bytes().size();
+    }
+  }
+  ASSERT_LT(binary.size(), raw * 3 / 4);
+}
+
+TEST(Binary, Empty) {
+  Metadata m;
+  Metadata loaded;
+  BinaryFormat::fromBinary(loaded, BinaryFormat::toBinary(m));
+  ASSERT_TRUE(loaded.ids().empty());
+}
+
+TEST(Binary, Corrupt) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Food", "Bar", "Florble");
+  std::string binary = BinaryFormat::toBinary(m);
+  Metadata loaded;
+  ASSERT_THROW(BinaryFormat::fromBinary(loaded, binary.substr(0, binary.size() - 1)), std::runtime_error);
+  ASSERT_THROW(BinaryFormat::fromBinary(loaded, "not binary at all"), std::runtime_error);
+  std::string flipped = binary;
+  flipped[12] ^= 0x40;
+  ASSERT_THROW(BinaryFormat::fromBinary(loaded, flipped), std::runtime_error);
+  // Nothing was changed by the failures
+  ASSERT_TRUE(loaded.ids().empty());
+}
+
+TEST(Binary, Delta) {
+  Metadata leader;
+  leader.setChangeTracking(true);
+  leader.update("Foo", "Bar", "Baz");
+  leader.update("Gone", "Bar", "Baz");
+  uint64_t since = leader.currentSequence();
+  leader.update("Foo", "Bar", "Florble");
+  leader.erase("Gone");
+
+  Metadata follower;
+  ASSERT_EQ(BinaryFormat::applyDelta(follower, BinaryFormat::exportSince(leader, 0)), since + 2);
+  ASSERT_EQ(follower.value("Foo", "Bar"), "Florble");
+  ASSERT_FALSE(follower.contains("Gone"));
+
+  Metadata::Delta delta = BinaryFormat::decodeDelta(BinaryFormat::exportSince(leader, since));
+  ASSERT_FALSE(delta.full);
+  ASSERT_EQ(delta.since, since);
+  ASSERT_EQ(delta.erased, std::vector<std::string>{"Gone"});
+  ASSERT_EQ(delta.stores.at("Foo")->at("Bar"), "Florble");
+  ASSERT_THROW(BinaryFormat::decodeDelta(BinaryFormat::toBinary(leader)), std::runtime_error);
+}
@@ -0,0 +1,186 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for counters
+ */
+
+#include <gtest/gtest.h>
+#include <cereal/archives/binary.hpp>
+#include <format>
+#include <fr/metadata/counters.h>
+#include <fr/metadata/metadata.h>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  // Remembers the last thing it was told
+  class LastChange : public MutationListener {
+  public:
+    int changes = 0;
+    Op op;
+    std::string id;
+    std::string key;
+    std::string value;
+
+    uint64_t record(Op op, const std::string& id, const std::string& key, const std::string& value) override {
+      changes++;
+      this->op = op;
+      this->id = id;
+      this->key = key;
+      this->value = value;
+      return changes;
+    }
+  };
+
+}
+
+TEST(Counter, Basic) {
+  Metadata m;
+  ASSERT_EQ(m.increment("Page", "hits"), 1);
+  ASSERT_EQ(m.increment("Page", "hits", 10), 11);
+  ASSERT_EQ(m.fetchAdd("Page", "hits", -1), 11);
+  ASSERT_EQ(m.getInt("Page", "hits"), 10);
+  ASSERT_EQ(m.value("Page", "hits"), "10");
+  ASSERT_TRUE(m.idContains("Page", "hits"));
+  ASSERT_EQ(m.counts("Page"), (std::map<std::string, int64_t>{{"hits", 10}}));
+
+  // A handle skips the lookup, and is the same counter
+  auto hits = m.counter("Page", "hits");
+  hits->fetchAdd(5);
+  ASSERT_EQ(m.getInt("Page", "hits"), 15);
+
+  // Setting it resets it without detaching the handle
+  m.setInt("Page", "hits", 100);
+  hits->fetchAdd(1);
+  ASSERT_EQ(m.getInt("Page", "hits"), 101);
+
+  // Setting it to something else stops it being a counter
+  m.update("Page", "hits", "lots");
+  ASSERT_EQ(m.value("Page", "hits"), "lots");
+  ASSERT_TRUE(m.counts("Page").empty());
+
+  // Ints and strings that read as ints pick up where they were
+  m.setInt("Page", "views", 41);
+  ASSERT_EQ(m.increment("Page", "views"), 42);
+  m.update("Page", "legacy", "7");
+  ASSERT_EQ(m.increment("Page", "legacy"), 8);
+  ASSERT_EQ(m.get("Page", "legacy").type(), Value::Type::Int);
+  ASSERT_THROW(m.increment("Page", "hits"), std::runtime_error);
+  m.setDouble("Page", "ratio", 0.5);
+  ASSERT_THROW(m.increment("Page", "ratio"), std::runtime_error);
+
+  m.erase("Page", "views");
+  ASSERT_FALSE(m.idContains("Page", "views"));
+  ASSERT_EQ(m.increment("Page", "views"), 1);
+  m.erase("Page");
+  ASSERT_FALSE(m.contains("Page"));
+  ASSERT_EQ(m.increment("Page", "views"), 1);
+}
+
+TEST(Counter, Concurrent) {
+  Metadata m;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&m, t]() {
+      for (int i = 0; i < 10000; ++i) {
+	m.increment("Shared", "count");
+	m.increment(std::format("Own{}", t), "count", 2);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(m.getInt("Shared", "count"), 40000);
+  for (int t = 0; t < 4; ++t) {
+    ASSERT_EQ(m.getInt(std::format("Own{}", t), "count"), 20000);
+  }
+}
+
+TEST(Counter, Snapshots) {
+  Metadata m;
+  auto listener = std::make_shared<LastChange>();
+  m.addListener(listener);
+  m.increment("Page", "hits", 3);
+  ASSERT_EQ(listener->op, MutationListener::Op::Set);
+  int before = listener->changes;
+  m.increment("Page", "hits", 4);
+  // Increments don't go to the listeners one at a time...
+  ASSERT_EQ(listener->changes, before);
+
+  // ...but a snapshot syncs the stores, and they hear about that
+  auto stores = m.snapshot();
+  ASSERT_EQ(stores.at("Page")->at("hits"), Value::ofInt(7));
+  ASSERT_EQ(listener->changes, before + 1);
+  ASSERT_EQ(listener->value, Value::ofInt(7).toText());
+
+  // A fork gets the count, but its own counter
+  auto copy = m.fork();
+  ASSERT_EQ(copy->increment("Page", "hits"), 8);
+  ASSERT_EQ(m.getInt("Page", "hits"), 7);
+
+  // incrementSynced hands every count over before it returns, even
+  // one the store already holds
+  before = listener->changes;
+  ASSERT_EQ(m.incrementSynced("Page", "hits"), 8);
+  ASSERT_EQ(listener->changes, before + 1);
+  ASSERT_EQ(listener->value, Value::ofInt(8).toText());
+  ASSERT_EQ(m.incrementSynced("Page", "hits", 0), 8);
+  ASSERT_EQ(listener->changes, before + 2);
+
+  // Nothing to sync, nothing to hear about
+  before = listener->changes;
+  m.syncCounters();
+  ASSERT_EQ(listener->changes, before);
+
+  // Restoring throws the counters away along with everything else
+  m.restore(Metadata::MetadataMap{});
+  ASSERT_TRUE(m.counts("Page").empty());
+  ASSERT_EQ(m.increment("Page", "hits"), 1);
+
+  // So does loading an archive, and merging stores in replaces the
+  // counts of the IDs merged
+  Metadata other;
+  other.setInt("Page", "hits", 100);
+  std::stringstream stream;
+  {
+    cereal::BinaryOutputArchive archive(stream);
+    archive(other);
+  }
+  m.increment("Page", "hits", 5);
+  {
+    cereal::BinaryInputArchive archive(stream);
+    archive(m);
+  }
+  ASSERT_EQ(m.getInt("Page", "hits"), 100);
+  ASSERT_EQ(m.value("Page", "hits"), "100");
+  ASSERT_EQ(m.increment("Page", "hits"), 101);
+
+  Metadata::MetadataMap merged;
+  merged["Page"] = std::make_shared<Metadata::DataType>();
+  (*merged["Page"])["hits"] = Value::ofInt(42);
+  m.increment("Other", "hits");
+  m.merge(std::move(merged));
+  ASSERT_EQ(m.getInt("Page", "hits"), 42);
+  ASSERT_EQ(m.increment("Page", "hits"), 43);
+  ASSERT_EQ(m.getInt("Other", "hits"), 1);
+}
@@ -0,0 +1,115 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for diff and three-way merge
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/diff.h>
+#include <fr/metadata/metadata.h>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+using Kind = MetadataDiff::Change::Kind;
+
+TEST(Diff, Basic) {
+  Metadata a;
+  a.update("Same", "k", "v");
+  a.update("Changed", "k", "old");
+  a.update("Changed", "gone", "x");
+  a.update("Removed", "k", "v");
+  Metadata b;
+  b.update("Same", "k", "v");
+  b.update("Changed", "k", "new");
+  b.update("Changed", "added", "y");
+  b.update("Added", "k", "v");
+
+  auto changes = MetadataDiff::diff(a, b);
+  std::vector<MetadataDiff::Change> expected{
+    {Kind::IdAdded, "Added", "", "", ""},
+    {Kind::KeyAdded, "Added", "k", "", "v"},
+    {Kind::KeyAdded, "Changed", "added", "", "y"},
+    {Kind::KeyRemoved, "Changed", "gone", "x", ""},
+    {Kind::KeyChanged, "Changed", "k", "old", "new"},
+    {Kind::IdRemoved, "Removed", "", "", ""},
+    {Kind::KeyRemoved, "Removed", "k", "v", ""},
+  };
+  ASSERT_EQ(changes, expected);
+
+  MetadataDiff::apply(a, changes);
+  ASSERT_TRUE(MetadataDiff::diff(a, b).empty());
+}
+
+TEST(Diff, ParallelMatchesSerial) {
+  Metadata a;
+  for (int i = 0; i < 100000; ++i) {
+    a.update(std::format("id{}", i), "key", std::format("value{}", i));
+  }
+  auto before = a.snapshot();
+  for (int i = 0; i < 100000; i += 37) {
+    a.update(std::format("id{}", i), "key", "changed");
+  }
+  a.erase("id5");
+  a.add("new");
+  auto after = a.snapshot();
+  auto serial = MetadataDiff::diff(before, after, 1);
+  auto parallel = MetadataDiff::diff(before, after, 4);
+  ASSERT_EQ(serial.size(), 2703 + 2 + 1);
+  ASSERT_EQ(parallel, serial);
+}
+
+TEST(Diff, ThreeWayMerge) {
+  Metadata base;
+  base.update("Both", "k", "base");
+  base.update("Both", "other", "base");
+  base.update("OursOnly", "k", "base");
+  base.update("Erased", "k", "base");
+  base.update("EraseVsChange", "k", "base");
+
+  Metadata ours;
+  ours.restore(base.snapshot());
+  Metadata theirs;
+  theirs.restore(base.snapshot());
+
+  ours.update("Both", "k", "ours");
+  theirs.update("Both", "k", "theirs");
+  theirs.update("Both", "other", "theirs");
+  ours.update("OursOnly", "k", "ours");
+  ours.erase("Erased");
+  theirs.erase("Erased");
+  ours.erase("EraseVsChange");
+  theirs.update("EraseVsChange", "k", "theirs");
+  theirs.update("TheirsNew", "k", "theirs");
+
+  auto result = MetadataDiff::merge(base, ours, theirs, MetadataDiff::Policy::Ours);
+  const auto& merged = result.merged;
+  ASSERT_EQ(merged.size(), 3);
+  ASSERT_EQ(merged.at("Both")->at("k"), "ours");
+  ASSERT_EQ(merged.at("Both")->at("other"), "theirs");
+  ASSERT_EQ(merged.at("OursOnly")->at("k"), "ours");
+  ASSERT_EQ(merged.at("TheirsNew")->at("k"), "theirs");
+  ASSERT_EQ(result.conflicts.size(), 2);
+  ASSERT_EQ(result.conflicts[0].id, "Both");
+  ASSERT_EQ(result.conflicts[0].key, "k");
+  ASSERT_EQ(result.conflicts[1].id, "EraseVsChange");
+
+  result = MetadataDiff::merge(base, ours, theirs, MetadataDiff::Policy::Theirs);
+  ASSERT_EQ(result.merged.at("Both")->at("k"), "theirs");
+  ASSERT_EQ(result.merged.at("EraseVsChange")->at("k"), "theirs");
+
+  ASSERT_THROW(MetadataDiff::merge(base, ours, theirs, MetadataDiff::Policy::Fail), std::runtime_error);
+}
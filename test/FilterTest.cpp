@@ -0,0 +1,195 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the counting bloom filter and Metadata's ID filter
+ */
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <format>
+#include <fr/metadata/filter.h>
+#include <fr/metadata/metadata.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+TEST(Filter, Basic) {
+  CountingBloomFilter filter(10000);
+  for (int i = 0; i < 10000; ++i) {
+    filter.insert(std::format("id{}", i));
+  }
+  ASSERT_EQ(filter.size(), 10000);
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(filter.maybeContains(std::format("id{}", i)));
+  }
+  int falsePositives = 0;
+  for (int i = 0; i < 100000; ++i) {
+    if (filter.maybeContains(std::format("missing{}", i))) {
+      falsePositives++;
+    }
+  }
+  // About 0.1% is expected; blocking makes it a bit worse
+  ASSERT_LT(falsePositives, 500);
+  ASSERT_LT(filter.estimatedFalsePositiveRate(), 0.005);
+  ASSERT_EQ(filter.bytes() % 64, 0);
+
+  // Erasing half of them has to leave the other half in
+  for (int i = 0; i < 10000; i += 2) {
+    filter.erase(std::format("id{}", i));
+  }
+  ASSERT_EQ(filter.size(), 5000);
+  int stillThere = 0;
+  for (int i = 0; i < 10000; ++i) {
+    if (i % 2) {
+      ASSERT_TRUE(filter.maybeContains(std::format("id{}", i)));
+    } else if (filter.maybeContains(std::format("id{}", i))) {
+      stillThere++;
+    }
+  }
+  ASSERT_LT(stillThere, 100);
+}
+
+TEST(Filter, ConcurrentInserts) {
+  CountingBloomFilter filter(40000);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&filter, t]() {
+      for (int i = 0; i < 10000; ++i) {
+	filter.insert(std::format("t{}-{}", t, i));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(filter.size(), 40000);
+  for (int t = 0; t < 4; ++t) {
+    for (int i = 0; i < 10000; ++i) {
+      ASSERT_TRUE(filter.maybeContains(std::format("t{}-{}", t, i)));
+    }
+  }
+}
+
+TEST(Filter, Metadata) {
+  Metadata m;
+  for (int i = 0; i < 1000; ++i) {
+    m.update(std::format("id{}", i), "key", "value");
+  }
+  m.setIdFilter(true);
+
+  // Adds after it's turned on, and enough of them that it has to grow
+  for (int i = 1000; i < 5000; ++i) {
+    m.update(std::format("id{}", i), "key", "value");
+  }
+  m.erase("id7");
+  for (int i = 0; i < 5000; ++i) {
+    ASSERT_EQ(m.contains(std::format("id{}", i)), i != 7);
+  }
+  ASSERT_FALSE(m.idContains("id7", "key"));
+  ASSERT_THROW(m.value("id7", "key"), std::runtime_error);
+  m.add("id7");
+  ASSERT_TRUE(m.contains("id7"));
+
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_FALSE(m.contains(std::format("missing{}", i)));
+  }
+  auto stats = m.filterStatistics();
+  ASSERT_TRUE(stats.enabled);
+  ASSERT_EQ(stats.ids, 5000);
+  ASSERT_GE(stats.capacity, 5000);
+  ASSERT_GT(stats.bytes, 0);
+  // update creates IDs under the same lock it sets them with, so it
+  // doesn't ask the filter about the 4000 new ones
+  ASSERT_EQ(stats.definiteMisses + stats.falsePositives, 10000 + 3);
+  ASSERT_LT(stats.observedFalsePositiveRate(), 0.01);
+
+  // restore rebuilds it from what's restored
+  Metadata::MetadataMap stores;
+  stores["restored"] = std::make_shared<Metadata::DataType>();
+  m.restore(std::move(stores));
+  ASSERT_TRUE(m.contains("restored"));
+  ASSERT_FALSE(m.contains("id1"));
+  ASSERT_EQ(m.filterStatistics().ids, 1);
+
+  m.setIdFilter(false);
+  ASSERT_FALSE(m.filterStatistics().enabled);
+  ASSERT_TRUE(m.contains("restored"));
+}
+
+TEST(Filter, ResizeWhileReading) {
+  // Readers going through the filter while it's rebuilt bigger (and
+  // turned off and on) underneath them. The old filters get freed as
+  // they're replaced, so this is mostly for the sanitizers.
+  Metadata m;
+  m.update("id0", "key", "value");
+  m.setIdFilter(true, 16);
+  std::atomic<bool> done{false};
+  std::atomic<int> wrong{0};
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&]() {
+      while (!done) {
+	if (m.contains("missing") || !m.contains("id0")) {
+	  wrong++;
+	}
+      }
+    });
+  }
+  for (int i = 1; i < 20000; ++i) {
+    m.update(std::format("id{}", i), "key", "value");
+    if (i % 5000 == 0) {
+      m.setIdFilter(false);
+      m.setIdFilter(true);
+    }
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQ(wrong, 0);
+  ASSERT_EQ(m.filterStatistics().ids, 20000);
+}
+
+TEST(Filter, Merge) {
+  // One merge with enough new IDs to make the filter grow partway
+  // through. The parallel importer goes through here.
+  Metadata m;
+  m.update("before", "key", "value");
+  m.setIdFilter(true, 16);
+  Metadata::MetadataMap stores;
+  for (int i = 0; i < 5000; ++i) {
+    auto store = std::make_shared<Metadata::DataType>();
+    (*store)["key"] = Value(std::format("value{}", i));
+    stores[std::format("id{}", i)] = store;
+  }
+  stores["before"] = std::make_shared<Metadata::DataType>();
+  m.merge(std::move(stores));
+  for (int i = 0; i < 5000; ++i) {
+    std::string id = std::format("id{}", i);
+    ASSERT_TRUE(m.contains(id)) << id;
+    ASSERT_EQ(m.value(id, "key"), std::format("value{}", i));
+  }
+  ASSERT_TRUE(m.contains("before"));
+  ASSERT_EQ(m.filterStatistics().ids, 5001);
+
+  // And a small one that fits without growing
+  Metadata::MetadataMap more;
+  more["late"] = std::make_shared<Metadata::DataType>();
+  m.merge(std::move(more));
+  ASSERT_TRUE(m.contains("late"));
+  ASSERT_EQ(m.filterStatistics().ids, 5002);
+}
@@ -0,0 +1,147 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the perfect hash and frozen metadata
+ */
+
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <format>
+#include <fr/metadata/frozen.h>
+#include <fr/metadata/metadata.h>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+TEST(Frozen, PerfectHash) {
+  for (size_t n : {0, 1, 2, 7, 1000, 50000}) {
+    std::vector<uint64_t> hashes;
+    for (size_t i = 0; i < n; ++i) {
+      hashes.push_back(codec::hash64(std::format("key{}", i)));
+    }
+    auto pilots = PerfectHash::build(hashes);
+    ASSERT_TRUE(pilots.has_value());
+    ASSERT_EQ(pilots->size(), PerfectHash::bucketCount(n));
+    std::vector<bool> seen(n, false);
+    for (uint64_t hash : hashes) {
+      size_t s = PerfectHash::slot(hash, (*pilots)[PerfectHash::bucket(hash, pilots->size())], n);
+      ASSERT_LT(s, n);
+      ASSERT_FALSE(seen[s]);
+      seen[s] = true;
+    }
+  }
+  // Duplicate hashes can't be separated
+  ASSERT_FALSE(PerfectHash::build({1, 2, 1}).has_value());
+}
+
+TEST(Frozen, MatchesMetadata) {
+  Metadata m;
+  for (int i = 0; i < 20000; ++i) {
+    std::string id = std::format("id{}", i);
+    m.update(id, "name", id);
+    m.update(id, std::format("key{}", i % 50), std::format("value{}", i % 7));
+  }
+  m.add("Empty");
+
+  auto frozen = FrozenMetadata::build(m);
+  ASSERT_EQ(frozen->idCount(), 20001);
+  ASSERT_EQ(frozen->ids(), m.ids());
+  for (int i = 0; i < 20000; ++i) {
+    std::string id = std::format("id{}", i);
+    ASSERT_TRUE(frozen->contains(id));
+    ASSERT_EQ(frozen->value(id, "name"), id);
+    ASSERT_EQ(frozen->value(id, std::format("key{}", i % 50)), std::format("value{}", i % 7));
+    ASSERT_FALSE(frozen->idContains(id, std::format("key{}", (i + 1) % 50)));
+  }
+  ASSERT_EQ(frozen->keys("id3"), m.keys("id3"));
+  ASSERT_TRUE(frozen->contains("Empty"));
+  ASSERT_TRUE(frozen->keys("Empty").empty());
+  ASSERT_FALSE(frozen->contains("id20000"));
+  ASSERT_FALSE(frozen->idContains("id1", "nope"));
+  ASSERT_THROW(frozen->value("nope", "name"), std::runtime_error);
+  ASSERT_THROW(frozen->keys("nope"), std::runtime_error);
+
+  Metadata copy;
+  frozen->materialize(copy);
+  ASSERT_EQ(copy.ids(), m.ids());
+  ASSERT_EQ(copy.value("id42", "key42"), "value0");
+}
+
+TEST(Frozen, File) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Foo", "Wibble", "Wobble");
+  m.update("Quux", "Bar", "Baz");
+  TempPath path("frozen");
+  FrozenMetadata::write(path.str(), m);
+  {
+    FrozenMetadata frozen(path.str());
+    ASSERT_EQ(frozen.idCount(), 2);
+    ASSERT_EQ(frozen.value("Foo", "Wibble"), "Wobble");
+    ASSERT_EQ(frozen.value("Quux", "Bar"), "Baz");
+    ASSERT_FALSE(frozen.contains("Bar"));
+  }
+  // Chop the end off and it should refuse to open
+  std::filesystem::resize_file(path.str(), std::filesystem::file_size(path.str()) - 1);
+  ASSERT_THROW(FrozenMetadata frozen(path.str()), std::runtime_error);
+
+  Metadata empty;
+  auto frozen = FrozenMetadata::build(empty);
+  ASSERT_EQ(frozen->idCount(), 0);
+  ASSERT_FALSE(frozen->contains("Foo"));
+  ASSERT_FALSE(frozen->idContains("Foo", "Bar"));
+}
+
+// Every offset, pair range and key slot in the image gets checked when
+// it's opened, rather than trusted by the lookups
+TEST(Frozen, Corrupt) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Foo", "Wibble", "Wobble");
+  m.update("Quux", "Bar", "Baz");
+  std::string good = FrozenMetadata::image(m.snapshot());
+  auto section = [&](int i) { return codec::getU64(good.data() + 56 + 8 * i); };
+  TempPath path("frozen_corrupt");
+  auto opens = [&](size_t at, uint64_t value, size_t width) {
+    std::string bad = good;
+    for (size_t i = 0; i < width; ++i) {
+      bad[at + i] = static_cast<char>(value >> (8 * i));
+    }
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      out.write(bad.data(), bad.size());
+    }
+    try {
+      FrozenMetadata frozen(path.str());
+      return true;
+    } catch (std::runtime_error&) {
+      return false;
+    }
+  };
+  ASSERT_TRUE(opens(0, 'F', 1));
+  // An ID past the end of the file, and one with more pairs than there are
+  ASSERT_FALSE(opens(section(2), good.size(), 8));
+  ASSERT_FALSE(opens(section(2) + 24, 1000, 4));
+  // A key name too long
+  ASSERT_FALSE(opens(section(3) + 8, 0xffffffff, 4));
+  // A pair pointing at a key slot that doesn't exist
+  ASSERT_FALSE(opens(section(4) + 12, 2, 4));
+  // An ID count that would overflow the section lengths
+  ASSERT_FALSE(opens(16, 1ull << 62, 8));
+}
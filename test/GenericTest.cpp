@@ -0,0 +1,115 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for BasicMetadata and its ID and key types
+ */
+
+#include <gtest/gtest.h>
+#include <cereal/archives/binary.hpp>
+#include <fr/metadata/generic.h>
+#include <fr/metadata/metadata.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+TEST(Generic, Types) {
+  const std::string text = "0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0";
+  Uuid128 uuid = Uuid128::parse(text);
+  ASSERT_EQ(uuid.hi, 0x0f1e2d3c4b5a6978ull);
+  ASSERT_EQ(uuid.lo, 0x8796a5b4c3d2e1f0ull);
+  ASSERT_EQ(uuid.str(), text);
+  ASSERT_EQ(Uuid128::parse("0F1E2D3C4B5A69788796A5B4C3D2E1F0"), uuid);
+  ASSERT_THROW(Uuid128::parse("0f1e2d3c"), std::runtime_error);
+  ASSERT_THROW(Uuid128::parse(text + "0"), std::runtime_error);
+  ASSERT_THROW(Uuid128::parse("zz1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0"), std::runtime_error);
+  ASSERT_LT(Uuid128::parse("00000000-0000-0000-0000-000000000001"), uuid);
+
+  Symbol mime("mime");
+  ASSERT_EQ(Symbol(std::string("mime")), mime);
+  ASSERT_NE(Symbol("size"), mime);
+  ASSERT_EQ(mime.str(), "mime");
+  ASSERT_EQ(Symbol().str(), "");
+  ASSERT_EQ(sizeof(Symbol), 4);
+  ASSERT_EQ(sizeof(Uuid128), 16);
+
+  ASSERT_EQ(KeyTraits<uint64_t>::fromString("42"), 42);
+  ASSERT_THROW(KeyTraits<uint64_t>::fromString("4x2"), std::runtime_error);
+}
+
+TEST(Generic, Metadata) {
+  UuidMetadata m;
+  Uuid128 cat = Uuid128::parse("00000000-0000-4000-8000-000000000002");
+  Uuid128 dog = Uuid128::parse("00000000-0000-4000-8000-000000000001");
+  m.set(cat, "size", Value::ofInt(2048));
+  m.set(cat, "mime", "image/png");
+  m.add(dog);
+  ASSERT_THROW(m.add(dog), std::runtime_error);
+  ASSERT_TRUE(m.contains(cat));
+  ASSERT_TRUE(m.idContains(cat, "mime"));
+  ASSERT_FALSE(m.idContains(dog, "mime"));
+  ASSERT_EQ(m.get(cat, "size").asInt(), 2048);
+  ASSERT_THROW(m.get(dog, "size"), std::runtime_error);
+  ASSERT_EQ(m.ids(), (std::vector<Uuid128>{dog, cat}));
+  ASSERT_EQ(m.keys(cat).size(), 2);
+
+  // Snapshots don't see later changes
+  auto before = m.snapshot();
+  m.set(cat, "size", Value::ofInt(1));
+  m.erase(cat, "mime");
+  ASSERT_EQ(before.at(cat)->size(), 2);
+  ASSERT_FALSE(m.idContains(cat, "mime"));
+  m.erase(dog);
+  ASSERT_EQ(m.size(), 1);
+
+  // Integer IDs work too
+  BasicMetadata<uint64_t, std::string> byNumber;
+  byNumber.set(7, "name", "seven");
+  ASSERT_EQ(byNumber.get(7, "name"), Value("seven"));
+}
+
+TEST(Generic, Serialization) {
+  // Archives are interchangeable with Metadata's
+  Metadata plain;
+  plain.update("00000000-0000-4000-8000-000000000001", "mime", "text/plain");
+  plain.setInt("00000000-0000-4000-8000-000000000001", "size", 12);
+  std::stringstream stream;
+  {
+    cereal::BinaryOutputArchive archive(stream);
+    archive(plain);
+  }
+  UuidMetadata m;
+  {
+    cereal::BinaryInputArchive archive(stream);
+    archive(m);
+  }
+  Uuid128 id = Uuid128::parse("00000000-0000-4000-8000-000000000001");
+  ASSERT_EQ(m.get(id, "size").asInt(), 12);
+  ASSERT_EQ(m.get(id, "mime"), Value("text/plain"));
+
+  std::stringstream back;
+  {
+    cereal::BinaryOutputArchive archive(back);
+    archive(m);
+  }
+  Metadata copy;
+  {
+    cereal::BinaryInputArchive archive(back);
+    archive(copy);
+  }
+  ASSERT_EQ(copy.value("00000000-0000-4000-8000-000000000001", "mime"), "text/plain");
+  ASSERT_EQ(copy.getInt("00000000-0000-4000-8000-000000000001", "size"), 12);
+}
@@ -0,0 +1,162 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for hot key tracking
+ */
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <format>
+#include <fr/metadata/hotkeys.h>
+#include <fr/metadata/metadata.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  HotTracker::Options everything() {
+    HotTracker::Options options;
+    options.sampleEvery = 1;
+    options.capacity = 16;
+    options.halfLife = std::chrono::milliseconds(0);
+    return options;
+  }
+
+}
+
+TEST(HotKey, Tracker) {
+  // Space-Saving on its own: the busy names stay, the error says how
+  // far off a count can be
+  SpaceSaving summary(4);
+  for (int round = 0; round < 100; ++round) {
+    summary.offer("hot", 10);
+    summary.offer("warm", 3);
+    summary.offer(std::format("cold{}", round));
+  }
+  std::map<std::string, HotEntry> kept;
+  for (const auto& entry : summary.entries()) {
+    kept[entry.name] = entry;
+  }
+  ASSERT_EQ(kept.size(), 4);
+  ASSERT_EQ(kept["hot"].count, 1000);
+  ASSERT_EQ(kept["hot"].error, 0);
+  ASSERT_GE(kept["warm"].count, 300);
+
+  // A skewed stream through the whole tracker. Names i gets used
+  // 1000 / i times, so the top 5 are name1 to name5 in that order.
+  HotTracker tracker(everything());
+  std::map<std::string, uint64_t> truth;
+  for (int i = 1; i <= 2000; ++i) {
+    std::string name = std::format("name{}", i);
+    for (int n = 0; n < 1000 / i + 1; ++n) {
+      tracker.record(name);
+      truth[name]++;
+    }
+  }
+  auto top = tracker.top(5);
+  ASSERT_EQ(top.size(), 5);
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_EQ(top[i].name, std::format("name{}", i + 1));
+    ASSERT_GE(top[i].count, truth[top[i].name]);
+    ASSERT_LE(top[i].count - top[i].error, truth[top[i].name]);
+  }
+  // The sketch never comes in low
+  for (const auto& [name, count] : truth) {
+    ASSERT_GE(tracker.estimate(name), count) << name;
+  }
+  ASSERT_EQ(tracker.sampled(), [&truth]() {
+    uint64_t total = 0;
+    for (const auto& [name, count] : truth) {
+      total += count;
+    }
+    return total;
+  }());
+
+  // Decay halves everything
+  uint64_t before = tracker.top(1)[0].count;
+  uint64_t estimated = tracker.estimate("name1");
+  tracker.decay();
+  ASSERT_EQ(tracker.top(1)[0].count, before / 2);
+  ASSERT_EQ(tracker.estimate("name1"), estimated / 2);
+  tracker.clear();
+  ASSERT_TRUE(tracker.top(5).empty());
+  ASSERT_EQ(tracker.estimate("name1"), 0);
+}
+
+TEST(HotKey, Metadata) {
+  Metadata m;
+  for (int i = 0; i < 1000; ++i) {
+    m.setInt(std::format("file{}", i), "size", i);
+    m.update(std::format("file{}", i), "mime", "text/plain");
+  }
+  ASSERT_FALSE(m.hotKeyStatistics().enabled);
+  ASSERT_EQ(m.accessEstimate("file7"), 0);
+
+  m.setHotKeyTracking(true, everything());
+  // Four threads mostly reading file7's size, with a bit of
+  // everything else mixed in
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&m, t]() {
+      for (int i = 0; i < 5000; ++i) {
+	m.getInt("file7", "size");
+	if (i % 10 == 0) {
+	  m.value(std::format("file{}", (i + t) % 1000), "mime");
+	}
+      }
+      m.increment("file42", "hits");
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  auto stats = m.hotKeyStatistics(3);
+  ASSERT_TRUE(stats.enabled);
+  ASSERT_EQ(stats.sampleEvery, 1);
+  ASSERT_EQ(stats.ids.size(), 3);
+  ASSERT_EQ(stats.ids[0].name, "file7");
+  ASSERT_GE(stats.ids[0].count, 20000);
+  ASSERT_EQ(stats.keys[0].name, "size");
+  ASSERT_GE(stats.keys[1].count, 2000);
+  ASSERT_EQ(stats.keys[1].name, "mime");
+  ASSERT_GE(m.accessEstimate("file7"), 20000);
+  ASSERT_GE(m.accessEstimate("file42"), 4);
+  ASSERT_GT(stats.bytes, 0);
+
+  // Sampled, the counts are scaled back up to about the same thing
+  HotTracker::Options sampled = everything();
+  sampled.sampleEvery = 8;
+  m.setHotKeyTracking(true, sampled);
+  // Every fourth read is file3, which a fixed sample rate of 8 would
+  // see either every time or not at all
+  for (int i = 0; i < 80000; ++i) {
+    m.get(i % 4 ? "file5" : "file3", "mime");
+  }
+  stats = m.hotKeyStatistics(2);
+  ASSERT_EQ(stats.ids[0].name, "file5");
+  ASSERT_EQ(stats.ids[1].name, "file3");
+  ASSERT_NEAR(static_cast<double>(stats.sampled), 10000.0, 1000.0);
+  ASSERT_NEAR(static_cast<double>(stats.ids[0].count), 60000.0, 6000.0);
+  ASSERT_NEAR(static_cast<double>(stats.ids[1].count), 20000.0, 2000.0);
+
+  m.setHotKeyTracking(false);
+  ASSERT_FALSE(m.hotKeyStatistics().enabled);
+  ASSERT_EQ(m.accessEstimate("file3"), 0);
+}
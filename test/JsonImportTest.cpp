@@ -0,0 +1,301 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the fast JSON importer
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/json_import.h>
+#include <fr/metadata/json_stream.h>
+#include <fr/metadata/metadata.h>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  // The slow, obvious version of stage one
+  std::vector<size_t> scalarStructurals(const std::string& input) {
+    std::vector<size_t> positions;
+    bool inString = false;
+    bool escaped = false;
+    for (size_t i = 0; i < input.size(); ++i) {
+      char c = input[i];
+      if (inString) {
+	if (escaped) {
+	  escaped = false;
+	} else if (c == '\\') {
+	  escaped = true;
+	} else if (c == '"') {
+	  inString = false;
+	  positions.push_back(i);
+	}
+      } else if (c == '"') {
+	inString = true;
+	positions.push_back(i);
+      } else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') {
+	positions.push_back(i);
+      }
+    }
+    return positions;
+  }
+
+}
+
+TEST(JsonImport, ScannerMatchesScalar) {
+  // Lots of backslashes, quotes and structurals inside strings, in runs
+  // that cross 64 byte block boundaries
+  std::mt19937 rng(1234);
+  const std::string alphabet = "\\\\\\\"{}[]:,ab ";
+  for (int round = 0; round < 200; ++round) {
+    std::string input = "{";
+    int pairs = 1 + rng() % 40;
+    for (int p = 0; p < pairs; ++p) {
+      std::string raw;
+      int len = rng() % 70;
+      for (int i = 0; i < len; ++i) {
+	raw.push_back(alphabet[rng() % alphabet.size()]);
+      }
+      std::string quoted;
+      JsonStreamer::quote(quoted, raw);
+      input += quoted + ":" + quoted + (p + 1 < pairs ? "," : "");
+    }
+    input += "}";
+    JsonImporter::StructuralScanner scanner(input);
+    std::vector<size_t> fast;
+    size_t pos;
+    while (scanner.next(pos)) {
+      fast.push_back(pos);
+    }
+    ASSERT_EQ(fast, scalarStructurals(input)) << input;
+    ASSERT_FALSE(scanner.unterminatedString());
+  }
+}
+
+TEST(JsonImport, SimpleShape) {
+  Metadata m;
+  JsonImporter::load(m, " { \"m\" : { \"Foo\" : { \"Bar\" : \"Baz\", \"Esc\\\"aped\" : \"line\\nbreak \\u00e9 \\ud83d\\ude00\" },\n"
+		     "\"Empty\": {} } }");
+  ASSERT_EQ(m.ids().size(), 2);
+  ASSERT_EQ(m.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(m.value("Foo", "Esc\"aped"), "line\nbreak \xc3\xa9 \xf0\x9f\x98\x80");
+  ASSERT_TRUE(m.keys("Empty").empty());
+}
+
+TEST(JsonImport, CerealShape) {
+  // Indented the way cereal writes it, with a repeated pointer
+  std::string json = R"({
+    "m": {
+        "value0": [
+            {
+                "key": "A",
+                "value": {
+                    "ptr_wrapper": {
+                        "id": 2147483649,
+                        "data": [
+                            {
+                                "key": "k",
+                                "value": "v"
+                            }
+                        ]
+                    }
+                }
+            },
+            {
+                "key": "B",
+                "value": {
+                    "ptr_wrapper": {
+                        "id": 1
+                    }
+                }
+            }
+        ]
+    }
+})";
+  auto stores = JsonImporter::parse(json);
+  ASSERT_EQ(stores.size(), 2);
+  ASSERT_EQ(stores.at("A")->at("k"), "v");
+  ASSERT_EQ(stores.at("A"), stores.at("B"));
+}
+
+TEST(JsonImport, RoundTripWithStreamer) {
+  Metadata m;
+  for (int i = 0; i < 500; ++i) {
+    m.update(std::format("id{}", i), "key", std::format("value \"{}\" \\ {}", i, i));
+    m.update(std::format("id{}", i), "other", std::string(i % 97, '\\'));
+  }
+  std::ostringstream out;
+  JsonStreamer::write(m, out);
+  Metadata loaded;
+  JsonImporter::load(loaded, out.str());
+  ASSERT_EQ(loaded.snapshot().size(), 500);
+  for (const auto& [id, store] : m.snapshot()) {
+    ASSERT_EQ(*loaded.snapshot().at(id), *store);
+  }
+}
+
+TEST(JsonImport, Malformed) {
+  Metadata m;
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"Foo\":{\"Bar\":\"Baz\"}}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"Foo\":{\"Bar\":\"Baz}}}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"Foo\":{\"Bar\":12}}}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"Foo\":{\"Bar\":\"Baz\"}}} {"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"value0\":[{\"key\":\"A\",\"value\":{\"ptr_wrapper\":{\"id\":7}}}]}}"),
+	       std::runtime_error);
+  // Junk that isn't structural, between structurals and after the end
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"a\":{\"k\":\"v\"} xyz }}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"a\":{\"k\":\"v\"}}} trailing"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"a\":{\"k\" x:\"v\"}}}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"a\":{\"k\":\"v\"}}, \"extra\": 1 2}"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"a\":{\"k\":\"v\"}}, \"extra\": }"), std::runtime_error);
+  ASSERT_THROW(JsonImporter::load(m, "{\"m\":{\"value0\":[{\"key\":\"A\",\"value\":{\"ptr_wrapper\":{\"id\":0 x}}}]}}"),
+	       std::runtime_error);
+  // Whitespace anywhere, and anything after the IDs, is still fine
+  JsonImporter::load(m, " {\n \"m\" : { \"a\" : { \"k\" : \"v\" } } ,\"extra\": [1, {\"x\": true}], \"n\": -1.5e3 }\n");
+  ASSERT_EQ(m.value("a", "k"), "v");
+  JsonImporter::load(m, "{\"m\":{\"value0\":[{\"key\":\"A\",\"value\":{\"ptr_wrapper\":{\"id\": 0 }}}], \"cereal_class_version\": 1}}");
+  ASSERT_TRUE(m.contains("A"));
+}
+
+namespace {
+
+  // Strings full of quotes, backslashes and structurals, so chunk
+  // boundaries land inside strings and right after backslashes
+  void fillTricky(Metadata& m) {
+    for (int i = 0; i < 300; ++i) {
+      m.update(std::format("id{}", i), "key", std::format("value \"{}\" \\ {}", i, "{[:,]}"));
+      m.update(std::format("id{}", i), "other", std::string(i % 13, '\\') + "\"");
+    }
+  }
+
+  void expectSame(Metadata& expected, Metadata& actual) {
+    auto want = expected.snapshot();
+    auto got = actual.snapshot();
+    ASSERT_EQ(got.size(), want.size());
+    for (const auto& [id, store] : want) {
+      ASSERT_EQ(*got.at(id), *store) << id;
+    }
+  }
+
+}
+
+TEST(JsonImport, ParallelMatchesSerial) {
+  Metadata m;
+  fillTricky(m);
+  std::ostringstream out;
+  JsonStreamer::write(m, out);
+  std::string cereal = out.str();
+
+  std::string simple = "{\"m\":{";
+  for (const auto& [id, store] : m.snapshot()) {
+    if (simple.back() != '{') {
+      simple += ",";
+    }
+    JsonStreamer::quote(simple, id);
+    simple += ":{";
+    bool first = true;
+    for (const auto& [key, value] : *store) {
+      if (!first) {
+	simple += ",";
+      }
+      first = false;
+      JsonStreamer::quote(simple, key);
+      simple += ":";
+      JsonStreamer::quote(simple, value.bytes());
+    }
+    simple += "}";
+  }
+  simple += "},\"extra\":{\"not\":{\"an\":\"id\"}}}";
+
+  for (size_t chunkBytes : {7, 64, 1000, 100000}) {
+    Metadata fromCereal;
+    JsonImporter::loadParallel(fromCereal, cereal, 4, JsonImporter::Format::Json, chunkBytes);
+    expectSame(m, fromCereal);
+    Metadata fromSimple;
+    JsonImporter::loadParallel(fromSimple, simple, 4, JsonImporter::Format::Json, chunkBytes);
+    expectSame(m, fromSimple);
+  }
+}
+
+TEST(JsonImport, ParallelSharedPointers) {
+  // Every other ID refers back to the pointer before it, which is
+  // usually in another chunk
+  std::string json = "{\"m\":{\"value0\":[";
+  for (int i = 0; i < 100; ++i) {
+    if (i > 0) {
+      json += ",";
+    }
+    json += std::format("{}\"key\":\"id{}\",\"value\":{}\"ptr_wrapper\":{}\"id\":", "{", i, "{", "{");
+    if (i % 2 == 0) {
+      json += std::format("{},\"data\":[{}\"key\":\"k\",\"value\":\"v{}\"{}]", 2147483649 + i / 2, "{", i, "}");
+    } else {
+      json += std::to_string(i / 2 + 1);
+    }
+    json += "}}}";
+  }
+  json += "]},\"cereal_class_version\":1}";
+  auto serial = JsonImporter::parse(json);
+  Metadata m;
+  JsonImporter::loadParallel(m, json, 3, JsonImporter::Format::Json, 50);
+  auto stores = m.snapshot();
+  ASSERT_EQ(stores.size(), 100);
+  for (int i = 0; i < 100; i += 2) {
+    ASSERT_EQ(stores.at(std::format("id{}", i)), stores.at(std::format("id{}", i + 1)));
+    ASSERT_EQ(*stores.at(std::format("id{}", i)), *serial.at(std::format("id{}", i)));
+  }
+}
+
+TEST(JsonImport, ParallelLines) {
+  std::string lines;
+  for (int i = 0; i < 200; ++i) {
+    lines += std::format("{}\"id{}\":{}\"key\":\"line {}\\n\"{}{}\n", "{", i % 150, "{", i, "}", "}");
+    if (i % 17 == 0) {
+      lines += "\n";
+    }
+  }
+  Metadata m;
+  m.update("existing", "key", "kept");
+  JsonImporter::loadParallel(m, lines, 4, JsonImporter::Format::Lines, 100);
+  ASSERT_EQ(m.ids().size(), 151);
+  ASSERT_EQ(m.value("existing", "key"), "kept");
+  // Later lines win
+  ASSERT_EQ(m.value("id0", "key"), "line 150\n");
+  ASSERT_EQ(m.value("id149", "key"), "line 149\n");
+}
+
+TEST(JsonImport, ParallelMalformed) {
+  Metadata m;
+  fillTricky(m);
+  std::ostringstream out;
+  JsonStreamer::write(m, out);
+  std::string json = out.str();
+  Metadata loaded;
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, json.substr(0, json.size() / 2), 4, JsonImporter::Format::Json, 100),
+	       std::runtime_error);
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, json + "{", 4, JsonImporter::Format::Json, 100), std::runtime_error);
+  std::string broken = json;
+  broken[json.size() / 2] = '}';
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, broken, 4, JsonImporter::Format::Json, 100), std::runtime_error);
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, "{\"a\":{\"k\":\"v\"}}\n{\"b\":{\"k\":\"v\"}\n", 2,
+					  JsonImporter::Format::Lines, 1), std::runtime_error);
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, json + " trailing", 4, JsonImporter::Format::Json, 100), std::runtime_error);
+  ASSERT_THROW(JsonImporter::loadParallel(loaded, "{\"a\":{\"k\":\"v\"}} junk\n{\"b\":{\"k\":\"v\"}}\n", 2,
+					  JsonImporter::Format::Lines, 1), std::runtime_error);
+  // None of the chunks that did parse made it in
+  ASSERT_TRUE(loaded.ids().empty());
+}
@@ -0,0 +1,86 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the streaming JSON exporter
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/json_stream.h>
+#include <fr/metadata/metadata.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+TEST(JsonStream, Shape) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Foo", "Quote", "say \"hi\"\n");
+  m.add("Empty");
+  std::ostringstream out;
+  JsonStreamer::write(m, out);
+  ASSERT_EQ(out.str(),
+	    "{\"m\":{\"value0\":["
+	    "{\"key\":\"Empty\",\"value\":{\"ptr_wrapper\":{\"id\":2147483649,\"data\":[]}}},"
+	    "{\"key\":\"Foo\",\"value\":{\"ptr_wrapper\":{\"id\":2147483650,\"data\":["
+	    "{\"key\":\"Bar\",\"value\":\"Baz\"},"
+	    "{\"key\":\"Quote\",\"value\":\"say \\\"hi\\\"\\n\"}]}}}"
+	    "]}}");
+}
+
+TEST(JsonStream, BoundedChunks) {
+  Metadata m;
+  for (int i = 0; i < 1000; ++i) {
+    m.update(std::format("id{}", i), "key", std::string(100, 'x'));
+  }
+  std::vector<size_t> chunks;
+  std::string all;
+  JsonStreamer streamer([&](std::string_view chunk) {
+    chunks.push_back(chunk.size());
+    all.append(chunk);
+  }, 4096);
+  streamer.write(m);
+  ASSERT_GT(chunks.size(), 10);
+  for (size_t size : chunks) {
+    // A chunk can only run over by the tail of one entry
+    ASSERT_LT(size, 4096 + 1024);
+  }
+  std::ostringstream whole;
+  JsonStreamer::write(m, whole);
+  ASSERT_EQ(all, whole.str());
+}
+
+TEST(JsonStream, RoundTripThroughFile) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Wibble", "Tab\there", "Wobble");
+  TempPath path("json_stream.json");
+  int fd = ::open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_GE(fd, 0);
+  JsonStreamer::write(m, fd);
+  ::close(fd);
+
+  std::ifstream in(path);
+  std::stringstream contents;
+  contents << in.rdbuf();
+  Metadata loaded;
+  Metadata::fromJson(loaded, contents.str());
+  ASSERT_EQ(loaded.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(loaded.value("Wibble", "Tab\there"), "Wobble");
+}
@@ -0,0 +1,162 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the log-structured storage engine
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/lsm.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+namespace {
+
+  // Tiny memtables so a handful of writes ends up spread across
+  // several segments
+  LsmStore::Options smallOptions() {
+    LsmStore::Options options;
+    options.memtableBytes = 1024;
+    options.compactionTrigger = 4;
+    return options;
+  }
+
+}
+
+TEST(Lsm, BasicOperations) {
+  TempPath dir("lsm_basic");
+  LsmStore store(dir);
+  store.add("Foo", "Bar", "Baz");
+  ASSERT_TRUE(store.contains("Foo"));
+  ASSERT_TRUE(store.idContains("Foo", "Bar"));
+  ASSERT_EQ(store.value("Foo", "Bar"), "Baz");
+  ASSERT_THROW(store.add("Foo"), std::runtime_error);
+  ASSERT_THROW(store.add("Foo", "Bar", "Again"), std::runtime_error);
+  store.update("Foo", "Bar", "Florble");
+  ASSERT_EQ(store.value("Foo", "Bar"), "Florble");
+  store.erase("Foo", "Bar");
+  ASSERT_FALSE(store.idContains("Foo", "Bar"));
+  ASSERT_TRUE(store.contains("Foo"));
+  store.erase("Foo");
+  ASSERT_FALSE(store.contains("Foo"));
+  ASSERT_THROW(store.keys("Foo"), std::runtime_error);
+  ASSERT_THROW(store.value("Foo", "Bar"), std::runtime_error);
+}
+
+TEST(Lsm, FlushAndCompact) {
+  TempPath dir("lsm_compact");
+  LsmStore store(dir, smallOptions());
+  for (int i = 0; i < 500; ++i) {
+    store.update(std::format("id{}", i % 50), std::format("key{}", i % 7), std::format("value{}", i));
+  }
+  // Erasing an ID hides everything written to it earlier, including
+  // what's already on disk
+  store.erase("id7");
+  store.add("id7");
+  store.update("id7", "fresh", "yes");
+  store.erase("id8", "key1");
+  store.flush();
+  store.compactNow();
+
+  auto stats = store.stats();
+  ASSERT_GT(stats.flushes, 1);
+  ASSERT_GE(stats.compactions, 1);
+  ASSERT_EQ(stats.segments, 1);
+  ASSERT_GT(stats.writeAmplification(), 0.0);
+
+  ASSERT_EQ(store.ids().size(), 50);
+  ASSERT_EQ(store.keys("id7").size(), 1);
+  ASSERT_EQ(store.value("id7", "fresh"), "yes");
+  ASSERT_FALSE(store.idContains("id8", "key1"));
+  ASSERT_EQ(store.keys("id1").size(), 7);
+  // i = 451 is the last write to id1 key3
+  ASSERT_EQ(store.value("id1", "key3"), "value451");
+  ASSERT_FALSE(store.contains("nope"));
+  ASSERT_GT(store.stats().bloomNegatives, 0);
+}
+
+TEST(Lsm, Reopen) {
+  TempPath dir("lsm_reopen");
+  {
+    LsmStore store(dir, smallOptions());
+    for (int i = 0; i < 200; ++i) {
+      store.update(std::format("id{}", i), "key", std::format("value{}", i));
+    }
+    store.erase("id5");
+    // Whatever is left in the memtable only exists in the log
+  }
+  {
+    LsmStore store(dir, smallOptions());
+    ASSERT_EQ(store.ids().size(), 199);
+    ASSERT_FALSE(store.contains("id5"));
+    ASSERT_EQ(store.value("id199", "key"), "value199");
+    ASSERT_EQ(store.value("id0", "key"), "value0");
+    store.update("id0", "key", "changed");
+  }
+  LsmStore store(dir, smallOptions());
+  ASSERT_EQ(store.value("id0", "key"), "changed");
+}
+
+TEST(Lsm, Source) {
+  TempPath dir("lsm_source");
+  {
+    auto store = std::make_shared<LsmStore>(dir, smallOptions());
+    store->update("Foo", "name", "Foo's name");
+    store->update("Foo", "count", Value::ofInt(42).toText());
+    store->update("Bar", "name", "Bar's name");
+
+    Metadata m;
+    LsmSource::attach(m, store);
+    ASSERT_EQ(m.loadStatistics().cold, 2);
+    ASSERT_EQ(m.value("Foo", "name"), "Foo's name");
+    ASSERT_EQ(m.getInt("Foo", "count"), 42);
+    ASSERT_EQ(m.loadStatistics().loads, 1);
+
+    // Stores that change go back out on demote, as one replace
+    m.setAccessTracking(true);
+    m.setDouble("Foo", "score", 1.5);
+    m.erase("Foo", "name");
+    m.update("Baz", "name", "Baz's name");
+    // Foo was used a few times, so it takes a few sweeps to cool off
+    for (int i = 0; i < 4; ++i) {
+      m.demoteCold();
+    }
+    ASSERT_EQ(m.loadStatistics().cold, 3);
+    ASSERT_EQ(m.loadStatistics().writeBacks, 2);
+    ASSERT_FALSE(store->idContains("Foo", "name"));
+    ASSERT_EQ(store->keys("Foo"), (std::vector<std::string>{"count", "score"}));
+    ASSERT_EQ(store->value("Baz", "name"), "Baz's name");
+    ASSERT_EQ(m.getDouble("Foo", "score"), 1.5);
+
+    // Erasing from the Metadata erases it from the store
+    m.erase("Bar");
+    ASSERT_FALSE(store->contains("Bar"));
+  }
+
+  // A file that only looks like one of ours doesn't get in the way of
+  // opening it again
+  std::ofstream(std::filesystem::path(dir.str()) / "segment-junk.lsm") << "junk";
+  std::ofstream(std::filesystem::path(dir.str()) / "segment-") << "junk";
+  auto store = std::make_shared<LsmStore>(dir, smallOptions());
+  Metadata m;
+  LsmSource::attach(m, store);
+  ASSERT_EQ(m.ids(), (std::vector<std::string>{"Baz", "Foo"}));
+  ASSERT_EQ(m.getInt("Foo", "count"), 42);
+  ASSERT_TRUE(std::filesystem::exists(std::filesystem::path(dir.str()) / "segment-junk.lsm"));
+}
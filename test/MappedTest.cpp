@@ -0,0 +1,183 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the mmapped read-only format
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/mapped.h>
+#include <fr/metadata/metadata.h>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+namespace {
+
+  void writeSample(const std::string& path) {
+    Metadata m;
+    m.update("Foo", "Bar", "Baz");
+    m.update("Foo", "Wibble", "Wobble");
+    m.update("Quux", "Key", "Value");
+    m.add("Empty");
+    MappedFile::write(path, m);
+  }
+
+}
+
+TEST(Mapped, ReadInPlace) {
+  TempPath path("mapped_read");
+  writeSample(path);
+  MappedFile file(path);
+  ASSERT_EQ(file.idCount(), 3);
+  ASSERT_EQ(file.idAt(0), "Empty");
+  auto block = file.block("Foo");
+  ASSERT_TRUE(block.has_value());
+  ASSERT_EQ(block->size(), 2);
+  ASSERT_EQ(block->find("Wibble").value(), "Wobble");
+  ASSERT_FALSE(block->find("Nope").has_value());
+  ASSERT_FALSE(file.block("Nope").has_value());
+  ASSERT_EQ(file.block("Empty")->size(), 0);
+}
+
+// Offsets and lengths in the file aren't taken on trust
+TEST(Mapped, Corrupt) {
+  TempPath path("mapped_corrupt");
+  writeSample(path);
+  std::string good;
+  {
+    std::ifstream in(path, std::ios::binary);
+    good.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  size_t indexOffset = good.size() - 3 * MappedFile::indexEntrySize;
+  auto patched = [&](size_t at, uint64_t value, size_t width) {
+    std::string bad = good;
+    for (size_t i = 0; i < width; ++i) {
+      bad[at + i] = static_cast<char>(value >> (8 * i));
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bad.data(), bad.size());
+  };
+
+  // An ID or a block pointing off the end gets caught when it's used,
+  // and the rest of the file still works. Empty's entry is first.
+  patched(indexOffset, good.size(), 8);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.idAt(0), std::runtime_error);
+    ASSERT_EQ(file.block("Foo")->find("Bar").value(), "Baz");
+  }
+  patched(indexOffset + 8, 1000000, 4);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.find("Empty"), std::runtime_error);
+  }
+  patched(indexOffset + MappedFile::indexEntrySize + 16, good.size() - 2, 8);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.block("Foo"), std::runtime_error);
+    ASSERT_EQ(file.block("Quux")->find("Key").value(), "Value");
+  }
+  // A header whose index runs off the end still fails on opening
+  patched(16, good.size(), 8);
+  ASSERT_THROW(MappedFile{path}, std::runtime_error);
+
+  // Blocks when they're read. Foo's is the second one, after Empty's
+  // four bytes.
+  size_t foo = MappedFile::headerSize + 4;
+  patched(foo, 0xffffffff, 4);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.block("Foo"), std::runtime_error);
+  }
+  patched(foo + 4, 0xfffffff0, 4);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.block("Foo")->find("Bar"), std::runtime_error);
+    ASSERT_EQ(file.block("Quux")->find("Key").value(), "Value");
+  }
+  // A key length that runs past the end
+  patched(foo + 4 + 8, 0x7fffffff, 4);
+  {
+    MappedFile file(path);
+    ASSERT_THROW(file.block("Foo")->materialize(), std::runtime_error);
+  }
+}
+
+TEST(Mapped, Overlay) {
+  TempPath path("mapped_overlay");
+  writeSample(path);
+  MappedMetadata m(path);
+  ASSERT_TRUE(m.contains("Foo"));
+  ASSERT_EQ(m.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(m.ids().size(), 3);
+
+  m.update("Foo", "Bar", "Changed");
+  m.erase("Foo", "Wibble");
+  m.update("Aardvark", "Key", "Value");
+  m.erase("Quux");
+  ASSERT_EQ(m.value("Foo", "Bar"), "Changed");
+  ASSERT_FALSE(m.idContains("Foo", "Wibble"));
+  ASSERT_EQ(m.keys("Foo").size(), 1);
+  ASSERT_FALSE(m.contains("Quux"));
+  auto ids = m.ids();
+  ASSERT_EQ(ids.size(), 3);
+  ASSERT_EQ(ids[0], "Aardvark");
+
+  // Re-adding an erased ID must not resurrect the file's keys
+  m.add("Quux");
+  ASSERT_FALSE(m.idContains("Quux", "Key"));
+  ASSERT_TRUE(m.keys("Quux").empty());
+
+  Metadata materialized;
+  m.materialize(materialized);
+  ASSERT_EQ(materialized.value("Foo", "Bar"), "Changed");
+  ASSERT_EQ(materialized.ids().size(), 4);
+}
+
+TEST(Mapped, LazyLoading) {
+  TempPath path("mapped_lazy");
+  writeSample(path);
+  Metadata m;
+  MappedSource::attach(m, path);
+  ASSERT_EQ(m.ids().size(), 3);
+  ASSERT_EQ(m.loadStatistics().loads, 0);
+  ASSERT_EQ(m.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(m.loadStatistics().loads, 1);
+  ASSERT_EQ(m.value("Foo", "Wibble"), "Wobble");
+  ASSERT_EQ(m.loadStatistics().loads, 1);
+
+  // Clean stores can be paged out and come back on the next read
+  ASSERT_EQ(m.pageOut(), 1);
+  ASSERT_EQ(m.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(m.loadStatistics().loads, 2);
+
+  // Changed stores are dirty and stay put
+  m.update("Foo", "Bar", "Changed");
+  ASSERT_EQ(m.pageOut(), 0);
+  ASSERT_EQ(m.value("Foo", "Bar"), "Changed");
+
+  // Snapshots fill in what hasn't been loaded
+  auto snapshot = m.snapshot();
+  ASSERT_EQ(snapshot.at("Quux")->at("Key"), "Value");
+  ASSERT_EQ(m.loadStatistics().resident, 0);
+
+  m.setResidentLimit(1);
+  m.keys("Quux");
+  m.keys("Empty");
+  ASSERT_EQ(m.loadStatistics().resident, 1);
+}
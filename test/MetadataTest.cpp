@@ -18,8 +18,12 @@
 
 #include <gtest/gtest.h>
 #include <fr/metadata/metadata.h>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 using namespace fr::metadata;
 
@@ -135,3 +139,115 @@ TEST(Metadata, fromjson) {
   Metadata::fromJson(meatdata, json);
   ASSERT_EQ(m.value("Foo", "Bar"), meatdata.value("Foo", "Bar"));
 }
+
+// Several threads touching an unloaded store at once should only
+// load it once
+TEST(Metadata, LazyLoadDeduplication) {
+  class SlowSource : public Metadata::StoreSource {
+  public:
+    std::atomic<int> loads = 0;
+    Metadata::Data load(const std::string& id) override {
+      loads++;
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      auto store = std::make_shared<Metadata::DataType>();
+      (*store)["key"] = id;
+      return store;
+    }
+  };
+  auto source = std::make_shared<SlowSource>();
+  Metadata m;
+  m.attachSource(source, {"Foo", "Bar"});
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 8; ++i) {
+    readers.emplace_back([&m]() {
+      ASSERT_EQ(m.value("Foo", "key"), "Foo");
+    });
+  }
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  ASSERT_EQ(source->loads, 1);
+  ASSERT_EQ(m.loadStatistics().loads, 1);
+}
+
+// A follower kept up to date with deltas should end up the same as
+// the leader
+TEST(Metadata, DeltaExport) {
+  Metadata leader;
+  leader.update("Before", "key", "tracking started");
+  leader.setChangeTracking(true);
+  for (int i = 0; i < 100; ++i) {
+    leader.update(std::format("id{}", i), "key", std::format("value{}", i));
+  }
+
+  Metadata follower;
+  auto delta = leader.exportSince(0);
+  ASSERT_TRUE(delta.full);
+  follower.applyDelta(delta);
+  uint64_t seen = delta.through;
+  ASSERT_EQ(seen, leader.currentSequence());
+
+  leader.update("id5", "key", "changed");
+  leader.erase("id6");
+  leader.erase("id7", "key");
+  leader.add("new");
+  delta = leader.exportSince(seen);
+  ASSERT_FALSE(delta.full);
+  ASSERT_EQ(delta.stores.size(), 3);
+  ASSERT_EQ(delta.erased, std::vector<std::string>{"id6"});
+  follower.applyDelta(delta);
+  seen = delta.through;
+  ASSERT_EQ(follower.value("id5", "key"), "changed");
+  ASSERT_FALSE(follower.contains("id6"));
+  ASSERT_TRUE(follower.keys("id7").empty());
+  ASSERT_TRUE(follower.contains("new"));
+  ASSERT_EQ(follower.ids(), leader.ids());
+
+  // Nothing new, nothing sent
+  delta = leader.exportSince(seen);
+  ASSERT_TRUE(delta.stores.empty());
+  ASSERT_TRUE(delta.erased.empty());
+
+  // Once the tombstones are gone, anyone further behind gets everything
+  leader.update("id1", "key", "again");
+  ASSERT_EQ(leader.forgetChangesBefore(seen), 100);
+  ASSERT_TRUE(leader.exportSince(seen - 1).full);
+  delta = leader.exportSince(seen);
+  ASSERT_FALSE(delta.full);
+  ASSERT_EQ(delta.stores.size(), 1);
+}
+
+// Forks share stores until one side changes them
+TEST(Metadata, Fork) {
+  Metadata m;
+  for (int i = 0; i < 100; ++i) {
+    m.update(std::format("id{}", i), "key", std::format("value{}", i));
+  }
+  auto fork = m.fork();
+  ASSERT_EQ(fork->ids(), m.ids());
+
+  fork->update("id1", "key", "forked");
+  fork->erase("id2");
+  fork->add("forkOnly");
+  m.update("id3", "key", "original");
+
+  ASSERT_EQ(m.value("id1", "key"), "value1");
+  ASSERT_TRUE(m.contains("id2"));
+  ASSERT_FALSE(m.contains("forkOnly"));
+  ASSERT_EQ(fork->value("id1", "key"), "forked");
+  ASSERT_FALSE(fork->contains("id2"));
+  ASSERT_EQ(fork->value("id3", "key"), "value3");
+
+  // Only the stores that were touched got copied
+  auto ours = m.snapshot();
+  auto theirs = fork->snapshot();
+  ASSERT_EQ(ours.at("id50"), theirs.at("id50"));
+  ASSERT_NE(ours.at("id1"), theirs.at("id1"));
+  ASSERT_NE(ours.at("id3"), theirs.at("id3"));
+
+  // A fork of a fork is just as independent
+  auto again = fork->fork();
+  again->erase("id50");
+  ASSERT_TRUE(fork->contains("id50"));
+  ASSERT_TRUE(m.contains("id50"));
+}
@@ -0,0 +1,170 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the parallel walks and key predicates
+ */
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/predicate.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  const char *mimes[] = {"image/png", "image/jpeg", "text/plain", "application/pdf"};
+
+  // Enough files to get split across threads
+  void fillFiles(Metadata& m, int count) {
+    for (int i = 0; i < count; ++i) {
+      std::string id = std::format("file{}", 100000 + i);
+      m.update(id, "mime", mimes[i % 4]);
+      m.setInt(id, "size", i);
+    }
+  }
+
+  using Histogram = std::map<std::string, int64_t>;
+
+  Histogram countMimes(Metadata& m, size_t threads) {
+    return m.parallelReduce(Histogram(),
+			    [](Histogram& counts, const std::string&, const Metadata::DataType& store) {
+			      // A new ID can be caught before its first key goes in
+			      auto mime = store.find("mime");
+			      if (mime != store.end()) {
+				counts[mime->second.str()]++;
+			      }
+			    },
+			    [](Histogram& into, Histogram&& from) {
+			      for (const auto& [mime, count] : from) {
+				into[mime] += count;
+			      }
+			    }, threads);
+  }
+
+}
+
+TEST(Parallel, ForEachAndReduce) {
+  Metadata m;
+  fillFiles(m, 20000);
+
+  std::atomic<int64_t> total{0};
+  std::atomic<int> visited{0};
+  m.parallelForEach([&](const std::string&, const Metadata::DataType& store) {
+    total += store.at("size").asInt();
+    visited++;
+  }, 4);
+  ASSERT_EQ(visited, 20000);
+  ASSERT_EQ(total, 20000LL * 19999 / 2);
+
+  Histogram expected{{"application/pdf", 5000}, {"image/jpeg", 5000}, {"image/png", 5000}, {"text/plain", 5000}};
+  ASSERT_EQ(countMimes(m, 1), expected);
+  ASSERT_EQ(countMimes(m, 4), expected);
+  ASSERT_EQ(countMimes(m, 0), expected);
+
+  // Combining happens in ID order, so concatenating IDs gives them back
+  // sorted
+  auto ids = m.parallelReduce(std::vector<std::string>(),
+			      [](std::vector<std::string>& acc, const std::string& id, const Metadata::DataType&) { acc.push_back(id); },
+			      [](std::vector<std::string>& into, std::vector<std::string>&& from) { into.insert(into.end(), from.begin(), from.end()); },
+			      8);
+  ASSERT_EQ(ids, m.ids());
+
+  // Exceptions come back out
+  ASSERT_THROW(m.parallelForEach([](const std::string& id, const Metadata::DataType&) {
+    if (id == "file112345") {
+      throw std::runtime_error("nope");
+    }
+  }, 4), std::runtime_error);
+
+  // Small or empty metadata works too
+  Metadata empty;
+  ASSERT_TRUE(countMimes(empty, 4).empty());
+  empty.add("nothing");
+  ASSERT_EQ(empty.parallelFilter([](const std::string&, const Metadata::DataType& store) { return store.empty(); }, 4),
+	    std::vector<std::string>{"nothing"});
+}
+
+TEST(Parallel, Predicates) {
+  Metadata m;
+  fillFiles(m, 20000);
+  m.update("legacy", "size", "150");
+  m.update("legacy", "mime", "image/gif");
+
+  ASSERT_EQ(m.parallelFilter(KeyPredicate::equals("mime", Value("text/plain")), 4).size(), 5000);
+  auto images = m.parallelFilter(KeyPredicate::prefix("mime", "image/"), 4);
+  ASSERT_EQ(images.size(), 10001);
+  ASSERT_TRUE(std::is_sorted(images.begin(), images.end()));
+  ASSERT_EQ(m.parallelFilter(KeyPredicate::exists("size"), 4).size(), 20001);
+  ASSERT_TRUE(m.parallelFilter(KeyPredicate::exists("owner"), 4).empty());
+
+  // Numeric ranges include strings that read as numbers
+  auto mid = m.parallelFilter(KeyPredicate::range("size", Value::ofInt(100), Value::ofInt(199)), 4);
+  ASSERT_EQ(mid.size(), 101);
+  ASSERT_EQ(mid.back(), "legacy");
+  ASSERT_EQ(m.parallelFilter(KeyPredicate::range("size", Value::ofDouble(19998.5), std::nullopt), 4),
+	    std::vector<std::string>{"file119999"});
+  // Strings compare as text
+  ASSERT_EQ(m.parallelFilter(KeyPredicate::range("mime", Value("image/a"), Value("image/k")), 4).size(), 5001);
+
+  // And "7" equals 7
+  ASSERT_EQ(m.parallelFilter(KeyPredicate::equals("size", Value::ofInt(150)), 4),
+	    (std::vector<std::string>{"file100150", "legacy"}));
+}
+
+TEST(Parallel, Snapshot) {
+  // Writers carrying on while a reduce runs don't show up half way
+  // through it
+  Metadata m;
+  fillFiles(m, 20000);
+  std::atomic<bool> done{false};
+  std::thread writer([&]() {
+    for (int i = 0; !done; ++i) {
+      m.setInt(std::format("file{}", 100000 + i % 20000), "size", 0);
+      m.update(std::format("extra{}", i), "mime", "image/png");
+    }
+  });
+  for (int pass = 0; pass < 5; ++pass) {
+    auto counts = countMimes(m, 4);
+    EXPECT_EQ(counts["text/plain"], 5000);
+  }
+  done = true;
+  writer.join();
+}
+
+TEST(Parallel, SharedPool) {
+  Metadata m;
+  fillFiles(m, 8000);
+  ThreadPool *pool = &Metadata::View::pool();
+  ASSERT_EQ(countMimes(m, 4).size(), 4);
+  ASSERT_EQ(countMimes(m, 4).size(), 4);
+  ASSERT_EQ(&Metadata::View::pool(), pool);
+
+  // Walks started from inside a walk (more of them than there are pool
+  // threads) still finish, on whatever threads they can get
+  std::atomic<int> inner{0};
+  auto view = m.view();
+  auto outer = view.split(pool->size() * 2);
+  Metadata::View::run(outer, pool->size() * 2, [&](size_t, auto, auto) {
+    m.parallelForEach([&](const std::string&, const Metadata::DataType&) { inner++; }, 4);
+  });
+  ASSERT_EQ(inner, 8000 * (outer.size() - 1));
+}
@@ -0,0 +1,158 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for path IDs and the radix tree behind them
+ */
+
+#include <gtest/gtest.h>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/paths.h>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  void fillPaths(Metadata& m) {
+    for (const char *id : {"acme/web/index.html", "acme/web/css/site.css", "acme/web/css/print.css",
+			   "acme/api", "acme/api/v1", "acme/api-old", "globex/data/2024.csv", "lonely"}) {
+      m.update(id, "owner", "someone");
+    }
+  }
+
+  void checkPaths(Metadata& m) {
+    ASSERT_EQ(m.listChildren(""), (std::vector<std::string>{"acme", "globex", "lonely"}));
+    ASSERT_EQ(m.listChildren("acme"), (std::vector<std::string>{"api", "api-old", "web"}));
+    ASSERT_EQ(m.listChildren("acme/web"), (std::vector<std::string>{"css", "index.html"}));
+    ASSERT_EQ(m.listChildren("acme/api"), (std::vector<std::string>{"v1"}));
+    ASSERT_TRUE(m.listChildren("acme/we").empty());
+    ASSERT_TRUE(m.listChildren("nobody").empty());
+
+    ASSERT_EQ(m.subtreeCount(""), 8);
+    ASSERT_EQ(m.subtreeCount("acme"), 6);
+    // The ID acme/api counts, acme/api-old doesn't
+    ASSERT_EQ(m.subtreeCount("acme/api"), 2);
+    ASSERT_EQ(m.subtreeCount("acme/web/css"), 2);
+    ASSERT_EQ(m.subtreeCount("lonely"), 1);
+    ASSERT_EQ(m.subtreeCount("acme/w"), 0);
+
+    auto web = m.exportSubtree("acme/web");
+    ASSERT_EQ(web.size(), 3);
+    ASSERT_TRUE(web.contains("acme/web/css/site.css"));
+
+    ASSERT_EQ(m.eraseSubtree("acme/api"), 2);
+    ASSERT_TRUE(m.contains("acme/api-old"));
+    ASSERT_FALSE(m.contains("acme/api/v1"));
+    ASSERT_EQ(m.subtreeCount("acme"), 4);
+    ASSERT_EQ(m.listChildren("acme"), (std::vector<std::string>{"api-old", "web"}));
+    m.erase("acme/web/index.html");
+    ASSERT_EQ(m.listChildren("acme/web"), (std::vector<std::string>{"css"}));
+    ASSERT_EQ(m.eraseSubtree(""), 5);
+    ASSERT_EQ(m.subtreeCount(""), 0);
+  }
+
+}
+
+TEST(Path, Tree) {
+  PathTree tree;
+  ASSERT_TRUE(tree.insert("tenant/project/a"));
+  ASSERT_TRUE(tree.insert("tenant/project/b"));
+  ASSERT_FALSE(tree.insert("tenant/project/a"));
+  ASSERT_TRUE(tree.insert("tenant/pro"));
+  ASSERT_TRUE(tree.contains("tenant/pro"));
+  ASSERT_FALSE(tree.contains("tenant/p"));
+  ASSERT_EQ(tree.count("tenant/"), 3);
+  ASSERT_EQ(tree.count("tenant/project/"), 2);
+  ASSERT_EQ(tree.count("tenant/proj"), 2);
+  ASSERT_EQ(tree.count("x"), 0);
+  ASSERT_EQ(tree.children("tenant/", '/'), (std::vector<std::string>{"pro", "project"}));
+  ASSERT_TRUE(tree.erase("tenant/pro"));
+  ASSERT_FALSE(tree.erase("tenant/pro"));
+  ASSERT_FALSE(tree.erase("tenant/project"));
+  ASSERT_EQ(tree.size(), 2);
+
+  // Compare with the obvious way on a pile of random paths
+  std::mt19937 rng(7);
+  std::set<std::string> ids;
+  for (int i = 0; i < 5000; ++i) {
+    std::string id = std::format("t{}/p{}/f{}", rng() % 5, rng() % 20, rng() % 100);
+    ASSERT_EQ(tree.insert(id), ids.insert(id).second);
+    if (i % 3 == 0) {
+      auto victim = ids.lower_bound(std::format("t{}", rng() % 5));
+      if (victim != ids.end()) {
+	ASSERT_TRUE(tree.erase(*victim));
+	ids.erase(victim);
+      }
+    }
+  }
+  tree.erase("tenant/project/a");
+  tree.erase("tenant/project/b");
+  ASSERT_EQ(tree.size(), ids.size());
+  for (int t = 0; t < 5; ++t) {
+    std::string prefix = std::format("t{}/p1", t);
+    size_t expected = 0;
+    std::set<std::string> children;
+    for (const auto& id : ids) {
+      if (id.starts_with(prefix)) {
+	expected++;
+      }
+      if (id.starts_with(std::format("t{}/", t))) {
+	children.insert(id.substr(3, id.find('/', 3) - 3));
+      }
+    }
+    ASSERT_EQ(tree.count(prefix), expected);
+    ASSERT_EQ(tree.children(std::format("t{}/", t), '/'), std::vector<std::string>(children.begin(), children.end()));
+  }
+  for (const auto& id : ids) {
+    ASSERT_TRUE(tree.contains(id));
+    ASSERT_TRUE(tree.erase(id));
+  }
+  ASSERT_EQ(tree.size(), 0);
+}
+
+TEST(Path, Metadata) {
+  // Same answers with and without the tree
+  Metadata plain;
+  fillPaths(plain);
+  checkPaths(plain);
+
+  Metadata indexed;
+  indexed.setPathIndex(true);
+  fillPaths(indexed);
+  ASSERT_GT(indexed.pathIndexBytes(), 0);
+  checkPaths(indexed);
+
+  // Turning it on later picks up what's already there, and restores
+  // rebuild it
+  Metadata later;
+  fillPaths(later);
+  later.setPathIndex(true);
+  ASSERT_EQ(later.subtreeCount("acme"), 6);
+  later.restore(later.exportSubtree("globex"));
+  ASSERT_EQ(later.subtreeCount(""), 1);
+  ASSERT_EQ(later.listChildren(""), (std::vector<std::string>{"globex"}));
+
+  // Other separators
+  Metadata dotted;
+  dotted.setPathIndex(true, '.');
+  dotted.update("com.example.www", "a", "b");
+  dotted.update("com.example.mail", "a", "b");
+  ASSERT_EQ(dotted.listChildren("com.example"), (std::vector<std::string>{"mail", "www"}));
+  ASSERT_EQ(dotted.subtreeCount("com"), 2);
+}
@@ -0,0 +1,268 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for queries
+ */
+
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/query.h>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  const char *mimes[] = {"image/png", "image/jpeg", "text/plain", "application/pdf", "image/gif"};
+
+  // files/100000 to files/1xxxxx, with sizes that repeat every 1000
+  std::shared_ptr<Metadata> makeFiles(int count) {
+    auto m = std::make_shared<Metadata>();
+    for (int i = 0; i < count; ++i) {
+      std::string id = std::format("files/{}", 100000 + i);
+      m->update(id, "mime", mimes[i % 5]);
+      m->setInt(id, "size", (i * 7919) % 1000);
+      if (i % 10 != 0) {
+	m->setInt(id, "mtime", 1700000000 + i);
+      }
+    }
+    return m;
+  }
+
+  std::vector<std::string> ids(const std::vector<QueryRow>& rows) {
+    std::vector<std::string> found;
+    for (const auto& row : rows) {
+      found.push_back(row.id);
+    }
+    return found;
+  }
+
+  // The same query done the slow way
+  std::vector<std::string> bruteForce(Metadata& m, const Query& q) {
+    std::vector<std::pair<OrderKey, std::string>> rows;
+    for (const auto& [id, store] : m.snapshot()) {
+      if (!q.where || q.where->matches(id, *store)) {
+	auto found = store->find(q.orderBy);
+	rows.emplace_back(OrderKey::of(found == store->end() ? nullptr : &found->second), id);
+      }
+    }
+    std::stable_sort(rows.begin(), rows.end(), [&q](const auto& a, const auto& b) {
+      if (!q.orderBy.empty()) {
+	int c = OrderKey::compare(a.first, b.first);
+	if (q.descending && a.first.rank != OrderKey::Rank::Missing && b.first.rank != OrderKey::Rank::Missing) {
+	  c = -c;
+	}
+	if (c) {
+	  return c < 0;
+	}
+      }
+      return a.second < b.second;
+    });
+    std::vector<std::string> found;
+    for (const auto& [key, id] : rows) {
+      if (q.limit && found.size() == q.limit) {
+	break;
+      }
+      found.push_back(id);
+    }
+    return found;
+  }
+
+  const char *queries[] = {
+    "where mime ^= 'image/' and size > 900",
+    "where mime = 'text/plain' or size between 10 and 12",
+    "where not (mime ^= 'image/') and size <= 3",
+    "where has mtime and size >= 998 order by mtime desc limit 7",
+    "where size < 5 order by size limit 20",
+    "order by mtime limit 5",
+    "order by mtime desc limit 5",
+    "where size = 500 order by mtime",
+    "where mime != 'image/png' limit 10",
+    "where id ^= 'files/1001' and size > 500",
+    "where id = 'files/100042'",
+    "limit 3",
+    // Fewer than the limit have mtime, so the ones without it come last
+    "where not (size between 1 and 998) order by mtime limit 100",
+    "where not (size between 1 and 998) order by mtime desc limit 100",
+  };
+
+}
+
+TEST(Query, Parse) {
+  Query q = Query::parse("SELECT size, `id` WHERE mime ^= \"image/\" AND (size > 1e6 OR NOT has `order`) ORDER BY mtime DESC LIMIT 100");
+  ASSERT_EQ(q.select, (std::vector<std::string>{"size", "id"}));
+  ASSERT_EQ(q.orderBy, "mtime");
+  ASSERT_TRUE(q.descending);
+  ASSERT_EQ(q.limit, 100);
+  ASSERT_EQ(q.where->kind, Condition::Kind::And);
+  ASSERT_EQ(q.where->children[0].test.op, KeyPredicate::Op::Prefix);
+  ASSERT_EQ(q.where->children[1].kind, Condition::Kind::Or);
+  ASSERT_EQ(*q.where->children[1].children[0].test.low, Value::ofDouble(1e6));
+
+  // str() gives back something that parses to the same thing
+  std::string text = q.str();
+  ASSERT_EQ(Query::parse(text).str(), text);
+  ASSERT_EQ(Query::parse("where x between 1 and 'z'").str(), "where x between 1 and 'z'");
+  ASSERT_EQ(Query::parse("where x > 1 and y < 2.5").str(), "where x > 1 and y < 2.5");
+  ASSERT_EQ(Query::parse("select * where id ^= 'a/' and flag = true").str(), "select * where id ^= 'a/' and flag = true");
+  ASSERT_EQ(Query::parse("where name = 'it\\'s'").where->test.value, Value("it's"));
+
+  ASSERT_THROW(Query::parse("where size >"), std::runtime_error);
+  ASSERT_THROW(Query::parse("where size ~ 3"), std::runtime_error);
+  ASSERT_THROW(Query::parse("where (size > 3"), std::runtime_error);
+  ASSERT_THROW(Query::parse("where name = 'open"), std::runtime_error);
+  ASSERT_THROW(Query::parse("limit -1"), std::runtime_error);
+  ASSERT_THROW(Query::parse("order size"), std::runtime_error);
+  ASSERT_THROW(Query::parse("where id > 3"), std::runtime_error);
+  ASSERT_THROW(Query::parse("limit 3 nonsense"), std::runtime_error);
+  // Nesting is limited rather than left to run the stack out
+  std::string deep = "where ";
+  for (int i = 0; i < 100000; ++i) {
+    deep += i % 2 ? "not " : "(";
+  }
+  ASSERT_THROW(Query::parse(deep), std::runtime_error);
+  ASSERT_NO_THROW(Query::parse("where " + std::string(50, '(') + "has x" + std::string(50, ')')));
+}
+
+TEST(Query, Scans) {
+  auto m = makeFiles(20000);
+  QueryEngine engine(m);
+  for (const char *text : queries) {
+    Query q = Query::parse(text);
+    ASSERT_EQ(ids(engine.run(q, 4)), bruteForce(*m, q)) << text;
+    ASSERT_EQ(ids(engine.run(q, 1)), bruteForce(*m, q)) << text;
+  }
+  ASSERT_EQ(engine.plan(Query::parse("where id = 'files/100042'")).access, QueryEngine::Plan::Access::Point);
+  ASSERT_EQ(engine.plan(Query::parse("where id ^= 'files/1001' and size > 5")).access, QueryEngine::Plan::Access::IdRange);
+  ASSERT_EQ(engine.plan(Query::parse("where size > 5")).access, QueryEngine::Plan::Access::Scan);
+
+  // Selected values come back with the IDs
+  auto rows = engine.run("select size, nothing where id = 'files/100001'");
+  ASSERT_EQ(rows.size(), 1);
+  ASSERT_EQ(rows[0].values.size(), 1);
+  ASSERT_EQ(rows[0].values[0].first, "size");
+  ASSERT_EQ(rows[0].values[0].second, Value::ofInt(7919 % 1000));
+  rows = engine.run("select * where id = 'files/100001'");
+  ASSERT_EQ(rows[0].values.size(), 3);
+
+  // Sinks can stop early
+  size_t seen = engine.run(Query::parse("where has size"), [](const QueryRow&) { return false; });
+  ASSERT_EQ(seen, 1);
+}
+
+TEST(Query, Indexes) {
+  auto m = makeFiles(20000);
+  QueryEngine engine(m);
+  engine.addIndex("size");
+  engine.addIndex("mime");
+  engine.addIndex("mtime");
+  ASSERT_EQ(engine.indexedKeys(), (std::vector<std::string>{"mime", "mtime", "size"}));
+
+  auto check = [&]() {
+    for (const char *text : queries) {
+      Query q = Query::parse(text);
+      ASSERT_EQ(ids(engine.run(q, 4)), bruteForce(*m, q)) << text;
+    }
+  };
+  check();
+  ASSERT_EQ(engine.plan(Query::parse("where size = 500")).access, QueryEngine::Plan::Access::Index);
+  ASSERT_EQ(engine.plan(Query::parse("where size = 500 or mime = 'nope'")).access, QueryEngine::Plan::Access::Index);
+  // Not selective enough to be worth it
+  ASSERT_EQ(engine.plan(Query::parse("where mime ^= 'image/'")).access, QueryEngine::Plan::Access::Scan);
+  ASSERT_EQ(engine.plan(Query::parse("order by mtime desc limit 5")).access, QueryEngine::Plan::Access::OrderedIndex);
+  ASSERT_EQ(engine.plan(Query::parse("where not (size between 1 and 998) order by mtime limit 100")).access, QueryEngine::Plan::Access::OrderedIndex);
+  ASSERT_NE(engine.explain(Query::parse("where size = 500")).find("index lookup"), std::string::npos);
+
+  // The indexes keep up with changes
+  m->setInt("files/100003", "size", 500);
+  m->erase("files/100004");
+  m->update("files/200000", "size", "500");
+  m->erase("files/100005", "size");
+  m->setInt("files/100006", "mtime", 1800000000);
+  // Text sorts after every number, so it's first going down
+  m->update("files/100007", "mtime", "later");
+  check();
+  auto found = ids(engine.run("where size = 500"));
+  ASSERT_NE(std::find(found.begin(), found.end(), "files/100003"), found.end());
+  ASSERT_NE(std::find(found.begin(), found.end(), "files/200000"), found.end());
+  ASSERT_EQ(ids(engine.run("order by mtime desc limit 2")), (std::vector<std::string>{"files/100007", "files/100006"}));
+  // Changes made since the last query don't stop the indexes being
+  // used, since they're caught up before the view is taken
+  m->setInt("files/100010", "size", 500);
+  ASSERT_EQ(engine.plan(Query::parse("where size = 500")).access, QueryEngine::Plan::Access::Index);
+  m->setInt("files/100010", "mtime", 1);
+  ASSERT_EQ(engine.plan(Query::parse("order by mtime desc limit 5")).access, QueryEngine::Plan::Access::OrderedIndex);
+
+  // NaN and the infinities aren't numbers as far as queries go, so
+  // they're never in a numeric range and sort with the text
+  m->update("files/100008", "size", "nan");
+  m->update("files/100009", "size", "-inf");
+  m->set("files/100011", "size", Value::ofDouble(std::numeric_limits<double>::quiet_NaN()));
+  m->set("files/100012", "mtime", Value::ofDouble(std::numeric_limits<double>::infinity()));
+  check();
+  found = ids(engine.run("where size >= 0"));
+  ASSERT_EQ(std::find(found.begin(), found.end(), "files/100008"), found.end());
+  ASSERT_EQ(std::find(found.begin(), found.end(), "files/100011"), found.end());
+  // And they come back out of the index cleanly
+  m->setInt("files/100008", "size", 1);
+  m->erase("files/100011", "size");
+  m->erase("files/100012");
+  check();
+
+  // Including after a restore
+  m->restore(makeFiles(300)->snapshot());
+  check();
+  ASSERT_TRUE(engine.dropIndex("mtime"));
+  ASSERT_FALSE(engine.dropIndex("mtime"));
+  ASSERT_EQ(engine.plan(Query::parse("order by mtime limit 5")).access, QueryEngine::Plan::Access::Scan);
+}
+
+// Changes every index has seen are forgotten, and tracking goes back
+// off with the last index, unless somebody else turned it on
+TEST(Query, IndexChangeLog) {
+  auto m = makeFiles(100);
+  QueryEngine engine(m);
+  engine.addIndex("size");
+  ASSERT_TRUE(m->changeTracking());
+  engine.run("where size = 5");
+  uint64_t before = m->currentSequence();
+  m->setInt("files/100003", "size", 5);
+  m->erase("files/100004");
+  ASSERT_EQ(m->exportSince(before).stores.size(), 1);
+  ASSERT_EQ(m->exportSince(before).erased.size(), 1);
+  auto found = ids(engine.run("where size = 5"));
+  ASSERT_NE(std::find(found.begin(), found.end(), "files/100003"), found.end());
+  // The index has seen both changes, so they're gone
+  ASSERT_TRUE(m->exportSince(before).full);
+  ASSERT_FALSE(m->exportSince(m->currentSequence()).full);
+  ASSERT_TRUE(engine.dropIndex("size"));
+  ASSERT_FALSE(m->changeTracking());
+
+  m->setChangeTracking(true);
+  before = m->currentSequence();
+  engine.addIndex("size");
+  m->setInt("files/100005", "size", 5);
+  engine.run("where size = 5");
+  ASSERT_FALSE(m->exportSince(before).full);
+  ASSERT_EQ(m->exportSince(before).stores.size(), 1);
+  engine.dropIndex("size");
+  ASSERT_TRUE(m->changeTracking());
+}
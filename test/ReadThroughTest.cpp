@@ -0,0 +1,198 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for read-through mode (Metadata::setLoader)
+ */
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <fr/metadata/metadata.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  // A slow backing store with IDs user0 to user99, which counts how
+  // often it's asked
+  struct Backend {
+    std::atomic<int> calls{0};
+    std::chrono::milliseconds delay{0};
+    bool broken = false;
+
+    Metadata::Loader loader() {
+      return [this](const std::string& id) -> Metadata::Data {
+	calls++;
+	std::this_thread::sleep_for(delay);
+	if (broken) {
+	  throw std::runtime_error("backend is down");
+	}
+	if (!id.starts_with("user") || std::stoi(id.substr(4)) >= 100) {
+	  return nullptr;
+	}
+	auto store = std::make_shared<Metadata::DataType>();
+	(*store)["name"] = Value(std::format("Name of {}", id));
+	(*store)["visits"] = Value::ofInt(std::stoi(id.substr(4)));
+	return store;
+      };
+    }
+  };
+
+}
+
+TEST(ReadThrough, Basics) {
+  Backend backend;
+  Metadata m;
+  m.update("local", "name", "here already");
+  ASSERT_FALSE(m.readThroughStatistics().enabled);
+  m.setLoader(backend.loader());
+
+  // Misses go to the loader, and what it finds is kept
+  ASSERT_EQ(m.value("user7", "name"), "Name of user7");
+  ASSERT_EQ(m.getInt("user7", "visits"), 7);
+  ASSERT_EQ(m.keys("user8"), (std::vector<std::string>{"name", "visits"}));
+  ASSERT_EQ(backend.calls, 2);
+  ASSERT_TRUE(m.contains("user7"));
+  ASSERT_EQ(m.value("local", "name"), "here already");
+  ASSERT_EQ(backend.calls, 2);
+
+  // Without a negative TTL, every read of an ID that doesn't exist
+  // asks again
+  ASSERT_THROW(m.value("nobody", "name"), std::runtime_error);
+  ASSERT_FALSE(m.idContains("nobody", "name"));
+  ASSERT_EQ(backend.calls, 4);
+  ASSERT_FALSE(m.contains("nobody"));
+
+  auto stats = m.readThroughStatistics();
+  ASSERT_TRUE(stats.enabled);
+  ASSERT_EQ(stats.loads, 4);
+  ASSERT_EQ(stats.notFound, 2);
+  ASSERT_EQ(stats.hits, 2);
+  ASSERT_NEAR(stats.hitRatio(), 2.0 / 6.0, 1e-9);
+  ASSERT_GE(stats.loadSecondsAt(0.99), stats.maxLoadSeconds);
+
+  // Writing to an ID that isn't here yet starts from what the loader has
+  m.setInt("user9", "visits", 90);
+  ASSERT_EQ(m.value("user9", "name"), "Name of user9");
+  ASSERT_EQ(m.getInt("user9", "visits"), 90);
+
+  // With the ID filter on too, the loader still gets asked
+  m.setIdFilter(true);
+  ASSERT_EQ(m.value("user10", "name"), "Name of user10");
+
+  // Loader errors come through, and aren't remembered
+  backend.broken = true;
+  ASSERT_THROW(m.value("user11", "name"), std::runtime_error);
+  ASSERT_EQ(m.readThroughStatistics().errors, 1);
+  backend.broken = false;
+  ASSERT_EQ(m.value("user11", "name"), "Name of user11");
+
+  m.setLoader(nullptr);
+  ASSERT_THROW(m.value("user12", "name"), std::runtime_error);
+  ASSERT_TRUE(m.contains("user11"));
+}
+
+TEST(ReadThrough, NegativeCache) {
+  Backend backend;
+  Metadata m;
+  m.setLoader(backend.loader(), std::chrono::milliseconds(100));
+
+  ASSERT_THROW(m.value("nobody", "name"), std::runtime_error);
+  ASSERT_THROW(m.value("nobody", "name"), std::runtime_error);
+  ASSERT_FALSE(m.idContains("nobody", "name"));
+  ASSERT_EQ(backend.calls, 1);
+  ASSERT_EQ(m.readThroughStatistics().negativeHits, 2);
+
+  // Adding it yourself means it exists after all
+  m.update("nobody", "name", "somebody");
+  ASSERT_EQ(m.value("nobody", "name"), "somebody");
+
+  // And the answer runs out
+  ASSERT_THROW(m.value("user500", "name"), std::runtime_error);
+  ASSERT_EQ(backend.calls, 2);
+  std::this_thread::sleep_for(std::chrono::milliseconds(150));
+  ASSERT_THROW(m.value("user500", "name"), std::runtime_error);
+  ASSERT_EQ(backend.calls, 3);
+}
+
+TEST(ReadThrough, SingleFlight) {
+  Backend backend;
+  backend.delay = std::chrono::milliseconds(100);
+  Metadata m;
+  m.setLoader(backend.loader());
+
+  std::atomic<int> right{0};
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; ++i) {
+    threads.emplace_back([&]() {
+      if (m.value("user3", "name") == "Name of user3") {
+	right++;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(right, 8);
+  ASSERT_EQ(backend.calls, 1);
+  auto stats = m.readThroughStatistics();
+  ASSERT_EQ(stats.loads, 1);
+  ASSERT_EQ(stats.coalesced + stats.hits, 7);
+  ASSERT_GE(stats.averageLoadSeconds(), 0.1);
+
+  // Same for misses; everyone waiting hears there's nothing there
+  threads.clear();
+  std::atomic<int> missing{0};
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]() {
+      if (!m.idContains("user1000", "name")) {
+	missing++;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_EQ(missing, 4);
+  ASSERT_LE(backend.calls, 5);
+}
+
+TEST(ReadThrough, PagingOut) {
+  Backend backend;
+  Metadata m;
+  m.setLoader(backend.loader());
+  m.setResidentLimit(3);
+
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(m.getInt(std::format("user{}", i), "visits"), i);
+  }
+  // Only the last three loaded are still cached
+  ASSERT_EQ(m.ids(), (std::vector<std::string>{"user7", "user8", "user9"}));
+  ASSERT_EQ(m.loadStatistics().evictions, 7);
+  ASSERT_EQ(m.getInt("user0", "visits"), 0);
+  ASSERT_EQ(backend.calls, 11);
+
+  // Once one's changed it's ours and stays
+  m.setInt("user8", "visits", 80);
+  ASSERT_EQ(m.pageOut(), 2);
+  ASSERT_EQ(m.ids(), std::vector<std::string>{"user8"});
+  ASSERT_EQ(m.getInt("user8", "visits"), 80);
+}
@@ -0,0 +1,120 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for schemas
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/binary.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/schema.h>
+#include <string>
+#include <vector>
+
+using namespace fr::metadata;
+
+namespace {
+
+  struct FileMeta {
+    FR_SCHEMA;
+    FR_FIELD(mime);
+    FR_FIELD(size);
+    FR_FIELD(mtime);
+    FR_FIELD(path);
+  };
+
+  // The slots are known when we compile
+  static_assert(FileMeta::mime.slot == 0);
+  static_assert(FileMeta::path.slot == 3);
+  static_assert(SchemaTraits<FileMeta>::size == 4);
+  static_assert(SchemaTraits<FileMeta>::slotOf("mtime") == 2);
+  static_assert(SchemaTraits<FileMeta>::slotOf("owner") == 4);
+
+  // Slots only depend on the fields before them in the struct, so
+  // nothing else in between can shift them
+  struct Spaced {
+    FR_SCHEMA;
+    FR_FIELD(first);
+    static constexpr int unrelated = __COUNTER__;
+    FR_FIELD(second);
+  };
+
+  static_assert(Spaced::first.slot == 0);
+  static_assert(Spaced::second.slot == 1);
+  static_assert(SchemaTraits<Spaced>::size == 2);
+
+}
+
+TEST(Schema, Record) {
+  Record<FileMeta> record;
+  record.set(FileMeta::mime, "image/png");
+  record.set(FileMeta::size, Value::ofInt(1234));
+  // Strings find their way to the slots too
+  record.set("path", "/tmp/cat.png");
+  record.set("owner", "bruce");
+  ASSERT_EQ(record.get(FileMeta::path), Value("/tmp/cat.png"));
+  ASSERT_EQ(record.get(FileMeta::size).asInt(), 1234);
+  ASSERT_EQ(*record.find("mime"), Value("image/png"));
+  ASSERT_EQ(*record.find("owner"), Value("bruce"));
+  ASSERT_EQ(record.find(FileMeta::mtime), nullptr);
+  ASSERT_THROW(record.get(FileMeta::mtime), std::runtime_error);
+  ASSERT_EQ(record.size(), 4);
+  ASSERT_EQ(record.keys(), (std::vector<std::string>{"mime", "owner", "path", "size"}));
+
+  auto data = record.toData();
+  ASSERT_EQ(data.size(), 4);
+  auto back = Record<FileMeta>::fromData(data);
+  ASSERT_EQ(back.get(FileMeta::mime), Value("image/png"));
+  ASSERT_TRUE(back.contains("owner"));
+
+  ASSERT_TRUE(back.erase(FileMeta::mime));
+  ASSERT_FALSE(back.erase("mime"));
+  ASSERT_TRUE(back.erase("owner"));
+  ASSERT_EQ(back.keys(), (std::vector<std::string>{"path", "size"}));
+}
+
+TEST(Schema, Metadata) {
+  SchemaMetadata<FileMeta> m;
+  m.update("cat", "mime", "image/png");
+  m.set("cat", FileMeta::size, Value::ofInt(2048));
+  m.update("cat", "colour", "ginger");
+  ASSERT_TRUE(m.contains("cat"));
+  ASSERT_TRUE(m.idContains("cat", "size"));
+  ASSERT_FALSE(m.idContains("cat", "path"));
+  ASSERT_EQ(m.value("cat", "size"), "2048");
+  ASSERT_EQ(m.get("cat", FileMeta::mime), Value("image/png"));
+  ASSERT_EQ(m.get("cat", "colour"), Value("ginger"));
+  ASSERT_THROW(m.get("cat", FileMeta::path), std::runtime_error);
+  ASSERT_THROW(m.value("dog", "mime"), std::runtime_error);
+  ASSERT_THROW(m.add("cat"), std::runtime_error);
+  ASSERT_EQ(m.read("cat", [](const Record<FileMeta>& r) { return r.get(FileMeta::size).asInt() * 2; }), 4096);
+
+  // Round trip through a regular Metadata and BinaryFormat
+  Metadata plain;
+  plain.restore(m.snapshot());
+  ASSERT_EQ(plain.getInt("cat", "size"), 2048);
+  ASSERT_EQ(plain.value("cat", "colour"), "ginger");
+  Metadata decoded;
+  BinaryFormat::fromBinary(decoded, BinaryFormat::toBinary(plain));
+  SchemaMetadata<FileMeta> copy;
+  copy.restore(decoded.snapshot());
+  ASSERT_EQ(copy.get("cat", FileMeta::size).asInt(), 2048);
+  ASSERT_EQ(copy.keys("cat"), (std::vector<std::string>{"colour", "mime", "size"}));
+
+  copy.erase("cat", "mime");
+  ASSERT_FALSE(copy.idContains("cat", "mime"));
+  copy.erase("cat");
+  ASSERT_EQ(copy.ids().size(), 0);
+}
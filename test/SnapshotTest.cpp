@@ -0,0 +1,123 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for copy-on-write snapshots and the background snapshotter
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/snapshot.h>
+#include <fr/metadata/wal.h>
+#include <chrono>
+#include <filesystem>
+#include <format>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+// Changes made after a snapshot is taken must not show up in it
+TEST(Snapshot, CopyOnWrite) {
+  Metadata m;
+  m.update("Foo", "Bar", "Baz");
+  m.update("Foo", "Gone", "Soon");
+  auto snapshot = m.snapshot();
+  m.update("Foo", "Bar", "Changed");
+  m.erase("Foo", "Gone");
+  m.update("New", "Key", "Value");
+  ASSERT_EQ(snapshot.at("Foo")->at("Bar"), "Baz");
+  ASSERT_TRUE(snapshot.at("Foo")->contains("Gone"));
+  ASSERT_FALSE(snapshot.contains("New"));
+  ASSERT_EQ(m.value("Foo", "Bar"), "Changed");
+  ASSERT_FALSE(m.idContains("Foo", "Gone"));
+}
+
+TEST(Snapshot, RecoverFromSnapshotAndLog) {
+  TempPath snapshotPath("snapshot_snap");
+  TempPath walPath("snapshot_wal");
+  {
+    auto m = std::make_shared<Metadata>();
+    auto wal = std::make_shared<WriteAheadLog>(walPath);
+    m->addListener(wal);
+    m->update("Foo", "Bar", "Baz");
+    m->update("Foo", "Wibble", "Wobble");
+    {
+      Snapshotter snapshotter(m, snapshotPath, wal);
+      snapshotter.request();
+      snapshotter.wait();
+    }
+    // These only exist in the log
+    m->update("Foo", "Bar", "Florble");
+    m->update("Later", "Key", "Value");
+    m->removeListener(wal);
+  }
+  ASSERT_TRUE(std::filesystem::exists(snapshotPath.str()));
+  Metadata restored;
+  Snapshotter::recover(snapshotPath, walPath, restored);
+  ASSERT_EQ(restored.value("Foo", "Bar"), "Florble");
+  ASSERT_EQ(restored.value("Foo", "Wibble"), "Wobble");
+  ASSERT_EQ(restored.value("Later", "Key"), "Value");
+
+  // LSNs have to keep counting up after the log was trimmed, or the
+  // next recovery would skip the new records
+  {
+    auto wal = std::make_shared<WriteAheadLog>(walPath);
+    restored.addListener(wal);
+    restored.update("AfterRecovery", "Key", "Value");
+    restored.removeListener(wal);
+  }
+  Metadata again;
+  Snapshotter::recover(snapshotPath, walPath, again);
+  ASSERT_EQ(again.value("AfterRecovery", "Key"), "Value");
+}
+
+// snapshotNow on other threads while the interval worker is taking its
+// own. Whichever finishes last, everything written is either in the
+// snapshot on disk or still in the log.
+TEST(Snapshot, ConcurrentWithWorker) {
+  TempPath snapshotPath("snapshot_concurrent_snap");
+  TempPath walPath("snapshot_concurrent_wal");
+  {
+    auto m = std::make_shared<Metadata>();
+    auto wal = std::make_shared<WriteAheadLog>(walPath);
+    m->addListener(wal);
+    {
+      Snapshotter snapshotter(m, snapshotPath, wal, std::chrono::milliseconds(1));
+      std::vector<std::thread> threads;
+      for (int t = 0; t < 4; ++t) {
+	threads.emplace_back([&m, &snapshotter, t]() {
+	  for (int i = 0; i < 50; ++i) {
+	    m->update(std::format("id{}", t), std::format("key{}", i), "value");
+	    if (i % 5 == 0) {
+	      snapshotter.snapshotNow();
+	    }
+	  }
+	});
+      }
+      for (auto& thread : threads) {
+	thread.join();
+      }
+    }
+    m->removeListener(wal);
+  }
+  Metadata restored;
+  Snapshotter::recover(snapshotPath, walPath, restored);
+  ASSERT_EQ(restored.ids().size(), 4);
+  for (int t = 0; t < 4; ++t) {
+    ASSERT_EQ(restored.keys(std::format("id{}", t)).size(), 50);
+  }
+}
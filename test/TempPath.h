@@ -0,0 +1,64 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Scratch space on disk for the tests that write files
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <format>
+#include <string>
+#include <unistd.h>
+
+/**
+ * TempPath names a file or directory in the temp directory that's
+ * unique to this test process. Whatever an earlier run left there is
+ * removed when it's created, and whatever the test left there is
+ * removed when it goes out of scope, even if an assertion bailed out
+ * of the test halfway through. It turns into a std::string wherever
+ * one is wanted.
+ */
+
+class TempPath {
+  std::string path;
+
+public:
+  TempPath(const std::string& name) :
+    path((std::filesystem::temp_directory_path() / std::format("fr_{}_{}", name, ::getpid())).string()) {
+    clear();
+  }
+
+  TempPath(const TempPath&) = delete;
+  TempPath& operator=(const TempPath&) = delete;
+
+  ~TempPath() {
+    clear();
+  }
+
+  const std::string& str() const {
+    return path;
+  }
+
+  operator const std::string&() const {
+    return path;
+  }
+
+  // Remove it (and everything under it, if it's a directory)
+  void clear() {
+    std::error_code ec;
+    std::filesystem::remove_all(path, ec);
+  }
+};
@@ -0,0 +1,191 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for hot/cold tiering
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/tiered.h>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+namespace {
+
+  // A tier where somebody erases the ID from the Metadata while it's
+  // being demoted, just before it gets saved
+  struct RacingTier : public ColdTier {
+    Metadata *m = nullptr;
+    std::string victim;
+
+    RacingTier(const std::string& path) : ColdTier(path) {}
+
+    void save(const std::string& id, const Metadata::DataType& store) override {
+      if (m && id == victim) {
+	m->erase(id);
+      }
+      ColdTier::save(id, store);
+    }
+  };
+
+}
+
+TEST(Tiered, DemoteAndPromote) {
+  TempPath path("tier_demote");
+  auto tier = std::make_shared<ColdTier>(path);
+  Metadata m;
+  m.attachSource(tier, {});
+  m.setAccessTracking(true);
+  for (int i = 0; i < 100; ++i) {
+    m.update(std::format("id{}", i), "key", std::format("value{}", i));
+  }
+  // Everything was touched once by update, so the first sweep only
+  // ages the counts
+  ASSERT_EQ(m.demoteCold(), 0);
+  m.value("id5", "key");
+  ASSERT_EQ(m.demoteCold(), 99);
+  auto stats = m.loadStatistics();
+  ASSERT_EQ(stats.hot, 1);
+  ASSERT_EQ(stats.cold, 99);
+  ASSERT_EQ(stats.writeBacks, 99);
+  ASSERT_EQ(tier->stats().ids, 99);
+  ASSERT_GT(tier->stats().rawBytes, 0);
+
+  // Promoted on access, and still clean afterwards, so demoting it
+  // again doesn't write anything. id5 has never been saved, so it does.
+  ASSERT_EQ(m.value("id42", "key"), "value42");
+  stats = m.loadStatistics();
+  ASSERT_EQ(stats.loads, 1);
+  ASSERT_EQ(stats.hot, 2);
+  ASSERT_GT(stats.averageLoadSeconds(), 0.0);
+  m.demoteCold();
+  m.demoteCold();
+  m.demoteCold();
+  ASSERT_EQ(m.loadStatistics().writeBacks, 100);
+  ASSERT_EQ(m.loadStatistics().hot, 0);
+
+  // Changing a cold store brings it in and makes it dirty
+  m.update("id7", "other", "thing");
+  m.demoteCold();
+  m.demoteCold();
+  ASSERT_EQ(m.loadStatistics().writeBacks, 101);
+  ASSERT_EQ(m.keys("id7").size(), 2);
+
+  // Erased IDs are dropped from the tier, and their space comes back
+  // on compaction
+  for (int i = 0; i < 60; ++i) {
+    m.erase(std::format("id{}", i));
+  }
+  ASSERT_EQ(tier->stats().ids, 40);
+  ASSERT_TRUE(tier->compact());
+  ASSERT_EQ(tier->stats().fileBytes, tier->stats().liveBytes);
+  ASSERT_EQ(m.value("id99", "key"), "value99");
+  ASSERT_EQ(m.ids().size(), 40);
+
+  // Snapshots see cold stores too
+  auto snapshot = m.snapshot();
+  ASSERT_EQ(snapshot.at("id80")->at("key"), "value80");
+
+  // So do forks, even after the originals are erased from the tier
+  auto fork = m.fork();
+  ASSERT_EQ(fork->loadStatistics().cold, 0);
+  m.erase("id81");
+  ASSERT_EQ(fork->value("id81", "key"), "value81");
+
+  // A fork of something with everything loaded doesn't get the tier
+  // either, so it can't save into it or take things out of it
+  for (const auto& id : m.ids()) {
+    m.value(id, "key");
+  }
+  ASSERT_EQ(m.loadStatistics().cold, 0);
+  auto saved = tier->stats().ids;
+  auto hot = m.fork();
+  hot->setAccessTracking(true);
+  ASSERT_EQ(hot->demoteCold(), 0);
+  hot->erase("id90");
+  ASSERT_EQ(tier->stats().ids, saved);
+  m.demoteCold();
+  m.demoteCold();
+  ASSERT_EQ(m.value("id90", "key"), "value90");
+}
+
+TEST(Tiered, Manager) {
+  TempPath path("tier_manager");
+  auto m = std::make_shared<Metadata>();
+  auto tier = std::make_shared<ColdTier>(path);
+  for (int i = 0; i < 10; ++i) {
+    m->update(std::format("id{}", i), "key", "value");
+  }
+  TierManager manager(m, tier, std::chrono::milliseconds(10));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (m->loadStatistics().cold < 10 && std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_EQ(m->loadStatistics().cold, 10);
+  ASSERT_GT(manager.completedSweeps(), 0);
+  ASSERT_EQ(m->value("id3", "key"), "value");
+}
+
+// Putting a tier in front of a Metadata that's still lazily loading
+// from somewhere else would lose whatever hasn't been loaded yet
+TEST(Tiered, ManagerOverLazySource) {
+  TempPath path("tier_lazy");
+  struct Fixed : public Metadata::StoreSource {
+    Metadata::Data load(const std::string& id) override {
+      auto store = std::make_shared<Metadata::DataType>();
+      (*store)["key"] = id;
+      return store;
+    }
+  };
+  auto m = std::make_shared<Metadata>();
+  auto from = std::make_shared<Fixed>();
+  m->attachSource(from, {"Foo", "Bar"});
+  auto tier = std::make_shared<ColdTier>(path);
+  ASSERT_THROW(TierManager(m, tier), std::runtime_error);
+  ASSERT_EQ(m->value("Foo", "key"), "Foo");
+  ASSERT_EQ(m->value("Bar", "key"), "Bar");
+
+  // Once it's all in, the tier can take over
+  TierManager manager(m, tier, std::chrono::milliseconds(10));
+  manager.sweep();
+  manager.sweep();
+  ASSERT_EQ(m->loadStatistics().cold, 2);
+  ASSERT_EQ(tier->stats().ids, 2);
+  ASSERT_EQ(m->value("Bar", "key"), "Bar");
+}
+
+TEST(Tiered, EraseDuringDemote) {
+  TempPath path("tier_racing");
+  auto tier = std::make_shared<RacingTier>(path);
+  Metadata m;
+  m.attachSource(tier, {});
+  m.setAccessTracking(true);
+  for (int i = 0; i < 10; ++i) {
+    m.update(std::format("id{}", i), "key", std::format("value{}", i));
+  }
+  tier->m = &m;
+  tier->victim = "id3";
+  m.demoteCold();
+  ASSERT_EQ(m.demoteCold(), 9);
+  ASSERT_FALSE(m.contains("id3"));
+  // What got saved for id3 is stale, so it doesn't get to stay
+  ASSERT_EQ(tier->stats().ids, 9);
+  ASSERT_EQ(tier->load("id3"), nullptr);
+}
@@ -0,0 +1,169 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for typed values
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/binary.h>
+#include <fr/metadata/frozen.h>
+#include <fr/metadata/json_import.h>
+#include <fr/metadata/json_stream.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/value.h>
+#include <fr/metadata/wal.h>
+#include <limits>
+#include <sstream>
+#include <string>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+namespace {
+
+  void fillTyped(Metadata& m) {
+    m.update("File", "mime", "image/png");
+    m.setInt("File", "size", 1234567);
+    m.setInt("File", "offset", std::numeric_limits<int64_t>::min());
+    m.setDouble("File", "ratio", 0.1);
+    m.setBool("File", "hidden", true);
+    m.setBytes("File", "hash", std::string("\x00\xff\x1f\x80", 4));
+    // A string that looks like the text form of an int has to stay a string
+    m.update("File", "tricky", std::string{Value::marker} + "i42");
+  }
+
+  void checkTyped(Metadata& m) {
+    ASSERT_EQ(m.get("File", "mime"), "image/png");
+    ASSERT_EQ(m.getInt("File", "size"), 1234567);
+    ASSERT_EQ(m.getInt("File", "offset"), std::numeric_limits<int64_t>::min());
+    ASSERT_EQ(m.getDouble("File", "ratio"), 0.1);
+    ASSERT_TRUE(m.getBool("File", "hidden"));
+    ASSERT_EQ(m.get("File", "hash"), Value::ofBytes(std::string("\x00\xff\x1f\x80", 4)));
+    ASSERT_EQ(m.get("File", "tricky").type(), Value::Type::String);
+    ASSERT_EQ(m.value("File", "tricky"), std::string{Value::marker} + "i42");
+  }
+
+}
+
+TEST(Value, Text) {
+  for (const Value& v : {Value("plain"), Value(""), Value(std::string{Value::marker}), Value::ofInt(-42),
+			 Value::ofDouble(1e-300), Value::ofBool(false), Value::ofBytes(std::string("\0\1\2", 3)),
+			 Value::ofBytes("")}) {
+    ASSERT_EQ(Value::fromText(v.toText()), v);
+  }
+  ASSERT_EQ(Value("plain").toText(), "plain");
+  // Anything that starts with the marker but doesn't parse is just a string
+  std::string junk{Value::marker, 'i', 'x'};
+  ASSERT_EQ(Value::fromText(junk), Value(junk));
+
+  ASSERT_EQ(Value::ofInt(42).str(), "42");
+  ASSERT_EQ(Value::ofDouble(2.5).str(), "2.5");
+  ASSERT_EQ(Value::ofBool(true).str(), "true");
+  ASSERT_EQ(Value::ofInt(3).asDouble(), 3.0);
+  ASSERT_THROW(Value("42").asInt(), std::runtime_error);
+  ASSERT_THROW(Value::ofInt(1).bytes(), std::runtime_error);
+
+  // Numbers and strings share one storage area, so changing a value's
+  // type leaves nothing of the old one behind
+  Value v("a string long enough to go on the heap");
+  v = Value::ofInt(7);
+  ASSERT_EQ(v.type(), Value::Type::Int);
+  ASSERT_EQ(v.asInt(), 7);
+  v = Value("short");
+  ASSERT_EQ(v.bytes(), "short");
+  ASSERT_NE(Value::ofInt(1), Value::ofDouble(1.0));
+}
+
+TEST(Value, Metadata) {
+  Metadata m;
+  fillTyped(m);
+  checkTyped(m);
+  // The string API still works, with numbers formatted
+  ASSERT_EQ(m.value("File", "size"), "1234567");
+  ASSERT_EQ(m.value("File", "hidden"), "true");
+  ASSERT_THROW(m.getInt("File", "mime"), std::runtime_error);
+  ASSERT_THROW(m.get("File", "nope"), std::runtime_error);
+  m.update("File", "size", "big");
+  ASSERT_EQ(m.get("File", "size").type(), Value::Type::String);
+}
+
+TEST(Value, Blobs) {
+  Metadata m;
+  std::string thumbnail(4096, '\xff');
+  m.setBytes("File", "thumbnail", thumbnail);
+
+  // Reads, snapshots and other keys all share the one buffer
+  Blob blob = m.getBlob("File", "thumbnail");
+  ASSERT_EQ(*blob, thumbnail);
+  ASSERT_EQ(m.getBlob("File", "thumbnail").get(), blob.get());
+  auto stores = m.snapshot();
+  ASSERT_EQ(stores.at("File")->at("thumbnail").blob().get(), blob.get());
+  m.setBlob("Copy", "thumbnail", blob);
+  ASSERT_EQ(m.getBlob("Copy", "thumbnail").get(), blob.get());
+  ASSERT_EQ(m.get("Copy", "thumbnail"), Value::ofBytes(thumbnail));
+
+  // The blob outlives the key
+  m.erase("File");
+  m.erase("Copy");
+  stores.clear();
+  ASSERT_EQ(*blob, thumbnail);
+
+  // Putting something else in a bytes value lets go of its blob
+  Value holder = Value::ofBlob(blob);
+  ASSERT_EQ(blob.use_count(), 2);
+  Value moved = std::move(holder);
+  ASSERT_EQ(blob.use_count(), 2);
+  moved = Value("text");
+  ASSERT_EQ(blob.use_count(), 1);
+
+  ASSERT_EQ(Value::ofBlob(nullptr).bytes(), "");
+  ASSERT_THROW(Value("text").blob(), std::runtime_error);
+  m.update("File", "name", "cat.png");
+  ASSERT_THROW(m.getBlob("File", "name"), std::runtime_error);
+}
+
+TEST(Value, Formats) {
+  Metadata m;
+  fillTyped(m);
+
+  Metadata binary;
+  BinaryFormat::fromBinary(binary, BinaryFormat::toBinary(m));
+  checkTyped(binary);
+
+  std::ostringstream json;
+  JsonStreamer::write(m, json);
+  Metadata imported;
+  JsonImporter::load(imported, json.str());
+  checkTyped(imported);
+
+  Metadata thawed;
+  FrozenMetadata::build(m)->materialize(thawed);
+  checkTyped(thawed);
+  ASSERT_EQ(FrozenMetadata::build(m)->get("File", "size"), Value::ofInt(1234567));
+}
+
+TEST(Value, WriteAheadLog) {
+  TempPath path("value_wal.log");
+  {
+    Metadata m;
+    auto wal = std::make_shared<WriteAheadLog>(path.str());
+    m.addListener(wal);
+    fillTyped(m);
+    m.removeListener(wal);
+  }
+  Metadata restored;
+  WriteAheadLog::replay(path.str(), restored);
+  checkTyped(restored);
+}
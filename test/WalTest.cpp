@@ -0,0 +1,210 @@
+/**
+ * Copyright 2025 Bruce Ide
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ * Tests for the write-ahead log
+ */
+
+#include <gtest/gtest.h>
+#include <fr/metadata/metadata.h>
+#include <fr/metadata/wal.h>
+#include <csignal>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include "TempPath.h"
+
+using namespace fr::metadata;
+
+namespace {
+
+  void checkReplay(WriteAheadLog::Durability durability, const std::string& name) {
+    TempPath path(std::format("wal_{}.log", name));
+    {
+      Metadata m;
+      auto wal = std::make_shared<WriteAheadLog>(path, durability);
+      m.addListener(wal);
+      m.add("Foo", "Bar", "Baz");
+      m.update("Foo", "Bar", "Florble");
+      m.add("Gone", "Key", "Value");
+      m.erase("Gone");
+      m.update("Foo", "Temp", "Value");
+      m.erase("Foo", "Temp");
+      m.removeListener(wal);
+    }
+    Metadata restored;
+    ASSERT_GT(WriteAheadLog::replay(path, restored), 0);
+    ASSERT_EQ(restored.value("Foo", "Bar"), "Florble");
+    ASSERT_FALSE(restored.contains("Gone"));
+    ASSERT_FALSE(restored.idContains("Foo", "Temp"));
+    }
+
+}
+
+TEST(WriteAheadLog, ReplayPerOperation) {
+  checkReplay(WriteAheadLog::Durability::PerOperation, "perop");
+}
+
+TEST(WriteAheadLog, ReplayPerBatch) {
+  checkReplay(WriteAheadLog::Durability::PerBatch, "perbatch");
+}
+
+TEST(WriteAheadLog, ReplayInterval) {
+  checkReplay(WriteAheadLog::Durability::Interval, "interval");
+}
+
+// Concurrent writers should end up sharing fdatasyncs
+TEST(WriteAheadLog, GroupCommit) {
+  TempPath path("wal_group.log");
+  Metadata m;
+  auto wal = std::make_shared<WriteAheadLog>(path, WriteAheadLog::Durability::PerBatch);
+  m.addListener(wal);
+  std::vector<std::thread> writers;
+  for (int t = 0; t < 8; ++t) {
+    writers.emplace_back([&m, t]() {
+      for (int i = 0; i < 50; ++i) {
+	m.update(std::format("id{}", t), std::format("key{}", i), "value");
+      }
+    });
+  }
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  auto stats = wal->stats();
+  ASSERT_EQ(stats.records, 8 + 8 * 50);
+  ASSERT_LE(stats.syncs, stats.records);
+  Metadata restored;
+  WriteAheadLog::replay(path, restored);
+  ASSERT_EQ(restored.ids().size(), 8);
+  ASSERT_EQ(restored.keys("id3").size(), 50);
+}
+
+// A synced increment is in the log as soon as it returns, without
+// waiting for syncCounters
+TEST(WriteAheadLog, SyncedCounter) {
+  TempPath path("wal_counter.log");
+  {
+    Metadata m;
+    auto wal = std::make_shared<WriteAheadLog>(path, WriteAheadLog::Durability::PerBatch);
+    m.addListener(wal);
+    m.increment("Page", "hits", 5);
+    ASSERT_EQ(m.incrementSynced("Page", "hits"), 6);
+    // Never synced, so never logged
+    m.increment("Page", "hits");
+    m.removeListener(wal);
+  }
+  Metadata restored;
+  WriteAheadLog::replay(path, restored);
+  ASSERT_EQ(restored.getInt("Page", "hits"), 6);
+}
+
+// A record torn in half at the end of the log gets dropped, and the
+// log picks up where the last good record left off.
+TEST(WriteAheadLog, TornTail) {
+  TempPath path("wal_torn.log");
+  {
+    Metadata m;
+    auto wal = std::make_shared<WriteAheadLog>(path);
+    m.addListener(wal);
+    m.update("Foo", "Bar", "Baz");
+    m.update("Foo", "Torn", "Record");
+    m.removeListener(wal);
+  }
+  std::filesystem::resize_file(path.str(), std::filesystem::file_size(path.str()) - 3);
+  {
+    Metadata m;
+    WriteAheadLog::replay(path, m);
+    ASSERT_EQ(m.value("Foo", "Bar"), "Baz");
+    ASSERT_FALSE(m.idContains("Foo", "Torn"));
+    auto wal = std::make_shared<WriteAheadLog>(path);
+    m.addListener(wal);
+    m.update("Foo", "After", "Crash");
+    m.removeListener(wal);
+  }
+  Metadata restored;
+  WriteAheadLog::replay(path, restored);
+  ASSERT_EQ(restored.value("Foo", "After"), "Crash");
+}
+
+// A write that fails partway through leaves half a record in the file.
+// It has to be trimmed off before the retry, or replay would stop there
+// and lose everything logged after it.
+TEST(WriteAheadLog, FailedWrite) {
+  TempPath path("wal_failed.log");
+  struct rlimit before;
+  ASSERT_EQ(::getrlimit(RLIMIT_FSIZE, &before), 0);
+  auto oldHandler = ::signal(SIGXFSZ, SIG_IGN);
+  {
+    Metadata m;
+    auto wal = std::make_shared<WriteAheadLog>(path);
+    m.addListener(wal);
+    m.update("Foo", "Bar", "Baz");
+
+    // Only room for part of the next record
+    struct rlimit tight = before;
+    tight.rlim_cur = std::filesystem::file_size(path.str()) + 64;
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &tight), 0);
+    ASSERT_THROW(m.update("Foo", "Big", std::string(4096, 'x')), std::runtime_error);
+    ASSERT_EQ(::setrlimit(RLIMIT_FSIZE, &before), 0);
+    ASSERT_FALSE(wal->failed());
+
+    // The next flush writes the one that failed and this one after it
+    m.update("Foo", "After", "Failure");
+    m.removeListener(wal);
+  }
+  ::signal(SIGXFSZ, oldHandler);
+  Metadata restored;
+  WriteAheadLog::replay(path, restored);
+  ASSERT_EQ(restored.value("Foo", "Bar"), "Baz");
+  ASSERT_EQ(restored.value("Foo", "Big"), std::string(4096, 'x'));
+  ASSERT_EQ(restored.value("Foo", "After"), "Failure");
+}
+
+// set racing erase on the same ID. Whatever order they land in, the
+// log has to replay to what's in memory, so set can't log a change it
+// then fails to make.
+TEST(WriteAheadLog, SetRacingErase) {
+  TempPath path("wal_race.log");
+  Metadata m;
+  {
+    auto wal = std::make_shared<WriteAheadLog>(path, WriteAheadLog::Durability::Interval);
+    m.addListener(wal);
+    std::thread setter([&m]() {
+      for (int i = 0; i < 20000; ++i) {
+	m.setInt("Foo", "count", i);
+      }
+    });
+    std::thread eraser([&m]() {
+      for (int i = 0; i < 20000; ++i) {
+	try {
+	  m.erase("Foo");
+	} catch (std::exception& e) {
+	  // Already gone
+	}
+      }
+    });
+    setter.join();
+    eraser.join();
+    m.removeListener(wal);
+  }
+  Metadata restored;
+  WriteAheadLog::replay(path, restored);
+  ASSERT_EQ(restored.contains("Foo"), m.contains("Foo"));
+  if (m.contains("Foo")) {
+    ASSERT_EQ(restored.getInt("Foo", "count"), m.getInt("Foo", "count"));
+  }
+}
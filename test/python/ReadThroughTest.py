@@ -0,0 +1,103 @@
+# Copyright 2025 Bruce Ide
+#
+#  Licensed under the Apache License, Version 2.0 (the "License");
+#  you may not use this file except in compliance with the License.
+#  You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+#  Unless required by applicable law or agreed to in writing, software
+#  distributed under the License is distributed on an "AS IS" BASIS,
+#  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#  See the License for the specific language governing permissions and
+#  limitations under the License.
+#
+# Tests for read-through mode with a loader written in Python. Needs
+# the FRMetadata module on PYTHONPATH (ctest sets that up when the
+# Python API is built.)
+
+import faulthandler
+import threading
+import time
+import unittest
+
+import FRMetadata
+
+
+class ReadThroughTest(unittest.TestCase):
+
+    def setUp(self):
+        # If anything deadlocks on the GIL, say where rather than
+        # hanging the test run
+        faulthandler.dump_traceback_later(60, exit=True)
+
+    def tearDown(self):
+        faulthandler.cancel_dump_traceback_later()
+
+    def slowLoader(self, calls):
+        def load(id):
+            calls.append(id)
+            # Long enough for the other thread to come in and wait on
+            # this load. sleep lets go of the GIL, and the loader needs
+            # it back afterwards.
+            time.sleep(0.2)
+            if id.startswith("user"):
+                return {"name": "Name of " + id, "visits": 1}
+            return None
+        return load
+
+    def sameIdTwice(self, call):
+        m = FRMetadata.Metadata()
+        calls = []
+        m.setLoader(self.slowLoader(calls))
+        errors = []
+
+        def run():
+            try:
+                call(m)
+            except Exception as e:
+                errors.append(e)
+
+        threads = [threading.Thread(target=run) for _ in range(2)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual(calls, ["user1"])
+        return m
+
+    def testBasics(self):
+        m = FRMetadata.Metadata()
+        calls = []
+        m.setLoader(self.slowLoader(calls), negativeTtlSeconds=60.0)
+        self.assertEqual(m.value("user1", "name"), "Name of user1")
+        self.assertEqual(m.get("user1", "visits"), 1)
+        self.assertFalse(m.idContains("nobody", "name"))
+        self.assertFalse(m.idContains("nobody", "name"))
+        self.assertEqual(calls, ["user1", "nobody"])
+        stats = m.readThroughStatistics()
+        self.assertTrue(stats["enabled"])
+        self.assertEqual(stats["loads"], 2)
+        self.assertEqual(stats["negativeHits"], 1)
+        m.setLoader(None)
+        self.assertFalse(m.readThroughStatistics()["enabled"])
+
+    # Two threads after the same unloaded ID, one of them waiting on the
+    # other's call to the loader, through calls that write or count
+    def testConcurrentIncrement(self):
+        m = self.sameIdTwice(lambda m: m.increment("user1", "visits"))
+        self.assertEqual(m.get("user1", "visits"), 3)
+
+    def testConcurrentUpdate(self):
+        m = self.sameIdTwice(lambda m: m.update("user1", "seen", "yes"))
+        self.assertEqual(m.value("user1", "name"), "Name of user1")
+        self.assertEqual(m.value("user1", "seen"), "yes")
+
+    def testConcurrentBlob(self):
+        m = self.sameIdTwice(lambda m: m.setBlob("user1", "data", b"abc"))
+        self.assertEqual(bytes(m.getBlob("user1", "data")), b"abc")
+
+
+if __name__ == "__main__":
+    unittest.main()